@@ -0,0 +1,819 @@
+/*
+ * Load generator for the Bourse server.
+ *
+ * Usage: loadgen [-h <host>] [-p <port>] [-t <traders>] [-s <subscribers>]
+ *                [-d <seconds>] [-r <rate>] [-w <window>] [-c <cancel ratio>]
+ *                [-m <mid price>] [-x <spread>] [-D uniform|normal]
+ *                [-q <max quantity>] [-S <symbol>] [-n <name>]
+ *
+ *   -t  Number of traders, each a thread with its own connection (1).
+ *   -s  Number of passive subscribers, which log in and only receive the
+ *       notifications broadcast by the server (0).
+ *   -d  Duration of the run in seconds (5).
+ *   -r  Requests per second sent by each trader, 0 for as many as the
+ *       window allows (0).
+ *   -w  Number of requests a trader may have outstanding (1).
+ *   -c  Fraction of requests that cancel a resting order of the trader
+ *       rather than post a new one (0).
+ *   -m  Price around which orders are posted (1000).
+ *   -x  Spread of the prices: the half-width of a uniform distribution, or
+ *       twice the standard deviation of a normal one (10).
+ *   -D  Distribution of the prices (uniform).
+ *   -q  Largest quantity of an order; quantities are uniform from 1 (10).
+ *   -S  Trade the instrument with this symbol, in ENVELOPE packets, rather
+ *       than the default instrument.
+ *   -n  Name of the scenario, printed with the report.
+ *
+ * Traders post buy and sell orders at random, at prices drawn from the
+ * distribution given.  Each logs in under a name of its own, deposits funds
+ * and escrows inventory before the run, so that orders are normally only
+ * refused when a trader runs out.
+ *
+ * The report gives the throughput of requests, fills and notifications,
+ * and the latency of:
+ *   ack     A request, from sending it to receiving its ACK or NACK.
+ *   fill    An order, from sending it to receiving the first BOUGHT or SOLD
+ *           for it.
+ *   notify  A notification received by a subscriber, from the time the
+ *           server stamped it with to receiving it.  This is only meaningful
+ *           with the server on the same host.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+
+/*
+ * Latency histograms: log-linear buckets, each power of two split into
+ * HIST_SUB_BUCKETS, so that a percentile is within about 6% of the truth.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_MAGNITUDE 40
+#define HIST_BUCKETS (HIST_SUB_BUCKETS * (HIST_MAX_MAGNITUDE - HIST_SUB_BITS + 2))
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} HISTOGRAM;
+
+typedef enum {
+    LAT_ACK, LAT_FILL, LAT_NOTIFY, LATENCIES
+} latency_t;
+
+static const char *latency_names[LATENCIES] = { "ack", "fill", "notify" };
+
+/*
+ * What one thread counted, added to the totals when it finishes.
+ */
+typedef struct results {
+    uint64_t requests;                  // Requests answered
+    uint64_t nacks;                     // Requests answered with NACK
+    uint64_t orders;                    // BUY and SELL requests sent
+    uint64_t cancels;                   // CANCEL requests sent
+    uint64_t fills;                     // BOUGHT and SOLD received by traders
+    uint64_t notifications;             // Notifications received by subscribers
+    HISTOGRAM latency[LATENCIES];
+} RESULTS;
+
+typedef enum { DIST_UNIFORM, DIST_NORMAL } distribution_t;
+
+/*
+ * Scenario, as given on the command line.
+ */
+static const char *host = "127.0.0.1";
+static const char *port = "9999";
+static const char *scenario = NULL;
+static const char *symbol = NULL;
+static int traders = 1;
+static int subscribers = 0;
+static double duration = 5;
+static double rate = 0;
+static int window = 1;
+static double cancel_ratio = 0;
+static funds_t mid_price = 1000;
+static funds_t spread = 10;
+static distribution_t distribution = DIST_UNIFORM;
+static quantity_t max_quantity = 10;
+
+#define DEPOSIT_AMOUNT 100000000
+#define ESCROW_QUANTITY 100000000
+#define MAX_WINDOW 1024
+
+static volatile int stopping = 0;       // Traders are to stop sending
+static volatile int finished = 0;       // Subscribers are to stop receiving
+static pthread_barrier_t start_barrier;
+
+static pthread_mutex_t totals_mutex = PTHREAD_MUTEX_INITIALIZER;
+static RESULTS totals;
+
+static uint64_t now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+    int magnitude = 63 - __builtin_clzll(value);
+    if (magnitude > HIST_MAX_MAGNITUDE) {
+        return HIST_BUCKETS - 1;
+    }
+    int sub = (value >> (magnitude - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return HIST_SUB_BUCKETS * (magnitude - HIST_SUB_BITS + 1) + sub;
+}
+
+static uint64_t hist_bucket_max(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS) {
+        return bucket;
+    }
+    int magnitude = bucket / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket % HIST_SUB_BUCKETS;
+    return ((HIST_SUB_BUCKETS + sub + 1) << (magnitude - HIST_SUB_BITS)) - 1;
+}
+
+static void hist_record(HISTOGRAM *h, uint64_t value) {
+    h->buckets[hist_bucket(value)]++;
+    h->count++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+static uint64_t hist_percentile(HISTOGRAM *h, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * h->count);
+    if (rank >= h->count) {
+        rank = h->count - 1;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > rank) {
+            uint64_t value = hist_bucket_max(b);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+static void results_add(RESULTS *res) {
+    pthread_mutex_lock(&totals_mutex);
+    totals.requests += res->requests;
+    totals.nacks += res->nacks;
+    totals.orders += res->orders;
+    totals.cancels += res->cancels;
+    totals.fills += res->fills;
+    totals.notifications += res->notifications;
+    for (int i = 0; i < LATENCIES; i++) {
+        HISTOGRAM *to = &totals.latency[i], *from = &res->latency[i];
+        to->count += from->count;
+        if (from->max > to->max) {
+            to->max = from->max;
+        }
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            to->buckets[b] += from->buckets[b];
+        }
+    }
+    pthread_mutex_unlock(&totals_mutex);
+}
+
+/*
+ * Random numbers (xorshift64*), one generator per thread.
+ */
+static uint64_t rand_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double rand_unit(uint64_t *state) {
+    return (rand_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static funds_t rand_price(uint64_t *state) {
+    double price;
+    if (distribution == DIST_NORMAL) {
+        double u = rand_unit(state), v = rand_unit(state);
+        price = mid_price + spread / 2.0 * sqrt(-2 * log(1 - u)) * cos(2 * M_PI * v);
+    } else {
+        price = mid_price - (double)spread + rand_unit(state) * (2.0 * spread + 1);
+    }
+    return price < 1 ? 1 : (funds_t)price;
+}
+
+/*
+ * Connect to the server.
+ *
+ * @return  The socket, or -1 if the connection failed.
+ */
+static int connect_server(void) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1) {
+        perror("connect");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/*
+ * Send a request, enclosing it in an ENVELOPE if it concerns the instrument
+ * given with -S.
+ */
+static int send_request(int fd, uint8_t type, void *payload, size_t size) {
+    BRS_PACKET_HEADER hdr;
+    BRS_ENVELOPE_INFO env;
+    struct iovec iov[3];
+    int iovcnt = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.timestamp_sec = htonl(ts.tv_sec);
+    hdr.timestamp_nsec = htonl(ts.tv_nsec);
+    iov[iovcnt].iov_base = &hdr;
+    iov[iovcnt++].iov_len = sizeof(hdr);
+    if (symbol != NULL && type != BRS_LOGIN_PKT && type != BRS_DEPOSIT_PKT
+        && type != BRS_WITHDRAW_PKT) {
+        memset(&env, 0, sizeof(env));
+        strncpy(env.symbol, symbol, BRS_SYMBOL_SIZE);
+        env.type = type;
+        hdr.type = BRS_ENVELOPE_PKT;
+        iov[iovcnt].iov_base = &env;
+        iov[iovcnt++].iov_len = sizeof(env);
+    }
+    if (payload != NULL) {
+        iov[iovcnt].iov_base = payload;
+        iov[iovcnt++].iov_len = size;
+    }
+    hdr.size = htons(hdr.type == BRS_ENVELOPE_PKT ? size + sizeof(env) : size);
+    return proto_send_iov(fd, iov, iovcnt);
+}
+
+/*
+ * Take the type and payload of a packet, seeing through an ENVELOPE.
+ */
+static uint8_t packet_type(BRS_PACKET_HEADER *hdr, void **payloadp) {
+    if (hdr->type == BRS_ENVELOPE_PKT && *payloadp != NULL
+        && ntohs(hdr->size) >= sizeof(BRS_ENVELOPE_INFO)) {
+        BRS_ENVELOPE_INFO *env = *payloadp;
+        *payloadp = (char *)*payloadp + sizeof(BRS_ENVELOPE_INFO);
+        return env->type;
+    }
+    return hdr->type;
+}
+
+/*
+ * Send a request and wait for its response, ignoring notifications.
+ *
+ * @return  0 if the request was ACKed, -1 otherwise.
+ */
+static int request(int fd, PROTO_RBUF *rb, uint8_t type, void *payload, size_t size) {
+    if (send_request(fd, type, payload, size) == -1) {
+        return -1;
+    }
+    BRS_PACKET_HEADER *hdr;
+    void *data;
+    while (proto_recv_packet_rbuf(rb, &hdr, &data) == 0) {
+        if (hdr->type == BRS_ACK_PKT) {
+            return 0;
+        }
+        if (hdr->type == BRS_NACK_PKT) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Connect and log in.
+ *
+ * @return  The socket, or -1.
+ */
+static int login(PROTO_RBUF *rb, void *buf, size_t bufsize, const char *role, int index) {
+    int fd = connect_server();
+    if (fd == -1) {
+        return -1;
+    }
+    proto_rbuf_init(rb, fd, buf, bufsize);
+    char name[64];
+    int len = snprintf(name, sizeof(name), "%s%d.%d", role, index, (int)getpid());
+    if (request(fd, rb, BRS_LOGIN_PKT, name, len) == -1) {
+        fprintf(stderr, "Login of %s failed\n", name);
+        proto_rbuf_fini(rb);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Orders of a trader that may still rest on the book, by ID, with a dense
+ * array of their IDs from which to pick one to cancel.
+ */
+typedef struct order_slot {
+    orderid_t id;
+    uint8_t state;                      // SLOT_EMPTY, SLOT_LIVE or SLOT_DELETED
+    uint8_t filled;                     // A fill for it has been received
+    uint32_t live_index;                // Index in live[]
+    uint64_t sent;                      // Time the order was sent, 0 if not yet known
+    uint64_t first_fill;                // Time of the first fill, if before the ACK
+} ORDER_SLOT;
+
+#define SLOT_EMPTY 0
+#define SLOT_LIVE 1
+#define SLOT_DELETED 2
+
+typedef struct order_map {
+    ORDER_SLOT *slots;
+    size_t size;                        // Power of two
+    size_t used;                        // Slots not empty
+    orderid_t *live;
+    size_t live_count;
+} ORDER_MAP;
+
+static ORDER_SLOT *map_find(ORDER_MAP *map, orderid_t id) {
+    if (map->size == 0) {
+        return NULL;
+    }
+    size_t i = (id * 0x9E3779B1u) & (map->size - 1);
+    while (map->slots[i].state != SLOT_EMPTY) {
+        if (map->slots[i].state == SLOT_LIVE && map->slots[i].id == id) {
+            return &map->slots[i];
+        }
+        i = (i + 1) & (map->size - 1);
+    }
+    return NULL;
+}
+
+static int map_resize(ORDER_MAP *map) {
+    size_t size = map->size == 0 ? 1024 : map->live_count * 4 > map->size ? map->size * 2 : map->size;
+    ORDER_SLOT *slots = calloc(size, sizeof(ORDER_SLOT));
+    orderid_t *live = malloc(size * sizeof(orderid_t));
+    if (slots == NULL || live == NULL) {
+        free(slots);
+        free(live);
+        return -1;
+    }
+    ORDER_SLOT *old = map->slots;
+    size_t old_size = map->size;
+    free(map->live);
+    map->slots = slots;
+    map->live = live;
+    map->size = size;
+    map->used = 0;
+    map->live_count = 0;
+    for (size_t j = 0; j < old_size; j++) {
+        if (old[j].state == SLOT_LIVE) {
+            size_t i = (old[j].id * 0x9E3779B1u) & (size - 1);
+            while (slots[i].state != SLOT_EMPTY) {
+                i = (i + 1) & (size - 1);
+            }
+            slots[i] = old[j];
+            slots[i].live_index = map->live_count;
+            live[map->live_count++] = old[j].id;
+            map->used++;
+        }
+    }
+    free(old);
+    return 0;
+}
+
+static ORDER_SLOT *map_insert(ORDER_MAP *map, orderid_t id) {
+    if ((map->used + 1) * 2 > map->size && map_resize(map) == -1) {
+        return NULL;
+    }
+    size_t i = (id * 0x9E3779B1u) & (map->size - 1);
+    while (map->slots[i].state == SLOT_LIVE) {
+        i = (i + 1) & (map->size - 1);
+    }
+    ORDER_SLOT *slot = &map->slots[i];
+    if (slot->state == SLOT_EMPTY) {
+        map->used++;
+    }
+    memset(slot, 0, sizeof(*slot));
+    slot->id = id;
+    slot->state = SLOT_LIVE;
+    slot->live_index = map->live_count;
+    map->live[map->live_count++] = id;
+    return slot;
+}
+
+static void map_remove(ORDER_MAP *map, ORDER_SLOT *slot) {
+    orderid_t last = map->live[--map->live_count];
+    if (last != slot->id) {
+        ORDER_SLOT *moved = map_find(map, last);
+        moved->live_index = slot->live_index;
+        map->live[slot->live_index] = last;
+    }
+    slot->state = SLOT_DELETED;
+}
+
+static void map_fini(ORDER_MAP *map) {
+    free(map->slots);
+    free(map->live);
+}
+
+/*
+ * A request sent by a trader and not yet answered.
+ */
+typedef struct outstanding {
+    uint8_t type;
+    orderid_t cancel;                   // Order to be canceled, for CANCEL
+    uint64_t sent;
+} OUTSTANDING;
+
+typedef struct trader_state {
+    int fd;
+    RESULTS res;
+    ORDER_MAP orders;
+    OUTSTANDING pending[MAX_WINDOW];
+    size_t pending_head;
+    size_t pending_count;
+} TRADER_STATE;
+
+static void trader_fill(TRADER_STATE *ts, orderid_t id, uint64_t now) {
+    ts->res.fills++;
+    ORDER_SLOT *slot = map_find(&ts->orders, id);
+    if (slot == NULL) {
+        // The fill came before the ACK that gives the order its ID
+        if ((slot = map_insert(&ts->orders, id)) == NULL) {
+            return;
+        }
+        slot->first_fill = now;
+        slot->filled = 1;
+    } else if (!slot->filled) {
+        slot->filled = 1;
+        hist_record(&ts->res.latency[LAT_FILL], now - slot->sent);
+    }
+}
+
+static void trader_response(TRADER_STATE *ts, BRS_PACKET_HEADER *hdr, void *payload, uint64_t now) {
+    if (ts->pending_count == 0) {
+        return;
+    }
+    OUTSTANDING *out = &ts->pending[ts->pending_head];
+    ts->pending_head = (ts->pending_head + 1) % MAX_WINDOW;
+    ts->pending_count--;
+    ts->res.requests++;
+    hist_record(&ts->res.latency[LAT_ACK], now - out->sent);
+
+    if (hdr->type == BRS_NACK_PKT) {
+        ts->res.nacks++;
+        if (out->type == BRS_CANCEL_PKT) {
+            // Filled or canceled already: either way no longer resting
+            ORDER_SLOT *slot = map_find(&ts->orders, out->cancel);
+            if (slot != NULL) {
+                map_remove(&ts->orders, slot);
+            }
+        }
+        return;
+    }
+    if (payload == NULL || ntohs(hdr->size) < sizeof(BRS_STATUS_INFO)) {
+        return;
+    }
+    BRS_STATUS_INFO *info = payload;
+    orderid_t id = ntohl(info->orderid);
+    ORDER_SLOT *slot = map_find(&ts->orders, id);
+    if (out->type == BRS_CANCEL_PKT) {
+        if (slot != NULL) {
+            map_remove(&ts->orders, slot);
+        }
+    } else if (slot != NULL) {
+        // Filled already
+        slot->sent = out->sent;
+        hist_record(&ts->res.latency[LAT_FILL], slot->first_fill - out->sent);
+    } else if ((slot = map_insert(&ts->orders, id)) != NULL) {
+        slot->sent = out->sent;
+    }
+}
+
+/*
+ * Send the next request of a trader: an order, or a cancellation of one of
+ * its orders that may still rest on the book.
+ */
+static int trader_send(TRADER_STATE *ts, uint64_t *rng) {
+    OUTSTANDING *out = &ts->pending[(ts->pending_head + ts->pending_count) % MAX_WINDOW];
+    if (cancel_ratio > 0 && ts->orders.live_count > 0 && rand_unit(rng) < cancel_ratio) {
+        orderid_t id = ts->orders.live[rand_next(rng) % ts->orders.live_count];
+        BRS_CANCEL_INFO info = { htonl(id) };
+        out->type = BRS_CANCEL_PKT;
+        out->cancel = id;
+        out->sent = now_ns(CLOCK_MONOTONIC);
+        if (send_request(ts->fd, BRS_CANCEL_PKT, &info, sizeof(info)) == -1) {
+            return -1;
+        }
+        ts->res.cancels++;
+    } else {
+        BRS_ORDER_INFO info;
+        info.quantity = htonl(1 + rand_next(rng) % max_quantity);
+        info.price = htonl(rand_price(rng));
+        out->type = rand_next(rng) & 1 ? BRS_BUY_PKT : BRS_SELL_PKT;
+        out->sent = now_ns(CLOCK_MONOTONIC);
+        if (send_request(ts->fd, out->type, &info, sizeof(info)) == -1) {
+            return -1;
+        }
+        ts->res.orders++;
+    }
+    ts->pending_count++;
+    return 0;
+}
+
+/*
+ * Receive what has arrived for a trader, waiting until the given time at
+ * most.
+ */
+static int trader_receive(TRADER_STATE *ts, PROTO_RBUF *rb, uint64_t until) {
+    uint64_t now = now_ns(CLOCK_MONOTONIC);
+    struct timespec timeout = { 0, 0 };
+    if (until > now) {
+        timeout.tv_sec = (until - now) / 1000000000u;
+        timeout.tv_nsec = (until - now) % 1000000000u;
+    }
+    struct pollfd pfd = { ts->fd, POLLIN, 0 };
+    int n = ppoll(&pfd, 1, &timeout, NULL);
+    if (n <= 0) {
+        return n == -1 && errno != EINTR ? -1 : 0;
+    }
+    ssize_t got = proto_rbuf_fill(rb, 1);
+    if (got == 0 || (got == -1 && errno != EAGAIN && errno != EINTR)) {
+        return -1;
+    }
+    now = now_ns(CLOCK_MONOTONIC);
+    BRS_PACKET_HEADER *hdr;
+    void *payload;
+    while (proto_rbuf_next(rb, &hdr, &payload)) {
+        uint8_t type = packet_type(hdr, &payload);
+        if (type == BRS_ACK_PKT || type == BRS_NACK_PKT) {
+            trader_response(ts, hdr, payload, now);
+        } else if ((type == BRS_BOUGHT_PKT || type == BRS_SOLD_PKT) && payload != NULL) {
+            BRS_NOTIFY_INFO *info = payload;
+            trader_fill(ts, ntohl(type == BRS_BOUGHT_PKT ? info->buyer : info->seller), now);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Thread function for a trader.
+ */
+static void *trader_thread(void *arg) {
+    int index = (int)(intptr_t)arg;
+    uint64_t rng = now_ns(CLOCK_MONOTONIC) ^ ((uint64_t)(index + 1) << 32) ^ 0x9E3779B97F4A7C15ULL;
+    static __thread char buf[PROTO_RBUF_SIZE] __attribute__((aligned(8)));
+    PROTO_RBUF rb;
+    TRADER_STATE *ts = calloc(1, sizeof(TRADER_STATE));
+    if (ts == NULL) {
+        pthread_barrier_wait(&start_barrier);
+        return NULL;
+    }
+
+    ts->fd = login(&rb, buf, sizeof(buf), "trader", index);
+    if (ts->fd != -1) {
+        BRS_FUNDS_INFO funds = { htonl(DEPOSIT_AMOUNT) };
+        BRS_ESCROW_INFO escrow = { htonl(ESCROW_QUANTITY) };
+        if (request(ts->fd, &rb, BRS_DEPOSIT_PKT, &funds, sizeof(funds)) == -1
+            || request(ts->fd, &rb, BRS_ESCROW_PKT, &escrow, sizeof(escrow)) == -1) {
+            fprintf(stderr, "Trader %d could not be funded\n", index);
+        }
+    }
+    pthread_barrier_wait(&start_barrier);
+    if (ts->fd == -1) {
+        free(ts);
+        return NULL;
+    }
+
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+    uint64_t next = now_ns(CLOCK_MONOTONIC);
+    while (!stopping) {
+        uint64_t now = now_ns(CLOCK_MONOTONIC);
+        if ((size_t)window > ts->pending_count && now >= next) {
+            if (trader_send(ts, &rng) == -1) {
+                break;
+            }
+            next = interval > 0 ? next + interval : now;
+            continue;
+        }
+        uint64_t until = (size_t)window > ts->pending_count ? next : now + 100000000u;
+        if (trader_receive(ts, &rb, until) == -1) {
+            break;
+        }
+    }
+
+    // Collect the responses still outstanding
+    uint64_t deadline = now_ns(CLOCK_MONOTONIC) + 2000000000u;
+    while (ts->pending_count > 0 && now_ns(CLOCK_MONOTONIC) < deadline) {
+        if (trader_receive(ts, &rb, deadline) == -1) {
+            break;
+        }
+    }
+    results_add(&ts->res);
+    proto_rbuf_fini(&rb);
+    close(ts->fd);
+    map_fini(&ts->orders);
+    free(ts);
+    return NULL;
+}
+
+/*
+ * Thread function for a subscriber.
+ */
+static void *subscriber_thread(void *arg) {
+    int index = (int)(intptr_t)arg;
+    static __thread char buf[PROTO_RBUF_SIZE] __attribute__((aligned(8)));
+    PROTO_RBUF rb;
+    RESULTS *res = calloc(1, sizeof(RESULTS));
+    int fd = res == NULL ? -1 : login(&rb, buf, sizeof(buf), "subscriber", index);
+    pthread_barrier_wait(&start_barrier);
+    if (fd == -1) {
+        free(res);
+        return NULL;
+    }
+
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (!finished) {
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        ssize_t got = proto_rbuf_fill(&rb, 1);
+        if (got == 0 || (got == -1 && errno != EAGAIN && errno != EINTR)) {
+            break;
+        }
+        uint64_t now = now_ns(CLOCK_REALTIME);
+        BRS_PACKET_HEADER *hdr;
+        void *payload;
+        while (proto_rbuf_next(&rb, &hdr, &payload)) {
+            uint8_t type = packet_type(hdr, &payload);
+            if (type < BRS_BOUGHT_PKT || type > BRS_TRADED_PKT) {
+                continue;
+            }
+            res->notifications++;
+            uint64_t stamp = (uint64_t)ntohl(hdr->timestamp_sec) * 1000000000u
+                             + ntohl(hdr->timestamp_nsec);
+            hist_record(&res->latency[LAT_NOTIFY], now > stamp ? now - stamp : 0);
+        }
+    }
+    results_add(res);
+    proto_rbuf_fini(&rb);
+    close(fd);
+    free(res);
+    return NULL;
+}
+
+static void report(double elapsed) {
+    char rate_text[32];
+    if (rate > 0) {
+        snprintf(rate_text, sizeof(rate_text), "%g/s", rate);
+    } else {
+        snprintf(rate_text, sizeof(rate_text), "unlimited");
+    }
+    printf("scenario %s: traders %d, subscribers %d, rate %s, window %d, cancel %g, "
+           "prices %s %u+-%u, quantity 1-%u%s%s\n",
+           scenario != NULL ? scenario : "-", traders, subscribers, rate_text, window,
+           cancel_ratio, distribution == DIST_NORMAL ? "normal" : "uniform",
+           mid_price, spread, max_quantity, symbol != NULL ? ", symbol " : "",
+           symbol != NULL ? symbol : "");
+    printf("%-14s %12.2f s\n", "elapsed", elapsed);
+    printf("%-14s %12" PRIu64 " %12.0f/s\n", "requests", totals.requests, totals.requests / elapsed);
+    printf("%-14s %12" PRIu64 "\n", "orders", totals.orders);
+    printf("%-14s %12" PRIu64 "\n", "cancels", totals.cancels);
+    printf("%-14s %12" PRIu64 "\n", "nacks", totals.nacks);
+    printf("%-14s %12" PRIu64 " %12.0f/s\n", "fills", totals.fills, totals.fills / elapsed);
+    printf("%-14s %12" PRIu64 " %12.0f/s\n", "notifications", totals.notifications,
+           totals.notifications / elapsed);
+    printf("%-14s %12s %10s %10s %10s %10s\n", "latency (us)", "count", "p50", "p99", "p99.9", "max");
+    for (int i = 0; i < LATENCIES; i++) {
+        HISTOGRAM *h = &totals.latency[i];
+        if (h->count == 0) {
+            continue;
+        }
+        printf("%-14s %12" PRIu64 " %10.1f %10.1f %10.1f %10.1f\n", latency_names[i], h->count,
+               hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.99) / 1e3,
+               hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-h <host>] [-p <port>] [-t <traders>] [-s <subscribers>]\n"
+            "       [-d <seconds>] [-r <rate>] [-w <window>] [-c <cancel ratio>]\n"
+            "       [-m <mid price>] [-x <spread>] [-D uniform|normal]\n"
+            "       [-q <max quantity>] [-S <symbol>] [-n <name>]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:t:s:d:r:w:c:m:x:D:q:S:n:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 't': traders = atoi(optarg); break;
+            case 's': subscribers = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            case 'c': cancel_ratio = atof(optarg); break;
+            case 'm': mid_price = strtoul(optarg, NULL, 10); break;
+            case 'x': spread = strtoul(optarg, NULL, 10); break;
+            case 'q': max_quantity = strtoul(optarg, NULL, 10); break;
+            case 'S': symbol = optarg; break;
+            case 'n': scenario = optarg; break;
+            case 'D':
+                if (strcmp(optarg, "uniform") == 0) {
+                    distribution = DIST_UNIFORM;
+                } else if (strcmp(optarg, "normal") == 0) {
+                    distribution = DIST_NORMAL;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc || traders < 1 || subscribers < 0 || duration <= 0 || window < 1
+        || window > MAX_WINDOW || cancel_ratio < 0 || cancel_ratio > 1 || max_quantity < 1
+        || (symbol != NULL && strlen(symbol) > BRS_SYMBOL_SIZE)) {
+        usage(argv[0]);
+    }
+
+    int threads = traders + subscribers;
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    if (tids == NULL || pthread_barrier_init(&start_barrier, NULL, threads + 1) != 0) {
+        perror("loadgen");
+        exit(EXIT_FAILURE);
+    }
+    // Subscribers first, so that they see all that the traders do
+    for (int i = 0; i < threads; i++) {
+        void *(*func)(void *) = i < subscribers ? subscriber_thread : trader_thread;
+        if (pthread_create(&tids[i], NULL, func, (void *)(intptr_t)i) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns(CLOCK_MONOTONIC);
+
+    struct timespec delay = { (time_t)duration, (long)((duration - (time_t)duration) * 1e9) };
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR) {
+    }
+    stopping = 1;
+    for (int i = subscribers; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = (now_ns(CLOCK_MONOTONIC) - start) / 1e9;
+
+    // Give the last notifications time to reach the subscribers
+    delay.tv_sec = 0;
+    delay.tv_nsec = 200000000;
+    nanosleep(&delay, NULL);
+    finished = 1;
+    for (int i = 0; i < subscribers; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    report(elapsed);
+    free(tids);
+    return totals.requests > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,541 @@
+/*
+ * Microbenchmark for the exchange core, without sockets.
+ *
+ * Usage: microbench [-n <orders>] [-t <traders>] [-k null|count|memory]
+ *                   [-c <cancel ratio>] [-m <mid price>] [-x <spread>]
+ *                   [-D uniform|normal] [-q <max quantity>] [-p <phases>]
+ *                   [-f <stream>] [-w <stream>] [-W block|adaptive|spin]
+ *                   [-F] [-M] [-v]
+ *
+ *   -n  Number of orders in each phase (1000000).
+ *   -t  Number of traders (8).
+ *   -k  Kind of sink to which the packets sent to traders go (count).
+ *   -c  Fraction of operations that cancel an earlier order (0.2).
+ *   -m  Price around which orders are posted (1000).
+ *   -x  Spread of the prices, as for loadgen (10).
+ *   -D  Distribution of the prices (uniform).
+ *   -q  Largest quantity of an order (10).
+ *   -p  Comma-separated phases to run, of book, stream and sweep (all).
+ *   -f  Replay the order stream in a file in the stream phase, rather than
+ *       a synthetic one.
+ *   -w  Write the synthetic order stream of the stream phase to a file,
+ *       for replaying later.
+ *   -F  Deliver notifications through the fan-out stage, rather than
+ *       synchronously from the threads posting and matching orders.
+ *   -W  How the matchmaker waits to be woken (see exchange_ext.h) (block).
+ *   -M  Match orders on the thread posting them (see exchange_ext.h).
+ *   -v  Print the server's counters and histograms at the end.
+ *
+ * Traders are logged in with sinks in place of connections (see
+ * trader_ext.h), and orders are posted straight into a fresh EXCHANGE for
+ * each phase:
+ *
+ *   book    Orders that never cross, and cancellations of them: the cost of
+ *           operations on the book alone.
+ *   stream  A stream of orders that cross, with cancellations: operations
+ *           per second seen by the caller, and trades per second up to the
+ *           point at which the matchmaker has uncrossed the book.
+ *   sweep   A book of single-unit sell orders, swept by one buy order for
+ *           all of them: the cost of each trade made by the matchmaker.
+ *
+ * An order stream file has one operation per line:
+ *
+ *   B <trader> <quantity> <price>   Post a buy order
+ *   S <trader> <quantity> <price>   Post a sell order
+ *   C <order>                       Cancel the order posted by the operation
+ *                                   with this index (from 0) in the stream
+ *
+ * Traders are numbered from 0, modulo the number of traders.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "exchange.h"
+#include "exchange_ext.h"
+#include "account.h"
+#include "trader.h"
+#include "trader_ext.h"
+#include "fanout.h"
+#include "stats.h"
+
+/*
+ * An operation of an order stream.
+ */
+typedef struct op {
+    char type;                          // 'B', 'S' or 'C'
+    int trader;
+    quantity_t quantity;
+    funds_t price;
+    long target;                        // Index of the order to cancel
+} OP;
+
+typedef struct stream {
+    OP *ops;
+    long count;
+    long size;
+} STREAM;
+
+typedef enum { DIST_UNIFORM, DIST_NORMAL } distribution_t;
+
+static long orders = 1000000;
+static int ntraders = 8;
+static trader_sink_t sink_kind = TRADER_SINK_COUNT;
+static double cancel_ratio = 0.2;
+static funds_t mid_price = 1000;
+static funds_t spread = 10;
+static distribution_t distribution = DIST_UNIFORM;
+static quantity_t max_quantity = 10;
+static const char *phases = "book,stream,sweep";
+static const char *replay_file = NULL;
+static const char *write_file = NULL;
+static int use_fanout = 0;
+static int inline_matching = 0;
+static exchange_wait_t wait_strategy = EXCHANGE_WAIT_BLOCK;
+static int verbose = 0;
+
+static const char *wait_names[] = { "block", "adaptive", "spin" };
+
+/*
+ * Create a fresh exchange for a phase, with the matchmaker waiting as asked.
+ */
+static EXCHANGE *phase_exchange(void) {
+    EXCHANGE *xchg = exchange_init();
+    if (xchg != NULL) {
+        exchange_set_wait(xchg, wait_strategy);
+    }
+    return xchg;
+}
+
+#define DEPOSIT_AMOUNT 2000000000u
+#define ESCROW_QUANTITY 2000000000u
+#define SINK_MEMORY_SIZE (4 << 20)
+
+static TRADER **traders;
+static TRADER_SINK *sinks;
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+/*
+ * Random numbers (xorshift64*).
+ */
+static uint64_t rand_next(void) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double rand_unit(void) {
+    return (rand_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double rand_price(void) {
+    if (distribution == DIST_NORMAL) {
+        double u = rand_unit(), v = rand_unit();
+        return mid_price + spread / 2.0 * sqrt(-2 * log(1 - u)) * cos(2 * M_PI * v);
+    }
+    return mid_price - (double)spread + rand_unit() * (2.0 * spread + 1);
+}
+
+static funds_t clamp_price(double price) {
+    return price < 1 ? 1 : (funds_t)price;
+}
+
+static int stream_add(STREAM *stream, OP *op) {
+    if (stream->count == stream->size) {
+        long size = stream->size == 0 ? 1024 : stream->size * 2;
+        OP *ops = realloc(stream->ops, size * sizeof(OP));
+        if (ops == NULL) {
+            return -1;
+        }
+        stream->ops = ops;
+        stream->size = size;
+    }
+    stream->ops[stream->count++] = *op;
+    return 0;
+}
+
+/*
+ * Make a synthetic order stream.  Orders cross unless passive is nonzero,
+ * in which case buys are priced below the mid price and sells above it.
+ */
+static int stream_synthetic(STREAM *stream, long count, int passive) {
+    long posted = 0;
+    while (posted < count) {
+        OP op;
+        memset(&op, 0, sizeof(op));
+        if (stream->count > 0 && rand_unit() < cancel_ratio) {
+            // Cancel an earlier order, which may have been filled by now
+            long target;
+            do {
+                target = rand_next() % stream->count;
+            } while (stream->ops[target].type == 'C');
+            op.type = 'C';
+            op.trader = stream->ops[target].trader;
+            op.target = target;
+        } else {
+            op.type = rand_next() & 1 ? 'B' : 'S';
+            op.trader = rand_next() % ntraders;
+            op.quantity = 1 + rand_next() % max_quantity;
+            double price = rand_price();
+            if (passive) {
+                double off = fabs(price - mid_price);
+                price = op.type == 'B' ? mid_price - 1 - off : mid_price + 1 + off;
+            }
+            op.price = clamp_price(price);
+            posted++;
+        }
+        if (stream_add(stream, &op) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int stream_read(STREAM *stream, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    char line[128];
+    long lineno = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        OP op;
+        memset(&op, 0, sizeof(op));
+        char type;
+        int ok;
+        if (sscanf(line, " %c", &type) != 1 || type == '#') {
+            continue;
+        }
+        if (type == 'C') {
+            ok = sscanf(line, " C %ld", &op.target) == 1 && op.target >= 0
+                 && op.target < stream->count && stream->ops[op.target].type != 'C';
+            if (ok) {
+                op.trader = stream->ops[op.target].trader;
+            }
+        } else {
+            ok = (type == 'B' || type == 'S')
+                 && sscanf(line, " %*c %d %u %u", &op.trader, &op.quantity, &op.price) == 3
+                 && op.trader >= 0 && op.quantity > 0;
+            op.trader %= ntraders;
+        }
+        op.type = type;
+        if (!ok) {
+            fprintf(stderr, "%s:%ld: invalid operation\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+        if (stream_add(stream, &op) == -1) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static int stream_write(STREAM *stream, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    for (long i = 0; i < stream->count; i++) {
+        OP *op = &stream->ops[i];
+        if (op->type == 'C') {
+            fprintf(f, "C %ld\n", op->target);
+        } else {
+            fprintf(f, "%c %d %u %u\n", op->type, op->trader, op->quantity, op->price);
+        }
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/*
+ * Wait for the matchmaker to have made all possible trades.
+ */
+static void wait_uncrossed(EXCHANGE *xchg) {
+    ACCOUNT *account = trader_get_account(traders[0]);
+    while (1) {
+        BRS_STATUS_INFO info;
+        exchange_get_status(xchg, account, &info);
+        funds_t bid = ntohl(info.bid), ask = ntohl(info.ask);
+        if (bid == 0 || ask == 0 || bid < ask) {
+            return;
+        }
+        sched_yield();
+    }
+}
+
+typedef struct results {
+    long posts;
+    long cancels;
+    long rejects;                       // Posts refused, or cancels of orders gone
+    uint64_t post_ns;
+    uint64_t cancel_ns;
+} RESULTS;
+
+/*
+ * Apply an order stream to an exchange, timing each operation.
+ */
+static int stream_run(EXCHANGE *xchg, STREAM *stream, RESULTS *res) {
+    orderid_t *ids = calloc(stream->count > 0 ? stream->count : 1, sizeof(orderid_t));
+    if (ids == NULL) {
+        return -1;
+    }
+    memset(res, 0, sizeof(*res));
+    for (long i = 0; i < stream->count; i++) {
+        OP *op = &stream->ops[i];
+        TRADER *trader = traders[op->trader];
+        uint64_t start = stats_now();
+        if (op->type == 'C') {
+            quantity_t quantity;
+            int r = ids[op->target] != 0 ? exchange_cancel(xchg, trader, ids[op->target], &quantity) : -1;
+            res->cancel_ns += stats_now() - start;
+            res->cancels++;
+            res->rejects += r != 0;
+        } else {
+            ids[i] = op->type == 'B' ? exchange_post_buy(xchg, trader, op->quantity, op->price)
+                                     : exchange_post_sell(xchg, trader, op->quantity, op->price);
+            res->post_ns += stats_now() - start;
+            res->posts++;
+            res->rejects += ids[i] == 0;
+        }
+    }
+    free(ids);
+    return 0;
+}
+
+static void report_ops(const char *phase, RESULTS *res, uint64_t elapsed) {
+    long ops = res->posts + res->cancels;
+    printf("%-8s %10ld ops %12.0f ops/s   post %7.0f ns   cancel %7.0f ns   rejected %ld\n",
+           phase, ops, ops * 1e9 / (elapsed > 0 ? elapsed : 1),
+           res->posts > 0 ? (double)res->post_ns / res->posts : 0.0,
+           res->cancels > 0 ? (double)res->cancel_ns / res->cancels : 0.0, res->rejects);
+}
+
+static int phase_book(void) {
+    STREAM stream = { NULL, 0, 0 };
+    RESULTS res;
+    EXCHANGE *xchg = phase_exchange();
+    if (xchg == NULL || stream_synthetic(&stream, orders, 1) == -1) {
+        free(stream.ops);
+        exchange_fini(xchg);
+        return -1;
+    }
+    uint64_t start = stats_now();
+    stream_run(xchg, &stream, &res);
+    uint64_t elapsed = stats_now() - start;
+    report_ops("book", &res, elapsed);
+    exchange_fini(xchg);
+    free(stream.ops);
+    return 0;
+}
+
+static int phase_stream(void) {
+    STREAM stream = { NULL, 0, 0 };
+    RESULTS res;
+    int err = replay_file != NULL ? stream_read(&stream, replay_file)
+                                  : stream_synthetic(&stream, orders, 0);
+    if (err == 0 && write_file != NULL && replay_file == NULL) {
+        err = stream_write(&stream, write_file);
+    }
+    EXCHANGE *xchg = err == 0 ? phase_exchange() : NULL;
+    if (xchg == NULL) {
+        free(stream.ops);
+        return -1;
+    }
+    uint64_t trades = stats_counter_total(STATS_TRADES);
+    uint64_t start = stats_now();
+    stream_run(xchg, &stream, &res);
+    uint64_t elapsed = stats_now() - start;
+    wait_uncrossed(xchg);
+    uint64_t total = stats_now() - start;
+    trades = stats_counter_total(STATS_TRADES) - trades;
+    report_ops("stream", &res, elapsed);
+    printf("%-8s %10" PRIu64 " trades %9.0f trades/s (%.3f s until uncrossed)\n", "", trades,
+           trades * 1e9 / (total > 0 ? total : 1), total / 1e9);
+    exchange_fini(xchg);
+    free(stream.ops);
+    return 0;
+}
+
+static int phase_sweep(void) {
+    funds_t price = mid_price + spread;
+    if (orders * (double)price > DEPOSIT_AMOUNT) {
+        fprintf(stderr, "sweep: %ld orders at %u are more than a trader can pay for\n",
+                orders, price);
+        return -1;
+    }
+    EXCHANGE *xchg = phase_exchange();
+    if (xchg == NULL) {
+        return -1;
+    }
+    // Sell orders are posted by all traders but the first, which sweeps them
+    for (long i = 0; i < orders; i++) {
+        TRADER *seller = traders[ntraders > 1 ? 1 + i % (ntraders - 1) : 0];
+        exchange_post_sell(xchg, seller, 1, mid_price + i % (spread + 1));
+    }
+    wait_uncrossed(xchg);
+    uint64_t trades = stats_counter_total(STATS_TRADES);
+    uint64_t start = stats_now();
+    exchange_post_buy(xchg, traders[0], orders, price);
+    wait_uncrossed(xchg);
+    uint64_t elapsed = stats_now() - start;
+    trades = stats_counter_total(STATS_TRADES) - trades;
+    printf("%-8s %10" PRIu64 " trades %9.0f trades/s   %7.0f ns/trade\n", "sweep", trades,
+           trades * 1e9 / (elapsed > 0 ? elapsed : 1), trades > 0 ? (double)elapsed / trades : 0.0);
+    exchange_fini(xchg);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n <orders>] [-t <traders>] [-k null|count|memory]\n"
+            "       [-c <cancel ratio>] [-m <mid price>] [-x <spread>]\n"
+            "       [-D uniform|normal] [-q <max quantity>] [-p <phases>]\n"
+            "       [-f <stream>] [-w <stream>] [-W block|adaptive|spin]\n"
+            "       [-F] [-M] [-v]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:k:c:m:x:D:q:p:f:w:W:FMv")) != -1) {
+        switch (opt) {
+            case 'n': orders = atol(optarg); break;
+            case 't': ntraders = atoi(optarg); break;
+            case 'c': cancel_ratio = atof(optarg); break;
+            case 'm': mid_price = strtoul(optarg, NULL, 10); break;
+            case 'x': spread = strtoul(optarg, NULL, 10); break;
+            case 'q': max_quantity = strtoul(optarg, NULL, 10); break;
+            case 'p': phases = optarg; break;
+            case 'f': replay_file = optarg; break;
+            case 'w': write_file = optarg; break;
+            case 'F': use_fanout = 1; break;
+            case 'M': inline_matching = 1; break;
+            case 'v': verbose = 1; break;
+            case 'k':
+                if (strcmp(optarg, "null") == 0) {
+                    sink_kind = TRADER_SINK_NULL;
+                } else if (strcmp(optarg, "count") == 0) {
+                    sink_kind = TRADER_SINK_COUNT;
+                } else if (strcmp(optarg, "memory") == 0) {
+                    sink_kind = TRADER_SINK_MEMORY;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case 'W':
+                if (strcmp(optarg, "block") == 0) {
+                    wait_strategy = EXCHANGE_WAIT_BLOCK;
+                } else if (strcmp(optarg, "adaptive") == 0) {
+                    wait_strategy = EXCHANGE_WAIT_ADAPTIVE;
+                } else if (strcmp(optarg, "spin") == 0) {
+                    wait_strategy = EXCHANGE_WAIT_SPIN;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case 'D':
+                if (strcmp(optarg, "uniform") == 0) {
+                    distribution = DIST_UNIFORM;
+                } else if (strcmp(optarg, "normal") == 0) {
+                    distribution = DIST_NORMAL;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc || orders < 1 || ntraders < 1 || cancel_ratio < 0 || cancel_ratio >= 1
+        || max_quantity < 1 || mid_price <= spread + 1) {
+        usage(argv[0]);
+    }
+
+    if (accounts_init() != 0 || traders_init() != 0
+        || (use_fanout && fanout_init(OUTBOUND_DEFAULT_CAPACITY, OUTBOUND_DROP) != 0)) {
+        fprintf(stderr, "Initialization failed\n");
+        exit(EXIT_FAILURE);
+    }
+    exchanges_set_inline_matching(inline_matching);
+    traders = calloc(ntraders, sizeof(TRADER *));
+    sinks = calloc(ntraders, sizeof(TRADER_SINK));
+    if (traders == NULL || sinks == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ntraders; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "bench%d", i);
+        void *buf = sink_kind == TRADER_SINK_MEMORY ? malloc(SINK_MEMORY_SIZE) : NULL;
+        trader_sink_init(&sinks[i], sink_kind, buf, buf != NULL ? SINK_MEMORY_SIZE : 0);
+        if ((traders[i] = trader_login_sink(&sinks[i], name)) == NULL) {
+            fprintf(stderr, "Login of %s failed\n", name);
+            exit(EXIT_FAILURE);
+        }
+        ACCOUNT *account = trader_get_account(traders[i]);
+        account_increase_balance(account, DEPOSIT_AMOUNT);
+        account_increase_inventory(account, ESCROW_QUANTITY);
+    }
+
+    printf("orders %ld, traders %d, sink %s, cancel %g, prices %s %u+-%u, quantity 1-%u, wait %s%s%s\n",
+           orders, ntraders,
+           sink_kind == TRADER_SINK_NULL ? "null" : sink_kind == TRADER_SINK_COUNT ? "count" : "memory",
+           cancel_ratio, distribution == DIST_NORMAL ? "normal" : "uniform", mid_price, spread,
+           max_quantity, wait_names[wait_strategy], use_fanout ? ", fan-out" : "",
+           inline_matching ? ", inline matching" : "");
+    int status = EXIT_SUCCESS;
+    char *list = strdup(phases);
+    for (char *save, *phase = strtok_r(list, ",", &save); phase != NULL;
+         phase = strtok_r(NULL, ",", &save)) {
+        int err;
+        if (strcmp(phase, "book") == 0) {
+            err = phase_book();
+        } else if (strcmp(phase, "stream") == 0) {
+            err = phase_stream();
+        } else if (strcmp(phase, "sweep") == 0) {
+            err = phase_sweep();
+        } else {
+            fprintf(stderr, "Unknown phase %s\n", phase);
+            err = -1;
+        }
+        if (err != 0) {
+            status = EXIT_FAILURE;
+        }
+    }
+    free(list);
+
+    unsigned long packets = 0, bytes = 0;
+    for (int i = 0; i < ntraders; i++) {
+        packets += sinks[i].packets;
+        bytes += sinks[i].bytes;
+    }
+    if (sink_kind != TRADER_SINK_NULL) {
+        printf("sinks    %10lu packets %9lu bytes\n", packets, bytes);
+    }
+    if (verbose) {
+        stats_report(stdout);
+    }
+
+    if (use_fanout) {
+        fanout_fini();
+    }
+    for (int i = 0; i < ntraders; i++) {
+        trader_logout(traders[i]);
+        free(sinks[i].buf);
+    }
+    traders_fini();
+    accounts_fini();
+    free(traders);
+    free(sinks);
+    return status;
+}
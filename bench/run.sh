@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Run the microbenchmark of the exchange core, then the standard load
+# scenarios against a server started for them.
+#
+# Usage: bench/run.sh [<bin directory>]
+#
+# BENCH_PORT    Port on which to start the server (9900).
+# BENCH_TIME    Duration of each scenario in seconds (3).
+# BENCH_ARGS    Further options for the server, e.g. "-i AAA -i BBB".
+# BENCH_ORDERS  Orders in each phase of the microbenchmark (200000).
+#
+BIN=${1:-bin}
+PORT=${BENCH_PORT:-9900}
+TIME=${BENCH_TIME:-3}
+
+$BIN/microbench -n ${BENCH_ORDERS:-200000} || exit 1
+echo
+
+$BIN/bourse -p $PORT $BENCH_ARGS > /dev/null 2>&1 &
+SERVER=$!
+trap 'kill -HUP $SERVER 2> /dev/null; wait $SERVER' EXIT
+sleep 0.5
+
+run() {
+    $BIN/loadgen -p $PORT -d $TIME "$@" || exit 1
+    echo
+}
+
+# Crossing orders from several traders: the matchmaker
+run -n match -t 4 -w 8 -x 5 -c 0.2
+# A book many levels deep, with frequent cancellation
+run -n book -t 4 -w 8 -x 500 -D normal -c 0.5
+# Paced traders and many passive subscribers: the broadcast path
+run -n broadcast -t 2 -r 5000 -w 16 -s 16 -x 5
@@ -0,0 +1,119 @@
+#ifndef ACCOUNT_EXT_H
+#define ACCOUNT_EXT_H
+
+#include <stdint.h>
+
+#include "account.h"
+
+/*
+ * Extensions to the accounts module declared in account.h.
+ *
+ * The balance and inventory of an account are packed into a single 64-bit
+ * word, which is updated with compare-and-swap rather than under a lock.
+ * A change to both, or a check that a decrease is covered followed by the
+ * decrease, is therefore a single atomic step, and account_get_status()
+ * always sees a balance and inventory that belong together.
+ *
+ * When the server trades several instruments (see BRS_ENVELOPE_PKT), funds
+ * are shared by all of them but inventory is kept for each instrument.
+ * Instrument 0 is the default instrument, whose inventory is the one
+ * operated on by the functions of account.h and kept in the same word as the
+ * balance; the inventories of other instruments are kept in words of their
+ * own, and are updated separately from the balance.  The balance and the
+ * inventory of another instrument are therefore each read atomically, but
+ * not together.
+ */
+
+/*
+ * Set the number of instruments for which accounts keep inventories.
+ * This must be called, if at all, before any account is created.
+ *
+ * @param count  The number of instruments, including the default one.
+ */
+void accounts_set_instruments(int count);
+
+/*
+ * Increase the inventory of an account in a specified instrument.
+ *
+ * @param account  The account whose inventory is to be increased.
+ * @param instrument  The index of the instrument.
+ * @param quantity  The quantity to add.
+ */
+void account_increase_inventory_in(ACCOUNT *account, int instrument, quantity_t quantity);
+
+/*
+ * Attempt to decrease the inventory of an account in a specified instrument.
+ *
+ * @param account  The account whose inventory is to be decreased.
+ * @param instrument  The index of the instrument.
+ * @param quantity  The quantity to deduct.
+ * @return 0 if the inventory was successfully decreased, -1 if the
+ * inventory was less than the quantity or the instrument does not exist.
+ */
+int account_decrease_inventory_in(ACCOUNT *account, int instrument, quantity_t quantity);
+
+/*
+ * Get the current balance of an account and its inventory in a specified
+ * instrument, as account_get_status() does for the default instrument.
+ *
+ * @param account  The account.
+ * @param instrument  The index of the instrument.
+ * @param infop  Pointer to the status structure to be filled in.
+ */
+void account_get_status_in(ACCOUNT *account, int instrument, BRS_STATUS_INFO *infop);
+
+/*
+ * Get the head of the list on which the exchange for a specified instrument
+ * keeps the account's pending orders (see order_book.h), so that they can
+ * all be canceled without searching the book.  The account only holds the
+ * list, which is initially empty; it is protected by the exchange's lock.
+ *
+ * @param account  The account.
+ * @param instrument  The index of the instrument.
+ * @return  The head of the list, or NULL if the instrument does not exist.
+ */
+void **account_orders_in(ACCOUNT *account, int instrument);
+
+/*
+ * Change the balance of an account and its inventory in a specified
+ * instrument by signed amounts, without checking that they remain
+ * nonnegative; changes wrap around as unsigned arithmetic does.  This is
+ * for restoring accounts from the journal, whose records apply, in whatever
+ * order, to the same final state.
+ *
+ * @param account  The account.
+ * @param instrument  The index of the instrument.
+ * @param balance_change  The amount to add to the balance.
+ * @param inventory_change  The quantity to add to the inventory.
+ */
+void account_adjust(ACCOUNT *account, int instrument, int64_t balance_change,
+                    int64_t inventory_change);
+
+/*
+ * Get the user name of an account.
+ *
+ * @return  The name, which remains owned by the account.
+ */
+const char *account_get_name(ACCOUNT *account);
+
+/*
+ * Apply the effects of a trade to the accounts of the buyer and the seller:
+ * the seller is credited with the proceeds, and the buyer is credited with
+ * the quantity bought and with the refund of any funds that were encumbered
+ * by the buy order but not needed to pay for the trade.  The changes to each
+ * account are made in one atomic update, and if the buyer and the seller
+ * are the same account, all of them are.  This holds only for the default
+ * instrument; for the others, funds and inventory are updated one after
+ * the other.
+ *
+ * @param buyer  The account of the buyer.
+ * @param seller  The account of the seller.
+ * @param instrument  The index of the instrument traded.
+ * @param quantity  The quantity traded.
+ * @param proceeds  The funds paid to the seller.
+ * @param refund  The funds returned to the buyer.
+ */
+void account_apply_trade(ACCOUNT *buyer, ACCOUNT *seller, int instrument, quantity_t quantity,
+                         funds_t proceeds, funds_t refund);
+
+#endif
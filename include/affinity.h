@@ -0,0 +1,82 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stddef.h>
+
+/*
+ * Placement of the server's threads and of the memory they work on.
+ *
+ * Each kind of thread ("role") can be given a list of CPUs to run on (-a).
+ * A thread that is one of several of its role, such as the matchmaker of an
+ * instrument or a reactor, is pinned to a single CPU of the list, taken in
+ * turn by its index; other threads of the role, such as the threads serving
+ * clients, may run on any CPU of the list.  Threads of a role without a list
+ * are left to the scheduler.
+ *
+ * The book and the orders of an instrument are allocated on the NUMA node
+ * of the CPU of its matchmaker, so that matching does not reach across
+ * nodes.  Memory is bound to a node with mbind(), without any library; on a
+ * machine with a single node, or a kernel without NUMA, it is allocated
+ * as usual.
+ *
+ * Threads are also given names (see pthread_setname_np()), which show up in
+ * top, perf and gdb.
+ */
+
+typedef enum {
+    AFFINITY_MATCH,                // Matchmakers, by instrument
+    AFFINITY_IO,                   // Reactors, by index, and client service threads
+    AFFINITY_FANOUT,               // The fan-out thread
+    AFFINITY_ROLES
+} affinity_role_t;
+
+/*
+ * Set the CPUs on which the threads of a role are to run.
+ *
+ * @param spec  The role and a list of CPUs, as "<role>=<list>", where the
+ * role is "match", "io" or "fanout", and the list is of CPU numbers and
+ * ranges separated by commas, for example "match=2,3" or "io=4-7".
+ * @return 0 if successful, -1 if the specification is invalid.
+ */
+int affinity_set(const char *spec);
+
+/*
+ * Pin the calling thread to the CPUs of its role, if any, and give it a name.
+ *
+ * @param role  The role of the thread.
+ * @param index  The index of the thread among those of its role, to pin it
+ * to a single CPU, or -1 to let it run on any CPU of the role.
+ * @param name  The name of the thread, truncated to 15 characters.
+ */
+void affinity_thread_start(affinity_role_t role, int index, const char *name);
+
+/*
+ * Give the calling thread a name, without pinning it.
+ */
+void affinity_thread_name(const char *name);
+
+/*
+ * Get the NUMA node of the CPU to which a thread of a role would be pinned.
+ *
+ * @return  The node, or -1 if the thread would not be pinned to a single
+ * CPU or its node is not known.
+ */
+int affinity_node(affinity_role_t role, int index);
+
+/*
+ * Allocate zeroed memory bound to a NUMA node.  The memory is mapped
+ * directly rather than taken from the heap, and must be released with
+ * affinity_free().
+ *
+ * @param size  The number of bytes wanted.
+ * @param node  The node, or -1 for whatever node first touches the memory.
+ * @return  The memory, or NULL if it could not be mapped.
+ */
+void *affinity_alloc(size_t size, int node);
+
+/*
+ * Release memory allocated with affinity_alloc().
+ */
+void affinity_free(void *ptr, size_t size);
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef EXCHANGE_EXT_H
+#define EXCHANGE_EXT_H
+
+#include "exchange.h"
+#include "protocol_ext.h"
+
+/*
+ * Extensions to the exchange module declared in exchange.h.
+ *
+ * Each exchange trades a single instrument, with its own order book, lock
+ * and matchmaker thread, so several exchanges can match orders in parallel.
+ * The exchange created by exchange_init() trades the default instrument;
+ * others are created with exchange_init_instrument() (see instrument.h).
+ */
+
+/*
+ * Initialize a new exchange for a specified instrument.
+ *
+ * @param instrument  The index of the instrument, which selects the account
+ * inventories used.  Instrument 0 is the default instrument.
+ * @param symbol  The symbol of the instrument, of at most BRS_SYMBOL_SIZE
+ * characters, used to label notifications (empty for the default instrument).
+ * @return the newly initialized exchange, or NULL if initialization failed.
+ */
+EXCHANGE *exchange_init_instrument(int instrument, const char *symbol);
+
+/*
+ * Get the index of the instrument traded on an exchange.
+ */
+int exchange_get_instrument(EXCHANGE *xchg);
+
+/*
+ * Get the symbol of the instrument traded on an exchange.
+ *
+ * @return  The symbol, padded with NULs to BRS_SYMBOL_SIZE characters,
+ * and so not NUL-terminated if it is of the maximum length.
+ */
+const char *exchange_get_symbol(EXCHANGE *xchg);
+
+/*
+ * Set whether an order that can trade as soon as it is posted with
+ * exchange_post_buy() or exchange_post_sell() is matched against the book
+ * on the thread posting it, before the call returns, rather than by the
+ * matchmaker thread.  This saves the wait for the matchmaker to be
+ * scheduled.  The matchmaker still does the matching called for by orders
+ * posted with exchange_bulk() and by orders restored from the journal.
+ * Inline matching is disabled by default.
+ *
+ * @param enable  Nonzero to enable inline matching, zero to disable it.
+ */
+void exchanges_set_inline_matching(int enable);
+
+/*
+ * How the matchmaker of an exchange waits to be woken.
+ */
+typedef enum {
+    EXCHANGE_WAIT_BLOCK,           // Sleep until woken
+    EXCHANGE_WAIT_ADAPTIVE,        // Poll for EXCHANGE_SPIN_NS, then sleep until woken
+    EXCHANGE_WAIT_SPIN             // Poll, never sleeping
+} exchange_wait_t;
+
+/*
+ * Time for which an adaptive matchmaker polls before it sleeps (ns).
+ */
+#define EXCHANGE_SPIN_NS 50000
+
+/*
+ * Set how the matchmaker of an exchange waits for an order that crosses
+ * the book.  A thread that wakes the matchmaker rings a doorbell, which a
+ * polling matchmaker notices within nanoseconds, and only makes the system
+ * call to wake it if it is asleep; a sleeping matchmaker must also be
+ * scheduled before it can match.  Polling keeps a CPU busy, so it is only
+ * worth it with the matchmaker pinned to a core of its own (see
+ * affinity.h).  The time from the doorbell being rung to the matchmaker
+ * noticing is recorded in the match.wakeup histogram (see stats.h).
+ * Matchmakers sleep until woken by default.
+ *
+ * @param xchg  The exchange.
+ * @param wait  The strategy, which takes effect the next time the
+ * matchmaker waits.
+ * @return 0 if successful, -1 if the strategy is unknown.
+ */
+int exchange_set_wait(EXCHANGE *xchg, exchange_wait_t wait);
+
+/*
+ * An item of a batch of orders and cancellations (see exchange_bulk()).
+ */
+typedef struct exchange_bulk_item {
+    BRS_PACKET_TYPE type;          // BRS_BUY_PKT, BRS_SELL_PKT or BRS_CANCEL_PKT
+    orderid_t order;               // Order to cancel; set to the order posted or canceled
+    quantity_t quantity;           // Quantity to buy or sell; set to the quantity canceled
+    funds_t price;                 // Price to buy or sell at
+    BRS_BULK_RESULT_CODE result;   // Set to the result of the item
+} EXCHANGE_BULK_ITEM;
+
+/*
+ * Post and cancel a batch of orders for a trader, in order, under a single
+ * acquisition of the exchange's lock.  The notifications for the whole
+ * batch are published together, and the matchmaker is woken once.
+ *
+ * @param xchg  The exchange.
+ * @param trader  The trader on whose behalf the orders are posted and canceled.
+ * @param items  The items, whose results are filled in.
+ * @param count  The number of items, at most BRS_BULK_MAX.
+ * @return  The number of items that succeeded, or -1 if the arguments are
+ * invalid.
+ */
+int exchange_bulk(EXCHANGE *xchg, TRADER *trader, EXCHANGE_BULK_ITEM *items, int count);
+
+/*
+ * Cancel all the pending orders of a trader, including those restored from
+ * the journal for its account, under a single acquisition of the exchange's
+ * lock.  This takes time proportional to the number of pending orders.
+ *
+ * @param xchg  The exchange.
+ * @param trader  The trader whose orders are to be canceled.
+ * @param quantity  Pointer to a variable to receive the total quantity canceled.
+ * @return  The number of orders canceled, or -1 if the arguments are invalid
+ * or storage could not be allocated.
+ */
+int exchange_cancel_all(EXCHANGE *xchg, TRADER *trader, quantity_t *quantity);
+
+/*
+ * Get the aggregated price levels nearest the top of each side of the
+ * book, for a DEPTH request (see protocol_ext.h).  This takes time
+ * proportional to the number of levels, not of orders, and the levels are
+ * consistent with the sequence number of the last change to them.
+ *
+ * @param xchg  The exchange.
+ * @param levels  The most levels wanted on each side.
+ * @param infop  Pointer to a BRS_DEPTH_INFO to receive the sequence number
+ * and the numbers of levels, in network byte order.
+ * @param buf  Storage for at least 2 * levels levels, to receive the bid
+ * levels from the best down, followed by the ask levels from the best up,
+ * in network byte order.
+ * @return  The total number of levels stored, or -1 if the arguments are
+ * invalid.
+ */
+int exchange_get_depth(EXCHANGE *xchg, int levels, BRS_DEPTH_INFO *infop, BRS_DEPTH_LEVEL *buf);
+
+/*
+ * Get the packets of the tape of an exchange kept for replay, for a REPLAY
+ * request (see protocol_ext.h).
+ *
+ * @param xchg  The exchange.
+ * @param from  Number of the first packet wanted.
+ * @param max  The most packets wanted.
+ * @param infop  Pointer to a BRS_REPLAY_INFO to receive the number of the
+ * first packet stored and of the last packet on the tape, in network byte
+ * order.
+ * @param buf  Storage for at least max packets, to receive those numbered
+ * from first on, oldest first, in network byte order.
+ * @return  The number of packets stored, or -1 if the arguments are
+ * invalid.
+ */
+int exchange_replay(EXCHANGE *xchg, uint32_t from, int max, BRS_REPLAY_INFO *infop,
+                    BRS_REPLAY_EVENT *buf);
+
+/*
+ * Functions used to restore the state of an exchange from the journal
+ * (see journal.h).  They change the book and the accounts concerned as the
+ * corresponding operation did originally, but send no notifications, and
+ * do not check that funds or inventory are available, since the journal
+ * records the changes to different accounts in an order that may differ
+ * from the one in which they were made.  The matchmaker is not woken until
+ * exchange_restore_done() is called, so that it does not make trades other
+ * than those recorded in the journal.
+ */
+
+/*
+ * Restore a pending order.
+ *
+ * @param trader  The trader to own the order, normally one created with
+ * trader_detached().
+ * @param id  The order ID, which must not be in use.
+ * @param sell  Nonzero for a sell order, zero for a buy order.
+ * @return 0 if the order was restored, -1 otherwise.
+ */
+int exchange_restore_order(EXCHANGE *xchg, TRADER *trader, orderid_t id, int sell,
+                           quantity_t quantity, funds_t price);
+
+/*
+ * Restore the cancellation of a pending order.
+ *
+ * @return 0 if the order was canceled, -1 if there is no such order.
+ */
+int exchange_restore_cancel(EXCHANGE *xchg, orderid_t id);
+
+/*
+ * Restore a trade between two pending orders.
+ *
+ * @return 0 if the trade was made, -1 if the orders do not exist or are
+ * not for the quantity traded.
+ */
+int exchange_restore_trade(EXCHANGE *xchg, orderid_t buy, orderid_t sell,
+                           quantity_t quantity, funds_t price);
+
+/*
+ * Restore the next order ID and the last trade price of an exchange, as
+ * recorded in a snapshot (see snapshot.h).  The next order ID is only ever
+ * increased, since restored orders may already have advanced it.
+ */
+void exchange_restore_state(EXCHANGE *xchg, orderid_t next_order_id, funds_t last_trade_price);
+
+/*
+ * Finish restoring an exchange, letting the matchmaker look for trades that
+ * had not yet been made when the journal ended.
+ */
+void exchange_restore_done(EXCHANGE *xchg);
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include "trader_ext.h"
+
+/*
+ * The fan-out stage delivers asynchronous notifications (POSTED, CANCELED,
+ * TRADED, BOUGHT, SOLD) to traders, so that the threads producing them never
+ * block on a socket.
+ *
+ * Producers (the matchmaker and the threads posting and cancelling orders)
+ * push events onto a bounded lock-free queue.  A dedicated fan-out thread
+ * takes events off the queue in order, copies each one onto the outbound
+ * ring of every trader that should receive it (see trader_ext.h), and drains
+ * the rings with non-blocking writes, waiting for sockets that are full to
+ * become writable again.  A slow trader therefore only ever delays itself;
+ * what happens once its ring fills is decided by the slow-consumer policy.
+ *
+ * Events are delivered to each trader in the order in which they were pushed
+ * onto the queue.  In particular, a producer that publishes the POSTED packet
+ * for an order before the order can be matched guarantees that the POSTED
+ * packet reaches every trader before any TRADED packet for that order.
+ *
+ * Ticker-tape packets go only to the traders subscribed to the full tape
+ * (see protocol_ext.h).  For the traders subscribed to the conflated feed,
+ * the fan-out thread instead takes the top of the book of every instrument
+ * every BRS_QUOTE_MIN_INTERVAL, and queues QUOTE packets for those whose
+ * interval has passed, so the cost of a conflated subscriber is bounded by
+ * time rather than by the number of events.
+ *
+ * If the fan-out stage has not been initialized, publishing falls back to
+ * sending synchronously with trader_broadcast_packet() or trader_send_packet(),
+ * and no QUOTE packets are sent.
+ */
+
+/*
+ * Default number of events that the fan-out queue can hold.
+ */
+#define FANOUT_QUEUE_SIZE 4096
+
+/*
+ * Initialize the fan-out stage and start the fan-out thread.
+ *
+ * @param capacity  Number of packets each trader's outbound ring can hold.
+ * @param policy  The slow-consumer policy.
+ * @return 0 if initialization succeeds, -1 otherwise.
+ */
+int fanout_init(int capacity, outbound_policy_t policy);
+
+/*
+ * Stop the fan-out thread and finalize the fan-out stage.  Events that
+ * have not yet been delivered are discarded.
+ */
+void fanout_fini(void);
+
+/*
+ * Publish a ticker-tape packet, to be sent to all logged-in traders.
+ *
+ * @param pkt  The packet header.
+ * @param data  Payload of the packet, or NULL if none.  At most
+ * OUTBOUND_MAX_PAYLOAD bytes; the payload is copied.
+ * @return 0 if the packet was accepted, -1 otherwise.
+ */
+int fanout_publish(BRS_PACKET_HEADER *pkt, void *data);
+
+/*
+ * Queue a private packet to be sent to one trader, in order with
+ * the ticker-tape packets published before and after it.
+ *
+ * @param trader  The trader to receive the packet.
+ * @param pkt  The packet header.
+ * @param data  Payload of the packet, or NULL if none.
+ * @return 0 if the packet was accepted, -1 otherwise.
+ */
+int fanout_send(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data);
+
+/*
+ * A packet to be published as part of a batch.
+ */
+typedef struct fanout_packet {
+    TRADER *target;                // Recipient of a private packet, or NULL for all
+    BRS_FEED_LEVEL feed;           // Subscribers to whom a broadcast goes
+    BRS_PACKET_HEADER *hdr;
+    void *data;                    // Payload, or NULL if none; copied
+} FANOUT_PACKET;
+
+/*
+ * Publish a batch of packets, each either a broadcast to the traders
+ * subscribed at some level (see protocol_ext.h) or private to one trader,
+ * as for fanout_publish() and fanout_send() in turn.  The
+ * fan-out thread is woken once for the whole batch.  If the fan-out stage
+ * has not been initialized, the batch is sent synchronously, finding the
+ * traders to broadcast to only once and sending each trader the packets
+ * for it with one write.  Either way, every trader receives the packets for
+ * it in the order in which they appear in the batch.
+ *
+ * @param packets  The packets.
+ * @param count  The number of packets.
+ * @return 0 if all the packets were accepted, -1 otherwise.
+ */
+int fanout_publish_batch(FANOUT_PACKET *packets, int count);
+
+/*
+ * Change the market-data subscription of a trader, as for trader_subscribe(),
+ * waking the fan-out thread if it has QUOTE packets to send.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int fanout_subscribe(TRADER *trader, BRS_FEED_LEVEL level, unsigned interval);
+
+#endif
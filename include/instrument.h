@@ -0,0 +1,65 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stddef.h>
+
+#include "exchange.h"
+
+/*
+ * Registry of the instruments traded by the server.
+ *
+ * Instrument 0 is the default instrument, traded on the exchange created by
+ * exchange_init(), to which all requests not enclosed in an ENVELOPE refer.
+ * Each additional instrument is identified by its symbol and has an exchange
+ * of its own.  The set of instruments is fixed when the server starts.
+ */
+
+/*
+ * Maximum number of instruments, including the default one.
+ */
+#define MAX_INSTRUMENTS 64
+
+/*
+ * Create exchanges for the additional instruments, and set the number of
+ * instruments for which accounts keep inventories.  This must be called
+ * before any account is created.
+ *
+ * @param dflt  The exchange for the default instrument.
+ * @param symbols  Comma-separated list of the symbols of the additional
+ * instruments, or NULL if there are none.
+ * @return 0 if successful, -1 if a symbol is invalid or repeated, there are
+ * too many instruments, or an exchange could not be created.
+ */
+int instruments_init(EXCHANGE *dflt, const char *symbols);
+
+/*
+ * Finalize the exchanges for the additional instruments.  The exchange for
+ * the default instrument is left for the caller to finalize.
+ */
+void instruments_fini(void);
+
+/*
+ * Look up the exchange for a specified instrument.
+ *
+ * @param symbol  The symbol, not necessarily NUL-terminated.
+ * @param len  The maximum length of the symbol; the symbol ends at the
+ * first NUL, if any, before that.
+ * @return the exchange, or NULL if there is no instrument with that symbol.
+ */
+EXCHANGE *instrument_lookup(const char *symbol, size_t len);
+
+/*
+ * Get the exchange for the instrument with a specified index.
+ *
+ * @param index  The index, from 0 for the default instrument to one less
+ * than instrument_count().
+ * @return  The exchange, or NULL if there is no such instrument.
+ */
+EXCHANGE *instrument_exchange(int index);
+
+/*
+ * Get the number of instruments, including the default one.
+ */
+int instrument_count(void);
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+
+/*
+ * Write-ahead journal of the changes made to accounts and order books.
+ *
+ * When the server is started with a journal, every change that cannot be
+ * derived from others is appended to it as a record: deposits, withdrawals,
+ * escrows and releases made by clients, and the orders posted, canceled
+ * and traded on each exchange.  When the server starts again, the journal
+ * is replayed to restore the balances and inventories of all accounts and
+ * the pending orders of all books, and is then appended to.
+ *
+ * Records are appended to a buffer in memory, which is cheap enough to be
+ * done while an exchange is locked, so that the records for each book are
+ * in the order in which the book changed.  A writer thread writes out
+ * whatever has accumulated and then calls fdatasync(); records appended
+ * while it does so are written and synced together next time round ("group
+ * commit").  Clients are not made to wait for their changes to be synced,
+ * so journaling adds no latency to requests; the cost is that a crash of
+ * the machine can lose the changes of the last commit, which normally
+ * spans no more than a few milliseconds.  If a commit cannot be written or
+ * synced, its records are lost, and nothing more is recorded until the
+ * server is restarted.
+ *
+ * Accounts and instruments are identified in records by name and symbol,
+ * and orders by ID, so a journal can be replayed by a server that trades
+ * the same instruments, whatever their order on the command line.
+ *
+ * Each record carries a checksum, so that a record only partly written
+ * before a crash is recognized.  Replay stops there, and the journal is
+ * truncated so that it can be appended to.
+ *
+ * Snapshots of the state are kept alongside the journal, in a file named
+ * after it with ".snap" appended, so that replay can start from the latest
+ * snapshot rather than from the beginning (see snapshot.h).
+ */
+
+/*
+ * Types of journal records.
+ */
+typedef enum {
+    JOURNAL_NONE,
+    JOURNAL_DEPOSIT, JOURNAL_WITHDRAW,      // Funds
+    JOURNAL_ESCROW, JOURNAL_RELEASE,        // Inventory
+    JOURNAL_POST,                           // Order posted
+    JOURNAL_CANCEL,                         // Order canceled
+    JOURNAL_TRADE                           // Orders traded
+} journal_type_t;
+
+/*
+ * Fixed-size part of a journal record, in host byte order.  The fields
+ * that do not apply to a type of record are zero.
+ */
+typedef struct journal_record {
+    uint32_t checksum;                  // Of the rest of the record, name included
+    uint8_t type;                       // journal_type_t
+    uint8_t sell;                       // For POST, nonzero for a sell order
+    uint16_t name_length;               // Length of the account name that follows
+    char symbol[BRS_SYMBOL_SIZE];       // Instrument, padded with NULs; empty for default
+    orderid_t order;                    // Order posted or canceled, or buy order traded
+    orderid_t other;                    // Sell order traded
+    quantity_t quantity;                // Quantity escrowed, released, posted or traded
+    funds_t amount;                     // Funds deposited or withdrawn, or price
+} JOURNAL_RECORD;                       // Followed by name_length bytes of account name
+
+/*
+ * Open a journal, replay it, and start recording changes to it.
+ * This is to be called once all the exchanges have been created, and before
+ * any client can connect.
+ *
+ * @param path  The path of the journal, which is created if necessary.
+ * @return 0 if successful, -1 if the journal could not be opened or written,
+ * or refers to an instrument that is not being traded.
+ */
+int journal_init(const char *path);
+
+/*
+ * Write out and sync all records appended so far, and close the journal.
+ * Changes made afterwards are not recorded.
+ */
+void journal_fini(void);
+
+/*
+ * Check whether changes are being recorded: the journal is open and no
+ * commit has failed.
+ */
+int journal_enabled(void);
+
+/*
+ * Record a change to the funds or inventory of an account made by a client.
+ *
+ * @param type  JOURNAL_DEPOSIT, JOURNAL_WITHDRAW, JOURNAL_ESCROW or
+ * JOURNAL_RELEASE.
+ * @param name  The name of the account.
+ * @param symbol  The instrument, for ESCROW and RELEASE, padded with NULs
+ * to BRS_SYMBOL_SIZE; NULL for funds.
+ * @param value  The amount or quantity.
+ */
+void journal_account(journal_type_t type, const char *name, const char *symbol, uint32_t value);
+
+/*
+ * Record that an order has been posted.  To be called with the exchange locked.
+ *
+ * @param symbol  The instrument, padded with NULs to BRS_SYMBOL_SIZE.
+ * @param name  The name of the account for which the order was posted.
+ */
+void journal_post(const char *symbol, const char *name, orderid_t order, int sell,
+                  quantity_t quantity, funds_t price);
+
+/*
+ * Record that an order has been canceled.  To be called with the exchange locked.
+ */
+void journal_cancel(const char *symbol, orderid_t order);
+
+/*
+ * Record a trade between two orders.  To be called with the exchange locked.
+ */
+void journal_trade(const char *symbol, orderid_t buy, orderid_t sell,
+                   quantity_t quantity, funds_t price);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include "protocol.h"
+#include "protocol_ext.h"
+
+/*
+ * Multicast publisher of the tape (see protocol_ext.h).
+ *
+ * Each exchange hands the packets of its tape to multicast_publish() as it
+ * publishes a batch of notifications, in sequence order, so the datagrams
+ * of each instrument are sent in the order of their numbers.  A datagram is
+ * sent with a single sendto() on a socket shared by all exchanges, which
+ * needs no lock, and sending is never waited for: a datagram that does not
+ * fit into the socket buffer is counted as an error and otherwise dropped,
+ * to be recovered by REPLAY.
+ */
+
+/*
+ * Start sending the tape to a multicast group.
+ *
+ * @param address  The group and port, as "<group>:<port>", optionally
+ * followed by "@<address>" to send from the local interface with that
+ * address rather than the one chosen by routing.  A unicast address may
+ * also be given for the group, to send to a single receiver.
+ * @return 0 if successful, -1 if the address is invalid or the socket could
+ * not be created.
+ */
+int multicast_init(const char *address);
+
+/*
+ * Stop sending the tape, and close the socket.
+ */
+void multicast_fini(void);
+
+/*
+ * Determine whether the tape is being sent to a multicast group.
+ */
+int multicast_enabled(void);
+
+/*
+ * Send packets of the tape of an instrument to the group, in as few
+ * datagrams as they fit into.  Does nothing unless multicast_init() has
+ * succeeded.
+ *
+ * @param symbol  The symbol of the instrument, padded with NULs to
+ * BRS_SYMBOL_SIZE; empty for the default instrument.
+ * @param events  The packets, oldest first, in network byte order.
+ * @param count  The number of packets.
+ */
+void multicast_publish(const char *symbol, BRS_REPLAY_EVENT *events, int count);
+
+#endif
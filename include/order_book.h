@@ -0,0 +1,181 @@
+#ifndef ORDER_BOOK_H
+#define ORDER_BOOK_H
+
+#include "trader.h"
+#include "pool.h"
+
+/*
+ * An order book maintains the pending buy and sell orders of an exchange.
+ *
+ * Each side of the book is a balanced (AVL) tree of price levels, keyed by
+ * price.  A price level holds a FIFO queue of the orders posted at that
+ * price, so that orders at the same price are matched in the order in which
+ * they were posted.  Each side caches a pointer to its best level (highest
+ * price for bids, lowest price for asks), so that the best buy and best sell
+ * orders can be obtained in constant time, while inserting or removing a
+ * level takes time logarithmic in the number of levels.  Adding or removing
+ * an order at an existing level takes constant time.
+ *
+ * The book also keeps an index from order ID to order, so that an order
+ * (and through it, its place in the book) can be found in constant time
+ * no matter how deep the book is.  The index is a hash table with chaining
+ * through the orders themselves; as order IDs are assigned sequentially,
+ * the low-order bits of the ID are used directly as the hash.  The table
+ * doubles in size whenever the number of orders exceeds the number of buckets.
+ *
+ * An order may also be kept on a list of its own owner's orders, given by
+ * the caller when the order is inserted, so that the orders of one owner
+ * can be found without searching the book.  The book links the order onto
+ * the list when it is inserted and off it when it is removed.
+ *
+ * The order book performs no locking of its own; the caller (the exchange)
+ * is responsible for serializing access to it.
+ */
+
+typedef enum {
+    ORDER_BUY,
+    ORDER_SELL
+} order_type_t;
+
+struct price_level;
+
+struct order {
+    orderid_t id;
+    TRADER *trader;
+    order_type_t type;
+    quantity_t quantity;
+    funds_t price;                 // max price for buy, min price for sell
+    uint64_t posted;               // When posted, by stats_now()
+    struct price_level *level;     // Level at which the order is queued
+    struct order *prev;            // Previous (older) order at the same level
+    struct order *next;            // Next (newer) order at the same level
+    struct order *id_next;         // Next order in the same index bucket
+    struct order **owner_list;     // Head of the list of the owner's orders, or NULL
+    struct order *owner_prev;      // Previous order on the owner's list
+    struct order *owner_next;      // Next order on the owner's list
+};
+
+struct price_level {
+    funds_t price;
+    quantity_t quantity;           // Total quantity of the orders at this level
+    int count;                     // Number of orders at this level
+    struct order *head;            // Oldest order at this level
+    struct order *tail;            // Newest order at this level
+    struct price_level *left;      // Levels with lower prices
+    struct price_level *right;     // Levels with higher prices
+    int height;                    // Height of the subtree rooted here
+};
+
+typedef struct book_side {
+    order_type_t type;
+    struct price_level *root;
+    struct price_level *best;      // Highest bid or lowest ask, NULL if empty
+    int levels;                    // Number of price levels
+    int orders;                    // Number of orders
+    quantity_t quantity;           // Total quantity of all orders
+} BOOK_SIDE;
+
+typedef struct order_book {
+    BOOK_SIDE bids;
+    BOOK_SIDE asks;
+    struct order **index;          // Buckets of the order ID index
+    size_t index_size;             // Number of buckets (a power of two)
+    size_t index_count;            // Number of orders in the index
+    POOL *level_pool;              // Storage for price levels
+    int node;                      // NUMA node of the levels and index, or -1
+} ORDER_BOOK;
+
+/*
+ * Initialize an empty order book.
+ *
+ * @param book  The order book to be initialized.
+ * @param node  The NUMA node on which to allocate the price levels and the
+ * index (see affinity.h), or -1 for any.
+ * @return  0 if initialization succeeds, -1 otherwise.
+ */
+int book_init(ORDER_BOOK *book, int node);
+
+/*
+ * Finalize an order book, freeing its price levels and index.  The orders
+ * themselves are owned by the caller and should have been removed beforehand.
+ *
+ * @param book  The order book to be finalized.
+ */
+void book_fini(ORDER_BOOK *book);
+
+/*
+ * Insert an order into the book, at the tail of the queue for its price level.
+ * The side of the book is determined by the type of the order.
+ *
+ * @param book  The order book.
+ * @param order  The order to be inserted, with id, trader, type, quantity,
+ * price and owner_list already filled in.
+ * @return  0 if the order was inserted, -1 if storage for a new price level
+ * or for the order ID index could not be allocated.
+ */
+int book_insert(ORDER_BOOK *book, struct order *order);
+
+/*
+ * Remove an order from the book, and from its owner's list.  The order
+ * itself is not freed.
+ *
+ * @param book  The order book.
+ * @param order  The order to be removed, which must currently be in the book.
+ */
+void book_remove(ORDER_BOOK *book, struct order *order);
+
+/*
+ * Reduce the quantity of an order in the book, keeping the aggregate
+ * quantities of its level and side up to date.  An order whose quantity
+ * drops to zero remains in the book until removed with book_remove().
+ *
+ * @param book  The order book.
+ * @param order  The order whose quantity is to be reduced.
+ * @param quantity  The amount of the reduction, which must not exceed
+ * the current quantity of the order.
+ */
+void book_reduce(ORDER_BOOK *book, struct order *order, quantity_t quantity);
+
+/*
+ * Get the best (highest priced, then oldest) buy order.
+ *
+ * @return  The best buy order, or NULL if there are no buy orders.
+ */
+struct order *book_best_buy(ORDER_BOOK *book);
+
+/*
+ * Get the best (lowest priced, then oldest) sell order.
+ *
+ * @return  The best sell order, or NULL if there are no sell orders.
+ */
+struct order *book_best_sell(ORDER_BOOK *book);
+
+/*
+ * Find a pending order by its order ID.
+ *
+ * @param book  The order book.
+ * @param id  The ID of the order to be found.
+ * @return  The order, if it is in the book, otherwise NULL.
+ */
+struct order *book_find(ORDER_BOOK *book, orderid_t id);
+
+/*
+ * Find the price level at a specified price on one side of the book.
+ *
+ * @param side  The side of the book.
+ * @param price  The price.
+ * @return  The level, or NULL if there are no orders at that price.
+ */
+struct price_level *book_level(BOOK_SIDE *side, funds_t price);
+
+/*
+ * Visit the price levels of one side of the book, from best to worst.
+ *
+ * @param side  The side of the book to be visited.
+ * @param fn  Function called for each level.  If it returns nonzero,
+ * the walk stops.
+ * @param arg  Argument passed through to fn.
+ */
+void book_walk(BOOK_SIDE *side, int (*fn)(struct price_level *level, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * A pool is an allocator for objects of a single fixed size.
+ *
+ * Objects are carved out of "slabs", each large enough to hold a fixed
+ * number of objects, and freed objects are kept on a free list for reuse
+ * rather than being returned to the heap.  Once a pool has grown to the
+ * number of objects in use at peak, allocating and freeing objects does not
+ * touch the heap at all.  Slabs are only returned to the heap when the pool
+ * is finalized.
+ *
+ * Each pool keeps counters of its activity, which can be used to check that
+ * steady-state operation is not performing heap allocations.  All live pools
+ * are kept in a registry, so that their counters can be reported together.
+ *
+ * All operations on a pool are thread-safe.
+ */
+typedef struct pool POOL;
+
+/*
+ * Counters maintained by a pool.
+ */
+typedef struct pool_stats {
+    const char *name;              // Name given to the pool
+    size_t object_size;            // Size of each object, after rounding
+    unsigned long allocs;          // Number of objects allocated
+    unsigned long frees;           // Number of objects freed
+    unsigned long in_use;          // Number of objects currently allocated
+    unsigned long capacity;        // Number of objects the slabs can hold
+    unsigned long slabs;           // Number of heap allocations (slabs) made
+} POOL_STATS;
+
+/*
+ * Initialize a new pool.  One slab is allocated immediately.
+ *
+ * @param name  Name of the pool, used in reports.  The string is not copied
+ * and must outlive the pool.
+ * @param object_size  Size of the objects to be allocated from the pool.
+ * @param slab_objects  Number of objects to allocate in each slab.
+ * @return  The new pool, or NULL if initialization failed.
+ */
+POOL *pool_init(const char *name, size_t object_size, size_t slab_objects);
+
+/*
+ * Initialize a new pool whose slabs are allocated on a specified NUMA node
+ * (see affinity.h), rather than taken from the heap.
+ *
+ * @param node  The node, or -1 to take slabs from the heap as pool_init()
+ * does.
+ */
+POOL *pool_init_node(const char *name, size_t object_size, size_t slab_objects, int node);
+
+/*
+ * Finalize a pool, returning all of its slabs to the heap.  Any objects
+ * still allocated from the pool become invalid.
+ *
+ * @param pool  The pool to be finalized.
+ */
+void pool_fini(POOL *pool);
+
+/*
+ * Allocate an object from a pool.  The contents of the object are undefined.
+ *
+ * @param pool  The pool from which to allocate.
+ * @return  The object, or NULL if the pool needed to grow and the heap
+ * allocation failed.
+ */
+void *pool_alloc(POOL *pool);
+
+/*
+ * Return an object to the pool from which it was allocated.
+ *
+ * @param pool  The pool.
+ * @param obj  The object to be freed, or NULL.
+ */
+void pool_free(POOL *pool, void *obj);
+
+/*
+ * Get the counters of a pool.
+ *
+ * @param pool  The pool.
+ * @param stats  Structure to receive the counters.
+ */
+void pool_get_stats(POOL *pool, POOL_STATS *stats);
+
+/*
+ * Print the counters of all live pools, one line per pool.
+ *
+ * @param out  Stream to which the report is written.
+ */
+void pools_report(FILE *out);
+
+#endif
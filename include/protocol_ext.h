@@ -0,0 +1,542 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+
+/*
+ * Extensions to the "Bourse" protocol functions declared in protocol.h.
+ */
+
+/*
+ * Size of the receive buffer that a connection keeps for payloads.
+ * Every request payload other than an unusually long LOGIN name fits.
+ */
+#define PROTO_RECV_BUFSIZE 256
+
+/*
+ * Write all of a vector of buffers, blocking until done.  Packets built
+ * up in several buffers are thereby sent with as few system calls as
+ * possible, normally one.
+ *
+ * @param fd  The file descriptor to which the data is to be written.
+ * @param iov  The buffers to be written.  The array is modified to keep
+ *   track of partial writes.
+ * @param iovcnt  The number of buffers.
+ * @return  0 if all the data was written, -1 otherwise, with errno set.
+ */
+int proto_send_iov(int fd, struct iovec *iov, int iovcnt);
+
+/*
+ * Receive a packet into caller-supplied storage, blocking until one is available.
+ *
+ * @param fd  The file descriptor from which the packet is to be received.
+ * @param hdr  Pointer to caller-supplied storage for the fixed-size
+ *   portion of the packet.
+ * @param buf  Caller-supplied storage for the payload, normally kept for
+ *   the lifetime of the connection.
+ * @param bufsize  Size of the storage pointed to by buf.
+ * @param payloadp  Pointer to a variable into which to store a pointer to any
+ *   payload received.
+ * @return  0 in case of successful reception, -1 otherwise.  In the
+ *   latter case, errno is set to indicate the error, or is 0 if EOF was
+ *   seen before any part of a packet.
+ *
+ * If the payload fits in buf, it is stored there and *payloadp is set to buf,
+ * so that no heap allocation is made.  Larger payloads are stored in storage
+ * allocated from the heap.  Either way, once the caller is finished with
+ * the payload it must call proto_release_payload().
+ */
+int proto_recv_packet_buf(int fd, BRS_PACKET_HEADER *hdr, void *buf, size_t bufsize,
+                          void **payloadp);
+
+/*
+ * Release a payload received by proto_recv_packet_buf().
+ *
+ * @param payload  The payload pointer returned by proto_recv_packet_buf(), or NULL.
+ * @param buf  The buffer that was passed to proto_recv_packet_buf().
+ */
+void proto_release_payload(void *payload, void *buf);
+
+/*
+ * Get the number of received payloads that were too large for the
+ * caller-supplied buffer and had to be allocated from the heap.
+ */
+unsigned long proto_heap_payload_count(void);
+
+/*
+ * Size of the receive buffer that a service thread keeps for a connection.
+ */
+#define PROTO_RBUF_SIZE 4096
+
+/*
+ * Buffered receiver for the packets arriving on a connection.
+ *
+ * Each read takes as many bytes as are available and fit, so that a burst
+ * of pipelined requests is normally received with a single system call.
+ * Packets are then parsed in place: the header and payload pointers handed
+ * out point into the buffer, and no copy or heap allocation is made.  The
+ * unparsed data is kept contiguous by moving it to the front of the buffer
+ * when room is needed, or when a packet that follows one with an odd-sized
+ * payload would not be aligned, and a packet too large for the buffer is
+ * assembled in storage allocated from the heap.  A packet is therefore to be
+ * handled before the next one is taken.
+ */
+typedef struct proto_rbuf {
+    int fd;
+    char *data;                    // Storage in use: buf, or heap storage
+    size_t size;                   // Size of storage in use
+    size_t start;                  // Offset of the first byte not yet parsed
+    size_t end;                    // Offset just past the last byte received
+    char *buf;                     // Caller-supplied storage
+    size_t bufsize;
+} PROTO_RBUF;
+
+/*
+ * Initialize a receive buffer.
+ *
+ * @param rb  The receive buffer to be initialized.
+ * @param fd  The file descriptor from which packets are to be received.
+ * @param buf  Caller-supplied storage, aligned for uint32_t, at least large
+ *   enough for a packet header and normally kept for the lifetime of the
+ *   connection.
+ * @param bufsize  Size of the storage pointed to by buf.
+ */
+void proto_rbuf_init(PROTO_RBUF *rb, int fd, void *buf, size_t bufsize);
+
+/*
+ * Finalize a receive buffer, freeing any heap storage it is using.
+ */
+void proto_rbuf_fini(PROTO_RBUF *rb);
+
+/*
+ * Read as many bytes as are available into a receive buffer, with a single
+ * system call.  This invalidates pointers previously handed out by
+ * proto_rbuf_next().
+ *
+ * @param rb  The receive buffer.
+ * @param nonblock  Nonzero if the read must not block.
+ * @return  The number of bytes read, 0 on EOF, or -1 on error with errno set
+ *   (to EAGAIN if nonblock was given and no data was available).
+ */
+ssize_t proto_rbuf_fill(PROTO_RBUF *rb, int nonblock);
+
+/*
+ * Take the next complete packet from a receive buffer, without reading.
+ *
+ * @param rb  The receive buffer.
+ * @param hdrp  Pointer to a variable into which to store a pointer to the
+ *   header of the packet.
+ * @param payloadp  Pointer to a variable into which to store a pointer to the
+ *   payload of the packet, or NULL if it has none.
+ * @return  1 if a packet was taken, 0 if no complete packet has been received.
+ *
+ * The pointers stored point into the buffer, and remain valid until the next
+ * call to proto_rbuf_next(), proto_rbuf_fill() or proto_rbuf_fini(): the
+ * data may be moved to align the next packet, so pointers to a packet are
+ * not to be kept once another has been taken.
+ */
+int proto_rbuf_next(PROTO_RBUF *rb, BRS_PACKET_HEADER **hdrp, void **payloadp);
+
+/*
+ * Get the number of bytes received into a receive buffer but not yet taken.
+ */
+size_t proto_rbuf_pending(PROTO_RBUF *rb);
+
+/*
+ * Receive a packet through a receive buffer, blocking until one is available.
+ *
+ * @param rb  The receive buffer.
+ * @param hdrp  As for proto_rbuf_next().
+ * @param payloadp  As for proto_rbuf_next().
+ * @return  0 in case of successful reception, -1 otherwise.  In the
+ *   latter case, errno is set to indicate the error, or is 0 if EOF was
+ *   seen before any part of a packet.
+ */
+int proto_recv_packet_rbuf(PROTO_RBUF *rb, BRS_PACKET_HEADER **hdrp, void **payloadp);
+
+/*
+ * Storage first allocated by a send buffer, and the most data that it keeps
+ * for a connection.
+ */
+#define PROTO_WBUF_MIN 4096
+#define PROTO_WBUF_MAX (1 << 20)
+
+/*
+ * Buffered sender for the packets to be sent on a connection, for a thread
+ * that must never block on a socket.
+ *
+ * Data is written to the socket for as long as it has room, and whatever
+ * does not fit is kept, in storage allocated from the heap, to be written
+ * by proto_wbuf_flush() once the socket becomes writable.  Data sent while
+ * some is kept goes after it, so packets are never reordered.  The data
+ * kept is bounded by PROTO_WBUF_MAX, so that a client that stops reading
+ * cannot make the server use unbounded memory.  A send buffer is not
+ * locked: its callers serialize their use of it.
+ */
+typedef struct proto_wbuf {
+    int fd;
+    char *data;                    // Storage from the heap, or NULL
+    size_t size;                   // Size of storage
+    size_t start;                  // Offset of the first byte not yet written
+    size_t end;                    // Offset just past the last byte kept
+} PROTO_WBUF;
+
+/*
+ * Initialize a send buffer, which keeps no storage until it is needed.
+ *
+ * @param wb  The send buffer to be initialized.
+ * @param fd  The file descriptor to which packets are to be sent.
+ */
+void proto_wbuf_init(PROTO_WBUF *wb, int fd);
+
+/*
+ * Finalize a send buffer, discarding any data it keeps.
+ */
+void proto_wbuf_fini(PROTO_WBUF *wb);
+
+/*
+ * Send a vector of buffers through a send buffer, without blocking.  What
+ * cannot be written at once is kept.
+ *
+ * @return  0 if the data was written or kept, -1 on error with errno set
+ *   (to ENOBUFS if keeping the data would exceed PROTO_WBUF_MAX).
+ */
+int proto_wbuf_send_iov(PROTO_WBUF *wb, struct iovec *iov, int iovcnt);
+
+/*
+ * Write as much of the data kept by a send buffer as can be written without
+ * blocking.
+ *
+ * @return  0 if no data remains, 1 if some remains to be written once the
+ *   socket is writable, -1 on error with errno set.
+ */
+int proto_wbuf_flush(PROTO_WBUF *wb);
+
+/*
+ * Get the number of bytes kept by a send buffer.
+ */
+size_t proto_wbuf_pending(PROTO_WBUF *wb);
+
+/*
+ * Multiple instruments.
+ *
+ * The server may trade instruments other than the default one, each
+ * identified by a short symbol.  The packets of protocol.h all refer to the
+ * default instrument.  A request concerning another instrument is sent in
+ * an ENVELOPE packet, whose payload is a BRS_ENVELOPE_INFO naming the
+ * instrument and the type of the enclosed request, followed by the payload
+ * of the enclosed request.  STATUS, ESCROW, RELEASE, BUY, SELL and CANCEL
+ * may be enclosed; the response is the usual ACK or NACK, with the status
+ * of the instrument named.  Notifications concerning another instrument are
+ * sent to clients enclosed in the same way.
+ *
+ * Funds are shared by all instruments; inventories are kept separately for
+ * each instrument, and order IDs are only unique within an instrument.
+ */
+#define BRS_ENVELOPE_PKT (BRS_TRADED_PKT + 1)
+
+/*
+ * Maximum length of an instrument symbol.
+ */
+#define BRS_SYMBOL_SIZE 8
+
+typedef struct brs_envelope_info { // For ENVELOPE
+    char symbol[BRS_SYMBOL_SIZE];  // Instrument symbol, padded with NULs
+    uint8_t type;                  // Type of the enclosed packet
+    uint8_t reserved[3];           // Zero
+} BRS_ENVELOPE_INFO;               // Followed by the enclosed packet's payload
+
+/*
+ * Server statistics.
+ *
+ * A STATS request has no payload, and is answered, once the client has
+ * logged in, by an ACK whose payload is a text report of the server's
+ * counters and latency histograms (see stats.h), one per line.  A report
+ * too long for one packet is cut at the end of a line and finishes with
+ * the line "(truncated)".  Before login, STATS is answered with a NACK.
+ */
+#define BRS_STATS_PKT (BRS_ENVELOPE_PKT + 1)
+
+/*
+ * Batched order entry.
+ *
+ * A BULK request carries an array of BRS_BULK_ITEM, each a BUY, a SELL or a
+ * CANCEL.  The items are carried out in order under a single acquisition of
+ * the exchange's lock, so the POSTED and CANCELED notifications for them are
+ * published together, ahead of any trade that they make possible.  The
+ * response is an ACK whose payload is a BRS_STATUS_INFO, with the status as
+ * of the end of the batch and quantity set to the number of items that
+ * succeeded, followed by one BRS_BULK_RESULT for each item, in order.  A
+ * BULK request is only answered with a NACK if it is malformed as a whole
+ * (empty, not a whole number of items, or more than BRS_BULK_MAX of them).
+ *
+ * A MASS_CANCEL request has no payload, and cancels all the pending orders
+ * of the trader, including those restored from the journal for its account.
+ * It is answered by an ACK with a BRS_STATUS_INFO in which orderid is the
+ * number of orders canceled and quantity is their total quantity.  A
+ * CANCELED notification is sent for each order, as for CANCEL.
+ *
+ * Both may be enclosed in an ENVELOPE to refer to another instrument.
+ */
+#define BRS_BULK_PKT (BRS_STATS_PKT + 1)
+#define BRS_MASS_CANCEL_PKT (BRS_BULK_PKT + 1)
+
+/*
+ * Maximum number of items in a BULK request.
+ */
+#define BRS_BULK_MAX 256
+
+typedef struct brs_bulk_item {     // For BULK
+    uint8_t type;                  // BRS_BUY_PKT, BRS_SELL_PKT or BRS_CANCEL_PKT
+    uint8_t reserved[3];           // Zero
+    uint32_t quantity;             // Quantity (BUY, SELL), or order ID (CANCEL)
+    funds_t price;                 // Price (BUY, SELL), or zero (CANCEL)
+} BRS_BULK_ITEM;
+
+/*
+ * Results of BULK items.
+ */
+typedef enum {
+    BRS_BULK_OK,                   // Order posted or canceled
+    BRS_BULK_INVALID,              // Unknown type, or zero quantity or price
+    BRS_BULK_INSUFFICIENT,         // Not enough funds or inventory
+    BRS_BULK_NO_ORDER,             // Order to cancel is not pending, or not the trader's
+    BRS_BULK_FAILED,               // The order could not be placed
+    BRS_BULK_REJECTED              // Refused by the pre-trade risk check
+} BRS_BULK_RESULT_CODE;
+
+typedef struct brs_bulk_result {   // For ACK of BULK, one per item
+    uint8_t result;                // BRS_BULK_RESULT_CODE
+    uint8_t reason;                // BRS_NACK_REASON, for BRS_BULK_REJECTED
+    uint8_t reserved[2];           // Zero
+    orderid_t order;               // Order posted or canceled
+    quantity_t quantity;           // Quantity canceled (CANCEL)
+} BRS_BULK_RESULT;
+
+/*
+ * Market-data subscriptions.
+ *
+ * By default a trader is sent every POSTED, CANCELED and TRADED packet for
+ * every instrument (the full tape).  A SUBSCRIBE request, whose payload is a
+ * BRS_SUBSCRIBE_INFO, selects what the trader is sent from then on, for all
+ * instruments:
+ *
+ *   BRS_FEED_FULL     The full tape.
+ *   BRS_FEED_TOP      No tape.  Instead, at most once per interval, a QUOTE
+ *                     packet for each instrument whose best bid, best ask or
+ *                     last trade price has changed since the trader was last
+ *                     sent one, giving their latest values.  A QUOTE for
+ *                     another instrument is enclosed in an ENVELOPE.  The
+ *                     first QUOTEs after subscribing give the current values
+ *                     for every instrument that has been quoted.
+ *   BRS_FEED_PRIVATE  No tape and no QUOTEs.
+ *   BRS_FEED_DEPTH    No tape.  Instead, a LEVEL packet for every change
+ *                     to a price level of the book of any instrument (see
+ *                     DEPTH below).
+ *   BRS_FEED_SEQUENCED  The full tape, with the number of each packet on
+ *                     the tape of its instrument (see REPLAY below).
+ *
+ * Whatever the level, the trader is sent BOUGHT and SOLD for its own orders,
+ * and the responses to its requests.  The request is answered by an ACK with
+ * the status of the default instrument, or a NACK if the level is unknown.
+ */
+#define BRS_SUBSCRIBE_PKT (BRS_MASS_CANCEL_PKT + 1)
+#define BRS_QUOTE_PKT (BRS_SUBSCRIBE_PKT + 1)
+
+typedef enum {
+    BRS_FEED_FULL,
+    BRS_FEED_TOP,
+    BRS_FEED_PRIVATE,
+    BRS_FEED_DEPTH,
+    BRS_FEED_SEQUENCED
+} BRS_FEED_LEVEL;
+
+#define BRS_FEED_LEVELS 5
+
+/*
+ * Interval between QUOTEs used when none is requested, and the least that
+ * may be requested, in milliseconds.  Intervals are rounded up to a multiple
+ * of the least.
+ */
+#define BRS_QUOTE_DEFAULT_INTERVAL 100
+#define BRS_QUOTE_MIN_INTERVAL 10
+
+typedef struct brs_subscribe_info { // For SUBSCRIBE
+    uint8_t level;                 // BRS_FEED_LEVEL
+    uint8_t reserved[3];           // Zero
+    uint32_t interval;             // Least time between QUOTEs (ms), or 0 for the default
+} BRS_SUBSCRIBE_INFO;
+
+typedef struct brs_quote_info {    // For QUOTE
+    funds_t bid;                   // Highest bid price, or 0 if none
+    funds_t ask;                   // Lowest ask price, or 0 if none
+    funds_t last;                  // Last trade price, or 0 if none
+} BRS_QUOTE_INFO;
+
+/*
+ * Depth of market.
+ *
+ * A DEPTH request, whose payload is a BRS_DEPTH_REQUEST or empty, asks for
+ * the aggregated price levels nearest the top of each side of the book.
+ * It is answered by an ACK whose payload is a BRS_DEPTH_INFO, followed by
+ * the bid levels from the highest price down and then the ask levels from
+ * the lowest price up, each a BRS_DEPTH_LEVEL.  It may be enclosed in an
+ * ENVELOPE to refer to another instrument.
+ *
+ * Each instrument numbers the changes to its price levels.  A trader
+ * subscribed at BRS_FEED_DEPTH is sent a LEVEL packet, whose payload is a
+ * BRS_LEVEL_INFO, for every change, in sequence, giving the new totals of
+ * the level (zero once it is empty); a LEVEL for another instrument is
+ * enclosed in an ENVELOPE.  The seq of a DEPTH response is that of the last
+ * change included in it, so a client keeps its depth up to date by
+ * subscribing, asking for DEPTH, and then applying the LEVELs with greater
+ * sequence numbers.  A client that sees a gap in the sequence (for example,
+ * because LEVELs were dropped by the slow-consumer policy) asks for DEPTH
+ * again.
+ */
+#define BRS_DEPTH_PKT (BRS_QUOTE_PKT + 1)
+#define BRS_LEVEL_PKT (BRS_DEPTH_PKT + 1)
+
+/*
+ * Number of levels on each side sent when none is requested, and the most
+ * that may be requested.
+ */
+#define BRS_DEPTH_DEFAULT 10
+#define BRS_DEPTH_MAX 256
+
+typedef struct brs_depth_request { // For DEPTH (optional)
+    uint32_t levels;               // Levels wanted on each side, or 0 for the default
+} BRS_DEPTH_REQUEST;
+
+typedef struct brs_depth_info {    // For ACK of DEPTH
+    uint32_t seq;                  // Sequence number of the last change included
+    uint16_t bids;                 // Number of bid levels that follow
+    uint16_t asks;                 // Number of ask levels that follow them
+} BRS_DEPTH_INFO;
+
+typedef struct brs_depth_level {   // For ACK of DEPTH, one per level
+    funds_t price;                 // Price of the level
+    quantity_t quantity;           // Total quantity of the orders at the level
+    uint32_t orders;               // Number of orders at the level
+} BRS_DEPTH_LEVEL;
+
+/*
+ * Sides of the book, for LEVEL.
+ */
+#define BRS_SIDE_BID 0
+#define BRS_SIDE_ASK 1
+
+typedef struct brs_level_info {    // For LEVEL
+    uint32_t seq;                  // Sequence number of the change
+    uint8_t side;                  // BRS_SIDE_BID or BRS_SIDE_ASK
+    uint8_t reserved[3];           // Zero
+    funds_t price;                 // Price of the level
+    quantity_t quantity;           // New total quantity, or 0 if the level is empty
+    uint32_t orders;               // New number of orders
+} BRS_LEVEL_INFO;
+
+/*
+ * Sequenced tape and replay.
+ *
+ * Each instrument numbers the POSTED, CANCELED and TRADED packets of its
+ * tape, from 1 when the server starts.  A trader subscribed at
+ * BRS_FEED_SEQUENCED is sent them with a BRS_SEQ_NOTIFY_INFO as payload,
+ * rather than a BRS_NOTIFY_INFO, so that it can tell when it has missed
+ * some (for example, because they were dropped by the slow-consumer
+ * policy).
+ *
+ * The server keeps the last BRS_REPLAY_KEPT packets of the tape of each
+ * instrument.  A REPLAY request, whose payload is a BRS_REPLAY_REQUEST, asks
+ * for those numbered from a given one on.  It is answered by an ACK whose
+ * payload is a BRS_REPLAY_INFO, followed by the packets kept, oldest first,
+ * each a BRS_REPLAY_EVENT.  If first is greater than the number asked for,
+ * the packets in between are no longer kept, and the client must catch up
+ * some other way (DEPTH gives the book as it now stands).  It may be
+ * enclosed in an ENVELOPE to refer to another instrument.
+ */
+#define BRS_REPLAY_PKT (BRS_LEVEL_PKT + 1)
+
+/*
+ * Number of packets of the tape kept for replay, for each instrument (a
+ * power of 2), and the most sent in response to one REPLAY request.
+ */
+#define BRS_REPLAY_KEPT 4096
+#define BRS_REPLAY_MAX 1024
+
+typedef struct brs_seq_notify_info { // For POSTED, CANCELED and TRADED (BRS_FEED_SEQUENCED)
+    BRS_NOTIFY_INFO info;
+    uint32_t seq;                  // Number of the packet on the tape
+} BRS_SEQ_NOTIFY_INFO;
+
+typedef struct brs_replay_request { // For REPLAY
+    uint32_t from;                 // Number of the first packet wanted
+    uint32_t count;                // Most packets wanted, or 0 for BRS_REPLAY_MAX
+} BRS_REPLAY_REQUEST;
+
+typedef struct brs_replay_info {   // For ACK of REPLAY
+    uint32_t first;                // Number of the first packet sent
+    uint32_t last;                 // Number of the last packet on the tape so far
+} BRS_REPLAY_INFO;
+
+typedef struct brs_replay_event {  // For ACK of REPLAY, one per packet
+    uint32_t seq;                  // Number of the packet on the tape
+    uint8_t type;                  // POSTED, CANCELED or TRADED
+    uint8_t reserved[3];           // Zero
+    uint32_t timestamp_sec;        // Timestamp sent with the packet
+    uint32_t timestamp_nsec;
+    BRS_NOTIFY_INFO info;          // Payload sent with the packet
+} BRS_REPLAY_EVENT;
+
+/*
+ * Multicast tape.
+ *
+ * A server started with a multicast group (-m) also sends the tape of every
+ * instrument to that group, once whatever the number of receivers, in UDP
+ * datagrams.  Each is a BRS_MCAST_HEADER followed by up to BRS_MCAST_MAX
+ * packets of the tape of one instrument, oldest first, each a
+ * BRS_REPLAY_EVENT numbered as for REPLAY.  The packets produced by one
+ * change to a book, or one pass of matching, share datagrams.  Datagrams
+ * can be lost, so a receiver that finds a gap in the numbers asks for the
+ * missing packets with a REPLAY over its TCP connection.
+ *
+ * Traders are then subscribed at BRS_FEED_PRIVATE when they log in, so that
+ * their connections carry only their own notifications and the responses
+ * to their requests; a trader can still SUBSCRIBE to the tape over TCP.
+ */
+#define BRS_MCAST_MAX 40
+
+typedef struct brs_mcast_header {  // For a multicast datagram
+    char symbol[BRS_SYMBOL_SIZE];  // Instrument, padded with NULs; empty for the default
+    uint16_t count;                // Number of BRS_REPLAY_EVENTs that follow
+    uint16_t reserved;             // Zero
+} BRS_MCAST_HEADER;
+
+/*
+ * Pre-trade risk check.
+ *
+ * Before a BUY or a SELL reaches the exchange, it is checked against limits
+ * kept for the trader: the number of its orders pending on all books, their
+ * total value at their limit prices (the notional), and the rate at which
+ * it enters orders.  An order whose value does not fit in funds_t is always
+ * refused.  A refused order is answered by a NACK whose payload is a
+ * BRS_NACK_INFO giving the reason; other NACKs have no payload.  A refused
+ * item of a BULK request has the result BRS_BULK_REJECTED, with the reason
+ * in its BRS_BULK_RESULT.  Cancellations are never refused.
+ */
+typedef enum {
+    BRS_NACK_NONE,                 // No reason given
+    BRS_NACK_OVERFLOW,             // Quantity times price does not fit in funds_t
+    BRS_NACK_ORDERS,               // Too many orders pending
+    BRS_NACK_NOTIONAL,             // Value of the orders pending would be too large
+    BRS_NACK_RATE                  // Orders are being entered too fast
+} BRS_NACK_REASON;
+
+typedef struct brs_nack_info {     // For NACK of a refused order
+    uint8_t reason;                // BRS_NACK_REASON
+    uint8_t reserved[3];           // Zero
+} BRS_NACK_INFO;
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+/*
+ * Event-loop server mode.
+ *
+ * Rather than running one service thread per client, a fixed number of
+ * reactor threads each multiplex many client connections with epoll.
+ * A connection is assigned to one reactor when it is accepted and stays
+ * with it until it is closed.  The reactor reads whatever data is available
+ * without blocking into a per-connection receive buffer (see PROTO_RBUF),
+ * and handles each packet in place as soon as it is complete, so that
+ * a client that sends a packet a byte at a time does not hold up any
+ * other client.
+ *
+ * Nor does a reactor ever block writing.  Connections are non-blocking, and
+ * responses are written through a send buffer (see PROTO_WBUF), which keeps
+ * what the socket has no room for.  While a connection has data kept, its
+ * reactor waits for it to become writable rather than reading more requests
+ * from it, so a client that sends requests without reading the responses
+ * holds up only itself.
+ *
+ * Connections are registered with the client registry as in thread-per-client
+ * mode, so creg_shutdown_all() and creg_wait_for_empty() work unchanged.
+ */
+
+/*
+ * Size of the receive buffer kept for each connection.  A packet that is
+ * larger is assembled in a buffer allocated from the heap.
+ */
+#define REACTOR_BUFSIZE 512
+
+/*
+ * Maximum number of events handled by a reactor per wakeup.
+ */
+#define REACTOR_MAX_EVENTS 64
+
+/*
+ * Start the reactor threads.
+ *
+ * @param count  The number of reactor threads.
+ * @return 0 if the reactors were started, -1 otherwise.
+ */
+int reactors_init(int count);
+
+/*
+ * Stop the reactor threads.  This is to be called only once all
+ * client connections have been closed.
+ */
+void reactors_fini(void);
+
+/*
+ * Hand a newly accepted client connection over to one of the reactors,
+ * which takes ownership of the file descriptor.
+ *
+ * @param fd  The file descriptor of the connection.
+ * @return 0 if the connection was added, -1 otherwise, in which case
+ * the file descriptor has been closed.
+ */
+int reactor_add_client(int fd);
+
+#endif
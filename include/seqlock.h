@@ -0,0 +1,88 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <sched.h>
+
+/*
+ * Sequence lock, for data that is read far more often than it is written.
+ *
+ * A writer makes the sequence number odd while it updates the data and even
+ * again once it has finished.  A reader notes the sequence number, reads the
+ * data, and then checks that the sequence number is unchanged; if not, or if
+ * it was odd to begin with, a write was in progress and the reader tries
+ * again.  Readers therefore never block writers, and never write shared
+ * memory themselves.
+ *
+ * Writers must be serialized by some other means, such as a mutex.  The data
+ * protected must be read and written with __atomic_load_n()/__atomic_store_n()
+ * (relaxed ordering is enough), as readers may run concurrently with a writer.
+ *
+ * A reader looks like:
+ *
+ *     unsigned seq;
+ *     do {
+ *         seq = seqlock_read_begin(&lock);
+ *         ... read the data ...
+ *     } while (seqlock_read_retry(&lock, seq));
+ */
+typedef struct seqlock {
+    unsigned seq;
+} SEQLOCK;
+
+/*
+ * Number of times a reader spins waiting for a write to finish before
+ * yielding the processor.
+ */
+#define SEQLOCK_SPINS 64
+
+static inline void seqlock_init(SEQLOCK *lock) {
+    lock->seq = 0;
+}
+
+/*
+ * Start updating the data protected by a sequence lock.
+ */
+static inline void seqlock_write_begin(SEQLOCK *lock) {
+    unsigned seq = __atomic_load_n(&lock->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&lock->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * Finish updating the data protected by a sequence lock.
+ */
+static inline void seqlock_write_end(SEQLOCK *lock) {
+    unsigned seq = __atomic_load_n(&lock->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&lock->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Start reading the data protected by a sequence lock, waiting for any
+ * write in progress to finish.
+ *
+ * @return  The sequence number to be passed to seqlock_read_retry().
+ */
+static inline unsigned seqlock_read_begin(SEQLOCK *lock) {
+    int spins = 0;
+    unsigned seq;
+    while ((seq = __atomic_load_n(&lock->seq, __ATOMIC_ACQUIRE)) & 1) {
+        if (++spins == SEQLOCK_SPINS) {
+            spins = 0;
+            sched_yield();
+        }
+    }
+    return seq;
+}
+
+/*
+ * Finish reading the data protected by a sequence lock.
+ *
+ * @return  Nonzero if the data may have changed while it was being read,
+ * in which case it must be read again.
+ */
+static inline int seqlock_read_retry(SEQLOCK *lock, unsigned seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&lock->seq, __ATOMIC_RELAXED) != seq;
+}
+
+#endif
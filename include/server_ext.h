@@ -0,0 +1,64 @@
+#ifndef SERVER_EXT_H
+#define SERVER_EXT_H
+
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "trader.h"
+
+/*
+ * Extensions to the server module declared in server.h.
+ *
+ * The handling of the packets received on a client connection is separated
+ * from the way in which they are received, so that it can be shared by
+ * brs_client_service(), which runs one thread per client, and the event-loop
+ * reactors (see reactor.h), which multiplex many clients over a few threads.
+ */
+
+/*
+ * State of the session with one client.
+ */
+typedef struct brs_session {
+    int fd;                        // Connection to the client
+    TRADER *trader;                // Logged-in trader, or NULL
+    char *username;                // Username of the trader, for debug messages
+    PROTO_WBUF *sender;            // Send buffer, if the connection is not to block
+} BRS_SESSION;
+
+/*
+ * Initialize the state of a client session.
+ *
+ * @param session  The session to be initialized.
+ * @param fd  The file descriptor of the connection to the client.
+ */
+void brs_session_init(BRS_SESSION *session, int fd);
+
+/*
+ * Handle one packet received from a client, sending any response.
+ *
+ * @param session  The session on which the packet was received.
+ * @param hdr  The header of the packet, in network byte order.
+ * @param payload  The payload of the packet, or NULL if none.  The payload
+ * remains owned by the caller.
+ * @return 0 if the session is to continue, -1 if it is to be terminated.
+ */
+int brs_session_dispatch(BRS_SESSION *session, BRS_PACKET_HEADER *hdr, void *payload);
+
+/*
+ * Write out as much as can be written without blocking of what is waiting
+ * to be sent to the client of a session with a send buffer.
+ *
+ * @param session  The session.
+ * @return  As for proto_wbuf_flush(): 0 if nothing remains, 1 if some
+ * remains to be written once the connection is writable, -1 on error.
+ */
+int brs_session_flush(BRS_SESSION *session);
+
+/*
+ * Finalize a client session, logging out its trader if any.
+ * The connection itself is not closed.
+ *
+ * @param session  The session to be finalized.
+ */
+void brs_session_fini(BRS_SESSION *session);
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "journal.h"
+
+/*
+ * Snapshots of the state recorded in the journal.
+ *
+ * A snapshot holds the balance and inventories of every account, the
+ * pending orders of every book, and the next order ID and last trade price
+ * of every exchange, as they were after a given prefix of the journal.
+ * On restart the latest snapshot is mapped into memory and restored, and
+ * only the part of the journal written after it is replayed, so that the
+ * time taken to start follows the size of the state rather than the length
+ * of its history.
+ *
+ * Snapshots are not taken from the live accounts and books, which change
+ * concurrently and are recorded in the journal only after they change.
+ * Rather, the journal writer thread applies each record it writes to a
+ * "shadow" copy of the state, which is therefore always exactly the state
+ * after the journal written so far, and from time to time writes the shadow
+ * out.  Nothing on the path of a request is slowed down.
+ *
+ * A snapshot is written to a temporary file which is synced and then
+ * renamed over the previous one, so there is always one complete snapshot.
+ * The journal itself is kept whole, so if the snapshot is found to be
+ * damaged, the state can still be restored by replaying all of it.
+ *
+ * File format (host byte order, all sections 8-byte aligned):
+ *
+ *   SNAPSHOT_HEADER
+ *   SNAPSHOT_INSTRUMENT   x header.instruments
+ *   SNAPSHOT_ACCOUNT      x header.accounts, each followed by
+ *                           int64_t inventories[header.instruments] and the
+ *                           name, padded with NULs to a multiple of 8 bytes
+ *   SNAPSHOT_ORDER        x header.orders, in order of instrument and ID,
+ *                           which for each book is the order of priority
+ *   uint32_t checksum     of everything before it
+ *
+ * Balances and inventories include the funds and inventory encumbered by
+ * the pending orders of the account, which are encumbered again when the
+ * orders are restored.
+ */
+
+#define SNAPSHOT_MAGIC "BRSSNAP"
+#define SNAPSHOT_VERSION 1
+
+/*
+ * Number of bytes written to the journal after which a new snapshot is taken.
+ */
+#define SNAPSHOT_INTERVAL (16 << 20)
+
+typedef struct snapshot_header {
+    char magic[8];                      // SNAPSHOT_MAGIC
+    uint32_t version;                   // SNAPSHOT_VERSION
+    uint32_t instruments;               // Number of instruments
+    uint64_t journal_offset;            // Length of the journal covered
+    uint64_t accounts;                  // Number of accounts
+    uint64_t orders;                    // Number of pending orders
+} SNAPSHOT_HEADER;
+
+typedef struct snapshot_instrument {
+    char symbol[BRS_SYMBOL_SIZE];       // Padded with NULs; empty for default
+    orderid_t next_order_id;
+    funds_t last_trade_price;
+} SNAPSHOT_INSTRUMENT;
+
+typedef struct snapshot_account {
+    int64_t balance;                    // Including encumbered funds
+    uint16_t name_length;
+    uint16_t reserved[3];
+} SNAPSHOT_ACCOUNT;
+
+typedef struct snapshot_order {
+    uint32_t account;                   // Index of the account in the snapshot
+    uint16_t instrument;                // Index of the instrument in the snapshot
+    uint8_t sell;                       // Nonzero for a sell order
+    uint8_t reserved;
+    orderid_t id;
+    quantity_t quantity;                // Remaining
+    funds_t price;
+} SNAPSHOT_ORDER;
+
+/*
+ * Initialize the shadow state, for the instruments being traded.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int snapshot_init(int instruments);
+
+/*
+ * Free the shadow state.
+ */
+void snapshot_fini(void);
+
+/*
+ * Restore the accounts and exchanges, and the shadow state, from a snapshot.
+ * This is to be called before any of the journal is replayed.
+ *
+ * @param path  The path of the snapshot.
+ * @param offsetp  Set to the length of the journal covered by the snapshot,
+ * from which replay is to continue; 0 if there is no usable snapshot.
+ * @return 0 if successful, including if there is no snapshot or it is
+ * damaged (in which case nothing is restored), -1 if the snapshot could not
+ * be restored.
+ */
+int snapshot_load(const char *path, off_t *offsetp);
+
+/*
+ * Apply a journal record to the shadow state.
+ *
+ * @param instrument  The index of the instrument named by the record.
+ * @return 0 if successful, -1 if the record is not consistent with the
+ * state, in which case no further snapshots are written.
+ */
+int snapshot_apply(JOURNAL_RECORD *rec, const char *name, int instrument);
+
+/*
+ * Write out the shadow state as a snapshot.
+ *
+ * @param path  The path of the snapshot, which is replaced.
+ * @param offset  The length of the journal applied to the shadow state.
+ * @return 0 if successful, -1 otherwise.
+ */
+int snapshot_write(const char *path, off_t offset);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "protocol_ext.h"
+
+/*
+ * Counters and latency histograms.
+ *
+ * Each thread records into its own set of counters and histograms, which it
+ * alone writes, so recording takes no lock and makes no atomic
+ * read-modify-write; a histogram is only allocated by a thread the first
+ * time it records into it.  A report sums the sets of all threads, which
+ * may be done at any time while they go on recording.  The sets of threads
+ * that exit are added to a set kept for threads that have gone.
+ *
+ * Histograms are log-linear, as in HdrHistogram: each power of two is
+ * divided into STATS_SUB_BUCKETS buckets, so that any value is reported to
+ * within 1/STATS_SUB_BUCKETS of its magnitude, whatever its range.
+ *
+ * A report can be obtained from a running server with a STATS request
+ * (see protocol_ext.h).
+ */
+
+/*
+ * Packet types for which request latency is recorded.
+ */
+#define STATS_PACKET_TYPES (BRS_REPLAY_PKT + 1)
+
+/*
+ * Histograms.
+ */
+typedef enum {
+    STATS_REQUEST,                              // Request received -> response, by type (ns)
+    STATS_MATCH = STATS_REQUEST + STATS_PACKET_TYPES,  // Order posted -> traded (ns)
+    STATS_MATCH_BURST,                          // Trades per pass of a matchmaker
+    STATS_MATCH_WAKEUP,                         // Matchmaker woken -> running (ns)
+    STATS_FANOUT,                               // Copying a broadcast to all traders (ns)
+    STATS_FANOUT_DEPTH,                         // Events waiting in the fan-out queue
+    STATS_OUTBOUND_DEPTH,                       // Packets queued for a trader
+    STATS_HISTOGRAMS
+} stats_histogram_t;
+
+/*
+ * Counters.
+ */
+typedef enum {
+    STATS_TRADES,                               // Trades made
+    STATS_MATCH_PASSES,                         // Times a matchmaker was woken
+    STATS_MATCH_IDLE,                           // Passes of a matchmaker that made no trade
+    STATS_OUTBOUND_DROPS,                       // Notifications discarded
+    STATS_OUTBOUND_DISCONNECTS,                 // Traders disconnected for being slow
+    STATS_FANOUT_STALLS,                        // Publishers that waited for the fan-out queue
+    STATS_MCAST_DATAGRAMS,                      // Datagrams sent to the multicast group
+    STATS_MCAST_ERRORS,                         // Datagrams that could not be sent
+    STATS_RISK_REJECTS,                         // Orders refused by the pre-trade risk check
+    STATS_COUNTERS
+} stats_counter_t;
+
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+
+/*
+ * Largest magnitude distinguished; larger values are counted in the last
+ * bucket (2^40 ns is about 18 minutes).
+ */
+#define STATS_MAX_MAGNITUDE 40
+
+#define STATS_BUCKETS (STATS_SUB_BUCKETS * (STATS_MAX_MAGNITUDE - STATS_SUB_BITS + 2))
+
+/*
+ * Get a monotonic timestamp in nanoseconds, for measuring latency.
+ */
+static inline uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*
+ * Record a value in a histogram of the calling thread.
+ */
+void stats_record(stats_histogram_t histogram, uint64_t value);
+
+/*
+ * Add to a counter of the calling thread.
+ */
+void stats_count(stats_counter_t counter, uint64_t n);
+
+/*
+ * Get the value of a counter, summed over all threads.
+ */
+uint64_t stats_counter_total(stats_counter_t counter);
+
+/*
+ * Write a report of all counters, and of all histograms that have recorded
+ * any values, summed over all threads.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int stats_report(FILE *out);
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Trace points.
+ *
+ * The debug_thread() calls throughout the server are trace points.  Unless
+ * the server is built with TRACE defined ("make trace"), they compile to
+ * nothing: their arguments are still checked against the format, but no
+ * code is generated for them.
+ *
+ * In a build with TRACE, and when the server was started with a trace file
+ * (-T), a trace point does not format anything or take any lock.  It copies
+ * the address of its format string and its arguments into a fixed-size
+ * record on a ring kept for the calling thread, which a background thread
+ * drains to the trace file.  A thread whose ring is full loses the record,
+ * rather than waiting.  The trace file is decoded offline with
+ * util/trace_decode, which prints the messages as they used to be printed
+ * to stderr.
+ *
+ * Only the conversions of printf() that take integers, pointers, doubles
+ * and strings are supported.  Strings are copied when traced, truncated to
+ * fit the record if necessary.
+ */
+
+#ifdef TRACE
+#define debug_thread(S, ...) trace_emit(0, S, ##__VA_ARGS__)
+#define debug_thread_no(S, ...) trace_emit(TRACE_NO_TID, S, ##__VA_ARGS__)
+#define debug_raw(S, ...) trace_emit(TRACE_RAW, S, ##__VA_ARGS__)
+#else
+#define debug_thread(S, ...) \
+    do { if (0) trace_emit(0, S, ##__VA_ARGS__); } while (0)
+#define debug_thread_no(S, ...) \
+    do { if (0) trace_emit(TRACE_NO_TID, S, ##__VA_ARGS__); } while (0)
+#define debug_raw(S, ...) \
+    do { if (0) trace_emit(TRACE_RAW, S, ##__VA_ARGS__); } while (0)
+#endif
+
+/*
+ * Flags of a trace record.
+ */
+#define TRACE_NO_TID 0x1                // Print without the thread ID
+#define TRACE_RAW 0x2                   // Print without any prefix
+
+/*
+ * Number of records on the ring of each thread.
+ */
+#define TRACE_RING_SIZE 512
+
+#define TRACE_MAX_ARGS 10
+#define TRACE_STRINGS 64
+
+/*
+ * Trace file format (host byte order):
+ *
+ *   TRACE_FILE_HEADER
+ *   entries, each a TRACE_ENTRY_HEADER followed by length bytes:
+ *     TRACE_ENTRY_FORMAT  uint64_t address, then the text of a format string
+ *     TRACE_ENTRY_RECORD  TRACE_RECORD
+ *     TRACE_ENTRY_LOST    uint32_t thread ID, uint32_t records lost
+ *
+ * A format string is written once, before the first record that uses it.
+ */
+#define TRACE_MAGIC "BRSTRACE"
+#define TRACE_VERSION 1
+
+typedef struct trace_file_header {
+    char magic[8];                      // TRACE_MAGIC, not NUL-terminated
+    uint32_t version;                   // TRACE_VERSION
+    uint32_t record_size;               // sizeof(TRACE_RECORD)
+} TRACE_FILE_HEADER;
+
+typedef enum {
+    TRACE_ENTRY_FORMAT = 1,
+    TRACE_ENTRY_RECORD,
+    TRACE_ENTRY_LOST
+} trace_entry_t;
+
+typedef struct trace_entry_header {
+    uint32_t kind;                      // trace_entry_t
+    uint32_t length;                    // Bytes that follow
+} TRACE_ENTRY_HEADER;
+
+typedef struct trace_record {
+    uint64_t timestamp;                 // CLOCK_REALTIME, in nanoseconds
+    uint64_t format;                    // Address of the format string
+    uint32_t tid;                       // Thread ID
+    uint16_t flags;                     // TRACE_NO_TID, ...
+    uint16_t nargs;                     // Arguments stored, including '*' widths
+    uint64_t args[TRACE_MAX_ARGS];      // Integers, pointers and doubles, as bits
+    char strings[TRACE_STRINGS];        // String arguments, each NUL-terminated
+} TRACE_RECORD;
+
+/*
+ * Start draining trace records to a file.  Until this is called, trace
+ * points do nothing.
+ *
+ * @return 0 if successful, -1 if the file could not be created or the
+ * server was not built with TRACE.
+ */
+int trace_init(const char *path);
+
+/*
+ * Stop tracing, writing out all records taken so far, and close the file.
+ */
+void trace_fini(void);
+
+/*
+ * Take a trace record.  Called by the trace point macros.
+ */
+void trace_emit(int flags, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,376 @@
+#ifndef TRADER_EXT_H
+#define TRADER_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "trader.h"
+#include "protocol_ext.h"
+
+/*
+ * Extensions to the trader module declared in trader.h.
+ *
+ * In addition to being sent packets synchronously with trader_send_packet(),
+ * a trader has a bounded outbound ring of packets that are waiting to be sent
+ * asynchronously.  The ring is filled and drained only by the fan-out thread
+ * (see fanout.h), which never blocks on a socket: it drains a ring by sending
+ * with non-blocking writes, and keeps any partially sent data to be finished
+ * later.  A synchronous send to the same trader first completes any partially
+ * sent data, so packets are never interleaved on the wire.
+ *
+ * When a packet is to be queued on a ring that is full, the trader is too
+ * slow to keep up, and the configured slow-consumer policy is applied.
+ */
+
+/*
+ * Maximum size of the payload of a packet queued on an outbound ring.
+ */
+#define OUTBOUND_MAX_PAYLOAD 48
+
+/*
+ * Default number of packets that an outbound ring can hold to begin with.
+ */
+#define OUTBOUND_DEFAULT_CAPACITY 256
+
+/*
+ * Slow-consumer policies, applied when a packet is to be queued for a
+ * trader whose outbound ring is full.
+ *
+ *   OUTBOUND_QUEUE        The ring is made twice as large, so that nothing
+ *                         is lost however far the trader falls behind
+ *                         (the default).
+ *   OUTBOUND_DROP         The new packet is discarded.
+ *   OUTBOUND_DROP_OLDEST  The oldest queued ticker-tape packet is discarded
+ *                         to make room, so that a slow trader sees the most
+ *                         recent events rather than the oldest ones.  The
+ *                         new packet is discarded if nothing but private
+ *                         packets is queued.
+ *   OUTBOUND_DISCONNECT   The trader's connection is shut down, which
+ *                         causes the trader to be logged out.
+ *
+ * Private packets (such as BOUGHT and SOLD) are never discarded: if one
+ * cannot be queued, the trader is disconnected whatever the policy.
+ */
+typedef enum {
+    OUTBOUND_QUEUE,
+    OUTBOUND_DROP,
+    OUTBOUND_DROP_OLDEST,
+    OUTBOUND_DISCONNECT
+} outbound_policy_t;
+
+/*
+ * Results of trader_flush_packets().
+ */
+typedef enum {
+    TRADER_FLUSH_DONE,             // Everything queued has been sent
+    TRADER_FLUSH_BLOCKED,          // The socket is full; retry when writable
+    TRADER_FLUSH_BUSY,             // Another thread is sending; retry soon
+    TRADER_FLUSH_CLOSED            // The trader has gone away; queue discarded
+} trader_flush_t;
+
+/*
+ * Set the capacity of the outbound rings of traders that log in from now on,
+ * and the slow-consumer policy.
+ *
+ * @param capacity  Number of packets an outbound ring can hold before the
+ * slow-consumer policy applies.
+ * @param policy  The slow-consumer policy.
+ */
+void traders_set_outbound(int capacity, outbound_policy_t policy);
+
+/*
+ * Get references to all currently logged-in traders.
+ *
+ * @param tradersp  Pointer to an array, allocated with malloc() or NULL, to
+ * receive the traders.  If the array is too small it is replaced by a larger
+ * one, so a caller that keeps the array between calls stops allocating once
+ * it has seen the largest number of traders.  The reference count of each
+ * trader stored is increased by one, and the caller must release these
+ * references with trader_unref().
+ * @param sizep  Pointer to the number of elements in the array, which is
+ * updated if the array is replaced.
+ * @return  The number of traders stored.  If a larger array cannot be
+ * allocated, only those traders that fit are stored.
+ */
+int trader_snapshot(TRADER ***tradersp, int *sizep);
+
+/*
+ * Get references to the logged-in traders subscribed at a specified level
+ * (see protocol_ext.h), as for trader_snapshot().  Traders are kept in a
+ * separate list for each level, so the traders at other levels cost nothing.
+ */
+int trader_snapshot_feed(TRADER ***tradersp, int *sizep, BRS_FEED_LEVEL level);
+
+/*
+ * Market-data subscription of a trader.  The level and interval are set by
+ * trader_subscribe(); due and seen are kept by the fan-out thread, which is
+ * the only one to use them.
+ */
+typedef struct trader_feed {
+    BRS_FEED_LEVEL level;
+    uint64_t interval;             // Least time between QUOTEs (ns)
+    uint64_t due;                  // Time from which the next QUOTE may be sent (ns)
+    uint64_t seen;                 // Version of the quotes last sent
+} TRADER_FEED;
+
+/*
+ * Set the subscription level of traders that log in from now on (by
+ * default, BRS_FEED_FULL).
+ */
+void traders_set_default_feed(BRS_FEED_LEVEL level);
+
+/*
+ * Change the market-data subscription of a trader.  Traders are subscribed
+ * at the default level when they log in.
+ *
+ * @param trader  The trader.
+ * @param level  The new level.
+ * @param interval  Least time between QUOTEs, in milliseconds, for
+ * BRS_FEED_TOP, or 0 for the default.
+ * @return 0 if successful, -1 if the level is unknown or the trader is not
+ * logged in.
+ */
+int trader_subscribe(TRADER *trader, BRS_FEED_LEVEL level, unsigned interval);
+
+/*
+ * Get the market-data subscription of a trader.
+ */
+TRADER_FEED *trader_get_feed(TRADER *trader);
+
+/*
+ * Get the number of logged-in traders subscribed at a specified level.
+ */
+int traders_feed_count(BRS_FEED_LEVEL level);
+
+/*
+ * Pre-trade risk limits (see protocol_ext.h).
+ *
+ * Each trader keeps the number of its orders pending on all books and their
+ * total value at their limit prices, which the exchanges update with its
+ * orders, and a token bucket for the rate at which it enters orders.  They
+ * are kept with atomic operations, so that an order can be checked on the
+ * client thread without taking any lock, before it reaches the exchange.
+ * Orders restored from the journal count against the detached trader that
+ * owns them, not against traders later logged in to the same account.
+ */
+
+/*
+ * Set the risk limits of all traders.  A limit of 0 disables it, which is
+ * the default for all of them.
+ *
+ * @param max_orders  Most orders a trader may have pending.
+ * @param max_notional  Most total value of the orders a trader may have pending.
+ * @param rate  Orders a trader may enter per second, on average.
+ * @param burst  Orders a trader may enter at once, ahead of the rate; 0 for 1.
+ */
+void traders_set_limits(uint32_t max_orders, uint64_t max_notional, uint32_t rate, uint32_t burst);
+
+/*
+ * Check whether a trader may enter an order, taking a token from its bucket
+ * if the rate allows.  Nothing is reserved for the order: the exchange
+ * counts it once it has been placed.
+ *
+ * @param trader  The trader.
+ * @param quantity  The quantity of the order.
+ * @param price  The limit price of the order.
+ * @param orders  Orders already let through, but not yet placed, as part of
+ * the same request (as for the items of a BULK request).
+ * @param notional  The value of those orders.
+ * @return  BRS_NACK_NONE if the order may be entered, otherwise the reason
+ * for which it is refused.
+ */
+BRS_NACK_REASON trader_risk_check(TRADER *trader, quantity_t quantity, funds_t price,
+                                  uint32_t orders, uint64_t notional);
+
+/*
+ * Count an order placed on a book for a trader.  Called by the exchange.
+ */
+void trader_risk_open(TRADER *trader, quantity_t quantity, funds_t price);
+
+/*
+ * Count a quantity of a trader's order that has left the book, by trading
+ * or being canceled.  Called by the exchange.
+ *
+ * @param closed  Nonzero if nothing remains of the order on the book.
+ */
+void trader_risk_close(TRADER *trader, quantity_t quantity, funds_t price, int closed);
+
+/*
+ * Get the number of a trader's orders pending on all books, as counted for
+ * the risk check.
+ */
+uint32_t trader_risk_orders(TRADER *trader);
+
+/*
+ * Send a NACK packet to a trader, giving the reason for which an order was
+ * refused.
+ *
+ * @return 0 if the packet was sent, -1 otherwise.
+ */
+int trader_send_nack_reason(TRADER *trader, BRS_NACK_REASON reason);
+
+/*
+ * Queue a packet on a trader's outbound ring.  Only to be called by the
+ * fan-out thread.
+ *
+ * @param trader  The trader to whom the packet is to be sent.
+ * @param pkt  The packet header.
+ * @param data  Payload of the packet, or NULL if none.
+ * @param reliable  Nonzero if the packet is private to the trader and must
+ * not be discarded.
+ * @return  1 if the packet was queued and the trader now needs to be flushed
+ * when it previously did not, 0 if the packet was queued (or discarded
+ * according to policy) and no change is needed, -1 if the packet is too
+ * large or the trader is no longer accepting packets.
+ */
+int trader_enqueue_packet(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data, int reliable);
+
+/*
+ * Send as much of a trader's queued data as can be sent without blocking.
+ * Only to be called by the fan-out thread.
+ *
+ * @param trader  The trader whose outbound ring is to be drained.
+ * @return  A trader_flush_t value indicating the outcome.
+ */
+trader_flush_t trader_flush_packets(TRADER *trader);
+
+/*
+ * Check whether the data queued for a trader is to be discarded rather than
+ * sent, because the trader has logged out or the slow-consumer policy wants
+ * its connection shut down.  Such a trader need not wait for its socket to
+ * become writable: the next trader_flush_packets() returns
+ * TRADER_FLUSH_CLOSED.  Only to be taken as a hint.
+ */
+int trader_is_closing(TRADER *trader);
+
+/*
+ * Start holding back packets sent to a trader with trader_send_packet(),
+ * so that several of them can be written out together, with a single system
+ * call, when trader_uncork() is called.  Calls may be nested; packets are
+ * written out when the outermost one is undone.  Packets held back are also
+ * written out whenever there is no room for more.
+ *
+ * @param trader  The trader whose packets are to be held back.
+ */
+void trader_cork(TRADER *trader);
+
+/*
+ * Undo a call to trader_cork(), writing out the packets held back if the
+ * trader is no longer corked.
+ *
+ * @param trader  The trader whose packets are held back.
+ * @return 0 if the packets held back, if any, were written, -1 otherwise.
+ */
+int trader_uncork(TRADER *trader);
+
+/*
+ * Log in a trader whose connection must never be written with a blocking
+ * call, as for a connection served by a reactor (see reactor.h).  Packets
+ * sent to the trader synchronously go through a send buffer (see
+ * protocol_ext.h), which keeps what the socket has no room for, and the
+ * outbound ring is drained only once the send buffer is empty.  A trader
+ * whose send buffer overflows is disconnected.
+ *
+ * @param sender  The send buffer for the connection, which must remain valid
+ * until the trader has logged out, and is only to be used by the caller under
+ * trader_flush_sender() once the trader has logged in.
+ * @param name  The user name, which selects the account.
+ * @return  A reference to the trader, as for trader_login(), or NULL.
+ */
+TRADER *trader_login_buffered(PROTO_WBUF *sender, char *name);
+
+/*
+ * Write out as much of what is kept by the send buffer of a trader logged in
+ * with trader_login_buffered() as can be written without blocking.
+ *
+ * @return  As for proto_wbuf_flush(): 0 if nothing remains (or the trader has
+ * no send buffer), 1 if some remains, -1 on error.
+ */
+int trader_flush_sender(TRADER *trader);
+
+/*
+ * Get the file descriptor of the connection for a trader, for waiting for it
+ * to become writable.
+ *
+ * @return  The file descriptor, or -1 if the trader has logged out.
+ */
+int trader_get_fd(TRADER *trader);
+
+/*
+ * Create a trader that is not logged in and has no connection, to own the
+ * orders restored from the journal (see journal.h) for an account.  Packets
+ * sent to such a trader are discarded.
+ *
+ * @param name  The user name, which selects the account.
+ * @return  The trader, with a reference count of one, or NULL if it could
+ * not be created.
+ */
+TRADER *trader_detached(char *name);
+
+/*
+ * Check whether a trader was created by trader_detached().
+ */
+int trader_is_detached(TRADER *trader);
+
+/*
+ * Sinks.
+ *
+ * A trader can be logged in with a sink in place of a connection, so that
+ * the exchange can be driven in-process, with no sockets involved (see
+ * bench/microbench.c).  Packets sent to such a trader, synchronously or
+ * through its outbound ring, are handed to the sink as they would have been
+ * written to the socket; a sink never blocks.
+ *
+ *   TRADER_SINK_NULL    Packets are discarded.
+ *   TRADER_SINK_COUNT   Packets are counted, in total and by type.
+ *   TRADER_SINK_MEMORY  Packets are counted, and appended to a buffer
+ *                       given by the caller until it is full; the bytes
+ *                       of those that do not fit are counted as overflow.
+ *
+ * A counting sink may be shared by several traders, since its counters are
+ * updated atomically.  A memory sink must only be used by one trader.
+ */
+typedef enum {
+    TRADER_SINK_NULL,
+    TRADER_SINK_COUNT,
+    TRADER_SINK_MEMORY
+} trader_sink_t;
+
+/*
+ * Number of packet types counted by a sink; larger types are counted as 0.
+ */
+#define TRADER_SINK_TYPES 32
+
+typedef struct trader_sink {
+    trader_sink_t kind;
+    unsigned long packets;                    // Packets received
+    unsigned long bytes;                      // Bytes received
+    unsigned long types[TRADER_SINK_TYPES];   // Packets received, by type
+    char *buf;                                // Storage (TRADER_SINK_MEMORY)
+    size_t size;                              // Size of storage
+    size_t len;                               // Bytes stored
+    size_t overflow;                          // Bytes that did not fit
+} TRADER_SINK;
+
+/*
+ * Initialize a sink.
+ *
+ * @param sink  The sink to be initialized.
+ * @param kind  The kind of sink.
+ * @param buf  Storage for the packets received, for TRADER_SINK_MEMORY,
+ * otherwise NULL.
+ * @param size  The size of the storage.
+ */
+void trader_sink_init(TRADER_SINK *sink, trader_sink_t kind, void *buf, size_t size);
+
+/*
+ * Log in a trader whose packets are to be handed to a sink.
+ *
+ * @param sink  The sink, which must remain valid until the trader has
+ * logged out.
+ * @param name  The user name, which selects the account.
+ * @return  A reference to the trader, as for trader_login(), or NULL.
+ */
+TRADER *trader_login_sink(TRADER_SINK *sink, char *name);
+
+#endif
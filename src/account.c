@@ -4,40 +4,114 @@
 #include <arpa/inet.h>
 
 #include "account.h"
+#include "account_ext.h"
+#include "trace.h"
 #include "debug.h"
 #include <unistd.h>
 #include <sys/syscall.h>
 
+struct account {
+    uint64_t state;         // Balance and inventory, packed so that they
+                            // can be updated together with a single CAS
+    char *name;             // Owned by the account
+    uint64_t hash;          // Hash of the name
+    ACCOUNT *next;          // Next account in the same hash bucket
+    void **orders;          // Lists of pending orders, one for each instrument
+    quantity_t inventories[];   // Inventories of the instruments other than
+                                // the default one, which is kept in state
+};
+
 /*
- * Debug macro with thread ID format (matching demo_server)
+ * The balance is kept in the upper half of the state word and the
+ * inventory in the lower half.
  */
-#define debug_thread(S, ...) \
-    do { \
-        fprintf(stderr, KMAG "DEBUG: %015lu: " KNRM S NL, (unsigned long)syscall(SYS_gettid), ##__VA_ARGS__); \
-    } while (0)
+#define ACCOUNT_STATE(balance, inventory) (((uint64_t)(balance) << 32) | (uint32_t)(inventory))
+#define ACCOUNT_BALANCE(state) ((funds_t)((state) >> 32))
+#define ACCOUNT_INVENTORY(state) ((quantity_t)(state))
 
-struct account {
-    funds_t balance;
-    quantity_t inventory;
+/*
+ * Global account map, from user name to account.
+ *
+ * The map is split into shards, each with its own lock and its own chained
+ * hash table, so that lookups of different names rarely contend.  The shard
+ * is chosen by the high bits of the hash of a name and the bucket within the
+ * shard by the low bits.  A shard's table doubles in size whenever it holds
+ * more accounts than buckets, so lookups stay constant-time however many
+ * accounts there are.
+ */
+#define ACCOUNT_SHARDS 64
+#define ACCOUNT_SHARD_INITIAL_BUCKETS 16
+
+static struct account_shard {
     pthread_mutex_t mutex;
-};
+    ACCOUNT **buckets;
+    size_t bucket_count;    // Always a power of two
+    size_t count;           // Number of accounts in the shard
+} account_shards[ACCOUNT_SHARDS];
 
-// Global account map
-static struct account_map_entry {
-    char *name;
-    ACCOUNT *account;
-} account_map[MAX_ACCOUNTS];
+static int instrument_count = 1;
 
-static int account_count = 0;
-static pthread_mutex_t account_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Hash a user name (64-bit FNV-1a).
+ */
+static uint64_t account_hash(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static struct account_shard *account_shard_for(uint64_t hash) {
+    return &account_shards[(hash >> 58) % ACCOUNT_SHARDS];
+}
+
+/*
+ * Double the number of buckets of a shard, which must be locked.
+ * If memory cannot be allocated the shard is left as it is, just more
+ * heavily loaded.
+ */
+static void account_shard_grow(struct account_shard *shard) {
+    size_t bucket_count = shard->bucket_count * 2;
+    ACCOUNT **buckets = calloc(bucket_count, sizeof(ACCOUNT *));
+    if (buckets == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        ACCOUNT *account = shard->buckets[i];
+        while (account != NULL) {
+            ACCOUNT *next = account->next;
+            size_t index = account->hash & (bucket_count - 1);
+            account->next = buckets[index];
+            buckets[index] = account;
+            account = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = bucket_count;
+}
 
 /*
  * Initialize the accounts module.
  */
 int accounts_init(void) {
-    // Map mutex is already initialized statically
-    account_count = 0;
-    memset(account_map, 0, sizeof(account_map));
+    for (int i = 0; i < ACCOUNT_SHARDS; i++) {
+        struct account_shard *shard = &account_shards[i];
+        shard->buckets = calloc(ACCOUNT_SHARD_INITIAL_BUCKETS, sizeof(ACCOUNT *));
+        if (shard->buckets == NULL) {
+            while (i-- > 0) {
+                pthread_mutex_destroy(&account_shards[i].mutex);
+                free(account_shards[i].buckets);
+                account_shards[i].buckets = NULL;
+            }
+            return -1;
+        }
+        shard->bucket_count = ACCOUNT_SHARD_INITIAL_BUCKETS;
+        shard->count = 0;
+        pthread_mutex_init(&shard->mutex, NULL);
+    }
     return 0;
 }
 
@@ -45,18 +119,29 @@ int accounts_init(void) {
  * Finalize the accounts module, freeing all associated resources.
  */
 void accounts_fini(void) {
-    pthread_mutex_lock(&account_map_mutex);
-    
-    for (int i = 0; i < account_count; i++) {
-        if (account_map[i].account != NULL) {
-            pthread_mutex_destroy(&account_map[i].account->mutex);
-            free(account_map[i].account);
-            free(account_map[i].name);
+    for (int i = 0; i < ACCOUNT_SHARDS; i++) {
+        struct account_shard *shard = &account_shards[i];
+        if (shard->buckets == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&shard->mutex);
+        for (size_t j = 0; j < shard->bucket_count; j++) {
+            ACCOUNT *account = shard->buckets[j];
+            while (account != NULL) {
+                ACCOUNT *next = account->next;
+                free(account->orders);
+                free(account->name);
+                free(account);
+                account = next;
+            }
         }
+        free(shard->buckets);
+        shard->buckets = NULL;
+        shard->bucket_count = 0;
+        shard->count = 0;
+        pthread_mutex_unlock(&shard->mutex);
+        pthread_mutex_destroy(&shard->mutex);
     }
-    
-    account_count = 0;
-    pthread_mutex_unlock(&account_map_mutex);
 }
 
 /*
@@ -67,59 +152,91 @@ ACCOUNT *account_lookup(char *name) {
         return NULL;
     }
     
-    pthread_mutex_lock(&account_map_mutex);
+    uint64_t hash = account_hash(name);
+    struct account_shard *shard = account_shard_for(hash);
+    pthread_mutex_lock(&shard->mutex);
     
     // Search for existing account
-    for (int i = 0; i < account_count; i++) {
-        if (account_map[i].name != NULL && strcmp(account_map[i].name, name) == 0) {
-            ACCOUNT *account = account_map[i].account;
-            pthread_mutex_unlock(&account_map_mutex);
+    ACCOUNT **bucket = &shard->buckets[hash & (shard->bucket_count - 1)];
+    for (ACCOUNT *account = *bucket; account != NULL; account = account->next) {
+        if (account->hash == hash && strcmp(account->name, name) == 0) {
+            pthread_mutex_unlock(&shard->mutex);
             return account;
         }
     }
     
-    // Account doesn't exist - check if we can create one
-    if (account_count >= MAX_ACCOUNTS) {
-        pthread_mutex_unlock(&account_map_mutex);
-        return NULL;
-    }
-    
     // Create new account
-    ACCOUNT *account = malloc(sizeof(ACCOUNT));
+    size_t extra = sizeof(quantity_t) * (instrument_count - 1);
+    ACCOUNT *account = malloc(sizeof(ACCOUNT) + extra);
     if (account == NULL) {
-        pthread_mutex_unlock(&account_map_mutex);
+        pthread_mutex_unlock(&shard->mutex);
         return NULL;
     }
-    
-    account->balance = 0;
-    account->inventory = 0;
-    if (pthread_mutex_init(&account->mutex, NULL) != 0) {
+    account->state = ACCOUNT_STATE(0, 0);
+    memset(account->inventories, 0, extra);
+    account->hash = hash;
+    account->orders = calloc(instrument_count, sizeof(void *));
+    if (account->orders == NULL) {
         free(account);
-        pthread_mutex_unlock(&account_map_mutex);
+        pthread_mutex_unlock(&shard->mutex);
         return NULL;
     }
     
     // Copy name
     char *name_copy = malloc(strlen(name) + 1);
     if (name_copy == NULL) {
-        pthread_mutex_destroy(&account->mutex);
+        free(account->orders);
         free(account);
-        pthread_mutex_unlock(&account_map_mutex);
+        pthread_mutex_unlock(&shard->mutex);
         return NULL;
     }
     strcpy(name_copy, name);
+    account->name = name_copy;
     
     // Add to map
-    account_map[account_count].name = name_copy;
-    account_map[account_count].account = account;
-    account_count++;
+    account->next = *bucket;
+    *bucket = account;
+    shard->count++;
+    if (shard->count > shard->bucket_count) {
+        account_shard_grow(shard);
+    }
     
     debug_thread("Create new account %p [%s]", account, name);
     
-    pthread_mutex_unlock(&account_map_mutex);
+    pthread_mutex_unlock(&shard->mutex);
     return account;
 }
 
+/*
+ * Apply signed changes to the balance and inventory of an account, atomically.
+ * If check is nonzero, fails, changing nothing, if a decrease would take
+ * either below zero.  Changes otherwise wrap around, as unsigned arithmetic does.
+ * Returns 0 on success, -1 on failure, and stores the state before the update.
+ */
+static int account_update_checked(ACCOUNT *account, int64_t balance_change,
+                                  int64_t inventory_change, int check, uint64_t *oldp) {
+    uint64_t old = __atomic_load_n(&account->state, __ATOMIC_RELAXED);
+    uint64_t new;
+    do {
+        funds_t balance = ACCOUNT_BALANCE(old);
+        quantity_t inventory = ACCOUNT_INVENTORY(old);
+        if (check && ((balance_change < 0 && balance < (uint64_t)-balance_change)
+                      || (inventory_change < 0 && inventory < (uint64_t)-inventory_change))) {
+            *oldp = old;
+            return -1;
+        }
+        new = ACCOUNT_STATE(balance + balance_change, inventory + inventory_change);
+    } while (!__atomic_compare_exchange_n(&account->state, &old, new, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    *oldp = old;
+    return 0;
+}
+
+static int account_update(ACCOUNT *account, int64_t balance_change, int64_t inventory_change,
+                          uint64_t *oldp) {
+    return account_update_checked(account, balance_change, inventory_change, 1, oldp);
+}
+
 /*
  * Increase the balance for an account.
  */
@@ -128,22 +245,10 @@ void account_increase_balance(ACCOUNT *account, funds_t amount) {
         return;
     }
     
-    pthread_mutex_lock(&account->mutex);
-    funds_t old_balance = account->balance;
-    account->balance += amount;
-    pthread_mutex_unlock(&account->mutex);
-    
-    // Find account name for debug
-    pthread_mutex_lock(&account_map_mutex);
-    const char *name = "unknown";
-    for (int i = 0; i < account_count; i++) {
-        if (account_map[i].account == account) {
-            name = account_map[i].name;
-            break;
-        }
-    }
-    debug_thread("Increase balance of account '%s' (%u -> %u)", name, old_balance, account->balance);
-    pthread_mutex_unlock(&account_map_mutex);
+    uint64_t old;
+    account_update(account, amount, 0, &old);
+    debug_thread("Increase balance of account '%s' (%u -> %u)", account->name,
+                 ACCOUNT_BALANCE(old), ACCOUNT_BALANCE(old) + amount);
 }
 
 /*
@@ -154,91 +259,192 @@ int account_decrease_balance(ACCOUNT *account, funds_t amount) {
         return -1;
     }
     
-    pthread_mutex_lock(&account->mutex);
-    
-    if (account->balance >= amount) {
-        funds_t old_balance = account->balance;
-        account->balance -= amount;
-        pthread_mutex_unlock(&account->mutex);
-        
-        // Find account name for debug
-        pthread_mutex_lock(&account_map_mutex);
-        const char *name = "unknown";
-        for (int i = 0; i < account_count; i++) {
-            if (account_map[i].account == account) {
-                name = account_map[i].name;
-                break;
-            }
+    uint64_t old;
+    if (account_update(account, -(int64_t)amount, 0, &old) != 0) {
+        return -1;
+    }
+    debug_thread("Account %s: decrease balance (%u -> %u)", account->name,
+                 ACCOUNT_BALANCE(old), ACCOUNT_BALANCE(old) - amount);
+    return 0;
+}
+
+/*
+ * Apply a signed change to the inventory of an instrument other than the
+ * default one, under the same rules as account_update_checked().
+ */
+static int inventory_update(ACCOUNT *account, int instrument, int64_t change, int check,
+                            quantity_t *oldp) {
+    quantity_t *inventory = &account->inventories[instrument - 1];
+    quantity_t old = __atomic_load_n(inventory, __ATOMIC_RELAXED);
+    do {
+        if (check && change < 0 && old < (uint64_t)-change) {
+            *oldp = old;
+            return -1;
         }
-        debug_thread("Account %s: decrease balance (%u -> %u)", name, old_balance, account->balance);
-        pthread_mutex_unlock(&account_map_mutex);
-        
-        return 0;
+    } while (!__atomic_compare_exchange_n(inventory, &old, (quantity_t)(old + change), 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    *oldp = old;
+    return 0;
+}
+
+/*
+ * Set the number of instruments for which accounts keep inventories.
+ */
+void accounts_set_instruments(int count) {
+    if (count >= 1) {
+        instrument_count = count;
     }
-    
-    pthread_mutex_unlock(&account->mutex);
-    return -1;
+}
+
+/*
+ * Get the head of the list of an account's pending orders in a specified instrument.
+ */
+void **account_orders_in(ACCOUNT *account, int instrument) {
+    if (account == NULL || instrument < 0 || instrument >= instrument_count) {
+        return NULL;
+    }
+    return &account->orders[instrument];
 }
 
 /*
  * Increase the inventory of an account by a specified quantity.
  */
 void account_increase_inventory(ACCOUNT *account, quantity_t quantity) {
-    if (account == NULL) {
+    account_increase_inventory_in(account, 0, quantity);
+}
+
+/*
+ * Increase the inventory of an account in a specified instrument.
+ */
+void account_increase_inventory_in(ACCOUNT *account, int instrument, quantity_t quantity) {
+    if (account == NULL || instrument < 0 || instrument >= instrument_count) {
         return;
     }
     
-    pthread_mutex_lock(&account->mutex);
-    quantity_t old_inventory = account->inventory;
-    account->inventory += quantity;
-    pthread_mutex_unlock(&account->mutex);
-    
-    // Find account name for debug
-    pthread_mutex_lock(&account_map_mutex);
-    const char *name = "unknown";
-    for (int i = 0; i < account_count; i++) {
-        if (account_map[i].account == account) {
-            name = account_map[i].name;
-            break;
-        }
+    quantity_t old_inventory;
+    if (instrument == 0) {
+        uint64_t old;
+        account_update(account, 0, quantity, &old);
+        old_inventory = ACCOUNT_INVENTORY(old);
+    } else {
+        inventory_update(account, instrument, quantity, 1, &old_inventory);
     }
-    debug_thread("Increase inventory of account '%s' (%u -> %u)", name, old_inventory, account->inventory);
-    pthread_mutex_unlock(&account_map_mutex);
+    debug_thread("Increase inventory of account '%s' (%u -> %u)", account->name,
+                 old_inventory, old_inventory + quantity);
 }
 
 /*
  * Attempt to decrease the inventory for an account by a specified quantity.
  */
 int account_decrease_inventory(ACCOUNT *account, quantity_t quantity) {
-    if (account == NULL) {
+    return account_decrease_inventory_in(account, 0, quantity);
+}
+
+/*
+ * Attempt to decrease the inventory of an account in a specified instrument.
+ */
+int account_decrease_inventory_in(ACCOUNT *account, int instrument, quantity_t quantity) {
+    if (account == NULL || instrument < 0 || instrument >= instrument_count) {
         return -1;
     }
     
-    pthread_mutex_lock(&account->mutex);
+    if (instrument == 0) {
+        uint64_t old;
+        return account_update(account, 0, -(int64_t)quantity, &old);
+    }
+    quantity_t old;
+    return inventory_update(account, instrument, -(int64_t)quantity, 1, &old);
+}
+
+/*
+ * Change the balance and inventory of an account without checking.
+ */
+void account_adjust(ACCOUNT *account, int instrument, int64_t balance_change,
+                    int64_t inventory_change) {
+    if (account == NULL || instrument < 0 || instrument >= instrument_count) {
+        return;
+    }
+    
+    uint64_t old;
+    if (instrument == 0) {
+        account_update_checked(account, balance_change, inventory_change, 0, &old);
+        return;
+    }
+    account_update_checked(account, balance_change, 0, 0, &old);
+    quantity_t old_inventory;
+    inventory_update(account, instrument, inventory_change, 0, &old_inventory);
+}
+
+/*
+ * Get the user name of an account.
+ */
+const char *account_get_name(ACCOUNT *account) {
+    return account->name;
+}
+
+/*
+ * Apply the effects of a trade to the accounts of the buyer and the seller.
+ */
+void account_apply_trade(ACCOUNT *buyer, ACCOUNT *seller, int instrument, quantity_t quantity,
+                         funds_t proceeds, funds_t refund) {
+    if (buyer == NULL || seller == NULL || instrument < 0 || instrument >= instrument_count) {
+        return;
+    }
     
-    if (account->inventory >= quantity) {
-        account->inventory -= quantity;
-        pthread_mutex_unlock(&account->mutex);
-        return 0;
+    if (instrument != 0) {
+        // Funds and inventory are in different words, so are updated separately
+        account_increase_balance(seller, proceeds);
+        if (refund > 0) {
+            account_increase_balance(buyer, refund);
+        }
+        account_increase_inventory_in(buyer, instrument, quantity);
+        return;
+    }
+    
+    uint64_t old;
+    if (buyer == seller) {
+        account_update(buyer, (int64_t)proceeds + refund, quantity, &old);
+        debug_thread("Trade within account '%s' (balance %u -> %u, inventory %u -> %u)", buyer->name,
+                     ACCOUNT_BALANCE(old), ACCOUNT_BALANCE(old) + proceeds + refund,
+                     ACCOUNT_INVENTORY(old), ACCOUNT_INVENTORY(old) + quantity);
+        return;
     }
     
-    pthread_mutex_unlock(&account->mutex);
-    return -1;
+    account_update(seller, proceeds, 0, &old);
+    debug_thread("Increase balance of account '%s' (%u -> %u)", seller->name,
+                 ACCOUNT_BALANCE(old), ACCOUNT_BALANCE(old) + proceeds);
+    account_update(buyer, refund, quantity, &old);
+    debug_thread("Trade for account '%s' (balance %u -> %u, inventory %u -> %u)", buyer->name,
+                 ACCOUNT_BALANCE(old), ACCOUNT_BALANCE(old) + refund,
+                 ACCOUNT_INVENTORY(old), ACCOUNT_INVENTORY(old) + quantity);
 }
 
 /*
  * Get the current balance and inventory of a specified account.
  */
 void account_get_status(ACCOUNT *account, BRS_STATUS_INFO *infop) {
-    if (account == NULL || infop == NULL) {
+    account_get_status_in(account, 0, infop);
+}
+
+/*
+ * Get the current balance and the inventory in a specified instrument
+ * of an account.
+ */
+void account_get_status_in(ACCOUNT *account, int instrument, BRS_STATUS_INFO *infop) {
+    if (account == NULL || infop == NULL || instrument < 0 || instrument >= instrument_count) {
         return;
     }
     
-    pthread_mutex_lock(&account->mutex);
+    // Balance and default inventory are read together, so they are always consistent
+    uint64_t state = __atomic_load_n(&account->state, __ATOMIC_ACQUIRE);
+    quantity_t inventory = ACCOUNT_INVENTORY(state);
+    if (instrument != 0) {
+        inventory = __atomic_load_n(&account->inventories[instrument - 1], __ATOMIC_ACQUIRE);
+    }
     
     // Copy values and convert to network byte order
-    infop->balance = htonl(account->balance);
-    infop->inventory = htonl(account->inventory);
+    infop->balance = htonl(ACCOUNT_BALANCE(state));
+    infop->inventory = htonl(inventory);
     
     // Other fields are set by exchange_get_status
     infop->bid = 0;
@@ -246,6 +452,4 @@ void account_get_status(ACCOUNT *account, BRS_STATUS_INFO *infop) {
     infop->last = 0;
     infop->orderid = 0;
     infop->quantity = 0;
-    
-    pthread_mutex_unlock(&account->mutex);
 }
\ No newline at end of file
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "affinity.h"
+#include "trace.h"
+#include "debug.h"
+
+static const char *role_names[AFFINITY_ROLES] = {
+    [AFFINITY_MATCH] = "match",
+    [AFFINITY_IO] = "io",
+    [AFFINITY_FANOUT] = "fanout"
+};
+
+// CPUs of each role, in the order given; set while parsing the command line,
+// before any thread is started
+static int *role_cpus[AFFINITY_ROLES];
+static int role_count[AFFINITY_ROLES];
+
+/*
+ * Set the CPUs on which the threads of a role are to run.
+ */
+int affinity_set(const char *spec) {
+    const char *eq = spec != NULL ? strchr(spec, '=') : NULL;
+    if (eq == NULL) {
+        return -1;
+    }
+    int role;
+    for (role = 0; role < AFFINITY_ROLES; role++) {
+        if (strlen(role_names[role]) == (size_t)(eq - spec)
+            && strncmp(spec, role_names[role], eq - spec) == 0) {
+            break;
+        }
+    }
+    if (role == AFFINITY_ROLES) {
+        return -1;
+    }
+    
+    int *cpus = malloc(CPU_SETSIZE * sizeof(int));
+    if (cpus == NULL) {
+        return -1;
+    }
+    int count = 0;
+    const char *p = eq + 1;
+    while (1) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end != p && *end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        if (end == p || first < 0 || last < first || last >= CPU_SETSIZE) {
+            count = 0;
+            break;
+        }
+        for (long cpu = first; cpu <= last && count < CPU_SETSIZE; cpu++) {
+            cpus[count++] = cpu;
+        }
+        if (*end != ',') {
+            if (*end != '\0') {
+                count = 0;
+            }
+            break;
+        }
+        p = end + 1;
+    }
+    if (count == 0) {
+        free(cpus);
+        return -1;
+    }
+    
+    free(role_cpus[role]);
+    role_cpus[role] = cpus;
+    role_count[role] = count;
+    return 0;
+}
+
+/*
+ * Pin the calling thread to the CPUs of its role, if any, and give it a name.
+ */
+void affinity_thread_start(affinity_role_t role, int index, const char *name) {
+    affinity_thread_name(name);
+    if (role < 0 || role >= AFFINITY_ROLES || role_count[role] == 0) {
+        return;
+    }
+    
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (index >= 0) {
+        CPU_SET(role_cpus[role][index % role_count[role]], &set);
+    } else {
+        for (int i = 0; i < role_count[role]; i++) {
+            CPU_SET(role_cpus[role][i], &set);
+        }
+    }
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        debug_thread("Failed to pin thread %s to the CPUs of %s: %s", name, role_names[role],
+                     strerror(err));
+    } else {
+        debug_thread("Pinned thread %s to the CPUs of %s", name, role_names[role]);
+    }
+}
+
+/*
+ * Give the calling thread a name, without pinning it.
+ */
+void affinity_thread_name(const char *name) {
+    char buf[16];
+    strncpy(buf, name, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    pthread_setname_np(pthread_self(), buf);
+}
+
+/*
+ * Get the NUMA node of the CPU to which a thread of a role would be pinned.
+ */
+int affinity_node(affinity_role_t role, int index) {
+    if (role < 0 || role >= AFFINITY_ROLES || role_count[role] == 0 || index < 0) {
+        return -1;
+    }
+    
+    // The directory of a CPU holds a link "node<n>" to its node
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d",
+             role_cpus[role][index % role_count[role]]);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    int node = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "node%d", &node) == 1) {
+            break;
+        }
+        node = -1;
+    }
+    closedir(dir);
+    return node;
+}
+
+/*
+ * Allocate zeroed memory bound to a NUMA node.
+ */
+void *affinity_alloc(size_t size, int node) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    
+    // Binding fails on kernels without NUMA, which have only one node anyway
+    if (node >= 0 && node < (int)(8 * sizeof(unsigned long))) {
+        unsigned long mask = 1ul << node;
+        if (syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask, 8 * sizeof(mask), 0) != 0) {
+            debug_thread("Failed to bind %zu bytes to node %d", size, node);
+        }
+    }
+    return ptr;
+}
+
+/*
+ * Release memory allocated with affinity_alloc().
+ */
+void affinity_free(void *ptr, size_t size) {
+    if (ptr != NULL) {
+        munmap(ptr, size);
+    }
+}
@@ -6,18 +6,14 @@
 #include <errno.h>
 
 #include "client_registry.h"
+#include "trace.h"
 #include "debug.h"
 #include <sys/syscall.h>
 
 /*
- * Debug macro with thread ID format (matching demo_server)
+ * Initial capacity of the registry, which grows as needed.
  */
-#define debug_thread(S, ...) \
-    do { \
-        fprintf(stderr, KMAG "DEBUG: %015lu: " KNRM S NL, (unsigned long)syscall(SYS_gettid), ##__VA_ARGS__); \
-    } while (0)
-
-#define MAX_CLIENTS 1024
+#define CREG_INITIAL_CAPACITY 1024
 
 struct client_registry {
     int *fds;                    // Array of file descriptors
@@ -36,7 +32,7 @@ CLIENT_REGISTRY *creg_init() {
         return NULL;
     }
     
-    cr->capacity = MAX_CLIENTS;
+    cr->capacity = CREG_INITIAL_CAPACITY;
     cr->count = 0;
     cr->fds = malloc(sizeof(int) * cr->capacity);
     if (cr->fds == NULL) {
@@ -85,8 +81,13 @@ int creg_register(CLIENT_REGISTRY *cr, int fd) {
     pthread_mutex_lock(&cr->mutex);
     
     if (cr->count >= cr->capacity) {
-        pthread_mutex_unlock(&cr->mutex);
-        return -1;
+        int *fds = realloc(cr->fds, sizeof(int) * cr->capacity * 2);
+        if (fds == NULL) {
+            pthread_mutex_unlock(&cr->mutex);
+            return -1;
+        }
+        cr->fds = fds;
+        cr->capacity *= 2;
     }
     
     // Add fd to array
@@ -1,76 +1,484 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <sched.h>
+#include <stdint.h>
 
 #include "exchange.h"
+#include "exchange_ext.h"
+#include "trader_ext.h"
+#include "account_ext.h"
+#include "order_book.h"
+#include "pool.h"
+#include "seqlock.h"
+#include "fanout.h"
+#include "journal.h"
+#include "multicast.h"
+#include "affinity.h"
+#include "stats.h"
 #include "protocol.h"
+#include "protocol_ext.h"
+#include "trace.h"
 #include "debug.h"
 #include <unistd.h>
 #include <sys/syscall.h>
 
 /*
- * Debug macro with thread ID format (matching demo_server)
+ * Number of orders allocated at a time by the order pool.
  */
-#define debug_thread(S, ...) \
-    do { \
-        fprintf(stderr, KMAG "DEBUG: %015lu: " KNRM S NL, (unsigned long)syscall(SYS_gettid), ##__VA_ARGS__); \
-    } while (0)
+#define ORDERS_PER_SLAB 1024
 
-#define MAX_ORDERS 1024
+/*
+ * Maximum number of notifications batched up by one critical section.
+ */
+#define EXCHANGE_BATCH_MAX 64
 
-typedef enum {
-    ORDER_BUY,
-    ORDER_SELL
-} order_type_t;
+/*
+ * Most notifications produced by posting or canceling an order (POSTED or
+ * CANCELED, its sequenced copy, and LEVEL), and by a trade (BOUGHT, SOLD,
+ * TRADED, its sequenced copy, and two LEVELs).
+ */
+#define EXCHANGE_ORDER_EVENTS 3
+#define EXCHANGE_TRADE_EVENTS 6
 
-struct order {
-    orderid_t id;
-    TRADER *trader;
-    order_type_t type;
-    quantity_t quantity;
-    funds_t price;  // max price for buy, min price for sell
-    struct order *next;
+/*
+ * A notification produced while the exchange is locked, to be published
+ * once it has been unlocked.
+ */
+struct exchange_event {
+    TRADER *target;                 // Recipient (referenced), or NULL for all traders
+    BRS_FEED_LEVEL feed;            // Subscribers to whom a broadcast goes
+    BRS_PACKET_HEADER hdr;
+    BRS_ENVELOPE_INFO envelope;     // Sent ahead of info, except for the default instrument
+    union {
+        struct {
+            BRS_NOTIFY_INFO info;   // POSTED, CANCELED, TRADED, BOUGHT, SOLD
+            uint32_t seq;           // Number on the tape, sent at BRS_FEED_SEQUENCED
+        };
+        BRS_LEVEL_INFO level;       // LEVEL
+    };
+};
+
+_Static_assert(offsetof(struct exchange_event, info)
+               == offsetof(struct exchange_event, envelope) + sizeof(BRS_ENVELOPE_INFO),
+               "envelope must immediately precede the notification it encloses");
+_Static_assert(offsetof(struct exchange_event, seq)
+               == offsetof(struct exchange_event, info) + sizeof(BRS_NOTIFY_INFO),
+               "seq must follow info as in BRS_SEQ_NOTIFY_INFO");
+
+/*
+ * Notifications produced by one critical section.  The batch is numbered
+ * from the exchange's event sequence before the exchange is unlocked, and
+ * batches are published strictly in sequence order, so that traders see
+ * notifications in the order in which the book changed.
+ */
+struct exchange_batch {
+    uint64_t seq;                   // Sequence number of the first event
+    int count;
+    int capacity;                   // Number of events there is room for
+    struct exchange_event *events;  // Storage, provided by the caller
+    int wake;                       // Wake the matchmaker once published
 };
 
 struct exchange {
-    struct order *buy_orders;      // List of buy orders
-    struct order *sell_orders;      // List of sell orders
+    ORDER_BOOK book;                // Pending buy and sell orders
+    POOL *order_pool;               // Storage for orders
     pthread_mutex_t mutex;
     sem_t matchmaker_sem;           // Semaphore to wake matchmaker
+    int match_pending;              // Matchmaker woken and not yet done, protected by mutex
     funds_t last_trade_price;
     orderid_t next_order_id;
     pthread_t matchmaker_thread;
     volatile int running;
+    exchange_wait_t wait;           // How the matchmaker waits to be woken
+    uint32_t doorbell;              // Rung to wake the matchmaker
+    int parked;                     // Nonzero while the matchmaker sleeps on its semaphore
+    uint64_t rung_at;               // When the doorbell was last rung (ns)
+    uint64_t event_seq;             // Next event sequence number, protected by mutex
+    uint64_t published_seq;         // Events before this one have been published
+    uint32_t depth_seq;             // Changes to price levels numbered, protected by mutex
+    uint32_t tape_seq;              // Packets of the tape numbered, protected by mutex
+    int instrument;                 // Index of the instrument traded
+    char symbol[BRS_SYMBOL_SIZE];   // Its symbol, padded with NULs
+    
+    // Top of the book as of the last update, for reading without the mutex
+    SEQLOCK status_lock;            // Odd while an update is in progress
+    funds_t status_bid;
+    funds_t status_ask;
+    funds_t status_last;
+    
+    // The last packets of the tape, in network byte order, indexed by their
+    // numbers modulo BRS_REPLAY_KEPT, protected by mutex
+    BRS_REPLAY_EVENT tape[BRS_REPLAY_KEPT];
 };
 
 static void *matchmaker_thread_func(void *arg);
+static int match_book(EXCHANGE *xchg, struct exchange_batch *batch);
+static void match_stats(int trades_made);
+
+/*
+ * Whether orders that cross the book on being posted are matched on the
+ * thread posting them (see exchanges_set_inline_matching()).
+ */
+static int inline_matching = 0;
+
+/*
+ * Lock the exchange for an update.  Status readers wait while an update is
+ * in progress, so that they only ever see the state between updates.
+ */
+static void exchange_lock(EXCHANGE *xchg) {
+    pthread_mutex_lock(&xchg->mutex);
+    seqlock_write_begin(&xchg->status_lock);
+}
+
+/*
+ * Publish the top of the book for status readers, and unlock the exchange.
+ */
+static void exchange_unlock(EXCHANGE *xchg) {
+    struct price_level *best_bid = xchg->book.bids.best;
+    struct price_level *best_ask = xchg->book.asks.best;
+    __atomic_store_n(&xchg->status_bid, best_bid != NULL ? best_bid->price : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&xchg->status_ask, best_ask != NULL ? best_ask->price : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&xchg->status_last, xchg->last_trade_price, __ATOMIC_RELAXED);
+    seqlock_write_end(&xchg->status_lock);
+    pthread_mutex_unlock(&xchg->mutex);
+}
+
+/*
+ * Initialize an empty batch in storage provided by the caller.
+ */
+static void batch_init(struct exchange_batch *batch, struct exchange_event *events, int capacity) {
+    batch->seq = 0;
+    batch->count = 0;
+    batch->capacity = capacity;
+    batch->events = events;
+    batch->wake = 0;
+}
+
+/*
+ * Arrange for the matchmaker to be woken once a batch has been published,
+ * unless it has already been woken and has not yet finished matching, in
+ * which case it will find whatever crosses the book anyway.  Must be called
+ * with the exchange locked.
+ */
+static void batch_wake(EXCHANGE *xchg, struct exchange_batch *batch) {
+    if (!xchg->match_pending) {
+        xchg->match_pending = 1;
+        batch->wake = 1;
+    }
+}
+
+/*
+ * Fill in the record of a numbered packet of the tape, as kept for replay
+ * and sent to the multicast group.
+ */
+static void tape_event(EXCHANGE *xchg, struct exchange_event *event, BRS_REPLAY_EVENT *out) {
+    out->seq = event->seq;
+    out->type = xchg->instrument == 0 ? event->hdr.type : event->envelope.type;
+    memset(out->reserved, 0, sizeof(out->reserved));
+    out->timestamp_sec = event->hdr.timestamp_sec;
+    out->timestamp_nsec = event->hdr.timestamp_nsec;
+    out->info = event->info;
+}
+
+/*
+ * Number a packet of the tape and keep it for replay, and add a copy that
+ * carries its number for the traders subscribed at BRS_FEED_SEQUENCED, if
+ * there are any.  Must be called with the exchange locked.
+ */
+static void batch_tape(EXCHANGE *xchg, struct exchange_batch *batch, struct exchange_event *event) {
+    event->seq = htonl(++xchg->tape_seq);
+    tape_event(xchg, event, &xchg->tape[xchg->tape_seq & (BRS_REPLAY_KEPT - 1)]);
+    if (traders_feed_count(BRS_FEED_SEQUENCED) > 0) {
+        struct exchange_event *copy = &batch->events[batch->count++];
+        *copy = *event;
+        copy->feed = BRS_FEED_SEQUENCED;
+        copy->hdr.size = htons(ntohs(event->hdr.size) + sizeof(uint32_t));
+    }
+}
+
+/*
+ * Add a notification to a batch.  Must be called with the exchange locked.
+ */
+static void batch_add(EXCHANGE *xchg, struct exchange_batch *batch, BRS_PACKET_TYPE type,
+                      TRADER *target, orderid_t buyer, orderid_t seller, quantity_t quantity,
+                      funds_t price) {
+    struct exchange_event *event = &batch->events[batch->count++];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    event->target = target != NULL ? trader_ref(target, "notification") : NULL;
+    event->feed = BRS_FEED_FULL;
+    if (xchg->instrument == 0) {
+        event->hdr.type = type;
+        event->hdr.size = htons(sizeof(BRS_NOTIFY_INFO));
+    } else {
+        event->hdr.type = BRS_ENVELOPE_PKT;
+        event->hdr.size = htons(sizeof(BRS_ENVELOPE_INFO) + sizeof(BRS_NOTIFY_INFO));
+        memcpy(event->envelope.symbol, xchg->symbol, BRS_SYMBOL_SIZE);
+        event->envelope.type = type;
+        memset(event->envelope.reserved, 0, sizeof(event->envelope.reserved));
+    }
+    event->hdr.timestamp_sec = htonl(ts.tv_sec);
+    event->hdr.timestamp_nsec = htonl(ts.tv_nsec);
+    event->info.buyer = htonl(buyer);
+    event->info.seller = htonl(seller);
+    event->info.quantity = htonl(quantity);
+    event->info.price = htonl(price);
+    event->seq = 0;
+    if (target == NULL) {
+        batch_tape(xchg, batch, event);
+    }
+}
+
+/*
+ * Add a LEVEL notification for the change of a price level to a batch, if
+ * any trader is subscribed to depth updates.  Must be called with the
+ * exchange locked, after the change.
+ */
+static void batch_add_level(EXCHANGE *xchg, struct exchange_batch *batch, order_type_t type,
+                            funds_t price) {
+    // Readers of depth take a snapshot after subscribing, under the mutex,
+    // so they see every change not numbered here in the snapshot
+    if (traders_feed_count(BRS_FEED_DEPTH) == 0) {
+        return;
+    }
+    BOOK_SIDE *side = type == ORDER_BUY ? &xchg->book.bids : &xchg->book.asks;
+    struct price_level *level = book_level(side, price);
+    struct exchange_event *event = &batch->events[batch->count++];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    event->target = NULL;
+    event->feed = BRS_FEED_DEPTH;
+    if (xchg->instrument == 0) {
+        event->hdr.type = BRS_LEVEL_PKT;
+        event->hdr.size = htons(sizeof(BRS_LEVEL_INFO));
+    } else {
+        event->hdr.type = BRS_ENVELOPE_PKT;
+        event->hdr.size = htons(sizeof(BRS_ENVELOPE_INFO) + sizeof(BRS_LEVEL_INFO));
+        memcpy(event->envelope.symbol, xchg->symbol, BRS_SYMBOL_SIZE);
+        event->envelope.type = BRS_LEVEL_PKT;
+        memset(event->envelope.reserved, 0, sizeof(event->envelope.reserved));
+    }
+    event->hdr.timestamp_sec = htonl(ts.tv_sec);
+    event->hdr.timestamp_nsec = htonl(ts.tv_nsec);
+    memset(&event->level, 0, sizeof(event->level));
+    event->level.seq = htonl(++xchg->depth_seq);
+    event->level.side = type == ORDER_BUY ? BRS_SIDE_BID : BRS_SIDE_ASK;
+    event->level.price = htonl(price);
+    event->level.quantity = htonl(level != NULL ? level->quantity : 0);
+    event->level.orders = htonl(level != NULL ? level->count : 0);
+}
+
+/*
+ * Number a batch of notifications.  Must be called with the exchange locked,
+ * after the last notification has been added.
+ */
+static void batch_close(EXCHANGE *xchg, struct exchange_batch *batch) {
+    batch->seq = xchg->event_seq;
+    xchg->event_seq += batch->count;
+}
+
+/*
+ * Wake the matchmaker, by ringing its doorbell and, if it is asleep, posting
+ * its semaphore.
+ */
+static void matchmaker_ring(EXCHANGE *xchg) {
+    __atomic_store_n(&xchg->rung_at, stats_now(), __ATOMIC_RELAXED);
+    
+    // Either the matchmaker sees the doorbell before it sleeps, or this sees
+    // that it is asleep (both are sequentially consistent)
+    __atomic_add_fetch(&xchg->doorbell, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&xchg->parked, __ATOMIC_SEQ_CST)) {
+        sem_post(&xchg->matchmaker_sem);
+    }
+}
+
+/*
+ * Hint to the CPU that the calling thread is polling.
+ */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * Wait, as the matchmaker, for the doorbell to be rung or the exchange to be
+ * finalized, polling or sleeping according to the exchange's strategy.
+ *
+ * @param seen  The doorbell as of the last wait, updated on return.
+ */
+static void matchmaker_wait(EXCHANGE *xchg, uint32_t *seen) {
+    uint64_t start = stats_now();
+    while (xchg->running) {
+        uint32_t doorbell = __atomic_load_n(&xchg->doorbell, __ATOMIC_ACQUIRE);
+        if (doorbell != *seen) {
+            *seen = doorbell;
+            stats_record(STATS_MATCH_WAKEUP,
+                         stats_now() - __atomic_load_n(&xchg->rung_at, __ATOMIC_RELAXED));
+            return;
+        }
+        
+        exchange_wait_t wait = __atomic_load_n(&xchg->wait, __ATOMIC_RELAXED);
+        if (wait == EXCHANGE_WAIT_SPIN
+            || (wait == EXCHANGE_WAIT_ADAPTIVE && stats_now() - start < EXCHANGE_SPIN_NS)) {
+            cpu_relax();
+            continue;
+        }
+        
+        __atomic_store_n(&xchg->parked, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&xchg->doorbell, __ATOMIC_SEQ_CST) == *seen && xchg->running) {
+            sem_wait(&xchg->matchmaker_sem);
+        }
+        __atomic_store_n(&xchg->parked, 0, __ATOMIC_RELAXED);
+        start = stats_now();
+    }
+}
+
+/*
+ * Publish a batch of notifications.  Must be called with the exchange unlocked,
+ * so that the exchange is not held up by the delivery of notifications.
+ */
+static void batch_publish(EXCHANGE *xchg, struct exchange_batch *batch) {
+    if (batch->count == 0) {
+        return;
+    }
+    
+    // Wait for the batches numbered before this one to be published.
+    // Their critical sections have already finished, so the wait is short.
+    while (__atomic_load_n(&xchg->published_seq, __ATOMIC_ACQUIRE) != batch->seq) {
+        sched_yield();
+    }
+    
+    // Handed over in chunks, so that a burst of trades is fanned out together
+    FANOUT_PACKET packets[EXCHANGE_BATCH_MAX];
+    BRS_REPLAY_EVENT tape[EXCHANGE_BATCH_MAX];
+    int multicast = multicast_enabled();
+    for (int i = 0; i < batch->count; i += EXCHANGE_BATCH_MAX) {
+        int n = batch->count - i < EXCHANGE_BATCH_MAX ? batch->count - i : EXCHANGE_BATCH_MAX;
+        int taped = 0;
+        for (int j = 0; j < n; j++) {
+            struct exchange_event *event = &batch->events[i + j];
+            packets[j].target = event->target;
+            packets[j].feed = event->feed;
+            packets[j].hdr = &event->hdr;
+            packets[j].data = xchg->instrument == 0 ? (void *)&event->info : (void *)&event->envelope;
+            if (multicast && event->target == NULL && event->feed == BRS_FEED_FULL) {
+                tape_event(xchg, event, &tape[taped++]);
+            }
+        }
+        multicast_publish(xchg->symbol, tape, taped);
+        fanout_publish_batch(packets, n);
+        for (int j = 0; j < n; j++) {
+            if (packets[j].target != NULL) {
+                trader_unref(packets[j].target, "notification");
+            }
+        }
+    }
+    
+    __atomic_store_n(&xchg->published_seq, batch->seq + batch->count, __ATOMIC_RELEASE);
+    batch->count = 0;
+}
+
+/*
+ * Match on the calling thread, rather than waking the matchmaker, for a
+ * batch that calls for matching, if inline matching is enabled.  Must be
+ * called with the exchange locked.
+ *
+ * @return  The number of trades made, or -1 if matching was left to the
+ * matchmaker or was not called for.
+ */
+static int batch_match(EXCHANGE *xchg, struct exchange_batch *batch) {
+    if (!batch->wake || !__atomic_load_n(&inline_matching, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    batch->wake = 0;
+    return match_book(xchg, batch);
+}
+
+/*
+ * Publish a batch of notifications, and then wake the matchmaker if the
+ * batch calls for it.  Must be called with the exchange unlocked.
+ */
+static void batch_finish(EXCHANGE *xchg, struct exchange_batch *batch) {
+    batch_publish(xchg, batch);
+    if (batch->wake) {
+        batch->wake = 0;
+        matchmaker_ring(xchg);
+    }
+}
 
 /*
  * Initialize a new exchange.
  */
 EXCHANGE *exchange_init() {
-    EXCHANGE *xchg = malloc(sizeof(EXCHANGE));
+    return exchange_init_instrument(0, "");
+}
+
+/*
+ * Initialize a new exchange for a specified instrument.
+ */
+EXCHANGE *exchange_init_instrument(int instrument, const char *symbol) {
+    if (instrument < 0 || symbol == NULL || strlen(symbol) > BRS_SYMBOL_SIZE) {
+        return NULL;
+    }
+    
+    // The exchange, its book and its orders are placed on the node of its
+    // matchmaker, which touches them most
+    int node = affinity_node(AFFINITY_MATCH, instrument);
+    EXCHANGE *xchg = affinity_alloc(sizeof(EXCHANGE), node);
     if (xchg == NULL) {
         return NULL;
     }
     
-    xchg->buy_orders = NULL;
-    xchg->sell_orders = NULL;
+    xchg->instrument = instrument;
+    memset(xchg->symbol, 0, BRS_SYMBOL_SIZE);
+    memcpy(xchg->symbol, symbol, strlen(symbol));
     xchg->last_trade_price = 0;
     xchg->next_order_id = 1;
     xchg->running = 1;
+    xchg->wait = EXCHANGE_WAIT_BLOCK;
+    xchg->doorbell = 0;
+    xchg->parked = 0;
+    xchg->rung_at = 0;
+    xchg->match_pending = 0;
+    xchg->depth_seq = 0;
+    xchg->tape_seq = 0;
+    xchg->event_seq = 0;
+    xchg->published_seq = 0;
+    seqlock_init(&xchg->status_lock);
+    xchg->status_bid = xchg->status_ask = xchg->status_last = 0;
+    
+    if (book_init(&xchg->book, node) != 0) {
+        affinity_free(xchg, sizeof(EXCHANGE));
+        return NULL;
+    }
+    
+    xchg->order_pool = pool_init_node("orders", sizeof(struct order), ORDERS_PER_SLAB, node);
+    if (xchg->order_pool == NULL) {
+        book_fini(&xchg->book);
+        affinity_free(xchg, sizeof(EXCHANGE));
+        return NULL;
+    }
     
     if (pthread_mutex_init(&xchg->mutex, NULL) != 0) {
-        free(xchg);
+        pool_fini(xchg->order_pool);
+        book_fini(&xchg->book);
+        affinity_free(xchg, sizeof(EXCHANGE));
         return NULL;
     }
     
     if (sem_init(&xchg->matchmaker_sem, 0, 0) != 0) {
         pthread_mutex_destroy(&xchg->mutex);
-        free(xchg);
+        pool_fini(xchg->order_pool);
+        book_fini(&xchg->book);
+        affinity_free(xchg, sizeof(EXCHANGE));
         return NULL;
     }
     
@@ -78,7 +486,9 @@ EXCHANGE *exchange_init() {
     if (pthread_create(&xchg->matchmaker_thread, NULL, matchmaker_thread_func, xchg) != 0) {
         sem_destroy(&xchg->matchmaker_sem);
         pthread_mutex_destroy(&xchg->mutex);
-        free(xchg);
+        pool_fini(xchg->order_pool);
+        book_fini(&xchg->book);
+        affinity_free(xchg, sizeof(EXCHANGE));
         return NULL;
     }
     
@@ -87,6 +497,38 @@ EXCHANGE *exchange_init() {
     return xchg;
 }
 
+/*
+ * Set whether orders are matched on the thread posting them.
+ */
+void exchanges_set_inline_matching(int enable) {
+    __atomic_store_n(&inline_matching, enable != 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Set how the matchmaker of an exchange waits to be woken.
+ */
+int exchange_set_wait(EXCHANGE *xchg, exchange_wait_t wait) {
+    if (xchg == NULL || wait < EXCHANGE_WAIT_BLOCK || wait > EXCHANGE_WAIT_SPIN) {
+        return -1;
+    }
+    __atomic_store_n(&xchg->wait, wait, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Get the index of the instrument traded on an exchange.
+ */
+int exchange_get_instrument(EXCHANGE *xchg) {
+    return xchg->instrument;
+}
+
+/*
+ * Get the symbol of the instrument traded on an exchange.
+ */
+const char *exchange_get_symbol(EXCHANGE *xchg) {
+    return xchg->symbol;
+}
+
 /*
  * Finalize an exchange, freeing all associated resources.
  */
@@ -103,87 +545,200 @@ void exchange_fini(EXCHANGE *xchg) {
     pthread_mutex_lock(&xchg->mutex);
     
     // Cancel all remaining orders and unencumber funds/inventory
-    struct order *order = xchg->buy_orders;
-    while (order != NULL) {
-        struct order *next = order->next;
+    struct order *order;
+    while ((order = book_best_buy(&xchg->book)) != NULL) {
+        book_remove(&xchg->book, order);
+        trader_risk_close(order->trader, order->quantity, order->price, 1);
         
         // Refund encumbered funds
         ACCOUNT *account = trader_get_account(order->trader);
         account_increase_balance(account, order->quantity * order->price);
         
         trader_unref(order->trader, "exchange_fini");
-        free(order);
-        order = next;
+        pool_free(xchg->order_pool, order);
     }
     
-    order = xchg->sell_orders;
-    while (order != NULL) {
-        struct order *next = order->next;
+    while ((order = book_best_sell(&xchg->book)) != NULL) {
+        book_remove(&xchg->book, order);
+        trader_risk_close(order->trader, order->quantity, order->price, 1);
         
         // Release encumbered inventory
         ACCOUNT *account = trader_get_account(order->trader);
-        account_increase_inventory(account, order->quantity);
+        account_increase_inventory_in(account, xchg->instrument, order->quantity);
         
         trader_unref(order->trader, "exchange_fini");
-        free(order);
-        order = next;
+        pool_free(xchg->order_pool, order);
     }
+    book_fini(&xchg->book);
     
     pthread_mutex_unlock(&xchg->mutex);
     
     sem_destroy(&xchg->matchmaker_sem);
     pthread_mutex_destroy(&xchg->mutex);
-    free(xchg);
+    pool_fini(xchg->order_pool);
+    affinity_free(xchg, sizeof(EXCHANGE));
 }
 
 /*
- * Find best buy order (highest price)
+ * Carry out a trade between two orders: reduce the orders, removing them
+ * from the book once filled (the caller frees them), and settle the trade
+ * with the accounts of the buyer and the seller.  Must be called with the
+ * exchange locked.
  */
-static struct order *find_best_buy(EXCHANGE *xchg) {
-    struct order *best = NULL;
-    struct order *order = xchg->buy_orders;
+static void exchange_execute(EXCHANGE *xchg, struct order *buy_order, struct order *sell_order,
+                             quantity_t trade_qty, funds_t trade_price) {
+    // Store max price before updating order
+    funds_t buy_max_price = buy_order->price;
     
-    while (order != NULL) {
-        if (best == NULL || order->price > best->price) {
-            best = order;
-        }
-        order = order->next;
-    }
+    // Update orders
+    book_reduce(&xchg->book, buy_order, trade_qty);
+    book_reduce(&xchg->book, sell_order, trade_qty);
+    trader_risk_close(buy_order->trader, trade_qty, buy_max_price, buy_order->quantity == 0);
+    trader_risk_close(sell_order->trader, trade_qty, sell_order->price, sell_order->quantity == 0);
+    
+    // Update last trade price
+    xchg->last_trade_price = trade_price;
+    
+    // Update accounts
+    ACCOUNT *buyer_account = trader_get_account(buy_order->trader);
+    ACCOUNT *seller_account = trader_get_account(sell_order->trader);
+    
+    // Buyer refund calculation:
+    // Originally encumbered: original_qty * buy_max_price
+    // Amount actually used: trade_qty * trade_price
+    // Should remain encumbered: buy_order->quantity * buy_max_price (after update)
+    // Refund = original_encumbered - used - remaining_encumbered
+    //        = (buy_order->quantity + trade_qty) * buy_max_price - trade_qty * trade_price - buy_order->quantity * buy_max_price
+    //        = trade_qty * buy_max_price - trade_qty * trade_price
+    //        = trade_qty * (buy_max_price - trade_price)
+    funds_t refund = trade_qty * (buy_max_price - trade_price);
     
-    return best;
+    // Seller gets proceeds, buyer gets inventory and refund
+    account_apply_trade(buyer_account, seller_account, xchg->instrument, trade_qty,
+                        trade_price * trade_qty, refund);
+    
+    // Remove orders with zero quantity
+    if (buy_order->quantity == 0) {
+        book_remove(&xchg->book, buy_order);
+    }
+    if (sell_order->quantity == 0) {
+        book_remove(&xchg->book, sell_order);
+    }
 }
 
 /*
- * Find best sell order (lowest price)
+ * Make the trades that are possible at the top of the book, until it no
+ * longer crosses, adding their notifications to a batch.  A full batch is
+ * published before matching goes on, which unlocks the exchange briefly.
+ * Must be called with the exchange locked.
+ *
+ * @return  The number of trades made.
  */
-static struct order *find_best_sell(EXCHANGE *xchg) {
-    struct order *best = NULL;
-    struct order *order = xchg->sell_orders;
-    
-    while (order != NULL) {
-        if (best == NULL || order->price < best->price) {
-            best = order;
+static int match_book(EXCHANGE *xchg, struct exchange_batch *batch) {
+    // The book was uncrossed at the end of the last pass, and only an order
+    // that crossed it on being posted calls for matching, so the trades are
+    // all to be found at the top of the book.
+    int trades_made = 0;
+    uint64_t now = stats_now();
+    while (1) {
+        if (batch->count + EXCHANGE_TRADE_EVENTS > batch->capacity) {
+            // Publish the notifications so far before matching more
+            batch_close(xchg, batch);
+            exchange_unlock(xchg);
+            batch_publish(xchg, batch);
+            exchange_lock(xchg);
+        }
+        
+        struct order *buy_order = book_best_buy(&xchg->book);
+        struct order *sell_order = book_best_sell(&xchg->book);
+        
+        // Check if orders match
+        if (buy_order == NULL || sell_order == NULL) {
+            if (!trades_made) {
+                debug_thread("Matchmaker sees no possible trades");
+            }
+            break;
+        }
+        
+        if (buy_order->price < sell_order->price) {
+            if (!trades_made) {
+                debug_thread("Matchmaker sees no possible trades");
+            }
+            break; // No match
+        }
+        
+        trades_made++;
+        
+        // Determine trade price (closest to last trade price within overlap)
+        funds_t trade_price;
+        funds_t min_price = sell_order->price;
+        funds_t max_price = buy_order->price;
+        
+        if (xchg->last_trade_price == 0) {
+            // No previous trade, use midpoint
+            trade_price = (min_price + max_price) / 2;
+        } else if (xchg->last_trade_price >= min_price && xchg->last_trade_price <= max_price) {
+            // Last trade price is within overlap
+            trade_price = xchg->last_trade_price;
+        } else if (xchg->last_trade_price < min_price) {
+            trade_price = min_price;
+        } else {
+            trade_price = max_price;
+        }
+        
+        // Determine trade quantity
+        quantity_t trade_qty = buy_order->quantity;
+        if (sell_order->quantity < trade_qty) {
+            trade_qty = sell_order->quantity;
+        }
+        
+        // Time from the order that made the book cross
+        uint64_t posted = buy_order->posted > sell_order->posted ? buy_order->posted
+                                                                 : sell_order->posted;
+        stats_record(STATS_MATCH, now > posted ? now - posted : 0);
+        
+        exchange_execute(xchg, buy_order, sell_order, trade_qty, trade_price);
+        journal_trade(xchg->symbol, buy_order->id, sell_order->id, trade_qty, trade_price);
+        
+        // Notify buyer, seller and all traders once unlocked
+        if (buy_order->quantity == 0 || trade_qty > 0) {
+            batch_add(xchg, batch, BRS_BOUGHT_PKT, buy_order->trader,
+                      buy_order->id, sell_order->id, trade_qty, trade_price);
+        }
+        if (sell_order->quantity == 0 || trade_qty > 0) {
+            batch_add(xchg, batch, BRS_SOLD_PKT, sell_order->trader,
+                      buy_order->id, sell_order->id, trade_qty, trade_price);
+        }
+        batch_add(xchg, batch, BRS_TRADED_PKT, NULL,
+                  buy_order->id, sell_order->id, trade_qty, trade_price);
+        batch_add_level(xchg, batch, ORDER_BUY, buy_order->price);
+        batch_add_level(xchg, batch, ORDER_SELL, sell_order->price);
+        
+        // Free orders that were removed
+        if (buy_order->quantity == 0) {
+            trader_unref(buy_order->trader, "trade complete");
+            pool_free(xchg->order_pool, buy_order);
+        }
+        if (sell_order->quantity == 0) {
+            trader_unref(sell_order->trader, "trade complete");
+            pool_free(xchg->order_pool, sell_order);
         }
-        order = order->next;
     }
     
-    return best;
+    // Orders posted from now on call for matching again if they cross
+    xchg->match_pending = 0;
+    return trades_made;
 }
 
 /*
- * Remove order from list
+ * Record the statistics of a pass of matching.
  */
-static void remove_order(struct order **list, struct order *order) {
-    if (*list == order) {
-        *list = order->next;
+static void match_stats(int trades_made) {
+    if (trades_made > 0) {
+        stats_record(STATS_MATCH_BURST, trades_made);
+        stats_count(STATS_TRADES, trades_made);
     } else {
-        struct order *prev = *list;
-        while (prev != NULL && prev->next != order) {
-            prev = prev->next;
-        }
-        if (prev != NULL) {
-            prev->next = order->next;
-        }
+        stats_count(STATS_MATCH_IDLE, 1);
     }
 }
 
@@ -193,156 +748,33 @@ static void remove_order(struct order **list, struct order *order) {
 static void *matchmaker_thread_func(void *arg) {
     EXCHANGE *xchg = (EXCHANGE *)arg;
     
+    char name[16] = "match";
+    if (xchg->instrument != 0) {
+        snprintf(name, sizeof(name), "match.%.8s", xchg->symbol);
+    }
+    affinity_thread_start(AFFINITY_MATCH, xchg->instrument, name);
+    
+    uint32_t seen = 0;
     while (xchg->running) {
         // Wait for orders to change
-        sem_wait(&xchg->matchmaker_sem);
+        matchmaker_wait(xchg, &seen);
         
         if (!xchg->running) {
             break;
         }
         
-        pthread_mutex_lock(&xchg->mutex);
+        struct exchange_event events[EXCHANGE_BATCH_MAX];
+        struct exchange_batch batch;
+        batch_init(&batch, events, EXCHANGE_BATCH_MAX);
+        stats_count(STATS_MATCH_PASSES, 1);
         
-        // Match orders until no more matches
-        int trades_made = 0;
-        while (1) {
-            struct order *buy_order = find_best_buy(xchg);
-            struct order *sell_order = find_best_sell(xchg);
-            
-            // Check if orders match
-            if (buy_order == NULL || sell_order == NULL) {
-                if (!trades_made) {
-                    debug_thread("Matchmaker sees no possible trades");
-                }
-                break;
-            }
-            
-            if (buy_order->price < sell_order->price) {
-                if (!trades_made) {
-                    debug_thread("Matchmaker sees no possible trades");
-                }
-                break; // No match
-            }
-            
-            trades_made = 1;
-            
-            // Determine trade price (closest to last trade price within overlap)
-            funds_t trade_price;
-            funds_t min_price = sell_order->price;
-            funds_t max_price = buy_order->price;
-            
-            if (xchg->last_trade_price == 0) {
-                // No previous trade, use midpoint
-                trade_price = (min_price + max_price) / 2;
-            } else if (xchg->last_trade_price >= min_price && xchg->last_trade_price <= max_price) {
-                // Last trade price is within overlap
-                trade_price = xchg->last_trade_price;
-            } else if (xchg->last_trade_price < min_price) {
-                trade_price = min_price;
-            } else {
-                trade_price = max_price;
-            }
-            
-            // Determine trade quantity
-            quantity_t trade_qty = buy_order->quantity;
-            if (sell_order->quantity < trade_qty) {
-                trade_qty = sell_order->quantity;
-            }
-            
-            // Store max price before updating order
-            funds_t buy_max_price = buy_order->price;
-            
-            // Update orders
-            buy_order->quantity -= trade_qty;
-            sell_order->quantity -= trade_qty;
-            
-            // Update last trade price
-            xchg->last_trade_price = trade_price;
-            
-            // Update accounts
-            ACCOUNT *buyer_account = trader_get_account(buy_order->trader);
-            ACCOUNT *seller_account = trader_get_account(sell_order->trader);
-            
-            // Seller gets proceeds
-            account_increase_balance(seller_account, trade_price * trade_qty);
-            
-            // Buyer gets inventory
-            account_increase_inventory(buyer_account, trade_qty);
-            
-            // Buyer refund calculation:
-            // Originally encumbered: original_qty * buy_max_price
-            // Amount actually used: trade_qty * trade_price
-            // Should remain encumbered: buy_order->quantity * buy_max_price (after update)
-            // Refund = original_encumbered - used - remaining_encumbered
-            //        = (buy_order->quantity + trade_qty) * buy_max_price - trade_qty * trade_price - buy_order->quantity * buy_max_price
-            //        = trade_qty * buy_max_price - trade_qty * trade_price
-            //        = trade_qty * (buy_max_price - trade_price)
-            funds_t refund = trade_qty * (buy_max_price - trade_price);
-            if (refund > 0) {
-                account_increase_balance(buyer_account, refund);
-            }
-            
-            // Remove orders with zero quantity
-            if (buy_order->quantity == 0) {
-                remove_order(&xchg->buy_orders, buy_order);
-            }
-            if (sell_order->quantity == 0) {
-                remove_order(&xchg->sell_orders, sell_order);
-            }
-            
-            // Send notifications
-            BRS_PACKET_HEADER hdr;
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            hdr.timestamp_sec = htonl(ts.tv_sec);
-            hdr.timestamp_nsec = htonl(ts.tv_nsec);
-            
-            // BOUGHT notification to buyer
-            if (buy_order->quantity == 0 || trade_qty > 0) {
-                hdr.type = BRS_BOUGHT_PKT;
-                hdr.size = htons(sizeof(BRS_NOTIFY_INFO));
-                BRS_NOTIFY_INFO notify;
-                notify.buyer = htonl(buy_order->id);
-                notify.seller = htonl(sell_order->id);
-                notify.quantity = htonl(trade_qty);
-                notify.price = htonl(trade_price);
-                trader_send_packet(buy_order->trader, &hdr, &notify);
-            }
-            
-            // SOLD notification to seller
-            if (sell_order->quantity == 0 || trade_qty > 0) {
-                hdr.type = BRS_SOLD_PKT;
-                hdr.size = htons(sizeof(BRS_NOTIFY_INFO));
-                BRS_NOTIFY_INFO notify;
-                notify.buyer = htonl(buy_order->id);
-                notify.seller = htonl(sell_order->id);
-                notify.quantity = htonl(trade_qty);
-                notify.price = htonl(trade_price);
-                trader_send_packet(sell_order->trader, &hdr, &notify);
-            }
-            
-            // TRADED broadcast
-            hdr.type = BRS_TRADED_PKT;
-            hdr.size = htons(sizeof(BRS_NOTIFY_INFO));
-            BRS_NOTIFY_INFO notify;
-            notify.buyer = htonl(buy_order->id);
-            notify.seller = htonl(sell_order->id);
-            notify.quantity = htonl(trade_qty);
-            notify.price = htonl(trade_price);
-            trader_broadcast_packet(&hdr, &notify);
-            
-            // Free orders that were removed
-            if (buy_order->quantity == 0) {
-                trader_unref(buy_order->trader, "trade complete");
-                free(buy_order);
-            }
-            if (sell_order->quantity == 0) {
-                trader_unref(sell_order->trader, "trade complete");
-                free(sell_order);
-            }
-        }
+        exchange_lock(xchg);
+        int trades_made = match_book(xchg, &batch);
+        batch_close(xchg, &batch);
+        exchange_unlock(xchg);
         
-        pthread_mutex_unlock(&xchg->mutex);
+        batch_publish(xchg, &batch);
+        match_stats(trades_made);
         debug_thread("Matchmaker for exchange %p sleeping", xchg);
     }
     
@@ -357,79 +789,181 @@ void exchange_get_status(EXCHANGE *xchg, ACCOUNT *account, BRS_STATUS_INFO *info
         return;
     }
     
-    pthread_mutex_lock(&xchg->mutex);
+    // A trade changes the accounts of both sides and the top of the book
+    // inside the write section of the status seqlock, so if no update happens
+    // while the account and the top of the book are read, together they form
+    // a consistent snapshot.  A change that a client makes to its own account
+    // (DEPOSIT, ESCROW and the like) is a single atomic update of the account.
+    unsigned seq;
+    do {
+        seq = seqlock_read_begin(&xchg->status_lock);
+        
+        // Get account status if provided
+        if (account != NULL) {
+            account_get_status_in(account, xchg->instrument, infop);
+        } else {
+            memset(infop, 0, sizeof(BRS_STATUS_INFO));
+        }
+        
+        infop->bid = htonl(__atomic_load_n(&xchg->status_bid, __ATOMIC_RELAXED));
+        infop->ask = htonl(__atomic_load_n(&xchg->status_ask, __ATOMIC_RELAXED));
+        infop->last = htonl(__atomic_load_n(&xchg->status_last, __ATOMIC_RELAXED));
+    } while (seqlock_read_retry(&xchg->status_lock, seq));
+}
+
+/*
+ * Trace the orders queued at one price level (helper for print_order_book)
+ */
+static int print_level(struct price_level *level, void *arg) {
+    (void)arg;
+    for (struct order *order = level->head; order != NULL; order = order->next) {
+        ACCOUNT *account = trader_get_account(order->trader);
+        debug_raw("[id: %u, trader: %p, account: %p, type: %d, quant: %u, price: %u]",
+                  order->id, order->trader, account, order->type, order->quantity, order->price);
+    }
+    return 0;
+}
+
+/*
+ * Trace order book dump (helper function)
+ */
+static void print_order_book(EXCHANGE *xchg) {
+    BOOK_SIDE *bids = &xchg->book.bids;
+    BOOK_SIDE *asks = &xchg->book.asks;
     
-    // Get account status if provided
-    if (account != NULL) {
-        account_get_status(account, infop);
+    debug_raw("Last trade price: %u", xchg->last_trade_price);
+    debug_raw("%s", "");
+    debug_raw("Buy orders:");
+    if (bids->orders == 0) {
+        debug_raw("%s", "");
     } else {
-        memset(infop, 0, sizeof(BRS_STATUS_INFO));
+        book_walk(bids, print_level, NULL);
     }
     
-    // Find best bid and ask
-    struct order *best_buy = find_best_buy(xchg);
-    struct order *best_sell = find_best_sell(xchg);
-    
-    infop->bid = best_buy != NULL ? htonl(best_buy->price) : 0;
-    infop->ask = best_sell != NULL ? htonl(best_sell->price) : 0;
-    infop->last = htonl(xchg->last_trade_price);
+    debug_raw("%s", "");
+    debug_raw("Sell orders:");
+    if (asks->orders == 0) {
+        debug_raw("%s", "");
+    } else {
+        book_walk(asks, print_level, NULL);
+    }
     
-    pthread_mutex_unlock(&xchg->mutex);
+    debug_raw("%s", "");
+    debug_raw("Buy orders: %d, quantity for purchase: %u", bids->orders, bids->quantity);
+    debug_raw("Sell orders: %d, quantity for sale: %u", asks->orders, asks->quantity);
 }
 
 /*
- * Print order book dump (helper function)
+ * Give back the funds or inventory encumbered by an order, or by what
+ * remains of it.
  */
-static void print_order_book(EXCHANGE *xchg) {
-    fprintf(stderr, "Last trade price: %u\n", xchg->last_trade_price);
-    fprintf(stderr, "\nBuy orders:\n");
-    
-    struct order *order = xchg->buy_orders;
-    if (order == NULL) {
-        fprintf(stderr, "\n");
+static void order_refund(EXCHANGE *xchg, ACCOUNT *account, order_type_t type,
+                         quantity_t quantity, funds_t price) {
+    if (type == ORDER_BUY) {
+        account_increase_balance(account, quantity * price);
     } else {
-        while (order != NULL) {
-            ACCOUNT *account = trader_get_account(order->trader);
-            fprintf(stderr, "[id: %u, trader: %p, account: %p, type: %d, quant: %u, price: %u]\n",
-                    order->id, order->trader, account, order->type, order->quantity, order->price);
-            order = order->next;
-        }
+        account_increase_inventory_in(account, xchg->instrument, quantity);
     }
-    
-    fprintf(stderr, "\nSell orders:\n");
-    order = xchg->sell_orders;
+}
+
+/*
+ * Place an order, for which funds or inventory have already been encumbered,
+ * on the book, and add its POSTED notification to a batch.  If the order
+ * cannot be placed, the encumbrance is given back.  Must be called with the
+ * exchange locked.
+ *
+ * @return  The order ID, or 0 if the order could not be placed.
+ */
+static orderid_t order_post(EXCHANGE *xchg, TRADER *trader, ACCOUNT *account, order_type_t type,
+                            quantity_t quantity, funds_t price, struct exchange_batch *batch) {
+    // Create order
+    struct order *order = pool_alloc(xchg->order_pool);
     if (order == NULL) {
-        fprintf(stderr, "\n");
-    } else {
-        while (order != NULL) {
-            ACCOUNT *account = trader_get_account(order->trader);
-            fprintf(stderr, "[id: %u, trader: %p, account: %p, type: %d, quant: %u, price: %u]\n",
-                    order->id, order->trader, account, order->type, order->quantity, order->price);
-            order = order->next;
-        }
+        order_refund(xchg, account, type, quantity, price);
+        return 0;
     }
     
-    // Count orders and quantities
-    int buy_count = 0;
-    quantity_t buy_qty = 0;
-    order = xchg->buy_orders;
-    while (order != NULL) {
-        buy_count++;
-        buy_qty += order->quantity;
-        order = order->next;
+    order->id = xchg->next_order_id++;
+    order->trader = trader_ref(trader, type == ORDER_BUY ? "to place in new order" : "sell order");
+    order->type = type;
+    order->quantity = quantity;
+    order->price = price;
+    order->posted = stats_now();
+    order->owner_list = (struct order **)account_orders_in(account, xchg->instrument);
+    if (book_insert(&xchg->book, order) != 0) {
+        trader_unref(trader, "order not placed");
+        pool_free(xchg->order_pool, order);
+        order_refund(xchg, account, type, quantity, price);
+        return 0;
     }
     
-    int sell_count = 0;
-    quantity_t sell_qty = 0;
-    order = xchg->sell_orders;
-    while (order != NULL) {
-        sell_count++;
-        sell_qty += order->quantity;
-        order = order->next;
+    trader_risk_open(trader, quantity, price);
+    orderid_t order_id = order->id;
+    journal_post(xchg->symbol, account_get_name(account), order_id, type == ORDER_SELL,
+                 quantity, price);
+    
+    // Print exchange posting message and order book
+    debug_thread("Exchange %p posting %s order %u for trader %p, quantity %u, %s price %u",
+                 xchg, type == ORDER_BUY ? "buy" : "sell", order_id, trader, quantity,
+                 type == ORDER_BUY ? "max" : "min", price);
+#ifdef TRACE
+    // Walks the whole book, so only in builds in which it can be traced
+    print_order_book(xchg);
+#endif
+    
+    // Number POSTED before the matchmaker can see the order, so that it
+    // reaches every trader ahead of any TRADED for the order
+    batch_add(xchg, batch, BRS_POSTED_PKT, NULL, type == ORDER_BUY ? order_id : 0,
+              type == ORDER_SELL ? order_id : 0, quantity, price);
+    batch_add_level(xchg, batch, type, price);
+    
+    // The book is otherwise uncrossed, so the order makes a trade possible
+    // only if it crosses the top of the opposite side
+    struct price_level *opposite = type == ORDER_BUY ? xchg->book.asks.best : xchg->book.bids.best;
+    if (opposite != NULL && (type == ORDER_BUY ? price >= opposite->price : price <= opposite->price)) {
+        batch_wake(xchg, batch);
     }
     
-    fprintf(stderr, "\nBuy orders: %d, quantity for purchase: %u\n", buy_count, buy_qty);
-    fprintf(stderr, "Sell orders: %d, quantity for sale: %u\n", sell_count, sell_qty);
+    return order_id;
+}
+
+/*
+ * Check whether a trader may cancel an order.  Orders restored from the
+ * journal belong to no logged-in trader, and may be canceled by any trader
+ * for the account.
+ */
+static int order_owned(struct order *order, TRADER *trader) {
+    return order->trader == trader
+           || (trader_is_detached(order->trader)
+               && trader_get_account(order->trader) == trader_get_account(trader));
+}
+
+/*
+ * Cancel an order on the book, giving back what it encumbers, and add its
+ * CANCELED notification to a batch.  Must be called with the exchange locked.
+ *
+ * @return  The quantity canceled.
+ */
+static quantity_t order_cancel(EXCHANGE *xchg, struct order *order, struct exchange_batch *batch) {
+    quantity_t quantity = order->quantity;
+    orderid_t id = order->id;
+    order_type_t type = order->type;
+    funds_t price = order->price;
+    book_remove(&xchg->book, order);
+    trader_risk_close(order->trader, quantity, price, 1);
+    journal_cancel(xchg->symbol, id);
+    
+    // Refund encumbered funds or inventory
+    order_refund(xchg, trader_get_account(order->trader), type, quantity, price);
+    
+    trader_unref(order->trader, "cancel");
+    pool_free(xchg->order_pool, order);
+    
+    // Notify all traders once unlocked, in order with the other events on the book
+    batch_add(xchg, batch, BRS_CANCELED_PKT, NULL,
+              type == ORDER_BUY ? id : 0, type == ORDER_SELL ? id : 0, quantity, 0);
+    batch_add_level(xchg, batch, type, price);
+    return quantity;
 }
 
 /*
@@ -445,42 +979,31 @@ orderid_t exchange_post_buy(EXCHANGE *xchg, TRADER *trader, quantity_t quantity,
         return 0;
     }
     
+    // The cost of the order, and the proceeds of a sale, must fit in funds_t
+    if ((uint64_t)quantity * price > UINT32_MAX) {
+        return 0;
+    }
+    
     // Check if trader has enough funds
     funds_t max_cost = quantity * price;
     if (account_decrease_balance(account, max_cost) != 0) {
         return 0; // Insufficient funds
     }
     
-    pthread_mutex_lock(&xchg->mutex);
+    struct exchange_event events[EXCHANGE_BATCH_MAX];
+    struct exchange_batch batch;
+    batch_init(&batch, events, EXCHANGE_BATCH_MAX);
     
-    // Create order
-    struct order *order = malloc(sizeof(struct order));
-    if (order == NULL) {
-        // Refund the funds
-        account_increase_balance(account, max_cost);
-        pthread_mutex_unlock(&xchg->mutex);
-        return 0;
-    }
+    exchange_lock(xchg);
+    orderid_t order_id = order_post(xchg, trader, account, ORDER_BUY, quantity, price, &batch);
+    int trades_made = batch_match(xchg, &batch);
+    batch_close(xchg, &batch);
+    exchange_unlock(xchg);
     
-    order->id = xchg->next_order_id++;
-    order->trader = trader_ref(trader, "to place in new order");
-    order->type = ORDER_BUY;
-    order->quantity = quantity;
-    order->price = price;
-    order->next = xchg->buy_orders;
-    xchg->buy_orders = order;
-    
-    orderid_t order_id = order->id;
-    
-    // Print exchange posting message and order book
-    debug_thread("Exchange %p posting buy order %u for trader %p, quantity %u, max price %u",
-                 xchg, order_id, trader, quantity, price);
-    print_order_book(xchg);
-    
-    pthread_mutex_unlock(&xchg->mutex);
-    
-    // Wake matchmaker
-    sem_post(&xchg->matchmaker_sem);
+    batch_finish(xchg, &batch);
+    if (trades_made >= 0) {
+        match_stats(trades_made);
+    }
     
     return order_id;
 }
@@ -498,36 +1021,29 @@ orderid_t exchange_post_sell(EXCHANGE *xchg, TRADER *trader, quantity_t quantity
         return 0;
     }
     
-    // Check if trader has enough inventory
-    if (account_decrease_inventory(account, quantity) != 0) {
-        return 0; // Insufficient inventory
-    }
-    
-    pthread_mutex_lock(&xchg->mutex);
-    
-    // Create order
-    struct order *order = malloc(sizeof(struct order));
-    if (order == NULL) {
-        // Refund the inventory
-        account_increase_inventory(account, quantity);
-        pthread_mutex_unlock(&xchg->mutex);
+    if ((uint64_t)quantity * price > UINT32_MAX) {
         return 0;
     }
     
-    order->id = xchg->next_order_id++;
-    order->trader = trader_ref(trader, "sell order");
-    order->type = ORDER_SELL;
-    order->quantity = quantity;
-    order->price = price;
-    order->next = xchg->sell_orders;
-    xchg->sell_orders = order;
+    // Check if trader has enough inventory
+    if (account_decrease_inventory_in(account, xchg->instrument, quantity) != 0) {
+        return 0; // Insufficient inventory
+    }
     
-    orderid_t order_id = order->id;
+    struct exchange_event events[EXCHANGE_BATCH_MAX];
+    struct exchange_batch batch;
+    batch_init(&batch, events, EXCHANGE_BATCH_MAX);
     
-    pthread_mutex_unlock(&xchg->mutex);
+    exchange_lock(xchg);
+    orderid_t order_id = order_post(xchg, trader, account, ORDER_SELL, quantity, price, &batch);
+    int trades_made = batch_match(xchg, &batch);
+    batch_close(xchg, &batch);
+    exchange_unlock(xchg);
     
-    // Wake matchmaker
-    sem_post(&xchg->matchmaker_sem);
+    batch_finish(xchg, &batch);
+    if (trades_made >= 0) {
+        match_stats(trades_made);
+    }
     
     return order_id;
 }
@@ -540,99 +1056,364 @@ int exchange_cancel(EXCHANGE *xchg, TRADER *trader, orderid_t order, quantity_t
         return -1;
     }
     
-    pthread_mutex_lock(&xchg->mutex);
+    struct exchange_event events[EXCHANGE_ORDER_EVENTS];
+    struct exchange_batch batch;
+    batch_init(&batch, events, EXCHANGE_ORDER_EVENTS);
+    
+    exchange_lock(xchg);
+    
+    struct order *found = book_find(&xchg->book, order);
+    if (found == NULL || !order_owned(found, trader)) {
+        exchange_unlock(xchg);
+        return -1; // Order not found, or not the trader's
+    }
+    *quantity = order_cancel(xchg, found, &batch);
+    batch_close(xchg, &batch);
+    
+    exchange_unlock(xchg);
+    
+    batch_publish(xchg, &batch);
     
-    // Search for order in buy orders
-    struct order **list = &xchg->buy_orders;
-    struct order *found = NULL;
+    return 0;
+}
+
+/*
+ * Post and cancel a batch of orders for a trader under a single acquisition
+ * of the exchange's lock.
+ */
+int exchange_bulk(EXCHANGE *xchg, TRADER *trader, EXCHANGE_BULK_ITEM *items, int count) {
+    if (xchg == NULL || trader == NULL || items == NULL || count < 0 || count > BRS_BULK_MAX) {
+        return -1;
+    }
     
-    for (struct order **p = list; *p != NULL; p = &(*p)->next) {
-        if ((*p)->id == order) {
-            // Verify trader matches
-            if ((*p)->trader != trader) {
-                pthread_mutex_unlock(&xchg->mutex);
-                return -1;
+    ACCOUNT *account = trader_get_account(trader);
+    if (account == NULL) {
+        return -1;
+    }
+    
+    struct exchange_event events[EXCHANGE_ORDER_EVENTS * BRS_BULK_MAX];
+    struct exchange_batch batch;
+    batch_init(&batch, events, EXCHANGE_ORDER_EVENTS * BRS_BULK_MAX);
+    int done = 0;
+    
+    exchange_lock(xchg);
+    
+    for (int i = 0; i < count; i++) {
+        EXCHANGE_BULK_ITEM *item = &items[i];
+        item->result = BRS_BULK_INVALID;
+        if (item->type == BRS_CANCEL_PKT) {
+            struct order *found = book_find(&xchg->book, item->order);
+            if (found == NULL || !order_owned(found, trader)) {
+                item->result = BRS_BULK_NO_ORDER;
+                continue;
             }
-            
-            found = *p;
-            *quantity = found->quantity;
-            
-            // Remove from list
-            *p = (*p)->next;
-            
-            // Refund encumbered funds
-            ACCOUNT *account = trader_get_account(trader);
-            account_increase_balance(account, found->quantity * found->price);
-            
-            trader_unref(found->trader, "cancel");
-            free(found);
-            
-            pthread_mutex_unlock(&xchg->mutex);
-            
-            // Broadcast CANCELED notification
-            BRS_PACKET_HEADER hdr;
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            hdr.timestamp_sec = htonl(ts.tv_sec);
-            hdr.timestamp_nsec = htonl(ts.tv_nsec);
-            hdr.type = BRS_CANCELED_PKT;
-            hdr.size = htons(sizeof(BRS_NOTIFY_INFO));
-            BRS_NOTIFY_INFO notify;
-            notify.buyer = htonl(order);
-            notify.seller = 0;
-            notify.quantity = htonl(*quantity);
-            notify.price = 0;
-            trader_broadcast_packet(&hdr, &notify);
-            
-            return 0;
+            item->quantity = order_cancel(xchg, found, &batch);
+        } else if (item->type == BRS_BUY_PKT || item->type == BRS_SELL_PKT) {
+            if (item->quantity == 0 || item->price == 0
+                || (uint64_t)item->quantity * item->price > UINT32_MAX) {
+                continue;
+            }
+            // The accounts are locked after the exchange, as by the matchmaker
+            order_type_t type = item->type == BRS_BUY_PKT ? ORDER_BUY : ORDER_SELL;
+            if ((type == ORDER_BUY
+                 ? account_decrease_balance(account, item->quantity * item->price)
+                 : account_decrease_inventory_in(account, xchg->instrument, item->quantity)) != 0) {
+                item->result = BRS_BULK_INSUFFICIENT;
+                continue;
+            }
+            item->order = order_post(xchg, trader, account, type, item->quantity, item->price, &batch);
+            if (item->order == 0) {
+                item->result = BRS_BULK_FAILED;
+                continue;
+            }
+        } else {
+            continue;
         }
+        item->result = BRS_BULK_OK;
+        done++;
     }
+    batch_close(xchg, &batch);
     
-    // Search in sell orders
-    list = &xchg->sell_orders;
-    for (struct order **p = list; *p != NULL; p = &(*p)->next) {
-        if ((*p)->id == order) {
-            // Verify trader matches
-            if ((*p)->trader != trader) {
-                pthread_mutex_unlock(&xchg->mutex);
-                return -1;
-            }
-            
-            found = *p;
-            *quantity = found->quantity;
-            
-            // Remove from list
-            *p = (*p)->next;
-            
-            // Refund encumbered inventory
-            ACCOUNT *account = trader_get_account(trader);
-            account_increase_inventory(account, found->quantity);
-            
-            trader_unref(found->trader, "cancel");
-            free(found);
-            
-            pthread_mutex_unlock(&xchg->mutex);
-            
-            // Broadcast CANCELED notification
-            BRS_PACKET_HEADER hdr;
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            hdr.timestamp_sec = htonl(ts.tv_sec);
-            hdr.timestamp_nsec = htonl(ts.tv_nsec);
-            hdr.type = BRS_CANCELED_PKT;
-            hdr.size = htons(sizeof(BRS_NOTIFY_INFO));
-            BRS_NOTIFY_INFO notify;
-            notify.buyer = 0;
-            notify.seller = htonl(order);
-            notify.quantity = htonl(*quantity);
-            notify.price = 0;
-            trader_broadcast_packet(&hdr, &notify);
-            
-            return 0;
+    exchange_unlock(xchg);
+    
+    // Wakes the matchmaker at most once for the whole batch
+    batch_finish(xchg, &batch);
+    debug_thread("Exchange %p carried out %d of %d bulk items for trader %p", xchg, done, count, trader);
+    
+    return done;
+}
+
+/*
+ * Cancel all the pending orders of a trader.
+ */
+int exchange_cancel_all(EXCHANGE *xchg, TRADER *trader, quantity_t *quantity) {
+    if (xchg == NULL || trader == NULL || quantity == NULL) {
+        return -1;
+    }
+    
+    struct order **list = (struct order **)account_orders_in(trader_get_account(trader),
+                                                             xchg->instrument);
+    struct exchange_event *events = NULL;
+    struct exchange_batch batch;
+    int count;
+    
+    // The batch is allocated before the exchange is locked, with room for
+    // all the trader's pending orders; orders of the account restored from
+    // the journal are not among them, so if there are more, try again
+    int size = trader_risk_orders(trader);
+    while (1) {
+        if (size > 0
+            && (events = malloc(EXCHANGE_ORDER_EVENTS * size * sizeof(struct exchange_event))) == NULL) {
+            return -1;
+        }
+        
+        exchange_lock(xchg);
+        
+        count = 0;
+        for (struct order *order = list != NULL ? *list : NULL; order != NULL; order = order->owner_next) {
+            count += order_owned(order, trader);
+        }
+        if (count <= size) {
+            break;
+        }
+        
+        exchange_unlock(xchg);
+        
+        free(events);
+        events = NULL;
+        size = count;
+    }
+    batch_init(&batch, events, EXCHANGE_ORDER_EVENTS * size);
+    
+    *quantity = 0;
+    struct order *next;
+    for (struct order *order = list != NULL ? *list : NULL; order != NULL; order = next) {
+        next = order->owner_next;
+        if (order_owned(order, trader)) {
+            *quantity += order_cancel(xchg, order, &batch);
         }
     }
+    batch_close(xchg, &batch);
     
+    exchange_unlock(xchg);
+    
+    batch_publish(xchg, &batch);
+    debug_thread("Exchange %p canceled %d orders for trader %p", xchg, count, trader);
+    
+    free(events);
+    return count;
+}
+
+/*
+ * Copy the levels of one side of the book (helper for exchange_get_depth)
+ */
+struct depth_state {
+    BRS_DEPTH_LEVEL *levels;
+    int count;
+    int max;
+};
+
+static int depth_level(struct price_level *level, void *arg) {
+    struct depth_state *state = arg;
+    if (state->count == state->max) {
+        return 1;
+    }
+    BRS_DEPTH_LEVEL *out = &state->levels[state->count++];
+    out->price = htonl(level->price);
+    out->quantity = htonl(level->quantity);
+    out->orders = htonl(level->count);
+    return 0;
+}
+
+/*
+ * Get the aggregated price levels nearest the top of each side of the book.
+ */
+int exchange_get_depth(EXCHANGE *xchg, int levels, BRS_DEPTH_INFO *infop, BRS_DEPTH_LEVEL *buf) {
+    if (xchg == NULL || infop == NULL || buf == NULL || levels < 0) {
+        return -1;
+    }
+    
+    // Only reads the book, so the status of the exchange is not disturbed
+    pthread_mutex_lock(&xchg->mutex);
+    struct depth_state state = { buf, 0, levels };
+    book_walk(&xchg->book.bids, depth_level, &state);
+    int bids = state.count;
+    state.max += bids;
+    book_walk(&xchg->book.asks, depth_level, &state);
+    infop->seq = htonl(xchg->depth_seq);
     pthread_mutex_unlock(&xchg->mutex);
-    return -1; // Order not found
+    
+    infop->bids = htons(bids);
+    infop->asks = htons(state.count - bids);
+    return state.count;
+}
+
+/*
+ * Get the packets of the tape kept for replay, numbered from a given one on.
+ */
+int exchange_replay(EXCHANGE *xchg, uint32_t from, int max, BRS_REPLAY_INFO *infop,
+                    BRS_REPLAY_EVENT *buf) {
+    if (xchg == NULL || infop == NULL || buf == NULL || max < 0) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&xchg->mutex);
+    uint32_t last = xchg->tape_seq;
+    uint32_t oldest = last > BRS_REPLAY_KEPT ? last - BRS_REPLAY_KEPT + 1 : 1;
+    uint32_t first = from < oldest ? oldest : from;
+    int count = 0;
+    for (uint32_t seq = first; seq <= last && count < max; seq++) {
+        buf[count++] = xchg->tape[seq & (BRS_REPLAY_KEPT - 1)];
+    }
+    pthread_mutex_unlock(&xchg->mutex);
+    
+    infop->first = htonl(first);
+    infop->last = htonl(last);
+    return count;
+}
+
+/*
+ * Restore a pending order recorded in the journal.
+ */
+int exchange_restore_order(EXCHANGE *xchg, TRADER *trader, orderid_t id, int sell,
+                           quantity_t quantity, funds_t price) {
+    if (xchg == NULL || trader == NULL || id == 0 || quantity == 0 || price == 0) {
+        return -1;
+    }
+    
+    exchange_lock(xchg);
+    
+    struct order *order;
+    if (book_find(&xchg->book, id) != NULL || (order = pool_alloc(xchg->order_pool)) == NULL) {
+        exchange_unlock(xchg);
+        return -1;
+    }
+    order->id = id;
+    order->trader = trader_ref(trader, "restored order");
+    order->type = sell ? ORDER_SELL : ORDER_BUY;
+    order->quantity = quantity;
+    order->price = price;
+    order->posted = stats_now();
+    order->owner_list = (struct order **)account_orders_in(trader_get_account(trader), xchg->instrument);
+    if (book_insert(&xchg->book, order) != 0) {
+        trader_unref(trader, "order not restored");
+        pool_free(xchg->order_pool, order);
+        exchange_unlock(xchg);
+        return -1;
+    }
+    trader_risk_open(trader, quantity, price);
+    if (id >= xchg->next_order_id) {
+        xchg->next_order_id = id + 1;
+    }
+    
+    // Encumber funds or inventory as posting did, without checking: the
+    // records that made them available may be later in the journal
+    ACCOUNT *account = trader_get_account(trader);
+    if (sell) {
+        account_adjust(account, xchg->instrument, 0, -(int64_t)quantity);
+    } else {
+        account_adjust(account, xchg->instrument, -(int64_t)(funds_t)(quantity * price), 0);
+    }
+    
+    exchange_unlock(xchg);
+    return 0;
 }
 
+/*
+ * Restore the cancellation of an order recorded in the journal.
+ */
+int exchange_restore_cancel(EXCHANGE *xchg, orderid_t id) {
+    if (xchg == NULL) {
+        return -1;
+    }
+    
+    exchange_lock(xchg);
+    
+    struct order *order = book_find(&xchg->book, id);
+    if (order == NULL) {
+        exchange_unlock(xchg);
+        return -1;
+    }
+    book_remove(&xchg->book, order);
+    trader_risk_close(order->trader, order->quantity, order->price, 1);
+    
+    ACCOUNT *account = trader_get_account(order->trader);
+    if (order->type == ORDER_BUY) {
+        account_increase_balance(account, order->quantity * order->price);
+    } else {
+        account_increase_inventory_in(account, xchg->instrument, order->quantity);
+    }
+    
+    trader_unref(order->trader, "restored cancel");
+    pool_free(xchg->order_pool, order);
+    
+    exchange_unlock(xchg);
+    return 0;
+}
+
+/*
+ * Restore a trade recorded in the journal.
+ */
+int exchange_restore_trade(EXCHANGE *xchg, orderid_t buy, orderid_t sell,
+                           quantity_t quantity, funds_t price) {
+    if (xchg == NULL) {
+        return -1;
+    }
+    
+    exchange_lock(xchg);
+    
+    struct order *buy_order = book_find(&xchg->book, buy);
+    struct order *sell_order = book_find(&xchg->book, sell);
+    if (buy_order == NULL || sell_order == NULL
+        || buy_order->type != ORDER_BUY || sell_order->type != ORDER_SELL
+        || buy_order->quantity < quantity || sell_order->quantity < quantity) {
+        exchange_unlock(xchg);
+        return -1;
+    }
+    
+    exchange_execute(xchg, buy_order, sell_order, quantity, price);
+    
+    if (buy_order->quantity == 0) {
+        trader_unref(buy_order->trader, "restored trade");
+        pool_free(xchg->order_pool, buy_order);
+    }
+    if (sell_order->quantity == 0) {
+        trader_unref(sell_order->trader, "restored trade");
+        pool_free(xchg->order_pool, sell_order);
+    }
+    
+    exchange_unlock(xchg);
+    return 0;
+}
+
+/*
+ * Restore the next order ID and the last trade price of an exchange.
+ */
+void exchange_restore_state(EXCHANGE *xchg, orderid_t next_order_id, funds_t last_trade_price) {
+    if (xchg == NULL) {
+        return;
+    }
+    
+    exchange_lock(xchg);
+    if (next_order_id > xchg->next_order_id) {
+        xchg->next_order_id = next_order_id;
+    }
+    xchg->last_trade_price = last_trade_price;
+    exchange_unlock(xchg);
+}
+
+/*
+ * Let the matchmaker look for trades among restored orders.
+ */
+void exchange_restore_done(EXCHANGE *xchg) {
+    if (xchg == NULL) {
+        return;
+    }
+    
+    struct exchange_batch batch;
+    batch_init(&batch, NULL, 0);
+    exchange_lock(xchg);
+    batch_wake(xchg, &batch);
+    exchange_unlock(xchg);
+    batch_finish(xchg, &batch);
+}
@@ -0,0 +1,680 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "fanout.h"
+#include "affinity.h"
+#include "exchange_ext.h"
+#include "instrument.h"
+#include "stats.h"
+#include "trace.h"
+#include "debug.h"
+
+/*
+ * Maximum number of events taken off the queue before the outbound rings
+ * of the traders are flushed.
+ */
+#define FANOUT_BATCH 64
+
+/*
+ * Longest time, in milliseconds, for which the fan-out thread waits while
+ * some trader's socket is full, before checking whether the trader has
+ * logged out (which closes its socket without waking the thread).
+ */
+#define FANOUT_BLOCKED_WAIT 100
+
+/*
+ * An event waiting to be fanned out.
+ */
+struct fanout_event {
+    TRADER *target;                // Recipient of a private packet, or NULL for all
+    BRS_FEED_LEVEL feed;           // Subscribers to whom a broadcast goes
+    BRS_PACKET_HEADER hdr;
+    uint8_t payload[OUTBOUND_MAX_PAYLOAD];
+};
+
+/*
+ * Slot of the event queue.  This is a bounded multi-producer queue in
+ * which each slot carries a sequence number that tells producers and the
+ * consumer whether the slot is free or full for the current lap.
+ */
+struct fanout_slot {
+    size_t seq;
+    struct fanout_event event;
+};
+
+/*
+ * A trader whose outbound ring has data still to be sent.
+ */
+struct fanout_active {
+    TRADER *trader;                // Holds a reference
+    int blocked;                   // Waiting for the socket to become writable
+};
+
+static struct fanout_slot *queue = NULL;
+static size_t queue_mask;
+static size_t enqueue_pos;         // Shared by producers
+static size_t dequeue_pos;         // Used only by the fan-out thread
+
+static int initialized = 0;
+static int running = 0;
+static int sleeping = 0;           // Fan-out thread is about to wait, or waiting
+static int wake_fd = -1;           // eventfd used to wake the fan-out thread
+static pthread_t fanout_thread;
+
+// Traders with data still to be flushed (used only by the fan-out thread)
+static struct fanout_active *active = NULL;
+static int active_count = 0;
+static int active_size = 0;
+static struct pollfd *pollfds = NULL;
+
+// Recipients of the broadcasts being delivered, at each subscription level,
+// taken once for each run of events taken off the queue, or -1 if not taken
+// (used only by the fan-out thread)
+static TRADER **snapshot[BRS_FEED_LEVELS];
+static int snapshot_size[BRS_FEED_LEVELS];
+static int snapshot_count[BRS_FEED_LEVELS] = { [0 ... BRS_FEED_LEVELS - 1] = -1 };
+
+static unsigned long queue_stalls = 0;
+
+/*
+ * Latest top of the book of each instrument, for conflated subscribers
+ * (used only by the fan-out thread).  Each change is given the next version,
+ * so that a subscriber need only remember the version it was last sent.
+ */
+struct fanout_quote {
+    uint64_t version;              // 0 until the instrument is first quoted
+    BRS_QUOTE_INFO info;
+};
+
+static struct fanout_quote quotes[MAX_INSTRUMENTS];
+static uint64_t quote_version = 0;
+static uint64_t quote_tick = 0;    // Time of the next tick (ns)
+
+// Conflated subscribers (used only by the fan-out thread)
+static TRADER **subscribers = NULL;
+static int subscribers_size = 0;
+
+/*
+ * Try to put an event on the queue.  Returns -1 if the queue is full.
+ */
+static int queue_push(struct fanout_event *event) {
+    size_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        struct fanout_slot *slot = &queue[pos & queue_mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                slot->event = *event;
+                __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Take the next event off the queue.  Returns -1 if the queue is empty.
+ */
+static int queue_pop(struct fanout_event *event) {
+    struct fanout_slot *slot = &queue[dequeue_pos & queue_mask];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if ((intptr_t)seq - (intptr_t)(dequeue_pos + 1) < 0) {
+        return -1;
+    }
+    *event = slot->event;
+    __atomic_store_n(&slot->seq, dequeue_pos + queue_mask + 1, __ATOMIC_RELEASE);
+    dequeue_pos++;
+    return 0;
+}
+
+static int queue_empty(void) {
+    struct fanout_slot *slot = &queue[dequeue_pos & queue_mask];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    return (intptr_t)seq - (intptr_t)(dequeue_pos + 1) < 0;
+}
+
+static void fanout_wake(void) {
+    uint64_t one = 1;
+    ssize_t n = write(wake_fd, &one, sizeof(one));
+    (void)n;
+}
+
+/*
+ * Put an event on the queue, waiting for room if necessary.
+ */
+static void fanout_enqueue(struct fanout_event *event) {
+    while (queue_push(event) != 0) {
+        // The fan-out thread has fallen behind; let it catch up
+        __atomic_fetch_add(&queue_stalls, 1, __ATOMIC_RELAXED);
+        stats_count(STATS_FANOUT_STALLS, 1);
+        fanout_wake();
+        sched_yield();
+    }
+}
+
+/*
+ * Wake the fan-out thread if it is asleep, after events have been queued.
+ */
+static void fanout_notify(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sleeping, __ATOMIC_RELAXED)) {
+        fanout_wake();
+    }
+}
+
+/*
+ * Put an event on the queue, waiting for room if necessary, and wake
+ * the fan-out thread if it is asleep.
+ */
+static void fanout_push(struct fanout_event *event) {
+    fanout_enqueue(event);
+    fanout_notify();
+}
+
+/*
+ * Add a trader to the set of traders to be flushed.
+ */
+static void active_add(TRADER *trader) {
+    if (active_count == active_size) {
+        int size = active_size == 0 ? 64 : active_size * 2;
+        struct fanout_active *a = realloc(active, sizeof(struct fanout_active) * size);
+        struct pollfd *p = realloc(pollfds, sizeof(struct pollfd) * (size + 1));
+        if (a != NULL) {
+            active = a;
+        }
+        if (p != NULL) {
+            pollfds = p;
+        }
+        if (a == NULL || p == NULL) {
+            error("Failed to grow fan-out flush set");
+            return;
+        }
+        active_size = size;
+    }
+    active[active_count].trader = trader_ref(trader, "fan-out flush");
+    active[active_count].blocked = 0;
+    active_count++;
+}
+
+/*
+ * Copy an event onto the outbound rings of its recipients.
+ */
+static void fanout_deliver(struct fanout_event *event) {
+    if (event->target != NULL) {
+        if (trader_enqueue_packet(event->target, &event->hdr, event->payload, 1) == 1) {
+            active_add(event->target);
+        }
+        trader_unref(event->target, "fan-out");
+        return;
+    }
+
+    uint64_t start = stats_now();
+    BRS_FEED_LEVEL feed = event->feed;
+    if (snapshot_count[feed] < 0) {
+        snapshot_count[feed] = trader_snapshot_feed(&snapshot[feed], &snapshot_size[feed], feed);
+    }
+    for (int i = 0; i < snapshot_count[feed]; i++) {
+        if (trader_enqueue_packet(snapshot[feed][i], &event->hdr, event->payload, 0) == 1) {
+            active_add(snapshot[feed][i]);
+        }
+    }
+    stats_record(STATS_FANOUT, stats_now() - start);
+}
+
+/*
+ * Release the recipients of the broadcasts delivered, if taken.
+ */
+static void snapshot_release(void) {
+    for (int feed = 0; feed < BRS_FEED_LEVELS; feed++) {
+        for (int i = 0; i < snapshot_count[feed]; i++) {
+            trader_unref(snapshot[feed][i], "snapshot");
+        }
+        snapshot_count[feed] = -1;
+    }
+}
+
+/*
+ * Take the latest top of the book of every instrument, giving a new version
+ * to each one that has changed.
+ */
+static void quotes_refresh(void) {
+    int count = instrument_count();
+    for (int i = 0; i < count; i++) {
+        EXCHANGE *xchg = instrument_exchange(i);
+        if (xchg == NULL) {
+            continue;
+        }
+        BRS_STATUS_INFO status;
+        exchange_get_status(xchg, NULL, &status);
+        struct fanout_quote *quote = &quotes[i];
+        if (quote->version == 0 || quote->info.bid != status.bid
+            || quote->info.ask != status.ask || quote->info.last != status.last) {
+            quote->info.bid = status.bid;
+            quote->info.ask = status.ask;
+            quote->info.last = status.last;
+            quote->version = ++quote_version;
+        }
+    }
+}
+
+/*
+ * Queue a QUOTE packet for an instrument on a trader's outbound ring.
+ */
+static void quote_enqueue(TRADER *trader, int instrument) {
+    struct {
+        BRS_ENVELOPE_INFO envelope;
+        BRS_QUOTE_INFO info;
+    } payload;
+    BRS_PACKET_HEADER hdr;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.timestamp_sec = htonl(ts.tv_sec);
+    hdr.timestamp_nsec = htonl(ts.tv_nsec);
+    payload.info = quotes[instrument].info;
+    void *data = &payload.info;
+    if (instrument == 0) {
+        hdr.type = BRS_QUOTE_PKT;
+        hdr.size = htons(sizeof(BRS_QUOTE_INFO));
+    } else {
+        hdr.type = BRS_ENVELOPE_PKT;
+        hdr.size = htons(sizeof(BRS_ENVELOPE_INFO) + sizeof(BRS_QUOTE_INFO));
+        memcpy(payload.envelope.symbol, exchange_get_symbol(instrument_exchange(instrument)),
+               BRS_SYMBOL_SIZE);
+        payload.envelope.type = BRS_QUOTE_PKT;
+        memset(payload.envelope.reserved, 0, sizeof(payload.envelope.reserved));
+        data = &payload;
+    }
+    if (trader_enqueue_packet(trader, &hdr, data, 0) == 1) {
+        active_add(trader);
+    }
+}
+
+/*
+ * Send the conflated subscribers that are due for it a QUOTE for each
+ * instrument that has changed since they were last sent one.  This is done
+ * at most once per BRS_QUOTE_MIN_INTERVAL, however busy the market, and
+ * costs nothing while there are no conflated subscribers.
+ */
+static void fanout_quotes(uint64_t now) {
+    if (traders_feed_count(BRS_FEED_TOP) == 0 || now < quote_tick) {
+        return;
+    }
+    quote_tick = now + BRS_QUOTE_MIN_INTERVAL * 1000000ull;
+    quotes_refresh();
+    
+    int instruments = instrument_count();
+    int count = trader_snapshot_feed(&subscribers, &subscribers_size, BRS_FEED_TOP);
+    for (int i = 0; i < count; i++) {
+        TRADER_FEED *feed = trader_get_feed(subscribers[i]);
+        uint64_t seen = __atomic_load_n(&feed->seen, __ATOMIC_RELAXED);
+        if (now >= __atomic_load_n(&feed->due, __ATOMIC_RELAXED) && seen < quote_version) {
+            for (int j = 0; j < instruments; j++) {
+                if (quotes[j].version > seen) {
+                    quote_enqueue(subscribers[i], j);
+                }
+            }
+            __atomic_store_n(&feed->seen, quote_version, __ATOMIC_RELAXED);
+            __atomic_store_n(&feed->due, now + __atomic_load_n(&feed->interval, __ATOMIC_RELAXED),
+                             __ATOMIC_RELAXED);
+        }
+        trader_unref(subscribers[i], "snapshot");
+    }
+}
+
+/*
+ * Flush the traders that are not waiting for their sockets to become writable.
+ * Returns nonzero if some trader could not be flushed because another thread
+ * was sending to it.
+ */
+static int fanout_flush_active(void) {
+    int busy = 0;
+    int i = 0;
+    while (i < active_count) {
+        // A trader that is going away is flushed at once, which discards
+        // what is queued and shuts down the connection if it is still open,
+        // rather than waiting for a socket that may never become writable
+        if (active[i].blocked && !trader_is_closing(active[i].trader)) {
+            i++;
+            continue;
+        }
+        trader_flush_t result = trader_flush_packets(active[i].trader);
+        if (result == TRADER_FLUSH_DONE || result == TRADER_FLUSH_CLOSED) {
+            trader_unref(active[i].trader, "fan-out flush");
+            active[i] = active[--active_count];
+            continue;
+        }
+        if (result == TRADER_FLUSH_BLOCKED) {
+            active[i].blocked = 1;
+        } else {
+            busy = 1;
+        }
+        i++;
+    }
+    return busy;
+}
+
+/*
+ * Wait for new events, or for blocked sockets to become writable.
+ */
+static void fanout_wait(int busy) {
+    __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+    if (!queue_empty() || !__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct pollfd wake = { .fd = wake_fd, .events = POLLIN };
+    struct pollfd *fds = pollfds != NULL ? pollfds : &wake;
+    fds[0] = wake;
+    int blocked = 0;
+    for (int i = 0; i < active_count; i++) {
+        fds[i + 1].fd = active[i].blocked ? trader_get_fd(active[i].trader) : -1;
+        fds[i + 1].events = POLLOUT;
+        fds[i + 1].revents = 0;
+        blocked |= active[i].blocked;
+    }
+
+    // Wake for the next tick of the conflated feed, if anyone subscribes to
+    // it, and now and then to find blocked traders that have logged out
+    int timeout = busy ? 1 : blocked ? FANOUT_BLOCKED_WAIT : -1;
+    if (traders_feed_count(BRS_FEED_TOP) > 0) {
+        uint64_t now = stats_now();
+        int tick = now >= quote_tick ? 0 : (int)((quote_tick - now + 999999) / 1000000);
+        if (timeout < 0 || tick < timeout) {
+            timeout = tick;
+        }
+    }
+    
+    int n = poll(fds, active_count + 1, timeout);
+    __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+    if (n <= 0) {
+        return;
+    }
+
+    if (fds[0].revents & POLLIN) {
+        uint64_t value;
+        ssize_t r = read(wake_fd, &value, sizeof(value));
+        (void)r;
+    }
+    for (int i = 0; i < active_count; i++) {
+        if (fds[i + 1].revents != 0) {
+            active[i].blocked = 0;
+        }
+    }
+}
+
+/*
+ * Fan-out thread function
+ */
+static void *fanout_thread_func(void *arg) {
+    (void)arg;
+    struct fanout_event event;
+    affinity_thread_start(AFFINITY_FANOUT, -1, "fanout");
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        int delivered = 0;
+        if (!queue_empty()) {
+            stats_record(STATS_FANOUT_DEPTH,
+                         __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED) - dequeue_pos);
+        }
+        // The recipients of broadcasts are found once for the whole run,
+        // so a burst of trades costs one snapshot rather than one apiece
+        while (delivered < FANOUT_BATCH && queue_pop(&event) == 0) {
+            fanout_deliver(&event);
+            delivered++;
+        }
+        snapshot_release();
+        fanout_quotes(stats_now());
+        int busy = fanout_flush_active();
+        if (delivered < FANOUT_BATCH) {
+            fanout_wait(busy);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Initialize the fan-out stage and start the fan-out thread.
+ */
+int fanout_init(int capacity, outbound_policy_t policy) {
+    traders_set_outbound(capacity, policy);
+
+    queue = malloc(sizeof(struct fanout_slot) * FANOUT_QUEUE_SIZE);
+    if (queue == NULL) {
+        return -1;
+    }
+    queue_mask = FANOUT_QUEUE_SIZE - 1;
+    for (size_t i = 0; i < FANOUT_QUEUE_SIZE; i++) {
+        queue[i].seq = i;
+    }
+    enqueue_pos = dequeue_pos = 0;
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        free(queue);
+        queue = NULL;
+        return -1;
+    }
+
+    running = 1;
+    if (pthread_create(&fanout_thread, NULL, fanout_thread_func, NULL) != 0) {
+        close(wake_fd);
+        wake_fd = -1;
+        free(queue);
+        queue = NULL;
+        return -1;
+    }
+    initialized = 1;
+
+    debug_thread("Fan-out thread started (ring capacity %d, policy %d)", capacity, policy);
+    return 0;
+}
+
+/*
+ * Stop the fan-out thread and finalize the fan-out stage.
+ */
+void fanout_fini(void) {
+    if (!initialized) {
+        return;
+    }
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    fanout_wake();
+    pthread_join(fanout_thread, NULL);
+    initialized = 0;
+
+    // Release references held by undelivered events and the flush set
+    struct fanout_event event;
+    while (queue_pop(&event) == 0) {
+        if (event.target != NULL) {
+            trader_unref(event.target, "fan-out");
+        }
+    }
+    for (int i = 0; i < active_count; i++) {
+        trader_unref(active[i].trader, "fan-out flush");
+    }
+    active_count = active_size = 0;
+    free(active);
+    free(pollfds);
+    for (int feed = 0; feed < BRS_FEED_LEVELS; feed++) {
+        free(snapshot[feed]);
+        snapshot[feed] = NULL;
+        snapshot_size[feed] = 0;
+    }
+    free(subscribers);
+    active = NULL;
+    pollfds = NULL;
+    subscribers = NULL;
+    subscribers_size = 0;
+
+    debug_thread("Fan-out thread stopped (%lu queue stalls)", queue_stalls);
+    close(wake_fd);
+    wake_fd = -1;
+    free(queue);
+    queue = NULL;
+}
+
+/*
+ * Check a packet and copy it into an event.
+ */
+static int fanout_event_init(struct fanout_event *event, TRADER *target, BRS_FEED_LEVEL feed,
+                             BRS_PACKET_HEADER *pkt, void *data) {
+    uint16_t payload_size = ntohs(pkt->size);
+    if (payload_size > OUTBOUND_MAX_PAYLOAD || (payload_size > 0 && data == NULL)
+        || feed < 0 || feed >= BRS_FEED_LEVELS) {
+        return -1;
+    }
+    event->target = target;
+    event->feed = feed;
+    event->hdr = *pkt;
+    if (payload_size > 0) {
+        memcpy(event->payload, data, payload_size);
+    }
+    return 0;
+}
+
+/*
+ * Send a batch of packets synchronously, when the fan-out stage has not been
+ * initialized.  The recipients of broadcasts are found once for the batch,
+ * and every recipient is corked for the duration, so that each is sent the
+ * packets for it, in order, with a single write.
+ */
+static int publish_batch_sync(FANOUT_PACKET *packets, int count) {
+    TRADER **traders[BRS_FEED_LEVELS] = { NULL };
+    int traders_size[BRS_FEED_LEVELS] = { 0 };
+    int ntraders[BRS_FEED_LEVELS] = { [0 ... BRS_FEED_LEVELS - 1] = -1 };
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        BRS_FEED_LEVEL feed = packets[i].feed;
+        if (packets[i].target != NULL) {
+            if (trader_send_packet(packets[i].target, packets[i].hdr, packets[i].data) != 0) {
+                result = -1;
+            }
+            continue;
+        }
+        if (feed < 0 || feed >= BRS_FEED_LEVELS) {
+            result = -1;
+            continue;
+        }
+        if (ntraders[feed] < 0) {
+            ntraders[feed] = trader_snapshot_feed(&traders[feed], &traders_size[feed], feed);
+            for (int j = 0; j < ntraders[feed]; j++) {
+                trader_cork(traders[feed][j]);
+            }
+        }
+        for (int j = 0; j < ntraders[feed]; j++) {
+            BRS_PACKET_HEADER hdr = *packets[i].hdr;
+            if (trader_send_packet(traders[feed][j], &hdr, packets[i].data) != 0) {
+                result = -1;
+            }
+        }
+    }
+    
+    for (int feed = 0; feed < BRS_FEED_LEVELS; feed++) {
+        for (int i = 0; i < ntraders[feed]; i++) {
+            if (trader_uncork(traders[feed][i]) != 0) {
+                result = -1;
+            }
+            trader_unref(traders[feed][i], "snapshot");
+        }
+        free(traders[feed]);
+    }
+    return result;
+}
+
+/*
+ * Publish a ticker-tape packet, to be sent to all logged-in traders.
+ */
+int fanout_publish(BRS_PACKET_HEADER *pkt, void *data) {
+    if (pkt == NULL) {
+        return -1;
+    }
+    if (!initialized) {
+        return trader_broadcast_packet(pkt, data);
+    }
+
+    struct fanout_event event;
+    if (fanout_event_init(&event, NULL, BRS_FEED_FULL, pkt, data) != 0) {
+        return -1;
+    }
+    fanout_push(&event);
+    return 0;
+}
+
+/*
+ * Queue a private packet to be sent to one trader.
+ */
+int fanout_send(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data) {
+    if (trader == NULL || pkt == NULL) {
+        return -1;
+    }
+    if (!initialized) {
+        return trader_send_packet(trader, pkt, data);
+    }
+
+    struct fanout_event event;
+    if (fanout_event_init(&event, trader, BRS_FEED_FULL, pkt, data) != 0) {
+        return -1;
+    }
+    trader_ref(trader, "fan-out");
+    fanout_push(&event);
+    return 0;
+}
+
+/*
+ * Change the market-data subscription of a trader.
+ */
+int fanout_subscribe(TRADER *trader, BRS_FEED_LEVEL level, unsigned interval) {
+    if (trader_subscribe(trader, level, interval) != 0) {
+        return -1;
+    }
+    // The fan-out thread may be waiting with no tick to wake it
+    if (initialized && level == BRS_FEED_TOP) {
+        fanout_wake();
+    }
+    return 0;
+}
+
+/*
+ * Publish a batch of packets, to all traders or to one each.
+ */
+int fanout_publish_batch(FANOUT_PACKET *packets, int count) {
+    if (packets == NULL || count < 0) {
+        return -1;
+    }
+    if (!initialized) {
+        return publish_batch_sync(packets, count);
+    }
+    
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        struct fanout_event event;
+        if (fanout_event_init(&event, packets[i].target, packets[i].feed, packets[i].hdr,
+                              packets[i].data) != 0) {
+            result = -1;
+            continue;
+        }
+        if (packets[i].target != NULL) {
+            trader_ref(packets[i].target, "fan-out");
+        }
+        fanout_enqueue(&event);
+    }
+    // One wakeup for the whole batch
+    fanout_notify();
+    return result;
+}
@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "instrument.h"
+#include "exchange_ext.h"
+#include "account_ext.h"
+#include "protocol_ext.h"
+#include "trace.h"
+#include "debug.h"
+
+static struct instrument {
+    char symbol[BRS_SYMBOL_SIZE];   // Padded with NULs; empty for the default
+    EXCHANGE *exchange;
+} instruments[MAX_INSTRUMENTS];
+
+static int count = 0;
+
+/*
+ * Check that a symbol is nonempty, not too long, and alphanumeric.
+ */
+static int symbol_valid(const char *symbol, size_t len) {
+    if (len == 0 || len > BRS_SYMBOL_SIZE) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)symbol[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Create exchanges for the additional instruments.
+ */
+int instruments_init(EXCHANGE *dflt, const char *symbols) {
+    memset(instruments, 0, sizeof(instruments));
+    instruments[0].exchange = dflt;
+    count = 1;
+    
+    const char *p = symbols;
+    while (p != NULL && *p != '\0') {
+        const char *end = strchr(p, ',');
+        size_t len = end != NULL ? (size_t)(end - p) : strlen(p);
+        if (!symbol_valid(p, len) || instrument_lookup(p, len) != NULL || count == MAX_INSTRUMENTS) {
+            error("Invalid, repeated or too many instrument symbols: '%.*s'", (int)len, p);
+            instruments_fini();
+            return -1;
+        }
+        
+        char symbol[BRS_SYMBOL_SIZE + 1];
+        memcpy(symbol, p, len);
+        symbol[len] = '\0';
+        EXCHANGE *xchg = exchange_init_instrument(count, symbol);
+        if (xchg == NULL) {
+            error("Failed to initialize exchange for instrument %s", symbol);
+            instruments_fini();
+            return -1;
+        }
+        memcpy(instruments[count].symbol, p, len);
+        instruments[count].exchange = xchg;
+        count++;
+        debug_thread("Initialized exchange %p for instrument %s", xchg, symbol);
+        
+        p = end != NULL ? end + 1 : NULL;
+    }
+    
+    accounts_set_instruments(count);
+    return 0;
+}
+
+/*
+ * Finalize the exchanges for the additional instruments.
+ */
+void instruments_fini(void) {
+    for (int i = 1; i < count; i++) {
+        exchange_fini(instruments[i].exchange);
+        instruments[i].exchange = NULL;
+    }
+    count = instruments[0].exchange != NULL ? 1 : 0;
+}
+
+/*
+ * Look up the exchange for a specified instrument.
+ */
+EXCHANGE *instrument_lookup(const char *symbol, size_t len) {
+    size_t n = strnlen(symbol, len);
+    if (n == 0 || n > BRS_SYMBOL_SIZE) {
+        return NULL;
+    }
+    for (int i = 1; i < count; i++) {
+        if (memcmp(instruments[i].symbol, symbol, n) == 0
+            && (n == BRS_SYMBOL_SIZE || instruments[i].symbol[n] == '\0')) {
+            return instruments[i].exchange;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Get the exchange for the instrument with a specified index.
+ */
+EXCHANGE *instrument_exchange(int index) {
+    if (index < 0 || index >= count) {
+        return NULL;
+    }
+    return instruments[index].exchange;
+}
+
+/*
+ * Get the number of instruments, including the default one.
+ */
+int instrument_count(void) {
+    return count;
+}
@@ -0,0 +1,538 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "journal.h"
+#include "affinity.h"
+#include "snapshot.h"
+#include "instrument.h"
+#include "exchange_ext.h"
+#include "account_ext.h"
+#include "trader_ext.h"
+#include "trace.h"
+#include "debug.h"
+
+/*
+ * Initial size of the buffers in which records are accumulated.
+ */
+#define JOURNAL_BUFSIZE 65536
+
+static int journal_fd = -1;
+static int enabled = 0;
+static int running = 0;
+static pthread_t writer_thread;
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+
+// Records appended but not yet taken by the writer, protected by journal_mutex
+static char *pending = NULL;
+static size_t pending_len = 0;
+static size_t pending_size = 0;
+
+// Buffer being written out (used only by the writer thread)
+static char *writing = NULL;
+static size_t writing_size = 0;
+
+static unsigned long commits = 0;
+static unsigned long records = 0;
+
+// Snapshot of the shadow state (see snapshot.h), used only by the writer
+// thread once it has started
+static char *snapshot_path = NULL;
+static off_t journal_length = 0;        // Bytes written and applied to the shadow state
+static off_t snapshot_offset = 0;       // Journal length covered by the latest snapshot
+
+/*
+ * Get the index of the instrument named by a record.
+ *
+ * @return  The index, or -1 if the instrument is not being traded.
+ */
+static int record_instrument(JOURNAL_RECORD *rec) {
+    EXCHANGE *xchg = rec->symbol[0] == '\0' ? instrument_exchange(0)
+                                             : instrument_lookup(rec->symbol, BRS_SYMBOL_SIZE);
+    return xchg != NULL ? exchange_get_instrument(xchg) : -1;
+}
+
+/*
+ * Apply the records in a buffer that has been written out to the shadow
+ * state, and take a snapshot if enough has been written since the last.
+ */
+static void journal_shadow(char *buf, size_t len) {
+    char name[UINT16_MAX + 1];
+    size_t pos = 0;
+    while (pos < len) {
+        JOURNAL_RECORD rec;
+        memcpy(&rec, buf + pos, sizeof(rec));
+        memcpy(name, buf + pos + sizeof(rec), rec.name_length);
+        name[rec.name_length] = '\0';
+        snapshot_apply(&rec, name, record_instrument(&rec));
+        pos += sizeof(rec) + rec.name_length;
+    }
+    journal_length += len;
+
+    if (journal_length - snapshot_offset >= SNAPSHOT_INTERVAL) {
+        // Whether or not it succeeds, do not try again for another interval
+        snapshot_write(snapshot_path, journal_length);
+        snapshot_offset = journal_length;
+    }
+}
+
+/*
+ * Checksum of a record (32-bit FNV-1a of everything after the checksum).
+ */
+static uint32_t record_checksum(JOURNAL_RECORD *rec, const char *name) {
+    uint32_t hash = 2166136261u;
+    const unsigned char *p = (const unsigned char *)rec + sizeof(rec->checksum);
+    const unsigned char *end = (const unsigned char *)rec + sizeof(JOURNAL_RECORD);
+    while (p < end) {
+        hash = (hash ^ *p++) * 16777619u;
+    }
+    for (size_t i = 0; i < rec->name_length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Append a record to the pending buffer.
+ */
+static void journal_append(JOURNAL_RECORD *rec, const char *name) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    size_t name_length = name != NULL ? strlen(name) : 0;
+    if (name_length > UINT16_MAX) {
+        error("Journal: account name too long to record");
+        return;
+    }
+    rec->name_length = name_length;
+    rec->checksum = record_checksum(rec, name);
+    size_t size = sizeof(JOURNAL_RECORD) + name_length;
+
+    pthread_mutex_lock(&journal_mutex);
+    if (pending_len + size > pending_size) {
+        size_t new_size = pending_size * 2;
+        while (new_size < pending_len + size) {
+            new_size *= 2;
+        }
+        char *buf = realloc(pending, new_size);
+        if (buf == NULL) {
+            pthread_mutex_unlock(&journal_mutex);
+            error("Journal: out of memory, record lost");
+            return;
+        }
+        pending = buf;
+        pending_size = new_size;
+    }
+    memcpy(pending + pending_len, rec, sizeof(JOURNAL_RECORD));
+    memcpy(pending + pending_len + sizeof(JOURNAL_RECORD), name, name_length);
+    if (pending_len == 0) {
+        pthread_cond_signal(&journal_cond);
+    }
+    pending_len += size;
+    records++;
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+/*
+ * Write all of a buffer to the journal.
+ */
+static int journal_write(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(journal_fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Thread function for the writer thread.  Each time round, everything
+ * appended so far is written out and synced with one fdatasync().  Only
+ * what has been synced is applied to the shadow state.
+ */
+static void *journal_writer_func(void *arg) {
+    (void)arg;
+    affinity_thread_name("journal");
+    pthread_mutex_lock(&journal_mutex);
+    while (1) {
+        while (pending_len == 0 && running) {
+            pthread_cond_wait(&journal_cond, &journal_mutex);
+        }
+        if (pending_len == 0) {
+            break;
+        }
+
+        // Take the pending records, leaving the spare buffer for appenders
+        char *buf = pending;
+        size_t size = pending_size;
+        size_t len = pending_len;
+        pending = writing;
+        pending_size = writing_size;
+        pending_len = 0;
+        writing = buf;
+        writing_size = size;
+        pthread_mutex_unlock(&journal_mutex);
+
+        if (journal_write(buf, len) != 0 || fdatasync(journal_fd) != 0) {
+            // Records after these could not be replayed in order, so stop
+            // recording, and leave the shadow state at what was synced
+            error("Journal: write failed, no further changes will be recorded: %s",
+                  strerror(errno));
+            __atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+            pthread_mutex_lock(&journal_mutex);
+            pending_len = 0;
+            break;
+        }
+        journal_shadow(buf, len);
+
+        pthread_mutex_lock(&journal_mutex);
+        commits++;
+    }
+    pthread_mutex_unlock(&journal_mutex);
+    return NULL;
+}
+
+/*
+ * Traders created to own the orders restored for each account, during replay.
+ */
+struct restored_trader {
+    ACCOUNT *account;
+    TRADER *trader;
+    struct restored_trader *next;
+};
+
+#define RESTORED_BUCKETS 1024
+
+static struct restored_trader *restored[RESTORED_BUCKETS];
+
+/*
+ * Get the trader owning the restored orders for an account, creating it if necessary.
+ */
+static TRADER *restored_trader(char *name) {
+    ACCOUNT *account = account_lookup(name);
+    if (account == NULL) {
+        return NULL;
+    }
+    struct restored_trader **bucket = &restored[((uintptr_t)account >> 4) % RESTORED_BUCKETS];
+    for (struct restored_trader *rt = *bucket; rt != NULL; rt = rt->next) {
+        if (rt->account == account) {
+            return rt->trader;
+        }
+    }
+    struct restored_trader *rt = malloc(sizeof(struct restored_trader));
+    if (rt == NULL) {
+        return NULL;
+    }
+    rt->trader = trader_detached(name);
+    if (rt->trader == NULL) {
+        free(rt);
+        return NULL;
+    }
+    rt->account = account;
+    rt->next = *bucket;
+    *bucket = rt;
+    return rt->trader;
+}
+
+/*
+ * Release the references held by replay on the traders owning restored
+ * orders.  Each lives on for as long as any of its orders.
+ */
+static void restored_traders_release(void) {
+    for (int i = 0; i < RESTORED_BUCKETS; i++) {
+        while (restored[i] != NULL) {
+            struct restored_trader *rt = restored[i];
+            restored[i] = rt->next;
+            trader_unref(rt->trader, "journal replay");
+            free(rt);
+        }
+    }
+}
+
+/*
+ * Apply one record to the state of the server.
+ */
+static int journal_apply(JOURNAL_RECORD *rec, char *name) {
+    int instrument = record_instrument(rec);
+    if (instrument == -1) {
+        error("Journal refers to instrument '%.*s', which is not being traded",
+              BRS_SYMBOL_SIZE, rec->symbol);
+        return -1;
+    }
+    EXCHANGE *xchg = instrument_exchange(instrument);
+    snapshot_apply(rec, name, instrument);
+    
+    switch (rec->type) {
+        case JOURNAL_DEPOSIT:
+        case JOURNAL_WITHDRAW:
+        case JOURNAL_ESCROW:
+        case JOURNAL_RELEASE: {
+            ACCOUNT *account = account_lookup(name);
+            if (account == NULL) {
+                return -1;
+            }
+            int64_t sign = rec->type == JOURNAL_DEPOSIT || rec->type == JOURNAL_ESCROW ? 1 : -1;
+            if (rec->type == JOURNAL_DEPOSIT || rec->type == JOURNAL_WITHDRAW) {
+                account_adjust(account, 0, sign * rec->amount, 0);
+            } else {
+                account_adjust(account, instrument, 0, sign * rec->quantity);
+            }
+            return 0;
+        }
+        case JOURNAL_POST: {
+            TRADER *trader = restored_trader(name);
+            if (trader == NULL) {
+                return -1;
+            }
+            return exchange_restore_order(xchg, trader, rec->order, rec->sell,
+                                          rec->quantity, rec->amount);
+        }
+        case JOURNAL_CANCEL:
+            return exchange_restore_cancel(xchg, rec->order);
+        case JOURNAL_TRADE:
+            return exchange_restore_trade(xchg, rec->order, rec->other, rec->quantity, rec->amount);
+        default:
+            error("Journal record of unknown type %d", rec->type);
+            return -1;
+    }
+}
+
+/*
+ * Replay the journal from a given offset, that of the end of the snapshot
+ * restored, if any.  Returns the length of the valid journal, or -1 if it
+ * could not be replayed.
+ */
+static off_t journal_replay(const char *path, off_t offset) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || st.st_size < offset || fseeko(f, offset, SEEK_SET) != 0) {
+        error("Journal %s is shorter than its snapshot", path);
+        fclose(f);
+        return -1;
+    }
+    
+    off_t valid = offset;
+    unsigned long count = 0;
+    char *name = malloc(UINT16_MAX + 1);
+    if (name == NULL) {
+        fclose(f);
+        return -1;
+    }
+    
+    JOURNAL_RECORD rec;
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (fread(name, 1, rec.name_length, f) != rec.name_length
+            || record_checksum(&rec, name) != rec.checksum) {
+            // Torn write at the end of the journal
+            break;
+        }
+        name[rec.name_length] = '\0';
+        if (journal_apply(&rec, name) != 0) {
+            error("Journal record %lu at offset %ld could not be applied", count, (long)valid);
+            valid = -1;
+            break;
+        }
+        valid += sizeof(rec) + rec.name_length;
+        count++;
+    }
+    
+    free(name);
+    fclose(f);
+    restored_traders_release();
+    debug_thread("Replayed %lu journal records", count);
+    return valid;
+}
+
+/*
+ * Open a journal, replay it, and start recording changes to it.
+ */
+int journal_init(const char *path) {
+    journal_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (journal_fd == -1) {
+        error("Cannot open journal %s: %s", path, strerror(errno));
+        return -1;
+    }
+    
+    size_t path_len = strlen(path) + 6;
+    snapshot_path = malloc(path_len);
+    if (snapshot_path == NULL || snapshot_init(instrument_count()) != 0) {
+        free(snapshot_path);
+        snapshot_path = NULL;
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+    snprintf(snapshot_path, path_len, "%s.snap", path);
+    
+    off_t offset;
+    off_t valid = -1;
+    if (snapshot_load(snapshot_path, &offset) == 0) {
+        valid = journal_replay(path, offset);
+    }
+    if (valid == -1) {
+        snapshot_fini();
+        free(snapshot_path);
+        snapshot_path = NULL;
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+    journal_length = valid;
+    snapshot_offset = offset;
+    
+    // Discard any partial record, and append from there
+    if (ftruncate(journal_fd, valid) != 0 || lseek(journal_fd, valid, SEEK_SET) == -1) {
+        error("Cannot truncate journal %s: %s", path, strerror(errno));
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+    
+    pending = malloc(JOURNAL_BUFSIZE);
+    writing = malloc(JOURNAL_BUFSIZE);
+    if (pending == NULL || writing == NULL) {
+        free(pending);
+        free(writing);
+        pending = writing = NULL;
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+    pending_size = writing_size = JOURNAL_BUFSIZE;
+    pending_len = 0;
+    
+    running = 1;
+    if (pthread_create(&writer_thread, NULL, journal_writer_func, NULL) != 0) {
+        running = 0;
+        free(pending);
+        free(writing);
+        pending = writing = NULL;
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    
+    // Trades may not yet have been made among the orders restored
+    for (int i = 0; i < instrument_count(); i++) {
+        exchange_restore_done(instrument_exchange(i));
+    }
+    return 0;
+}
+
+/*
+ * Write out and sync all records appended so far, and close the journal.
+ */
+void journal_fini(void) {
+    if (journal_fd == -1) {
+        return;
+    }
+    
+    __atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&journal_mutex);
+    running = 0;
+    pthread_cond_signal(&journal_cond);
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_join(writer_thread, NULL);
+    
+    // Spare the next start replaying the journal written since the last snapshot
+    if (journal_length != snapshot_offset) {
+        snapshot_write(snapshot_path, journal_length);
+    }
+    snapshot_fini();
+    free(snapshot_path);
+    snapshot_path = NULL;
+    
+    debug_thread("Journal closed: %lu records in %lu commits", records, commits);
+    close(journal_fd);
+    journal_fd = -1;
+    free(pending);
+    free(writing);
+    pending = writing = NULL;
+    pending_len = pending_size = writing_size = 0;
+}
+
+/*
+ * Check whether changes are being recorded.
+ */
+int journal_enabled(void) {
+    return __atomic_load_n(&enabled, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Record a change to the funds or inventory of an account made by a client.
+ */
+void journal_account(journal_type_t type, const char *name, const char *symbol, uint32_t value) {
+    JOURNAL_RECORD rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    if (symbol != NULL) {
+        memcpy(rec.symbol, symbol, BRS_SYMBOL_SIZE);
+    }
+    if (type == JOURNAL_DEPOSIT || type == JOURNAL_WITHDRAW) {
+        rec.amount = value;
+    } else {
+        rec.quantity = value;
+    }
+    journal_append(&rec, name);
+}
+
+/*
+ * Record that an order has been posted.
+ */
+void journal_post(const char *symbol, const char *name, orderid_t order, int sell,
+                  quantity_t quantity, funds_t price) {
+    JOURNAL_RECORD rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = JOURNAL_POST;
+    rec.sell = sell != 0;
+    memcpy(rec.symbol, symbol, BRS_SYMBOL_SIZE);
+    rec.order = order;
+    rec.quantity = quantity;
+    rec.amount = price;
+    journal_append(&rec, name);
+}
+
+/*
+ * Record that an order has been canceled.
+ */
+void journal_cancel(const char *symbol, orderid_t order) {
+    JOURNAL_RECORD rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = JOURNAL_CANCEL;
+    memcpy(rec.symbol, symbol, BRS_SYMBOL_SIZE);
+    rec.order = order;
+    journal_append(&rec, NULL);
+}
+
+/*
+ * Record a trade between two orders.
+ */
+void journal_trade(const char *symbol, orderid_t buy, orderid_t sell,
+                   quantity_t quantity, funds_t price) {
+    JOURNAL_RECORD rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = JOURNAL_TRADE;
+    memcpy(rec.symbol, symbol, BRS_SYMBOL_SIZE);
+    rec.order = buy;
+    rec.other = sell;
+    rec.quantity = quantity;
+    rec.amount = price;
+    journal_append(&rec, NULL);
+}
@@ -5,6 +5,7 @@
 #include <signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <errno.h>
@@ -12,62 +13,179 @@
 
 #include "client_registry.h"
 #include "exchange.h"
+#include "exchange_ext.h"
 #include "account.h"
 #include "trader.h"
 #include "server.h"
+#include "pool.h"
+#include "fanout.h"
+#include "reactor.h"
+#include "instrument.h"
+#include "journal.h"
+#include "multicast.h"
+#include "affinity.h"
+#include "trader_ext.h"
+#include "stats.h"
+#include "protocol_ext.h"
+#include "trace.h"
 #include "debug.h"
 
 extern EXCHANGE *exchange;
 extern CLIENT_REGISTRY *client_registry;
 
-/*
- * Debug macro with thread ID format (matching demo_server)
- */
-#define debug_thread(S, ...) \
-    do { \
-        fprintf(stderr, KMAG "DEBUG: %015lu: " KNRM S NL, (unsigned long)syscall(SYS_gettid), ##__VA_ARGS__); \
-    } while (0)
-
-#define debug_thread_no(S, ...) \
-    do { \
-        fprintf(stderr, KMAG "DEBUG: " KNRM S NL, ##__VA_ARGS__); \
-    } while (0)
-
 static volatile sig_atomic_t shutdown_flag = 0;
 static int listen_fd = -1;
 
+#define USAGE "Usage: %s -p <port> [-a match|io|fanout=<cpus>]... [-e <reactors>] [-i <symbol>,...] [-j <journal>] [-m <group>:<port>[@<interface>]] [-M] [-q <capacity>] [-r orders|notional|rate|burst=<n>,...] [-s queue|drop|drop-oldest|disconnect (default queue)] [-T <trace>] [-w [<symbol>=]block|adaptive|spin,...]\n"
+
 static void terminate(int status);
 static void sighup_handler(int sig);
+static int set_waits(char *waits);
+static int set_limits(char *limits);
 
 /*
  * "Bourse" exchange server.
  *
- * Usage: bourse -p <port>
+ * Usage: bourse -p <port> [-a match|io|fanout=<cpus>]... [-e <reactors>] [-i <symbol>,...] [-j <journal>] [-m <group>:<port>[@<interface>]] [-M] [-q <capacity>] [-r orders|notional|rate|burst=<n>,...] [-s queue|drop|drop-oldest|disconnect (default queue)] [-T <trace>] [-w [<symbol>=]block|adaptive|spin,...]
+ *
+ *   -a  Run the matchmakers, the threads serving clients (reactors or
+ *       threads per client) or the fan-out thread on the given CPUs, as a
+ *       list of numbers and ranges such as 2,4-7 (see affinity.h).  Each
+ *       matchmaker and each reactor is pinned to one CPU of the list, in
+ *       turn, and the book of each instrument is allocated on the NUMA node
+ *       of its matchmaker.  May be given once for each kind of thread.
+ *   -e  Serve clients with the given number of event-loop reactor threads,
+ *       instead of one thread per client.
+ *   -i  Also trade the instruments with the given symbols, each on an
+ *       exchange with its own matchmaker thread.
+ *   -j  Record changes to accounts and books in the given journal, after
+ *       restoring them from it.
+ *   -m  Send the tape of every instrument to the given UDP multicast group
+ *       (see protocol_ext.h), from the local interface with the given
+ *       address if there is one, and subscribe traders only to their own
+ *       notifications when they log in.
+ *   -M  Match an order that can trade on being posted on the thread that
+ *       posts it, rather than on the matchmaker thread.
+ *   -q  Number of notifications that can be queued for each trader before
+ *       the slow-consumer policy applies (default 256).
+ *   -r  Refuse the orders of a trader that would have more than the given
+ *       number of orders pending, or pending orders of more than the given
+ *       total value, or that enters orders faster than the given rate per
+ *       second, ahead of a burst of the given number (see protocol_ext.h).
+ *       Each limit is disabled unless given.
+ *   -s  What to do with a trader whose queue is full: make the queue larger
+ *       (queue, the default), discard the new notification (drop) or the
+ *       oldest ticker-tape notification (drop-oldest), or log the trader
+ *       out (disconnect) (see trader_ext.h).
+ *   -T  Write trace records to the given file, in builds with TRACE
+ *       (see trace.h).
+ *   -w  How the matchmakers wait for orders that cross the book: sleeping
+ *       until woken (block, the default), polling for a while before
+ *       sleeping (adaptive), or polling only (spin) (see exchange_ext.h).
+ *       A strategy prefixed with a symbol applies only to the matchmaker
+ *       of that instrument (the default instrument has the empty symbol).
  */
 int main(int argc, char* argv[]){
     int port = 0;
+    int reactors = 0;
+    int capacity = OUTBOUND_DEFAULT_CAPACITY;
+    outbound_policy_t policy = OUTBOUND_QUEUE;
+    char *symbols = NULL;
+    char *journal = NULL;
+    char *waits = NULL;
     int opt;
     
     // Parse command-line arguments
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:a:e:i:j:m:Mq:r:s:T:w:")) != -1) {
         switch (opt) {
             case 'p':
                 port = atoi(optarg);
                 if (port <= 0 || port > 65535) {
                     fprintf(stderr, "Invalid port number: %s\n", optarg);
-                    fprintf(stderr, "Usage: %s -p <port>\n", argv[0]);
+                    fprintf(stderr, USAGE, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'a':
+                if (affinity_set(optarg) != 0) {
+                    fprintf(stderr, "Invalid CPUs: %s\n", optarg);
+                    fprintf(stderr, USAGE, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                reactors = atoi(optarg);
+                if (reactors <= 0) {
+                    fprintf(stderr, "Invalid number of reactors: %s\n", optarg);
+                    fprintf(stderr, USAGE, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                symbols = optarg;
+                break;
+            case 'j':
+                journal = optarg;
+                break;
+            case 'm':
+                if (multicast_init(optarg) != 0) {
+                    fprintf(stderr, "Invalid multicast group: %s\n", optarg);
+                    fprintf(stderr, USAGE, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                traders_set_default_feed(BRS_FEED_PRIVATE);
+                break;
+            case 'M':
+                exchanges_set_inline_matching(1);
+                break;
+            case 'T':
+                if (trace_init(optarg) != 0) {
+                    fprintf(stderr, "Cannot trace to %s (tracing needs a build with TRACE)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                capacity = atoi(optarg);
+                if (capacity <= 0) {
+                    fprintf(stderr, "Invalid queue capacity: %s\n", optarg);
+                    fprintf(stderr, USAGE, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                if (set_limits(optarg) != 0) {
+                    fprintf(stderr, "Invalid risk limits: %s\n", optarg);
+                    fprintf(stderr, USAGE, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                if (strcmp(optarg, "queue") == 0) {
+                    policy = OUTBOUND_QUEUE;
+                } else if (strcmp(optarg, "drop") == 0) {
+                    policy = OUTBOUND_DROP;
+                } else if (strcmp(optarg, "drop-oldest") == 0) {
+                    policy = OUTBOUND_DROP_OLDEST;
+                } else if (strcmp(optarg, "disconnect") == 0) {
+                    policy = OUTBOUND_DISCONNECT;
+                } else {
+                    fprintf(stderr, "Invalid slow-consumer policy: %s\n", optarg);
+                    fprintf(stderr, USAGE, argv[0]);
                     exit(EXIT_FAILURE);
                 }
                 break;
+            case 'w':
+                waits = optarg;
+                break;
             default:
-                fprintf(stderr, "Usage: %s -p <port>\n", argv[0]);
+                fprintf(stderr, USAGE, argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
     
     if (port == 0) {
         fprintf(stderr, "Port number is required\n");
-        fprintf(stderr, "Usage: %s -p <port>\n", argv[0]);
+        fprintf(stderr, USAGE, argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -82,6 +200,14 @@ int main(int argc, char* argv[]){
         exit(EXIT_FAILURE);
     }
 
+    // A write to a trader that has gone away must fail with EPIPE
+    // rather than kill the server
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        error("Failed to ignore SIGPIPE");
+        exit(EXIT_FAILURE);
+    }
+
     // Perform required initializations
     debug_thread("Initialize client registry");
     client_registry = creg_init();
@@ -102,12 +228,41 @@ int main(int argc, char* argv[]){
         terminate(EXIT_FAILURE);
     }
     
+    debug_thread("Initialize fan-out");
+    if (fanout_init(capacity, policy) != 0) {
+        error("Failed to initialize fan-out");
+        terminate(EXIT_FAILURE);
+    }
+    
     exchange = exchange_init();
     if (exchange == NULL) {
         error("Failed to initialize exchange");
         terminate(EXIT_FAILURE);
     }
     debug_thread_no("Initialized exchange %p", exchange);
+    
+    if (instruments_init(exchange, symbols) != 0) {
+        error("Failed to initialize instruments");
+        terminate(EXIT_FAILURE);
+    }
+    
+    if (waits != NULL && set_waits(waits) != 0) {
+        error("Invalid wait strategy: %s", waits);
+        terminate(EXIT_FAILURE);
+    }
+    
+    if (journal != NULL && journal_init(journal) != 0) {
+        error("Failed to restore from journal %s", journal);
+        terminate(EXIT_FAILURE);
+    }
+    
+    if (reactors > 0) {
+        debug_thread("Initialize %d reactors", reactors);
+        if (reactors_init(reactors) != 0) {
+            error("Failed to initialize reactors");
+            terminate(EXIT_FAILURE);
+        }
+    }
 
     // Create listening socket
     listen_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -138,7 +293,7 @@ int main(int argc, char* argv[]){
     }
 
     // Listen for connections
-    if (listen(listen_fd, 10) == -1) {
+    if (listen(listen_fd, SOMAXCONN) == -1) {
         error("Failed to listen on socket");
         close(listen_fd);
         terminate(EXIT_FAILURE);
@@ -161,6 +316,19 @@ int main(int argc, char* argv[]){
             continue;
         }
 
+        // Packets are coalesced before they are written, so there is nothing
+        // to gain from Nagle's algorithm, which would only delay responses
+        int nodelay = 1;
+        if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1) {
+            debug("Failed to disable Nagle's algorithm for fd %d", client_fd);
+        }
+
+        if (reactors > 0) {
+            // Event-loop mode: the reactor takes over the connection
+            reactor_add_client(client_fd);
+            continue;
+        }
+
         // Allocate memory for file descriptor to pass to thread
         int *fd_ptr = malloc(sizeof(int));
         if (fd_ptr == NULL) {
@@ -193,6 +361,85 @@ int main(int argc, char* argv[]){
     return 0;
 }
 
+/*
+ * Set the wait strategies of the matchmakers, from a comma-separated list
+ * of strategies, each for all instruments or, prefixed with "<symbol>=",
+ * for one.
+ *
+ * @return 0 if successful, -1 if a strategy or a symbol is unknown.
+ */
+static int set_waits(char *waits) {
+    for (char *save, *item = strtok_r(waits, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        char *name = strchr(item, '=');
+        EXCHANGE *xchg = NULL;
+        if (name != NULL) {
+            *name++ = '\0';
+            if ((xchg = instrument_lookup(item, strlen(item))) == NULL) {
+                return -1;
+            }
+        } else {
+            name = item;
+        }
+        
+        exchange_wait_t wait;
+        if (strcmp(name, "block") == 0) {
+            wait = EXCHANGE_WAIT_BLOCK;
+        } else if (strcmp(name, "adaptive") == 0) {
+            wait = EXCHANGE_WAIT_ADAPTIVE;
+        } else if (strcmp(name, "spin") == 0) {
+            wait = EXCHANGE_WAIT_SPIN;
+        } else {
+            return -1;
+        }
+        for (int i = 0; i < instrument_count(); i++) {
+            if (xchg == NULL || instrument_exchange(i) == xchg) {
+                exchange_set_wait(instrument_exchange(i), wait);
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Set the risk limits of traders, from a comma-separated list of limits,
+ * each "<name>=<value>".
+ *
+ * @return 0 if successful, -1 if a limit is unknown or its value invalid.
+ */
+static int set_limits(char *limits) {
+    unsigned long orders = 0, notional = 0, rate = 0, burst = 0;
+    for (char *save, *item = strtok_r(limits, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(item, '=');
+        char *end;
+        if (value == NULL) {
+            return -1;
+        }
+        *value++ = '\0';
+        errno = 0;
+        unsigned long n = strtoul(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || errno != 0
+            || (n > UINT32_MAX && strcmp(item, "notional") != 0)) {
+            return -1;
+        }
+        
+        if (strcmp(item, "orders") == 0) {
+            orders = n;
+        } else if (strcmp(item, "notional") == 0) {
+            notional = n;
+        } else if (strcmp(item, "rate") == 0) {
+            rate = n;
+        } else if (strcmp(item, "burst") == 0) {
+            burst = n;
+        } else {
+            return -1;
+        }
+    }
+    traders_set_limits(orders, notional, rate, burst);
+    return 0;
+}
+
 /*
  * SIGHUP handler - triggers clean shutdown
  */
@@ -216,13 +463,26 @@ static void terminate(int status) {
     debug_thread("Waiting for service threads to terminate...");
     creg_wait_for_empty(client_registry);
     debug_thread("All service threads terminated.");
+    reactors_fini();
+
+#ifdef DEBUG
+    // Report allocation counters, to check for heap use in steady state.
+    pools_report(stderr);
+    fprintf(stderr, "Payloads allocated from heap: %lu\n", proto_heap_payload_count());
+    stats_report(stderr);
+#endif
 
     // Finalize modules.
     creg_fini(client_registry);
+    journal_fini();
+    instruments_fini();
     exchange_fini(exchange);
+    fanout_fini();
+    multicast_fini();
     traders_fini();
     accounts_fini();
 
     debug_thread("Bourse server terminating");
+    trace_fini();
     exit(status);
 }
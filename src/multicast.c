@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "multicast.h"
+#include "stats.h"
+#include "trace.h"
+#include "debug.h"
+
+/*
+ * Hops a datagram may take; 1 keeps the tape on the local network.
+ */
+#define MULTICAST_TTL 1
+
+static int multicast_fd = -1;
+static struct sockaddr_in multicast_addr;
+
+/*
+ * Start sending the tape to a multicast group.
+ */
+int multicast_init(const char *address) {
+    if (address == NULL || multicast_fd != -1) {
+        return -1;
+    }
+    
+    const char *colon = strchr(address, ':');
+    if (colon == NULL || colon == address || colon - address >= INET_ADDRSTRLEN) {
+        return -1;
+    }
+    char group[INET_ADDRSTRLEN];
+    memcpy(group, address, colon - address);
+    group[colon - address] = '\0';
+    char *end;
+    long port = strtol(colon + 1, &end, 10);
+    if ((*end != '\0' && *end != '@') || port <= 0 || port > 65535) {
+        return -1;
+    }
+    
+    memset(&multicast_addr, 0, sizeof(multicast_addr));
+    multicast_addr.sin_family = AF_INET;
+    multicast_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, group, &multicast_addr.sin_addr) != 1) {
+        return -1;
+    }
+    struct in_addr interface = { htonl(INADDR_ANY) };
+    if (*end == '@' && inet_pton(AF_INET, end + 1, &interface) != 1) {
+        return -1;
+    }
+    
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    unsigned char ttl = MULTICAST_TTL;
+    unsigned char loop = 1;
+    if (IN_MULTICAST(ntohl(multicast_addr.sin_addr.s_addr))
+        && (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == -1
+            || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == -1
+            || (interface.s_addr != htonl(INADDR_ANY)
+                && setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)) == -1))) {
+        close(fd);
+        return -1;
+    }
+    multicast_fd = fd;
+    debug_thread("Sending the tape to %s:%ld", group, port);
+    return 0;
+}
+
+/*
+ * Stop sending the tape, and close the socket.
+ */
+void multicast_fini(void) {
+    if (multicast_fd != -1) {
+        close(multicast_fd);
+        multicast_fd = -1;
+    }
+}
+
+/*
+ * Determine whether the tape is being sent to a multicast group.
+ */
+int multicast_enabled(void) {
+    return multicast_fd != -1;
+}
+
+/*
+ * Send packets of the tape of an instrument to the group.
+ */
+void multicast_publish(const char *symbol, BRS_REPLAY_EVENT *events, int count) {
+    if (multicast_fd == -1) {
+        return;
+    }
+    
+    struct {
+        BRS_MCAST_HEADER hdr;
+        BRS_REPLAY_EVENT events[BRS_MCAST_MAX];
+    } datagram;                     // Both are whole numbers of 32-bit words
+    memcpy(datagram.hdr.symbol, symbol, BRS_SYMBOL_SIZE);
+    datagram.hdr.reserved = 0;
+    for (int i = 0; i < count; i += BRS_MCAST_MAX) {
+        int n = count - i < BRS_MCAST_MAX ? count - i : BRS_MCAST_MAX;
+        datagram.hdr.count = htons(n);
+        memcpy(datagram.events, &events[i], n * sizeof(BRS_REPLAY_EVENT));
+        size_t len = sizeof(BRS_MCAST_HEADER) + n * sizeof(BRS_REPLAY_EVENT);
+        if (sendto(multicast_fd, &datagram, len, 0, (struct sockaddr *)&multicast_addr,
+                   sizeof(multicast_addr)) == -1) {
+            debug_thread("Failed to send %d packets of the tape: %s", n, strerror(errno));
+            stats_count(STATS_MCAST_ERRORS, 1);
+        } else {
+            stats_count(STATS_MCAST_DATAGRAMS, 1);
+        }
+    }
+}
@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "order_book.h"
+#include "affinity.h"
+#include "debug.h"
+
+/*
+ * Initial number of buckets in the order ID index.
+ */
+#define BOOK_INDEX_INITIAL 1024
+
+/*
+ * Number of price levels allocated at a time by the level pool.
+ */
+#define BOOK_LEVELS_PER_SLAB 256
+
+/*
+ * Height of a (possibly empty) subtree of price levels.
+ */
+static int level_height(struct price_level *level) {
+    return level != NULL ? level->height : 0;
+}
+
+/*
+ * Recompute the height of a level from the heights of its children.
+ */
+static void level_update(struct price_level *level) {
+    int hl = level_height(level->left);
+    int hr = level_height(level->right);
+    level->height = 1 + (hl > hr ? hl : hr);
+}
+
+static struct price_level *rotate_right(struct price_level *level) {
+    struct price_level *pivot = level->left;
+    level->left = pivot->right;
+    pivot->right = level;
+    level_update(level);
+    level_update(pivot);
+    return pivot;
+}
+
+static struct price_level *rotate_left(struct price_level *level) {
+    struct price_level *pivot = level->right;
+    level->right = pivot->left;
+    pivot->left = level;
+    level_update(level);
+    level_update(pivot);
+    return pivot;
+}
+
+/*
+ * Restore the AVL balance condition at a level whose subtrees are balanced
+ * and differ in height by at most two.  Returns the new root of the subtree.
+ */
+static struct price_level *level_rebalance(struct price_level *level) {
+    level_update(level);
+    int balance = level_height(level->left) - level_height(level->right);
+
+    if (balance > 1) {
+        if (level_height(level->left->left) < level_height(level->left->right)) {
+            level->left = rotate_left(level->left);
+        }
+        return rotate_right(level);
+    }
+    if (balance < -1) {
+        if (level_height(level->right->right) < level_height(level->right->left)) {
+            level->right = rotate_right(level->right);
+        }
+        return rotate_left(level);
+    }
+    return level;
+}
+
+/*
+ * Insert a new level (whose price is not already present) into a subtree.
+ */
+static struct price_level *level_insert(struct price_level *root, struct price_level *level) {
+    if (root == NULL) {
+        return level;
+    }
+    if (level->price < root->price) {
+        root->left = level_insert(root->left, level);
+    } else {
+        root->right = level_insert(root->right, level);
+    }
+    return level_rebalance(root);
+}
+
+/*
+ * Detach the lowest priced level from a subtree, returning it in *minp.
+ */
+static struct price_level *level_detach_min(struct price_level *root, struct price_level **minp) {
+    if (root->left == NULL) {
+        *minp = root;
+        return root->right;
+    }
+    root->left = level_detach_min(root->left, minp);
+    return level_rebalance(root);
+}
+
+/*
+ * Delete the level with a specified price from a subtree.  The level
+ * itself is not freed.
+ */
+static struct price_level *level_delete(struct price_level *root, funds_t price) {
+    if (root == NULL) {
+        return NULL;
+    }
+    if (price < root->price) {
+        root->left = level_delete(root->left, price);
+    } else if (price > root->price) {
+        root->right = level_delete(root->right, price);
+    } else {
+        struct price_level *left = root->left;
+        struct price_level *right = root->right;
+        if (right == NULL) {
+            return left;
+        }
+        struct price_level *min;
+        right = level_detach_min(right, &min);
+        min->left = left;
+        min->right = right;
+        return level_rebalance(min);
+    }
+    return level_rebalance(root);
+}
+
+static struct price_level *level_find(struct price_level *root, funds_t price) {
+    while (root != NULL && root->price != price) {
+        root = price < root->price ? root->left : root->right;
+    }
+    return root;
+}
+
+/*
+ * Find the best level of a side by descending the tree.
+ */
+static struct price_level *side_find_best(BOOK_SIDE *side) {
+    struct price_level *level = side->root;
+    if (level == NULL) {
+        return NULL;
+    }
+    if (side->type == ORDER_BUY) {
+        while (level->right != NULL) {
+            level = level->right;
+        }
+    } else {
+        while (level->left != NULL) {
+            level = level->left;
+        }
+    }
+    return level;
+}
+
+/*
+ * Is price a better than price b for a given side of the book?
+ */
+static int side_better(BOOK_SIDE *side, funds_t a, funds_t b) {
+    return side->type == ORDER_BUY ? a > b : a < b;
+}
+
+static BOOK_SIDE *book_side_for(ORDER_BOOK *book, struct order *order) {
+    return order->type == ORDER_BUY ? &book->bids : &book->asks;
+}
+
+static struct order **index_bucket(ORDER_BOOK *book, orderid_t id) {
+    return &book->index[id & (book->index_size - 1)];
+}
+
+/*
+ * Resize the order ID index to a specified (power of two) number of buckets.
+ */
+static int index_resize(ORDER_BOOK *book, size_t size) {
+    struct order **buckets = affinity_alloc(size * sizeof(struct order *), book->node);
+    if (buckets == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < book->index_size; i++) {
+        struct order *order = book->index[i];
+        while (order != NULL) {
+            struct order *next = order->id_next;
+            struct order **bucket = &buckets[order->id & (size - 1)];
+            order->id_next = *bucket;
+            *bucket = order;
+            order = next;
+        }
+    }
+    affinity_free(book->index, book->index_size * sizeof(struct order *));
+    book->index = buckets;
+    book->index_size = size;
+    return 0;
+}
+
+static int index_add(ORDER_BOOK *book, struct order *order) {
+    if (book->index == NULL) {
+        if (index_resize(book, BOOK_INDEX_INITIAL) != 0) {
+            return -1;
+        }
+    } else if (book->index_count >= book->index_size) {
+        // Failure to grow only costs longer chains, so keep going
+        index_resize(book, book->index_size * 2);
+    }
+    struct order **bucket = index_bucket(book, order->id);
+    order->id_next = *bucket;
+    *bucket = order;
+    book->index_count++;
+    return 0;
+}
+
+static void index_del(ORDER_BOOK *book, struct order *order) {
+    for (struct order **p = index_bucket(book, order->id); *p != NULL; p = &(*p)->id_next) {
+        if (*p == order) {
+            *p = order->id_next;
+            order->id_next = NULL;
+            book->index_count--;
+            return;
+        }
+    }
+}
+
+/*
+ * Initialize an empty order book.
+ */
+int book_init(ORDER_BOOK *book, int node) {
+    memset(book, 0, sizeof(ORDER_BOOK));
+    book->bids.type = ORDER_BUY;
+    book->asks.type = ORDER_SELL;
+    book->node = node;
+    book->level_pool = pool_init_node("levels", sizeof(struct price_level), BOOK_LEVELS_PER_SLAB,
+                                      node);
+    return book->level_pool != NULL ? 0 : -1;
+}
+
+/*
+ * Finalize an order book, freeing its price levels and index.
+ */
+void book_fini(ORDER_BOOK *book) {
+    // Levels are returned to the heap along with the pool's slabs
+    pool_fini(book->level_pool);
+    affinity_free(book->index, book->index_size * sizeof(struct order *));
+    memset(book, 0, sizeof(ORDER_BOOK));
+}
+
+/*
+ * Insert an order into the book, at the tail of the queue for its price level.
+ */
+int book_insert(ORDER_BOOK *book, struct order *order) {
+    BOOK_SIDE *side = book_side_for(book, order);
+    if (index_add(book, order) != 0) {
+        return -1;
+    }
+
+    struct price_level *level = level_find(side->root, order->price);
+    if (level == NULL) {
+        level = pool_alloc(book->level_pool);
+        if (level == NULL) {
+            index_del(book, order);
+            return -1;
+        }
+        memset(level, 0, sizeof(struct price_level));
+        level->price = order->price;
+        level->height = 1;
+        side->root = level_insert(side->root, level);
+        side->levels++;
+        if (side->best == NULL || side_better(side, level->price, side->best->price)) {
+            side->best = level;
+        }
+    }
+
+    // Append to FIFO queue for this level
+    order->level = level;
+    order->next = NULL;
+    order->prev = level->tail;
+    if (level->tail != NULL) {
+        level->tail->next = order;
+    } else {
+        level->head = order;
+    }
+    level->tail = order;
+    level->count++;
+    level->quantity += order->quantity;
+
+    side->orders++;
+    side->quantity += order->quantity;
+
+    // Push onto the owner's list
+    order->owner_prev = NULL;
+    if (order->owner_list != NULL) {
+        order->owner_next = *order->owner_list;
+        if (order->owner_next != NULL) {
+            order->owner_next->owner_prev = order;
+        }
+        *order->owner_list = order;
+    } else {
+        order->owner_next = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Remove an order from the book.
+ */
+void book_remove(ORDER_BOOK *book, struct order *order) {
+    BOOK_SIDE *side = book_side_for(book, order);
+    struct price_level *level = order->level;
+    index_del(book, order);
+
+    // Unlink from FIFO queue
+    if (order->prev != NULL) {
+        order->prev->next = order->next;
+    } else {
+        level->head = order->next;
+    }
+    if (order->next != NULL) {
+        order->next->prev = order->prev;
+    } else {
+        level->tail = order->prev;
+    }
+    level->count--;
+    level->quantity -= order->quantity;
+    side->orders--;
+    side->quantity -= order->quantity;
+
+    order->level = NULL;
+    order->prev = NULL;
+    order->next = NULL;
+
+    // Unlink from the owner's list
+    if (order->owner_prev != NULL) {
+        order->owner_prev->owner_next = order->owner_next;
+    } else if (order->owner_list != NULL) {
+        *order->owner_list = order->owner_next;
+    }
+    if (order->owner_next != NULL) {
+        order->owner_next->owner_prev = order->owner_prev;
+    }
+    order->owner_prev = NULL;
+    order->owner_next = NULL;
+
+    // Remove the level once it has no orders
+    if (level->count == 0) {
+        side->root = level_delete(side->root, level->price);
+        side->levels--;
+        if (side->best == level) {
+            side->best = side_find_best(side);
+        }
+        pool_free(book->level_pool, level);
+    }
+}
+
+/*
+ * Reduce the quantity of an order in the book.
+ */
+void book_reduce(ORDER_BOOK *book, struct order *order, quantity_t quantity) {
+    BOOK_SIDE *side = book_side_for(book, order);
+    order->quantity -= quantity;
+    order->level->quantity -= quantity;
+    side->quantity -= quantity;
+}
+
+/*
+ * Get the best buy order.
+ */
+struct order *book_best_buy(ORDER_BOOK *book) {
+    return book->bids.best != NULL ? book->bids.best->head : NULL;
+}
+
+/*
+ * Get the best sell order.
+ */
+struct order *book_best_sell(ORDER_BOOK *book) {
+    return book->asks.best != NULL ? book->asks.best->head : NULL;
+}
+
+/*
+ * Find a pending order by its order ID.
+ */
+struct order *book_find(ORDER_BOOK *book, orderid_t id) {
+    if (book->index == NULL) {
+        return NULL;
+    }
+    struct order *order = *index_bucket(book, id);
+    while (order != NULL && order->id != id) {
+        order = order->id_next;
+    }
+    return order;
+}
+
+/*
+ * In-order traversal of a subtree, in descending or ascending price order.
+ * Returns nonzero once the visitor has asked to stop.
+ */
+static int level_walk(struct price_level *level, int descending,
+                      int (*fn)(struct price_level *, void *), void *arg) {
+    if (level == NULL) {
+        return 0;
+    }
+    struct price_level *first = descending ? level->right : level->left;
+    struct price_level *second = descending ? level->left : level->right;
+    if (level_walk(first, descending, fn, arg)) {
+        return 1;
+    }
+    if (fn(level, arg)) {
+        return 1;
+    }
+    return level_walk(second, descending, fn, arg);
+}
+
+/*
+ * Find the price level at a specified price on one side of the book.
+ */
+struct price_level *book_level(BOOK_SIDE *side, funds_t price) {
+    return level_find(side->root, price);
+}
+
+/*
+ * Visit the price levels of one side of the book, from best to worst.
+ */
+void book_walk(BOOK_SIDE *side, int (*fn)(struct price_level *level, void *arg), void *arg) {
+    level_walk(side->root, side->type == ORDER_BUY, fn, arg);
+}
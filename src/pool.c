@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "affinity.h"
+#include "debug.h"
+
+/*
+ * Alignment of objects allocated from a pool.
+ */
+#define POOL_ALIGN 16
+
+/*
+ * A free object is used to hold the free list link.
+ */
+struct pool_free_obj {
+    struct pool_free_obj *next;
+};
+
+/*
+ * Each slab starts with a header linking it to the other slabs of the pool.
+ */
+struct pool_slab {
+    struct pool_slab *next;
+    char pad[POOL_ALIGN - sizeof(struct pool_slab *)];
+};
+
+struct pool {
+    const char *name;
+    size_t object_size;
+    size_t slab_objects;
+    struct pool_free_obj *free_list;
+    struct pool_slab *slabs;
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long capacity;
+    unsigned long nslabs;
+    int node;                      // NUMA node of the slabs, or -1 for the heap
+    pthread_mutex_t mutex;
+    struct pool *next;             // Next pool in the registry
+};
+
+// Registry of live pools
+static struct pool *pool_list = NULL;
+static pthread_mutex_t pool_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Allocate a new slab and thread its objects onto the free list.
+ * Must be called with the pool mutex held.
+ */
+static size_t pool_slab_size(POOL *pool) {
+    return sizeof(struct pool_slab) + pool->object_size * pool->slab_objects;
+}
+
+static int pool_grow(POOL *pool) {
+    struct pool_slab *slab = pool->node >= 0 ? affinity_alloc(pool_slab_size(pool), pool->node)
+                                             : malloc(pool_slab_size(pool));
+    if (slab == NULL) {
+        return -1;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->nslabs++;
+
+    char *base = (char *)(slab + 1);
+    for (size_t i = pool->slab_objects; i > 0; i--) {
+        struct pool_free_obj *obj = (struct pool_free_obj *)(base + (i - 1) * pool->object_size);
+        obj->next = pool->free_list;
+        pool->free_list = obj;
+    }
+    pool->capacity += pool->slab_objects;
+    return 0;
+}
+
+/*
+ * Initialize a new pool.
+ */
+POOL *pool_init(const char *name, size_t object_size, size_t slab_objects) {
+    return pool_init_node(name, object_size, slab_objects, -1);
+}
+
+/*
+ * Initialize a new pool whose slabs are allocated on a specified NUMA node.
+ */
+POOL *pool_init_node(const char *name, size_t object_size, size_t slab_objects, int node) {
+    if (object_size == 0 || slab_objects == 0) {
+        return NULL;
+    }
+
+    POOL *pool = malloc(sizeof(POOL));
+    if (pool == NULL) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(POOL));
+    pool->name = name;
+    if (object_size < sizeof(struct pool_free_obj)) {
+        object_size = sizeof(struct pool_free_obj);
+    }
+    pool->object_size = (object_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    pool->slab_objects = slab_objects;
+    pool->node = node;
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        free(pool);
+        return NULL;
+    }
+    if (pool_grow(pool) != 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool_list_mutex);
+    pool->next = pool_list;
+    pool_list = pool;
+    pthread_mutex_unlock(&pool_list_mutex);
+    return pool;
+}
+
+/*
+ * Finalize a pool, returning all of its slabs to the heap.
+ */
+void pool_fini(POOL *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool_list_mutex);
+    for (struct pool **p = &pool_list; *p != NULL; p = &(*p)->next) {
+        if (*p == pool) {
+            *p = pool->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool_list_mutex);
+
+    if (pool->allocs != pool->frees) {
+        debug("Pool %s finalized with %lu objects in use", pool->name, pool->allocs - pool->frees);
+    }
+    struct pool_slab *slab = pool->slabs;
+    while (slab != NULL) {
+        struct pool_slab *next = slab->next;
+        if (pool->node >= 0) {
+            affinity_free(slab, pool_slab_size(pool));
+        } else {
+            free(slab);
+        }
+        slab = next;
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+/*
+ * Allocate an object from a pool.
+ */
+void *pool_alloc(POOL *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->free_list == NULL && pool_grow(pool) != 0) {
+        pthread_mutex_unlock(&pool->mutex);
+        return NULL;
+    }
+    struct pool_free_obj *obj = pool->free_list;
+    pool->free_list = obj->next;
+    pool->allocs++;
+    pthread_mutex_unlock(&pool->mutex);
+    return obj;
+}
+
+/*
+ * Return an object to the pool from which it was allocated.
+ */
+void pool_free(POOL *pool, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+    struct pool_free_obj *fobj = obj;
+    pthread_mutex_lock(&pool->mutex);
+    fobj->next = pool->free_list;
+    pool->free_list = fobj;
+    pool->frees++;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Get the counters of a pool.
+ */
+void pool_get_stats(POOL *pool, POOL_STATS *stats) {
+    pthread_mutex_lock(&pool->mutex);
+    stats->name = pool->name;
+    stats->object_size = pool->object_size;
+    stats->allocs = pool->allocs;
+    stats->frees = pool->frees;
+    stats->in_use = pool->allocs - pool->frees;
+    stats->capacity = pool->capacity;
+    stats->slabs = pool->nslabs;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Print the counters of all live pools, one line per pool.
+ */
+void pools_report(FILE *out) {
+    pthread_mutex_lock(&pool_list_mutex);
+    for (POOL *pool = pool_list; pool != NULL; pool = pool->next) {
+        POOL_STATS stats;
+        pool_get_stats(pool, &stats);
+        fprintf(out, "Pool %s: object size %zu, allocs %lu, frees %lu, in use %lu, capacity %lu, slabs %lu\n",
+                stats.name, stats.object_size, stats.allocs, stats.frees, stats.in_use,
+                stats.capacity, stats.slabs);
+    }
+    pthread_mutex_unlock(&pool_list_mutex);
+}
@@ -3,19 +3,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 
 #include "protocol.h"
+#include "protocol_ext.h"
 #include "debug.h"
 
 /*
- * Helper function to write all bytes, looping until complete or error
+ * Helper function to read all bytes, looping until complete or error
  */
-static ssize_t full_write(int fd, const void *buf, size_t count) {
+static ssize_t full_read(int fd, void *buf, size_t count) {
     size_t total = 0;
-    const char *ptr = (const char *)buf;
+    char *ptr = (char *)buf;
     
     while (total < count) {
-        ssize_t n = write(fd, ptr + total, count - total);
+        ssize_t n = read(fd, ptr + total, count - total);
         if (n == -1) {
             if (errno == EINTR) {
                 continue; // Interrupted, retry
@@ -31,14 +34,17 @@ static ssize_t full_write(int fd, const void *buf, size_t count) {
 }
 
 /*
- * Helper function to read all bytes, looping until complete or error
+ * Write all of a vector of buffers, looping until complete or error.
  */
-static ssize_t full_read(int fd, void *buf, size_t count) {
-    size_t total = 0;
-    char *ptr = (char *)buf;
+int proto_send_iov(int fd, struct iovec *iov, int iovcnt) {
+    // Skip empty buffers, so that completion is simply iovcnt reaching 0
+    while (iovcnt > 0 && iov->iov_len == 0) {
+        iov++;
+        iovcnt--;
+    }
     
-    while (total < count) {
-        ssize_t n = read(fd, ptr + total, count - total);
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
         if (n == -1) {
             if (errno == EINTR) {
                 continue; // Interrupted, retry
@@ -46,11 +52,22 @@ static ssize_t full_read(int fd, void *buf, size_t count) {
             return -1; // Error
         }
         if (n == 0) {
-            return total; // EOF
+            errno = EPIPE; // Connection closed
+            return -1;
+        }
+        
+        // Advance past what was written
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
         }
-        total += n;
     }
-    return total;
+    return 0;
 }
 
 /*
@@ -63,39 +80,30 @@ int proto_send_packet(int fd, BRS_PACKET_HEADER *hdr, void *payload) {
         return -1;
     }
     
-    // Write header
-    ssize_t n = full_write(fd, hdr, sizeof(BRS_PACKET_HEADER));
-    if (n != sizeof(BRS_PACKET_HEADER)) {
-        if (n == 0) {
-            errno = EPIPE; // Connection closed
-        }
-        return -1;
-    }
-    
-    // Write payload if present
     uint16_t payload_size = ntohs(hdr->size);
-    if (payload_size > 0) {
-        if (payload == NULL) {
-            errno = EINVAL;
-            return -1;
-        }
-        
-        n = full_write(fd, payload, payload_size);
-        if (n != payload_size) {
-            if (n == 0) {
-                errno = EPIPE; // Connection closed
-            }
-            return -1;
-        }
+    if (payload_size > 0 && payload == NULL) {
+        errno = EINVAL;
+        return -1;
     }
     
-    return 0;
+    // Write header and payload with a single system call
+    struct iovec iov[2];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(BRS_PACKET_HEADER);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = payload_size;
+    return proto_send_iov(fd, iov, 2);
 }
 
+// Number of received payloads that did not fit in the caller's buffer
+static unsigned long heap_payloads = 0;
+
 /*
- * Receive a packet, blocking until one is available.
+ * Common code for receiving a packet.  The payload is read into buf if
+ * it fits, otherwise into storage allocated from the heap.
  */
-int proto_recv_packet(int fd, BRS_PACKET_HEADER *hdr, void **payloadp) {
+static int recv_packet(int fd, BRS_PACKET_HEADER *hdr, void *buf, size_t bufsize,
+                       void **payloadp) {
     if (hdr == NULL || payloadp == NULL) {
         errno = EINVAL;
         return -1;
@@ -124,15 +132,21 @@ int proto_recv_packet(int fd, BRS_PACKET_HEADER *hdr, void **payloadp) {
     
     // Read payload if present
     if (payload_size > 0) {
-        void *payload = malloc(payload_size);
-        if (payload == NULL) {
-            errno = ENOMEM;
-            return -1;
+        void *payload = buf;
+        if (payload_size > bufsize) {
+            payload = malloc(payload_size);
+            if (payload == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            if (buf != NULL) {
+                __atomic_fetch_add(&heap_payloads, 1, __ATOMIC_RELAXED);
+            }
         }
         
         n = full_read(fd, payload, payload_size);
         if (n != payload_size) {
-            free(payload);
+            proto_release_payload(payload, buf);
             if (n == 0) {
                 errno = EPIPE; // EOF before reading full payload
             }
@@ -145,3 +159,314 @@ int proto_recv_packet(int fd, BRS_PACKET_HEADER *hdr, void **payloadp) {
     return 0;
 }
 
+/*
+ * Receive a packet, blocking until one is available.
+ */
+int proto_recv_packet(int fd, BRS_PACKET_HEADER *hdr, void **payloadp) {
+    return recv_packet(fd, hdr, NULL, 0, payloadp);
+}
+
+/*
+ * Receive a packet into caller-supplied storage, blocking until one is available.
+ */
+int proto_recv_packet_buf(int fd, BRS_PACKET_HEADER *hdr, void *buf, size_t bufsize,
+                          void **payloadp) {
+    return recv_packet(fd, hdr, buf, bufsize, payloadp);
+}
+
+/*
+ * Release a payload received by proto_recv_packet_buf().
+ */
+void proto_release_payload(void *payload, void *buf) {
+    if (payload != NULL && payload != buf) {
+        free(payload);
+    }
+}
+
+/*
+ * Get the number of received payloads that had to be allocated from the heap.
+ */
+unsigned long proto_heap_payload_count(void) {
+    return __atomic_load_n(&heap_payloads, __ATOMIC_RELAXED);
+}
+
+/*
+ * Initialize a receive buffer.
+ */
+void proto_rbuf_init(PROTO_RBUF *rb, int fd, void *buf, size_t bufsize) {
+    rb->fd = fd;
+    rb->data = rb->buf = buf;
+    rb->size = rb->bufsize = bufsize;
+    rb->start = rb->end = 0;
+}
+
+/*
+ * Finalize a receive buffer.
+ */
+void proto_rbuf_fini(PROTO_RBUF *rb) {
+    if (rb->data != rb->buf) {
+        free(rb->data);
+    }
+    rb->data = rb->buf;
+    rb->size = rb->bufsize;
+    rb->start = rb->end = 0;
+}
+
+/*
+ * Move the unparsed data in a receive buffer to the start of its storage.
+ */
+static void rbuf_compact(PROTO_RBUF *rb) {
+    if (rb->start > 0) {
+        memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+        rb->end -= rb->start;
+        rb->start = 0;
+    }
+}
+
+/*
+ * Read as many bytes as are available into a receive buffer.
+ */
+ssize_t proto_rbuf_fill(PROTO_RBUF *rb, int nonblock) {
+    size_t pending = rb->end - rb->start;
+    
+    // Work out how much room the packet being received needs
+    size_t need = sizeof(BRS_PACKET_HEADER);
+    if (pending >= sizeof(BRS_PACKET_HEADER)) {
+        BRS_PACKET_HEADER hdr;
+        memcpy(&hdr, rb->data + rb->start, sizeof(hdr));
+        need = sizeof(BRS_PACKET_HEADER) + ntohs(hdr.size);
+    }
+    
+    if (need > rb->size) {
+        // Assemble an oversized packet in storage from the heap
+        char *data = malloc(need);
+        if (data == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(data, rb->data + rb->start, pending);
+        if (rb->data != rb->buf) {
+            free(rb->data);
+        } else {
+            __atomic_fetch_add(&heap_payloads, 1, __ATOMIC_RELAXED);
+        }
+        rb->data = data;
+        rb->size = need;
+        rb->start = 0;
+        rb->end = pending;
+    } else if (rb->data != rb->buf && pending <= rb->bufsize && need <= rb->bufsize) {
+        // Go back to the caller's storage once an oversized packet is done
+        memcpy(rb->buf, rb->data + rb->start, pending);
+        free(rb->data);
+        rb->data = rb->buf;
+        rb->size = rb->bufsize;
+        rb->start = 0;
+        rb->end = pending;
+    } else if (rb->start == rb->end || rb->start + need > rb->size || rb->end == rb->size) {
+        rbuf_compact(rb);
+    }
+    if (rb->end == rb->size) {
+        // The buffer holds a complete packet that has not been taken
+        errno = ENOBUFS;
+        return -1;
+    }
+    
+    ssize_t n;
+    if (nonblock) {
+        n = recv(rb->fd, rb->data + rb->end, rb->size - rb->end, MSG_DONTWAIT);
+    } else {
+        n = read(rb->fd, rb->data + rb->end, rb->size - rb->end);
+    }
+    if (n > 0) {
+        rb->end += n;
+    }
+    return n;
+}
+
+/*
+ * Take the next complete packet from a receive buffer.
+ */
+int proto_rbuf_next(PROTO_RBUF *rb, BRS_PACKET_HEADER **hdrp, void **payloadp) {
+    if (rb->end - rb->start < sizeof(BRS_PACKET_HEADER)) {
+        return 0;
+    }
+    
+    // Packets follow one another in the buffer, so one that comes after an
+    // odd-sized payload must be moved for its fields to be suitably aligned.
+    // This moves the packet taken last, which the caller has done with.
+    if (rb->start % sizeof(uint32_t) != 0) {
+        rbuf_compact(rb);
+    }
+    
+    BRS_PACKET_HEADER *hdr = (BRS_PACKET_HEADER *)(rb->data + rb->start);
+    uint16_t payload_size = ntohs(hdr->size);
+    if (rb->end - rb->start < sizeof(BRS_PACKET_HEADER) + payload_size) {
+        return 0;
+    }
+    
+    *hdrp = hdr;
+    *payloadp = payload_size > 0 ? (void *)(hdr + 1) : NULL;
+    rb->start += sizeof(BRS_PACKET_HEADER) + payload_size;
+    return 1;
+}
+
+/*
+ * Get the number of bytes received into a receive buffer but not yet taken.
+ */
+size_t proto_rbuf_pending(PROTO_RBUF *rb) {
+    return rb->end - rb->start;
+}
+
+/*
+ * Receive a packet through a receive buffer, blocking until one is available.
+ */
+int proto_recv_packet_rbuf(PROTO_RBUF *rb, BRS_PACKET_HEADER **hdrp, void **payloadp) {
+    while (!proto_rbuf_next(rb, hdrp, payloadp)) {
+        ssize_t n = proto_rbuf_fill(rb, 0);
+        if (n == 0) {
+            // EOF in the middle of a packet is an error
+            errno = rb->start == rb->end ? 0 : EPIPE;
+            return -1;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue; // Interrupted, retry
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Initialize a send buffer.
+ */
+void proto_wbuf_init(PROTO_WBUF *wb, int fd) {
+    wb->fd = fd;
+    wb->data = NULL;
+    wb->size = wb->start = wb->end = 0;
+}
+
+/*
+ * Finalize a send buffer.
+ */
+void proto_wbuf_fini(PROTO_WBUF *wb) {
+    free(wb->data);
+    wb->data = NULL;
+    wb->size = wb->start = wb->end = 0;
+}
+
+/*
+ * Write a vector of buffers without blocking, as far as the socket has room.
+ *
+ * @return  The number of bytes written, or -1 on error.
+ */
+static ssize_t send_iov_nonblock(int fd, struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (1) {
+        ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n >= 0) {
+            return n;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Send a vector of buffers through a send buffer, without blocking.
+ */
+int proto_wbuf_send_iov(PROTO_WBUF *wb, struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    
+    // Nothing can be written ahead of the data already kept
+    size_t written = 0;
+    if (proto_wbuf_flush(wb) < 0) {
+        return -1;
+    }
+    if (wb->start == wb->end && total > 0) {
+        ssize_t n = send_iov_nonblock(wb->fd, iov, iovcnt);
+        if (n < 0) {
+            return -1;
+        }
+        written = n;
+    }
+    if (written == total) {
+        return 0;
+    }
+    
+    // Keep the rest, making room for it at the end of the storage
+    size_t left = total - written;
+    size_t pending = wb->end - wb->start;
+    if (pending + left > PROTO_WBUF_MAX) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    if (wb->end + left > wb->size) {
+        if (pending + left <= wb->size) {
+            memmove(wb->data, wb->data + wb->start, pending);
+        } else {
+            size_t size = wb->size == 0 ? PROTO_WBUF_MIN : wb->size;
+            while (size < pending + left) {
+                size *= 2;
+            }
+            char *data = malloc(size);
+            if (data == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            if (pending > 0) {
+                memcpy(data, wb->data + wb->start, pending);
+            }
+            free(wb->data);
+            wb->data = data;
+            wb->size = size;
+        }
+        wb->start = 0;
+        wb->end = pending;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        size_t len = iov[i].iov_len;
+        size_t skip = written < len ? written : len;
+        written -= skip;
+        memcpy(wb->data + wb->end, (char *)iov[i].iov_base + skip, len - skip);
+        wb->end += len - skip;
+    }
+    return 0;
+}
+
+/*
+ * Write as much of the data kept by a send buffer as can be written.
+ */
+int proto_wbuf_flush(PROTO_WBUF *wb) {
+    if (wb->start < wb->end) {
+        struct iovec iov = { .iov_base = wb->data + wb->start, .iov_len = wb->end - wb->start };
+        ssize_t n = send_iov_nonblock(wb->fd, &iov, 1);
+        if (n < 0) {
+            return -1;
+        }
+        wb->start += n;
+    }
+    if (wb->start < wb->end) {
+        return 1;
+    }
+    wb->start = wb->end = 0;
+    return 0;
+}
+
+/*
+ * Get the number of bytes kept by a send buffer.
+ */
+size_t proto_wbuf_pending(PROTO_WBUF *wb) {
+    return wb->end - wb->start;
+}
@@ -0,0 +1,298 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "reactor.h"
+#include "affinity.h"
+#include "client_registry.h"
+#include "server_ext.h"
+#include "trader_ext.h"
+#include "protocol_ext.h"
+#include "trace.h"
+#include "debug.h"
+
+extern CLIENT_REGISTRY *client_registry;
+
+/*
+ * Maximum number of reads from one connection per readiness event, so that
+ * a client sending continuously does not starve the others.
+ */
+#define REACTOR_READS_PER_EVENT 4
+
+/*
+ * A client connection being served by a reactor.
+ */
+struct reactor_conn {
+    BRS_SESSION session;
+    PROTO_RBUF rbuf;
+    PROTO_WBUF wbuf;
+    int writing;                   // Waiting to write, rather than to read
+    uint32_t buf[REACTOR_BUFSIZE / sizeof(uint32_t)];
+};
+
+struct reactor {
+    int epoll_fd;
+    int wake_fd;                   // eventfd used to stop the reactor
+    pthread_t thread;
+};
+
+static struct reactor *reactors = NULL;
+static int reactor_count = 0;
+static int next_reactor = 0;       // Used only by the accepting thread
+static int running = 0;
+
+/*
+ * Close a connection and release its state.
+ */
+static void reactor_close(struct reactor *r, struct reactor_conn *conn) {
+    int fd = conn->session.fd;
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    brs_session_fini(&conn->session);
+    creg_unregister(client_registry, fd);
+    close(fd);
+    proto_rbuf_fini(&conn->rbuf);
+    proto_wbuf_fini(&conn->wbuf);
+    free(conn);
+}
+
+/*
+ * Write out what is waiting to be sent on a connection, and wait for it to
+ * become writable if some remains, rather than for more requests, so that
+ * a client that does not read its responses is held up until it does.
+ * Returns -1 if the connection is to be closed.
+ */
+static int reactor_output(struct reactor *r, struct reactor_conn *conn) {
+    int pending = brs_session_flush(&conn->session);
+    if (pending < 0) {
+        debug("Error sending to client fd %d: %s", conn->session.fd, strerror(errno));
+        return -1;
+    }
+    if (pending != conn->writing) {
+        struct epoll_event ev = { .events = (pending ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP,
+                                  .data.ptr = conn };
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, conn->session.fd, &ev) == -1) {
+            error("Failed to change events for client fd %d: %s", conn->session.fd, strerror(errno));
+            return -1;
+        }
+        conn->writing = pending;
+    }
+    return 0;
+}
+
+/*
+ * Handle every complete packet in the buffer of a connection.
+ * Returns -1 if the connection is to be closed.
+ */
+static int reactor_parse(struct reactor_conn *conn) {
+    BRS_PACKET_HEADER *hdr;
+    void *payload;
+    int result = 0;
+    
+    // Responses to the packets handled here are written out together
+    TRADER *corked = NULL;
+    while (proto_rbuf_next(&conn->rbuf, &hdr, &payload)) {
+        if (corked == NULL && conn->session.trader != NULL) {
+            corked = conn->session.trader;
+            trader_cork(corked);
+        }
+        if (brs_session_dispatch(&conn->session, hdr, payload) != 0) {
+            result = -1;
+            break;
+        }
+    }
+    if (corked != NULL) {
+        trader_uncork(corked);
+    }
+    return result;
+}
+
+/*
+ * Read and handle the data available on a connection.
+ * Returns -1 if the connection is to be closed.
+ */
+static int reactor_service(struct reactor_conn *conn) {
+    for (int i = 0; i < REACTOR_READS_PER_EVENT; i++) {
+        ssize_t n = proto_rbuf_fill(&conn->rbuf, 1);
+        if (n == 0) {
+            if (proto_rbuf_pending(&conn->rbuf) != 0) {
+                error("EOF in the middle of a packet from client fd %d", conn->session.fd);
+            } else {
+                debug("EOF received from client fd %d", conn->session.fd);
+            }
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            error("Error receiving packet from client fd %d: %s", conn->session.fd, strerror(errno));
+            return -1;
+        }
+        if (reactor_parse(conn) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Thread function for a reactor.
+ */
+static void *reactor_thread_func(void *arg) {
+    struct reactor *r = arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    char name[32];
+    snprintf(name, sizeof(name), "reactor.%d", (int)(r - reactors));
+    affinity_thread_start(AFFINITY_IO, r - reactors, name);
+    debug_thread("Reactor %ld starting", (long)(r - reactors));
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        int n = epoll_wait(r->epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error("Reactor epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct reactor_conn *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                uint64_t value;
+                ssize_t count = read(r->wake_fd, &value, sizeof(value));
+                (void)count;
+                continue;
+            }
+            // A connection being written is not read until it has been
+            // written out, unless the client has hung up
+            if ((!conn->writing || (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                && reactor_service(conn) != 0) {
+                reactor_close(r, conn);
+                continue;
+            }
+            if (reactor_output(r, conn) != 0) {
+                reactor_close(r, conn);
+            }
+        }
+    }
+    debug_thread("Reactor %ld terminating", (long)(r - reactors));
+    return NULL;
+}
+
+/*
+ * Start the reactor threads.
+ */
+int reactors_init(int count) {
+    if (count <= 0) {
+        return -1;
+    }
+    reactors = calloc(count, sizeof(struct reactor));
+    if (reactors == NULL) {
+        return -1;
+    }
+    running = 1;
+
+    for (int i = 0; i < count; i++) {
+        struct reactor *r = &reactors[i];
+        r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (r->epoll_fd == -1 || r->wake_fd == -1
+            || epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev) == -1
+            || pthread_create(&r->thread, NULL, reactor_thread_func, r) != 0) {
+            error("Failed to start reactor %d", i);
+            if (r->epoll_fd != -1) {
+                close(r->epoll_fd);
+            }
+            if (r->wake_fd != -1) {
+                close(r->wake_fd);
+            }
+            reactor_count = i;
+            reactors_fini();
+            return -1;
+        }
+        reactor_count = i + 1;
+    }
+
+    debug_thread("Started %d reactors", count);
+    return 0;
+}
+
+/*
+ * Stop the reactor threads.
+ */
+void reactors_fini(void) {
+    if (reactors == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < reactor_count; i++) {
+        uint64_t one = 1;
+        ssize_t n = write(reactors[i].wake_fd, &one, sizeof(one));
+        (void)n;
+    }
+    for (int i = 0; i < reactor_count; i++) {
+        pthread_join(reactors[i].thread, NULL);
+        close(reactors[i].epoll_fd);
+        close(reactors[i].wake_fd);
+    }
+    free(reactors);
+    reactors = NULL;
+    reactor_count = 0;
+}
+
+/*
+ * Hand a newly accepted client connection over to one of the reactors.
+ */
+int reactor_add_client(int fd) {
+    struct reactor_conn *conn = malloc(sizeof(struct reactor_conn));
+    if (conn == NULL) {
+        close(fd);
+        return -1;
+    }
+    // Nothing is to block the reactor: requests are read as they come, and
+    // responses are written through a send buffer
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        free(conn);
+        close(fd);
+        return -1;
+    }
+    brs_session_init(&conn->session, fd);
+    proto_rbuf_init(&conn->rbuf, fd, conn->buf, sizeof(conn->buf));
+    proto_wbuf_init(&conn->wbuf, fd);
+    conn->session.sender = &conn->wbuf;
+    conn->writing = 0;
+
+    if (creg_register(client_registry, fd) != 0) {
+        free(conn);
+        close(fd);
+        return -1;
+    }
+
+    struct reactor *r = &reactors[next_reactor];
+    next_reactor = (next_reactor + 1) % reactor_count;
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        error("Failed to add client fd %d to reactor: %s", fd, strerror(errno));
+        creg_unregister(client_registry, fd);
+        free(conn);
+        close(fd);
+        return -1;
+    }
+    debug_thread("[%d] Client assigned to reactor %ld", fd, (long)(r - reactors));
+    return 0;
+}
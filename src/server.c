@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <pthread.h>
 #include <unistd.h>
@@ -10,42 +11,32 @@
 #include <inttypes.h>
 
 #include "server.h"
+#include "affinity.h"
+#include "server_ext.h"
 #include "protocol.h"
+#include "protocol_ext.h"
 #include "trader.h"
+#include "trader_ext.h"
 #include "account.h"
 #include "exchange.h"
+#include "exchange_ext.h"
+#include "account_ext.h"
+#include "instrument.h"
+#include "fanout.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 #include "debug.h"
 
 extern EXCHANGE *exchange;
 extern CLIENT_REGISTRY *client_registry;
 
-/*
- * Get current thread ID
- */
-static inline unsigned long get_thread_id(void) {
-    return syscall(SYS_gettid);
-}
-
-/*
- * Debug macro with thread ID format (matching demo_server)
- */
-#define debug_thread(S, ...) \
-    do { \
-        fprintf(stderr, KMAG "DEBUG: %015lu: " KNRM S NL, get_thread_id(), ##__VA_ARGS__); \
-    } while (0)
-
-/*
- * Format timestamp from packet header
- */
-static double format_timestamp(uint32_t sec, uint32_t nsec) {
-    return (double)sec + (double)nsec / 1000000000.0;
-}
-
 /*
  * Format packet type name
  */
 static const char *packet_type_name(BRS_PACKET_TYPE type) {
-    switch (type) {
+    // The extended types are not members of BRS_PACKET_TYPE
+    switch ((int)type) {
         case BRS_LOGIN_PKT: return "LOGIN";
         case BRS_STATUS_PKT: return "STATUS";
         case BRS_DEPOSIT_PKT: return "DEPOSIT";
@@ -62,150 +53,290 @@ static const char *packet_type_name(BRS_PACKET_TYPE type) {
         case BRS_POSTED_PKT: return "POSTED";
         case BRS_CANCELED_PKT: return "CANCELED";
         case BRS_TRADED_PKT: return "TRADED";
+        case BRS_BULK_PKT: return "BULK";
+        case BRS_MASS_CANCEL_PKT: return "MASS_CANCEL";
+        case BRS_SUBSCRIBE_PKT: return "SUBSCRIBE";
+        case BRS_DEPTH_PKT: return "DEPTH";
+        case BRS_REPLAY_PKT: return "REPLAY";
         default: return "UNKNOWN";
     }
 }
 
 /*
- * Thread function for the thread that handles a particular client.
+ * Initialize the state of a client session.
  */
-void *brs_client_service(void *arg) {
-    int fd = *(int *)arg;
-    free(arg);
+void brs_session_init(BRS_SESSION *session, int fd) {
+    session->fd = fd;
+    session->trader = NULL;
+    session->username = NULL;
+    session->sender = NULL;
+}
+
+/*
+ * Send a packet to the client of a session, logged in or not, without
+ * blocking if the session has a send buffer.
+ */
+static int session_send(BRS_SESSION *session, BRS_PACKET_HEADER *hdr, void *payload) {
+    if (session->trader != NULL) {
+        return trader_send_packet(session->trader, hdr, payload);
+    }
+    if (session->sender == NULL) {
+        return proto_send_packet(session->fd, hdr, payload);
+    }
+    struct iovec iov[2];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(BRS_PACKET_HEADER);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = ntohs(hdr->size);
+    return proto_wbuf_send_iov(session->sender, iov, 2);
+}
+
+/*
+ * Write out what is waiting to be sent to the client of a session.
+ */
+int brs_session_flush(BRS_SESSION *session) {
+    if (session->trader != NULL) {
+        return trader_flush_sender(session->trader);
+    }
+    return session->sender != NULL ? proto_wbuf_flush(session->sender) : 0;
+}
+
+/*
+ * Answer a STATS request with a report of the server's statistics.
+ */
+static void send_stats(BRS_SESSION *session) {
+    char *report = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&report, &len);
+    if (out == NULL) {
+        return;
+    }
+    stats_report(out);
+    fclose(out);
     
-    // Detach thread
-    pthread_detach(pthread_self());
+    // A report too long for one packet is cut after the last whole line
+    // that fits, and ends with a line saying so
+    static const char truncated[] = "(truncated)\n";
+    if (len > UINT16_MAX) {
+        len = UINT16_MAX - (sizeof(truncated) - 1);
+        while (len > 0 && report[len - 1] != '\n') {
+            len--;
+        }
+        memcpy(report + len, truncated, sizeof(truncated) - 1);
+        len += sizeof(truncated) - 1;
+    }
     
-    // Register client
-    creg_register(client_registry, fd);
+    BRS_PACKET_HEADER hdr;
+    hdr.type = BRS_ACK_PKT;
+    hdr.size = htons(len);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.timestamp_sec = htonl(ts.tv_sec);
+    hdr.timestamp_nsec = htonl(ts.tv_nsec);
+    session_send(session, &hdr, report);
+    free(report);
+}
+
+/*
+ * Answer a BULK request, carrying out its items and sending the status
+ * followed by the result of each item.  The orders are checked against the
+ * trader's risk limits before the exchange is locked, each counting those
+ * let through before it.
+ */
+static void send_bulk(TRADER *trader, EXCHANGE *xchg, BRS_BULK_ITEM *request, int count) {
+    EXCHANGE_BULK_ITEM items[BRS_BULK_MAX];
+    BRS_NACK_REASON reasons[BRS_BULK_MAX];
+    uint32_t orders = 0;
+    uint64_t notional = 0;
+    for (int i = 0; i < count; i++) {
+        items[i].type = request[i].type;
+        items[i].order = request[i].type == BRS_CANCEL_PKT ? ntohl(request[i].quantity) : 0;
+        items[i].quantity = request[i].type == BRS_CANCEL_PKT ? 0 : ntohl(request[i].quantity);
+        items[i].price = ntohl(request[i].price);
+        reasons[i] = BRS_NACK_NONE;
+        if (items[i].type == BRS_BUY_PKT || items[i].type == BRS_SELL_PKT) {
+            reasons[i] = trader_risk_check(trader, items[i].quantity, items[i].price, orders, notional);
+            if (reasons[i] != BRS_NACK_NONE) {
+                items[i].type = 0;      // Skipped by the exchange
+            } else {
+                orders++;
+                notional += (uint64_t)items[i].quantity * items[i].price;
+            }
+        }
+    }
+    int done = exchange_bulk(xchg, trader, items, count);
+    if (done < 0) {
+        trader_send_nack(trader);
+        return;
+    }
     
-    TRADER *trader = NULL;
-    int logged_in = 0;
-    char *trader_username = NULL;  // Store username for debug messages
+    struct {
+        BRS_STATUS_INFO info;
+        BRS_BULK_RESULT results[BRS_BULK_MAX];
+    } response;                     // Both are whole numbers of 32-bit words
+    exchange_get_status(xchg, trader_get_account(trader), &response.info);
+    response.info.quantity = htonl(done);
+    for (int i = 0; i < count; i++) {
+        memset(&response.results[i], 0, sizeof(BRS_BULK_RESULT));
+        response.results[i].result = items[i].result;
+        if (reasons[i] != BRS_NACK_NONE) {
+            response.results[i].result = BRS_BULK_REJECTED;
+            response.results[i].reason = reasons[i];
+        }
+        response.results[i].order = htonl(items[i].order);
+        response.results[i].quantity = htonl(items[i].type == BRS_CANCEL_PKT ? items[i].quantity : 0);
+    }
     
-    debug_thread("[%d] Starting client service", fd);
+    BRS_PACKET_HEADER hdr;
+    hdr.type = BRS_ACK_PKT;
+    hdr.size = htons(sizeof(BRS_STATUS_INFO) + count * sizeof(BRS_BULK_RESULT));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.timestamp_sec = htonl(ts.tv_sec);
+    hdr.timestamp_nsec = htonl(ts.tv_nsec);
+    trader_send_packet(trader, &hdr, &response);
+}
+
+/*
+ * Answer a DEPTH request with the aggregated levels nearest the top of
+ * each side of the book.
+ */
+static void send_depth(TRADER *trader, EXCHANGE *xchg, int levels) {
+    struct {
+        BRS_DEPTH_INFO info;
+        BRS_DEPTH_LEVEL levels[2 * BRS_DEPTH_MAX];
+    } response;                     // Both are whole numbers of 32-bit words
+    int count = exchange_get_depth(xchg, levels, &response.info, response.levels);
+    if (count < 0) {
+        trader_send_nack(trader);
+        return;
+    }
     
-    // Main service loop
-    while (1) {
-        BRS_PACKET_HEADER hdr;
-        void *payload = NULL;
-        
-        int result = proto_recv_packet(fd, &hdr, &payload);
-        
-        if (result == -1) {
-            // Error or EOF
-            if (errno == 0) {
-                // EOF (clean connection close)
-                debug("EOF received from client fd %d", fd);
-            } else {
-                error("Error receiving packet from client fd %d: %s", fd, strerror(errno));
+    BRS_PACKET_HEADER hdr;
+    hdr.type = BRS_ACK_PKT;
+    hdr.size = htons(sizeof(BRS_DEPTH_INFO) + count * sizeof(BRS_DEPTH_LEVEL));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.timestamp_sec = htonl(ts.tv_sec);
+    hdr.timestamp_nsec = htonl(ts.tv_nsec);
+    trader_send_packet(trader, &hdr, &response);
+}
+
+/*
+ * Answer a REPLAY request with the packets of the tape kept since the one
+ * asked for.
+ */
+static void send_replay(TRADER *trader, EXCHANGE *xchg, uint32_t from, int max) {
+    struct {
+        BRS_REPLAY_INFO info;
+        BRS_REPLAY_EVENT events[BRS_REPLAY_MAX];
+    } response;                     // Both are whole numbers of 32-bit words
+    int count = exchange_replay(xchg, from, max, &response.info, response.events);
+    if (count < 0) {
+        trader_send_nack(trader);
+        return;
+    }
+    
+    BRS_PACKET_HEADER hdr;
+    hdr.type = BRS_ACK_PKT;
+    hdr.size = htons(sizeof(BRS_REPLAY_INFO) + count * sizeof(BRS_REPLAY_EVENT));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.timestamp_sec = htonl(ts.tv_sec);
+    hdr.timestamp_nsec = htonl(ts.tv_nsec);
+    trader_send_packet(trader, &hdr, &response);
+}
+
+/*
+ * Handle one packet received from a client, as for brs_session_dispatch().
+ */
+static int session_dispatch(BRS_SESSION *session, BRS_PACKET_HEADER *hdr, void *payload) {
+    int fd = session->fd;
+    TRADER *trader = session->trader;
+    const char *trader_username = session->username;
+    
+    // Convert packet type and size from network byte order
+    BRS_PACKET_TYPE type = (BRS_PACKET_TYPE)hdr->type;
+    uint16_t payload_size = ntohs(hdr->size);
+    uint32_t sec = ntohl(hdr->timestamp_sec), nsec = ntohl(hdr->timestamp_nsec);
+    
+    // Log incoming packet
+    if (type == BRS_LOGIN_PKT && payload != NULL && payload_size > 0) {
+        debug_thread("<= %u.%09u: type=%s, size=%d, user: '%.*s'", sec, nsec, packet_type_name(type), payload_size, payload_size, (char *)payload);
+    } else if (type == BRS_DEPOSIT_PKT && payload != NULL && payload_size == sizeof(BRS_FUNDS_INFO)) {
+        BRS_FUNDS_INFO *info = (BRS_FUNDS_INFO *)payload;
+        debug_thread("<= %u.%09u: type=%s, size=%d, amount: %u", sec, nsec, packet_type_name(type), payload_size, ntohl(info->amount));
+    } else if (type == BRS_WITHDRAW_PKT && payload != NULL && payload_size == sizeof(BRS_FUNDS_INFO)) {
+        BRS_FUNDS_INFO *info = (BRS_FUNDS_INFO *)payload;
+        debug_thread("<= %u.%09u: type=%s, size=%d, amount: %u", sec, nsec, packet_type_name(type), payload_size, ntohl(info->amount));
+    } else if (type == BRS_ESCROW_PKT && payload != NULL && payload_size == sizeof(BRS_ESCROW_INFO)) {
+        BRS_ESCROW_INFO *info = (BRS_ESCROW_INFO *)payload;
+        debug_thread("<= %u.%09u: type=%s, size=%d, quantity: %u", sec, nsec, packet_type_name(type), payload_size, ntohl(info->quantity));
+    } else if (type == BRS_RELEASE_PKT && payload != NULL && payload_size == sizeof(BRS_ESCROW_INFO)) {
+        BRS_ESCROW_INFO *info = (BRS_ESCROW_INFO *)payload;
+        debug_thread("<= %u.%09u: type=%s, size=%d, quantity: %u", sec, nsec, packet_type_name(type), payload_size, ntohl(info->quantity));
+    } else if (type == BRS_BUY_PKT && payload != NULL && payload_size == sizeof(BRS_ORDER_INFO)) {
+        BRS_ORDER_INFO *info = (BRS_ORDER_INFO *)payload;
+        debug_thread("<= %u.%09u: type=%s, size=%d, quantity: %u, price: %u", sec, nsec, packet_type_name(type), payload_size, ntohl(info->quantity), ntohl(info->price));
+    } else if (type == BRS_SELL_PKT && payload != NULL && payload_size == sizeof(BRS_ORDER_INFO)) {
+        BRS_ORDER_INFO *info = (BRS_ORDER_INFO *)payload;
+        debug_thread("<= %u.%09u: type=%s, size=%d, quantity: %u, price: %u", sec, nsec, packet_type_name(type), payload_size, ntohl(info->quantity), ntohl(info->price));
+    } else if (type == BRS_CANCEL_PKT && payload != NULL && payload_size == sizeof(BRS_CANCEL_INFO)) {
+        BRS_CANCEL_INFO *info = (BRS_CANCEL_INFO *)payload;
+        debug_thread("<= %u.%09u: type=%s, size=%d, order: %u", sec, nsec, packet_type_name(type), payload_size, ntohl(info->order));
+    } else if (type == BRS_STATUS_PKT) {
+        debug_thread("<= %u.%09u: type=%s, size=%d (no payload)", sec, nsec, packet_type_name(type), payload_size);
+    } else {
+        debug_thread("<= %u.%09u: type=%s, size=%d", sec, nsec, packet_type_name(type), payload_size);
+    }
+    
+    debug_thread("[%d] %s packet received", fd, packet_type_name(type));
+    
+    // Handle LOGIN before login
+    if (trader == NULL) {
+        if (type == BRS_LOGIN_PKT) {
+            // Extract username from payload
+            if (payload_size == 0 || payload == NULL) {
+                // Send NACK
+                BRS_PACKET_HEADER nack_hdr;
+                nack_hdr.type = BRS_NACK_PKT;
+                nack_hdr.size = 0;
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                nack_hdr.timestamp_sec = htonl(ts.tv_sec);
+                nack_hdr.timestamp_nsec = htonl(ts.tv_nsec);
+                session_send(session, &nack_hdr, NULL);
+                return 0;
             }
-            break;
-        }
-        
-        // result == 0 means success
-        
-        // Convert packet type and size from network byte order
-        BRS_PACKET_TYPE type = (BRS_PACKET_TYPE)hdr.type;
-        uint16_t payload_size = ntohs(hdr.size);
-        double timestamp = format_timestamp(ntohl(hdr.timestamp_sec), ntohl(hdr.timestamp_nsec));
-        
-        // Log incoming packet
-        if (type == BRS_LOGIN_PKT && payload != NULL && payload_size > 0) {
+            
+            // Username is not null-terminated, so we need to add null terminator
             char *username = malloc(payload_size + 1);
+            if (username == NULL) {
+                return -1;
+            }
             memcpy(username, payload, payload_size);
             username[payload_size] = '\0';
-            debug_thread("<= %.9f: type=%s, size=%d, user: '%s'", timestamp, packet_type_name(type), payload_size, username);
-            free(username);
-        } else if (type == BRS_DEPOSIT_PKT && payload != NULL && payload_size == sizeof(BRS_FUNDS_INFO)) {
-            BRS_FUNDS_INFO *info = (BRS_FUNDS_INFO *)payload;
-            debug_thread("<= %.9f: type=%s, size=%d, amount: %u", timestamp, packet_type_name(type), payload_size, ntohl(info->amount));
-        } else if (type == BRS_WITHDRAW_PKT && payload != NULL && payload_size == sizeof(BRS_FUNDS_INFO)) {
-            BRS_FUNDS_INFO *info = (BRS_FUNDS_INFO *)payload;
-            debug_thread("<= %.9f: type=%s, size=%d, amount: %u", timestamp, packet_type_name(type), payload_size, ntohl(info->amount));
-        } else if (type == BRS_ESCROW_PKT && payload != NULL && payload_size == sizeof(BRS_ESCROW_INFO)) {
-            BRS_ESCROW_INFO *info = (BRS_ESCROW_INFO *)payload;
-            debug_thread("<= %.9f: type=%s, size=%d, quantity: %u", timestamp, packet_type_name(type), payload_size, ntohl(info->quantity));
-        } else if (type == BRS_RELEASE_PKT && payload != NULL && payload_size == sizeof(BRS_ESCROW_INFO)) {
-            BRS_ESCROW_INFO *info = (BRS_ESCROW_INFO *)payload;
-            debug_thread("<= %.9f: type=%s, size=%d, quantity: %u", timestamp, packet_type_name(type), payload_size, ntohl(info->quantity));
-        } else if (type == BRS_BUY_PKT && payload != NULL && payload_size == sizeof(BRS_ORDER_INFO)) {
-            BRS_ORDER_INFO *info = (BRS_ORDER_INFO *)payload;
-            debug_thread("<= %.9f: type=%s, size=%d, quantity: %u, price: %u", timestamp, packet_type_name(type), payload_size, ntohl(info->quantity), ntohl(info->price));
-        } else if (type == BRS_SELL_PKT && payload != NULL && payload_size == sizeof(BRS_ORDER_INFO)) {
-            BRS_ORDER_INFO *info = (BRS_ORDER_INFO *)payload;
-            debug_thread("<= %.9f: type=%s, size=%d, quantity: %u, price: %u", timestamp, packet_type_name(type), payload_size, ntohl(info->quantity), ntohl(info->price));
-        } else if (type == BRS_CANCEL_PKT && payload != NULL && payload_size == sizeof(BRS_CANCEL_INFO)) {
-            BRS_CANCEL_INFO *info = (BRS_CANCEL_INFO *)payload;
-            debug_thread("<= %.9f: type=%s, size=%d, order: %u", timestamp, packet_type_name(type), payload_size, ntohl(info->order));
-        } else if (type == BRS_STATUS_PKT) {
-            debug_thread("<= %.9f: type=%s, size=%d (no payload)", timestamp, packet_type_name(type), payload_size);
-        } else {
-            debug_thread("<= %.9f: type=%s, size=%d", timestamp, packet_type_name(type), payload_size);
-        }
-        
-        debug_thread("[%d] %s packet received", fd, packet_type_name(type));
-        
-        // Handle LOGIN before login
-        if (!logged_in) {
-            if (type == BRS_LOGIN_PKT) {
-                // Extract username from payload
-                if (payload_size == 0 || payload == NULL) {
-                    // Send NACK
-                    BRS_PACKET_HEADER nack_hdr;
-                    nack_hdr.type = BRS_NACK_PKT;
-                    nack_hdr.size = 0;
-                    struct timespec ts;
-                    clock_gettime(CLOCK_REALTIME, &ts);
-                    nack_hdr.timestamp_sec = htonl(ts.tv_sec);
-                    nack_hdr.timestamp_nsec = htonl(ts.tv_nsec);
-                    proto_send_packet(fd, &nack_hdr, NULL);
-                    free(payload);
-                    continue;
-                }
-                
-                // Username is not null-terminated, so we need to add null terminator
-                char *username = malloc(payload_size + 1);
-                if (username == NULL) {
-                    free(payload);
-                    break;
-                }
-                memcpy(username, payload, payload_size);
-                username[payload_size] = '\0';
-                
-                // Try to login
-                debug_thread("[%d] Login '%s'", fd, username);
-                trader = trader_login(fd, username);
-                
-                if (trader != NULL) {
-                    logged_in = 1;
-                    // Store username for debug messages
-                    trader_username = malloc(strlen(username) + 1);
-                    if (trader_username != NULL) {
-                        strcpy(trader_username, username);
-                    }
-                }
-                free(username);
-                
-                if (trader != NULL) {
-                    // Send ACK
-                    trader_send_ack(trader, NULL);
-                } else {
-                    // Send NACK
-                    BRS_PACKET_HEADER nack_hdr;
-                    nack_hdr.type = BRS_NACK_PKT;
-                    nack_hdr.size = 0;
-                    struct timespec ts;
-                    clock_gettime(CLOCK_REALTIME, &ts);
-                    nack_hdr.timestamp_sec = htonl(ts.tv_sec);
-                    nack_hdr.timestamp_nsec = htonl(ts.tv_nsec);
-                    proto_send_packet(fd, &nack_hdr, NULL);
+            
+            // Try to login
+            debug_thread("[%d] Login '%s'", fd, username);
+            trader = session->sender != NULL ? trader_login_buffered(session->sender, username)
+                                             : trader_login(fd, username);
+            
+            if (trader != NULL) {
+                session->trader = trader;
+                // Store username for debug messages
+                session->username = malloc(strlen(username) + 1);
+                if (session->username != NULL) {
+                    strcpy(session->username, username);
                 }
-                
-                free(payload);
-                continue;
+            }
+            free(username);
+            
+            if (trader != NULL) {
+                // Send ACK
+                trader_send_ack(trader, NULL);
             } else {
-                // Not logged in and not LOGIN packet - send NACK
+                // Send NACK
                 BRS_PACKET_HEADER nack_hdr;
                 nack_hdr.type = BRS_NACK_PKT;
                 nack_hdr.size = 0;
@@ -213,274 +344,460 @@ void *brs_client_service(void *arg) {
                 clock_gettime(CLOCK_REALTIME, &ts);
                 nack_hdr.timestamp_sec = htonl(ts.tv_sec);
                 nack_hdr.timestamp_nsec = htonl(ts.tv_nsec);
-                proto_send_packet(fd, &nack_hdr, NULL);
-                free(payload);
-                continue;
+                session_send(session, &nack_hdr, NULL);
             }
+            
+            return 0;
+        } else {
+            // Not logged in and not LOGIN packet - send NACK
+            BRS_PACKET_HEADER nack_hdr;
+            nack_hdr.type = BRS_NACK_PKT;
+            nack_hdr.size = 0;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            nack_hdr.timestamp_sec = htonl(ts.tv_sec);
+            nack_hdr.timestamp_nsec = htonl(ts.tv_nsec);
+            session_send(session, &nack_hdr, NULL);
+            return 0;
+        }
+    }
+    
+    if (hdr->type == BRS_STATS_PKT) {
+        send_stats(session);
+        return 0;
+    }
+    
+    // Requests about instruments other than the default one are enclosed
+    // in an envelope naming the instrument
+    EXCHANGE *xchg = exchange;
+    if (hdr->type == BRS_ENVELOPE_PKT) {
+        BRS_ENVELOPE_INFO *envelope = payload;
+        if (payload == NULL || payload_size < sizeof(BRS_ENVELOPE_INFO)
+            || (xchg = instrument_lookup(envelope->symbol, BRS_SYMBOL_SIZE)) == NULL) {
+            debug_thread("[%d] Envelope for unknown instrument", fd);
+            trader_send_nack(trader);
+            return 0;
+        }
+        type = (BRS_PACKET_TYPE)envelope->type;
+        if (type != BRS_STATUS_PKT && type != BRS_ESCROW_PKT && type != BRS_RELEASE_PKT
+            && type != BRS_BUY_PKT && type != BRS_SELL_PKT && type != BRS_CANCEL_PKT
+            && type != BRS_BULK_PKT && type != BRS_MASS_CANCEL_PKT && type != BRS_DEPTH_PKT
+            && type != BRS_REPLAY_PKT) {
+            trader_send_nack(trader);
+            return 0;
+        }
+        payload_size -= sizeof(BRS_ENVELOPE_INFO);
+        payload = payload_size > 0 ? (void *)(envelope + 1) : NULL;
+        debug_thread("[%d] %s packet for instrument %.*s", fd, packet_type_name(type),
+                     BRS_SYMBOL_SIZE, envelope->symbol);
+    }
+    int instrument = exchange_get_instrument(xchg);
+    
+    // After login, handle other commands
+    switch ((int)type) {
+        case BRS_LOGIN_PKT:
+            // Already logged in - send NACK
+            trader_send_nack(trader);
+            break;
+            
+        case BRS_STATUS_PKT: {
+            debug_thread("Get status of exchange %p", xchg);
+            BRS_STATUS_INFO info;
+            exchange_get_status(xchg, trader_get_account(trader), &info);
+            trader_send_ack(trader, &info);
+            break;
+        }
+        
+        case BRS_DEPOSIT_PKT: {
+            if (payload_size != sizeof(BRS_FUNDS_INFO) || payload == NULL) {
+                trader_send_nack(trader);
+                break;
+            }
+            
+            BRS_FUNDS_INFO *funds_info = (BRS_FUNDS_INFO *)payload;
+            funds_t amount = ntohl(funds_info->amount);
+            
+            ACCOUNT *account = trader_get_account(trader);
+            account_increase_balance(account, amount);
+            journal_account(JOURNAL_DEPOSIT, account_get_name(account), NULL, amount);
+            
+            debug_thread("Get status of exchange %p", xchg);
+            
+            BRS_STATUS_INFO info;
+            exchange_get_status(xchg, account, &info);
+            trader_send_ack(trader, &info);
+            break;
         }
         
-        // After login, handle other commands
-        switch (type) {
-            case BRS_LOGIN_PKT:
-                // Already logged in - send NACK
+        case BRS_WITHDRAW_PKT: {
+            if (payload_size != sizeof(BRS_FUNDS_INFO) || payload == NULL) {
                 trader_send_nack(trader);
-                free(payload);
                 break;
-                
-            case BRS_STATUS_PKT: {
-                debug_thread("Get status of exchange %p", exchange);
+            }
+            
+            BRS_FUNDS_INFO *funds_info = (BRS_FUNDS_INFO *)payload;
+            funds_t amount = ntohl(funds_info->amount);
+            
+            ACCOUNT *account = trader_get_account(trader);
+            // Get current balance before withdraw
+            BRS_STATUS_INFO temp_info;
+            account_get_status(account, &temp_info);
+            funds_t old_balance = ntohl(temp_info.balance);
+            
+            if (account_decrease_balance(account, amount) != 0) {
+                debug_thread("Account '%s' balance %u is less than debit amount %u", trader_username ? trader_username : "unknown", old_balance, amount);
+                trader_send_nack(trader);
+            } else {
+                journal_account(JOURNAL_WITHDRAW, account_get_name(account), NULL, amount);
+                debug_thread("Account '%s': decrease balance (%u -> %u)", trader_username ? trader_username : "unknown", old_balance, old_balance - amount);
+                debug_thread("Get status of exchange %p", xchg);
                 BRS_STATUS_INFO info;
-                exchange_get_status(exchange, trader_get_account(trader), &info);
+                exchange_get_status(xchg, account, &info);
                 trader_send_ack(trader, &info);
-                free(payload);
+            }
+            break;
+        }
+        
+        case BRS_ESCROW_PKT: {
+            if (payload_size != sizeof(BRS_ESCROW_INFO) || payload == NULL) {
+                trader_send_nack(trader);
                 break;
             }
             
-            case BRS_DEPOSIT_PKT: {
-                if (payload_size != sizeof(BRS_FUNDS_INFO) || payload == NULL) {
-                    trader_send_nack(trader);
-                    free(payload);
-                    break;
-                }
-                
-                BRS_FUNDS_INFO *funds_info = (BRS_FUNDS_INFO *)payload;
-                funds_t amount = ntohl(funds_info->amount);
-                
-                ACCOUNT *account = trader_get_account(trader);
-                account_increase_balance(account, amount);
-                
-                debug_thread("Get status of exchange %p", exchange);
-                
+            BRS_ESCROW_INFO *escrow_info = (BRS_ESCROW_INFO *)payload;
+            quantity_t quantity = ntohl(escrow_info->quantity);
+            
+            ACCOUNT *account = trader_get_account(trader);
+            account_increase_inventory_in(account, instrument, quantity);
+            journal_account(JOURNAL_ESCROW, account_get_name(account), exchange_get_symbol(xchg), quantity);
+            
+            debug_thread("Get status of exchange %p", xchg);
+            
+            BRS_STATUS_INFO info;
+            exchange_get_status(xchg, account, &info);
+            trader_send_ack(trader, &info);
+            break;
+        }
+        
+        case BRS_RELEASE_PKT: {
+            if (payload_size != sizeof(BRS_ESCROW_INFO) || payload == NULL) {
+                trader_send_nack(trader);
+                break;
+            }
+            
+            BRS_ESCROW_INFO *escrow_info = (BRS_ESCROW_INFO *)payload;
+            quantity_t quantity = ntohl(escrow_info->quantity);
+            
+            ACCOUNT *account = trader_get_account(trader);
+            // Get current inventory before release
+            BRS_STATUS_INFO temp_info;
+            account_get_status_in(account, instrument, &temp_info);
+            quantity_t old_inventory = ntohl(temp_info.inventory);
+            
+            if (account_decrease_inventory_in(account, instrument, quantity) != 0) {
+                debug_thread("Account '%s' inventory %u is less than quantity %u to decrease by", trader_username ? trader_username : "unknown", old_inventory, quantity);
+                trader_send_nack(trader);
+            } else {
+                journal_account(JOURNAL_RELEASE, account_get_name(account), exchange_get_symbol(xchg), quantity);
+                debug_thread("Get status of exchange %p", xchg);
                 BRS_STATUS_INFO info;
-                exchange_get_status(exchange, account, &info);
+                exchange_get_status(xchg, account, &info);
                 trader_send_ack(trader, &info);
-                free(payload);
+            }
+            break;
+        }
+        
+        case BRS_BUY_PKT: {
+            if (payload_size != sizeof(BRS_ORDER_INFO) || payload == NULL) {
+                trader_send_nack(trader);
                 break;
             }
             
-            case BRS_WITHDRAW_PKT: {
-                if (payload_size != sizeof(BRS_FUNDS_INFO) || payload == NULL) {
-                    trader_send_nack(trader);
-                    free(payload);
-                    break;
-                }
-                
-                BRS_FUNDS_INFO *funds_info = (BRS_FUNDS_INFO *)payload;
-                funds_t amount = ntohl(funds_info->amount);
-                
-                ACCOUNT *account = trader_get_account(trader);
-                // Get current balance before withdraw
-                BRS_STATUS_INFO temp_info;
-                account_get_status(account, &temp_info);
-                funds_t old_balance = ntohl(temp_info.balance);
-                
-                if (account_decrease_balance(account, amount) != 0) {
-                    debug_thread("Account '%s' balance %u is less than debit amount %u", trader_username ? trader_username : "unknown", old_balance, amount);
-                    trader_send_nack(trader);
-                } else {
-                    debug_thread("Account '%s': decrease balance (%u -> %u)", trader_username ? trader_username : "unknown", old_balance, old_balance - amount);
-                    debug_thread("Get status of exchange %p", exchange);
-                    BRS_STATUS_INFO info;
-                    exchange_get_status(exchange, account, &info);
-                    trader_send_ack(trader, &info);
-                }
-                free(payload);
+            BRS_ORDER_INFO *order_info = (BRS_ORDER_INFO *)payload;
+            quantity_t quantity = ntohl(order_info->quantity);
+            funds_t price = ntohl(order_info->price);
+            
+            debug_thread("brs buy: quantity: %u, limit: %u", quantity, price);
+            
+            BRS_NACK_REASON reason = trader_risk_check(trader, quantity, price, 0, 0);
+            if (reason != BRS_NACK_NONE) {
+                trader_send_nack_reason(trader, reason);
                 break;
             }
             
-            case BRS_ESCROW_PKT: {
-                if (payload_size != sizeof(BRS_ESCROW_INFO) || payload == NULL) {
-                    trader_send_nack(trader);
-                    free(payload);
-                    break;
-                }
-                
-                BRS_ESCROW_INFO *escrow_info = (BRS_ESCROW_INFO *)payload;
-                quantity_t quantity = ntohl(escrow_info->quantity);
-                
-                ACCOUNT *account = trader_get_account(trader);
-                account_increase_inventory(account, quantity);
-                
-                debug_thread("Get status of exchange %p", exchange);
-                
+            ACCOUNT *account = trader_get_account(trader);
+            orderid_t order_id = exchange_post_buy(xchg, trader, quantity, price);
+            
+            if (order_id == 0) {
+                trader_send_nack(trader);
+            } else {
+                debug_thread("Get status of exchange %p", xchg);
                 BRS_STATUS_INFO info;
-                exchange_get_status(exchange, account, &info);
+                exchange_get_status(xchg, account, &info);
+                info.orderid = htonl(order_id);
                 trader_send_ack(trader, &info);
-                free(payload);
+            }
+            break;
+        }
+        
+        case BRS_SELL_PKT: {
+            if (payload_size != sizeof(BRS_ORDER_INFO) || payload == NULL) {
+                trader_send_nack(trader);
                 break;
             }
             
-            case BRS_RELEASE_PKT: {
-                if (payload_size != sizeof(BRS_ESCROW_INFO) || payload == NULL) {
-                    trader_send_nack(trader);
-                    free(payload);
-                    break;
-                }
-                
-                BRS_ESCROW_INFO *escrow_info = (BRS_ESCROW_INFO *)payload;
-                quantity_t quantity = ntohl(escrow_info->quantity);
-                
-                ACCOUNT *account = trader_get_account(trader);
-                // Get current inventory before release
-                BRS_STATUS_INFO temp_info;
-                account_get_status(account, &temp_info);
-                quantity_t old_inventory = ntohl(temp_info.inventory);
-                
-                if (account_decrease_inventory(account, quantity) != 0) {
-                    debug_thread("Account '%s' inventory %u is less than quantity %u to decrease by", trader_username ? trader_username : "unknown", old_inventory, quantity);
-                    trader_send_nack(trader);
-                } else {
-                    debug_thread("Get status of exchange %p", exchange);
-                    BRS_STATUS_INFO info;
-                    exchange_get_status(exchange, account, &info);
-                    trader_send_ack(trader, &info);
-                }
-                free(payload);
+            BRS_ORDER_INFO *order_info = (BRS_ORDER_INFO *)payload;
+            quantity_t quantity = ntohl(order_info->quantity);
+            funds_t price = ntohl(order_info->price);
+            
+            debug_thread("brs_sell: quantity: %u, limit: %u", quantity, price);
+            
+            BRS_NACK_REASON reason = trader_risk_check(trader, quantity, price, 0, 0);
+            if (reason != BRS_NACK_NONE) {
+                trader_send_nack_reason(trader, reason);
                 break;
             }
             
-            case BRS_BUY_PKT: {
-                if (payload_size != sizeof(BRS_ORDER_INFO) || payload == NULL) {
-                    trader_send_nack(trader);
-                    free(payload);
-                    break;
-                }
-                
-                BRS_ORDER_INFO *order_info = (BRS_ORDER_INFO *)payload;
-                quantity_t quantity = ntohl(order_info->quantity);
-                funds_t price = ntohl(order_info->price);
-                
-                debug_thread("brs buy: quantity: %u, limit: %u", quantity, price);
-                
-                ACCOUNT *account = trader_get_account(trader);
-                orderid_t order_id = exchange_post_buy(exchange, trader, quantity, price);
-                
-                if (order_id == 0) {
-                    trader_send_nack(trader);
-                } else {
-                    // Broadcast POSTED notification before ACK
-                    debug_thread("Attempt to broadcast");
-                    BRS_PACKET_HEADER hdr;
-                    struct timespec ts;
-                    clock_gettime(CLOCK_REALTIME, &ts);
-                    hdr.timestamp_sec = htonl(ts.tv_sec);
-                    hdr.timestamp_nsec = htonl(ts.tv_nsec);
-                    hdr.type = BRS_POSTED_PKT;
-                    hdr.size = htons(sizeof(BRS_NOTIFY_INFO));
-                    BRS_NOTIFY_INFO notify;
-                    notify.buyer = htonl(order_id);
-                    notify.seller = 0;
-                    notify.quantity = htonl(quantity);
-                    notify.price = htonl(price);
-                    trader_broadcast_packet(&hdr, &notify);
-                    
-                    debug_thread("Get status of exchange %p", exchange);
-                    BRS_STATUS_INFO info;
-                    exchange_get_status(exchange, account, &info);
-                    info.orderid = htonl(order_id);
-                    trader_send_ack(trader, &info);
-                }
-                free(payload);
+            ACCOUNT *account = trader_get_account(trader);
+            // Check inventory before posting
+            BRS_STATUS_INFO temp_info;
+            account_get_status_in(account, instrument, &temp_info);
+            quantity_t inventory = ntohl(temp_info.inventory);
+            
+            orderid_t order_id = exchange_post_sell(xchg, trader, quantity, price);
+            
+            if (order_id == 0) {
+                debug_thread("Account '%s' inventory %u is less than quantity %u to decrease by", trader_username ? trader_username : "unknown", inventory, quantity);
+                trader_send_nack(trader);
+            } else {
+                debug_thread("Get status of exchange %p", xchg);
+                BRS_STATUS_INFO info;
+                exchange_get_status(xchg, account, &info);
+                info.orderid = htonl(order_id);
+                trader_send_ack(trader, &info);
+            }
+            break;
+        }
+        
+        case BRS_CANCEL_PKT: {
+            if (payload_size != sizeof(BRS_CANCEL_INFO) || payload == NULL) {
+                trader_send_nack(trader);
                 break;
             }
             
-            case BRS_SELL_PKT: {
-                if (payload_size != sizeof(BRS_ORDER_INFO) || payload == NULL) {
-                    trader_send_nack(trader);
-                    free(payload);
-                    break;
-                }
-                
-                BRS_ORDER_INFO *order_info = (BRS_ORDER_INFO *)payload;
-                quantity_t quantity = ntohl(order_info->quantity);
-                funds_t price = ntohl(order_info->price);
-                
-                debug_thread("brs_sell: quantity: %u, limit: %u", quantity, price);
-                
-                ACCOUNT *account = trader_get_account(trader);
-                // Check inventory before posting
-                BRS_STATUS_INFO temp_info;
-                account_get_status(account, &temp_info);
-                quantity_t inventory = ntohl(temp_info.inventory);
-                
-                orderid_t order_id = exchange_post_sell(exchange, trader, quantity, price);
-                
-                if (order_id == 0) {
-                    debug_thread("Account '%s' inventory %u is less than quantity %u to decrease by", trader_username ? trader_username : "unknown", inventory, quantity);
-                    trader_send_nack(trader);
-                } else {
-                    debug_thread("Get status of exchange %p", exchange);
-                    BRS_STATUS_INFO info;
-                    exchange_get_status(exchange, account, &info);
-                    info.orderid = htonl(order_id);
-                    trader_send_ack(trader, &info);
-                    
-                    // Broadcast POSTED notification after ACK
-                    BRS_PACKET_HEADER hdr;
-                    struct timespec ts;
-                    clock_gettime(CLOCK_REALTIME, &ts);
-                    hdr.timestamp_sec = htonl(ts.tv_sec);
-                    hdr.timestamp_nsec = htonl(ts.tv_nsec);
-                    hdr.type = BRS_POSTED_PKT;
-                    hdr.size = htons(sizeof(BRS_NOTIFY_INFO));
-                    BRS_NOTIFY_INFO notify;
-                    notify.buyer = 0;
-                    notify.seller = htonl(order_id);
-                    notify.quantity = htonl(quantity);
-                    notify.price = htonl(price);
-                    trader_broadcast_packet(&hdr, &notify);
-                }
-                free(payload);
+            BRS_CANCEL_INFO *cancel_info = (BRS_CANCEL_INFO *)payload;
+            orderid_t order = ntohl(cancel_info->order);
+            quantity_t quantity;
+            
+            debug_thread("brs_cancel: order: %u", order);
+            debug_thread("Exchange %p trying to cancel order %u", xchg, order);
+            
+            if (exchange_cancel(xchg, trader, order, &quantity) != 0) {
+                debug_thread("Order to be canceled does not exist in exchange");
+                trader_send_nack(trader);
+            } else {
+                debug_thread("Get status of exchange %p", xchg);
+                BRS_STATUS_INFO info;
+                exchange_get_status(xchg, trader_get_account(trader), &info);
+                info.orderid = htonl(order);
+                info.quantity = htonl(quantity);
+                trader_send_ack(trader, &info);
+            }
+            break;
+        }
+        
+        case BRS_BULK_PKT: {
+            int count = payload_size / sizeof(BRS_BULK_ITEM);
+            if (payload == NULL || payload_size % sizeof(BRS_BULK_ITEM) != 0
+                || count == 0 || count > BRS_BULK_MAX) {
+                trader_send_nack(trader);
                 break;
             }
             
-            case BRS_CANCEL_PKT: {
-                if (payload_size != sizeof(BRS_CANCEL_INFO) || payload == NULL) {
-                    trader_send_nack(trader);
-                    free(payload);
-                    break;
-                }
-                
-                BRS_CANCEL_INFO *cancel_info = (BRS_CANCEL_INFO *)payload;
-                orderid_t order = ntohl(cancel_info->order);
-                quantity_t quantity;
-                
-                debug_thread("brs_cancel: order: %u", order);
-                debug_thread("Exchange %p trying to cancel order %u", exchange, order);
-                
-                if (exchange_cancel(exchange, trader, order, &quantity) != 0) {
-                    debug_thread("Order to be canceled does not exist in exchange");
-                    trader_send_nack(trader);
-                } else {
-                    debug_thread("Get status of exchange %p", exchange);
-                    BRS_STATUS_INFO info;
-                    exchange_get_status(exchange, trader_get_account(trader), &info);
-                    info.orderid = htonl(order);
-                    info.quantity = htonl(quantity);
-                    trader_send_ack(trader, &info);
+            debug_thread("brs_bulk: %d items", count);
+            send_bulk(trader, xchg, (BRS_BULK_ITEM *)payload, count);
+            break;
+        }
+        
+        case BRS_MASS_CANCEL_PKT: {
+            quantity_t quantity;
+            int canceled = exchange_cancel_all(xchg, trader, &quantity);
+            
+            if (canceled < 0) {
+                trader_send_nack(trader);
+            } else {
+                debug_thread("Get status of exchange %p", xchg);
+                BRS_STATUS_INFO info;
+                exchange_get_status(xchg, trader_get_account(trader), &info);
+                info.orderid = htonl(canceled);
+                info.quantity = htonl(quantity);
+                trader_send_ack(trader, &info);
+            }
+            break;
+        }
+        
+        case BRS_SUBSCRIBE_PKT: {
+            if (payload_size != sizeof(BRS_SUBSCRIBE_INFO) || payload == NULL) {
+                trader_send_nack(trader);
+                break;
+            }
+            
+            BRS_SUBSCRIBE_INFO *subscribe_info = (BRS_SUBSCRIBE_INFO *)payload;
+            unsigned interval = ntohl(subscribe_info->interval);
+            
+            debug_thread("brs_subscribe: level: %u, interval: %u", subscribe_info->level, interval);
+            
+            if (fanout_subscribe(trader, subscribe_info->level, interval) != 0) {
+                trader_send_nack(trader);
+            } else {
+                BRS_STATUS_INFO info;
+                exchange_get_status(xchg, trader_get_account(trader), &info);
+                trader_send_ack(trader, &info);
+            }
+            break;
+        }
+        
+        case BRS_DEPTH_PKT: {
+            int levels = BRS_DEPTH_DEFAULT;
+            if (payload_size == sizeof(BRS_DEPTH_REQUEST) && payload != NULL) {
+                uint32_t requested = ntohl(((BRS_DEPTH_REQUEST *)payload)->levels);
+                if (requested != 0) {
+                    levels = requested > BRS_DEPTH_MAX ? BRS_DEPTH_MAX : (int)requested;
                 }
-                free(payload);
+            } else if (payload_size != 0) {
+                trader_send_nack(trader);
                 break;
             }
             
-            default:
-                // Unknown packet type - send NACK
+            debug_thread("brs_depth: levels: %d", levels);
+            send_depth(trader, xchg, levels);
+            break;
+        }
+        
+        case BRS_REPLAY_PKT: {
+            if (payload_size != sizeof(BRS_REPLAY_REQUEST) || payload == NULL) {
                 trader_send_nack(trader);
-                free(payload);
                 break;
+            }
+            
+            BRS_REPLAY_REQUEST *replay_request = (BRS_REPLAY_REQUEST *)payload;
+            uint32_t from = ntohl(replay_request->from);
+            uint32_t count = ntohl(replay_request->count);
+            if (count == 0 || count > BRS_REPLAY_MAX) {
+                count = BRS_REPLAY_MAX;
+            }
+            
+            debug_thread("brs_replay: from: %u, count: %u", from, count);
+            send_replay(trader, xchg, from, count);
+            break;
         }
+        
+        default:
+            // Unknown packet type - send NACK
+            trader_send_nack(trader);
+            break;
     }
+    return 0;
+}
+
+/*
+ * Handle one packet received from a client, recording how long it took
+ * to respond.
+ */
+int brs_session_dispatch(BRS_SESSION *session, BRS_PACKET_HEADER *hdr, void *payload) {
+    uint64_t start = stats_now();
+    int result = session_dispatch(session, hdr, payload);
     
-    // Cleanup
-    if (trader != NULL) {
-        trader_logout(trader);
-        trader_unref(trader, "client disconnect");
+    int type = hdr->type;
+    if (type == BRS_ENVELOPE_PKT && ntohs(hdr->size) >= sizeof(BRS_ENVELOPE_INFO)) {
+        type = ((BRS_ENVELOPE_INFO *)payload)->type;
+    }
+    if (type > 0 && type < STATS_PACKET_TYPES) {
+        stats_record(STATS_REQUEST + type, stats_now() - start);
     }
+    return result;
+}
+
+/*
+ * Finalize a client session, logging out its trader if any.
+ */
+void brs_session_fini(BRS_SESSION *session) {
+    if (session->trader != NULL) {
+        trader_logout(session->trader);
+        session->trader = NULL;
+    }
+    if (session->username != NULL) {
+        free(session->username);
+        session->username = NULL;
+    }
+}
+
+/*
+ * Thread function for the thread that handles a particular client.
+ */
+void *brs_client_service(void *arg) {
+    int fd = *(int *)arg;
+    free(arg);
+    
+    // Detach thread
+    pthread_detach(pthread_self());
+    char name[32];
+    snprintf(name, sizeof(name), "client.%d", fd);
+    affinity_thread_start(AFFINITY_IO, -1, name);
+    
+    // Register client
+    creg_register(client_registry, fd);
+    
+    BRS_SESSION session;
+    brs_session_init(&session, fd);
     
-    if (trader_username != NULL) {
-        free(trader_username);
+    // Packets are received into this buffer and handled in place, so that
+    // the service loop does not copy them or allocate from the heap.
+    uint32_t recv_buf[PROTO_RBUF_SIZE / sizeof(uint32_t)];
+    PROTO_RBUF rbuf;
+    proto_rbuf_init(&rbuf, fd, recv_buf, sizeof(recv_buf));
+    
+    debug_thread("[%d] Starting client service", fd);
+    
+    // Main service loop
+    while (1) {
+        BRS_PACKET_HEADER *hdr;
+        void *payload;
+        
+        int result = proto_recv_packet_rbuf(&rbuf, &hdr, &payload);
+        
+        if (result == -1) {
+            // Error or EOF
+            if (errno == 0) {
+                // EOF (clean connection close)
+                debug("EOF received from client fd %d", fd);
+            } else {
+                error("Error receiving packet from client fd %d: %s", fd, strerror(errno));
+            }
+            break;
+        }
+        
+        // Handle this packet and any others received along with it,
+        // writing out the responses together
+        TRADER *corked = session.trader;
+        if (corked != NULL) {
+            trader_cork(corked);
+        }
+        do {
+            result = brs_session_dispatch(&session, hdr, payload);
+        } while (result == 0 && proto_rbuf_next(&rbuf, &hdr, &payload));
+        if (corked != NULL) {
+            trader_uncork(corked);
+        }
+        if (result != 0) {
+            break;
+        }
     }
     
+    // Cleanup
+    brs_session_fini(&session);
+    proto_rbuf_fini(&rbuf);
+    
     creg_unregister(client_registry, fd);
     close(fd);
     
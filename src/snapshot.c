@@ -0,0 +1,644 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "snapshot.h"
+#include "instrument.h"
+#include "exchange_ext.h"
+#include "account_ext.h"
+#include "trader_ext.h"
+#include "trace.h"
+#include "debug.h"
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+/*
+ * Account in the shadow state.
+ */
+struct shadow_account {
+    char *name;
+    uint32_t hash;
+    uint32_t index;                     // Position in the snapshot being written
+    int64_t balance;                    // Including encumbered funds
+    int64_t *inventories;               // Including encumbered inventory
+    struct shadow_account *next;        // In hash chain
+};
+
+/*
+ * Pending order in the shadow state.
+ */
+struct shadow_order {
+    orderid_t id;
+    int instrument;
+    int sell;
+    quantity_t quantity;
+    funds_t price;
+    struct shadow_account *account;
+    struct shadow_order *next;          // In hash chain
+};
+
+/*
+ * Chained hash table, doubled in size when it has more entries than buckets.
+ */
+struct shadow_table {
+    void **buckets;
+    size_t bucket_count;
+    size_t count;
+};
+
+static int instrument_total = 0;
+static int broken = 0;
+static struct shadow_table accounts;
+static struct shadow_table orders;
+static orderid_t *next_order_ids = NULL;
+static funds_t *last_trade_prices = NULL;
+
+static uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash;
+}
+
+static size_t order_bucket(int instrument, orderid_t id, size_t bucket_count) {
+    return ((uint64_t)id * 2654435761u + instrument) & (bucket_count - 1);
+}
+
+static int table_init(struct shadow_table *table) {
+    table->bucket_count = 1024;
+    table->count = 0;
+    table->buckets = calloc(table->bucket_count, sizeof(void *));
+    return table->buckets != NULL ? 0 : -1;
+}
+
+/*
+ * Find the shadow account with a given name, creating it if necessary.
+ */
+static struct shadow_account *shadow_account(const char *name) {
+    uint32_t hash = name_hash(name);
+    struct shadow_account **bucket =
+        (struct shadow_account **)&accounts.buckets[hash & (accounts.bucket_count - 1)];
+    for (struct shadow_account *acct = *bucket; acct != NULL; acct = acct->next) {
+        if (acct->hash == hash && strcmp(acct->name, name) == 0) {
+            return acct;
+        }
+    }
+
+    if (accounts.count >= accounts.bucket_count) {
+        size_t count = accounts.bucket_count * 2;
+        void **buckets = calloc(count, sizeof(void *));
+        if (buckets == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < accounts.bucket_count; i++) {
+            struct shadow_account *acct = accounts.buckets[i];
+            while (acct != NULL) {
+                struct shadow_account *next = acct->next;
+                acct->next = buckets[acct->hash & (count - 1)];
+                buckets[acct->hash & (count - 1)] = acct;
+                acct = next;
+            }
+        }
+        free(accounts.buckets);
+        accounts.buckets = buckets;
+        accounts.bucket_count = count;
+        bucket = (struct shadow_account **)&accounts.buckets[hash & (count - 1)];
+    }
+
+    struct shadow_account *acct = calloc(1, sizeof(struct shadow_account));
+    if (acct == NULL) {
+        return NULL;
+    }
+    acct->name = strdup(name);
+    acct->inventories = calloc(instrument_total, sizeof(int64_t));
+    if (acct->name == NULL || acct->inventories == NULL) {
+        free(acct->name);
+        free(acct->inventories);
+        free(acct);
+        return NULL;
+    }
+    acct->hash = hash;
+    acct->next = *bucket;
+    *bucket = acct;
+    accounts.count++;
+    return acct;
+}
+
+/*
+ * Find the link to a pending order in the shadow state.
+ */
+static struct shadow_order **shadow_order_link(int instrument, orderid_t id) {
+    struct shadow_order **link =
+        (struct shadow_order **)&orders.buckets[order_bucket(instrument, id, orders.bucket_count)];
+    while (*link != NULL && ((*link)->id != id || (*link)->instrument != instrument)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/*
+ * Add a pending order to the shadow state.
+ */
+static int shadow_order_add(struct shadow_account *acct, int instrument, orderid_t id, int sell,
+                            quantity_t quantity, funds_t price) {
+    if (*shadow_order_link(instrument, id) != NULL) {
+        return -1;
+    }
+    if (orders.count >= orders.bucket_count) {
+        size_t count = orders.bucket_count * 2;
+        void **buckets = calloc(count, sizeof(void *));
+        if (buckets == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < orders.bucket_count; i++) {
+            struct shadow_order *order = orders.buckets[i];
+            while (order != NULL) {
+                struct shadow_order *next = order->next;
+                size_t b = order_bucket(order->instrument, order->id, count);
+                order->next = buckets[b];
+                buckets[b] = order;
+                order = next;
+            }
+        }
+        free(orders.buckets);
+        orders.buckets = buckets;
+        orders.bucket_count = count;
+    }
+
+    struct shadow_order *order = malloc(sizeof(struct shadow_order));
+    if (order == NULL) {
+        return -1;
+    }
+    order->id = id;
+    order->instrument = instrument;
+    order->sell = sell;
+    order->quantity = quantity;
+    order->price = price;
+    order->account = acct;
+    size_t b = order_bucket(instrument, id, orders.bucket_count);
+    order->next = orders.buckets[b];
+    orders.buckets[b] = order;
+    orders.count++;
+    if (id >= next_order_ids[instrument]) {
+        next_order_ids[instrument] = id + 1;
+    }
+    return 0;
+}
+
+/*
+ * Remove a pending order from the shadow state.
+ */
+static void shadow_order_remove(struct shadow_order **link) {
+    struct shadow_order *order = *link;
+    *link = order->next;
+    free(order);
+    orders.count--;
+}
+
+/*
+ * Initialize the shadow state, for the instruments being traded.
+ */
+int snapshot_init(int instruments) {
+    instrument_total = instruments;
+    broken = 0;
+    next_order_ids = malloc(instruments * sizeof(orderid_t));
+    last_trade_prices = calloc(instruments, sizeof(funds_t));
+    if (next_order_ids == NULL || last_trade_prices == NULL
+        || table_init(&accounts) != 0 || table_init(&orders) != 0) {
+        snapshot_fini();
+        return -1;
+    }
+    for (int i = 0; i < instruments; i++) {
+        next_order_ids[i] = 1;
+    }
+    return 0;
+}
+
+/*
+ * Free the shadow state.
+ */
+void snapshot_fini(void) {
+    for (size_t i = 0; i < accounts.bucket_count; i++) {
+        struct shadow_account *acct = accounts.buckets[i];
+        while (acct != NULL) {
+            struct shadow_account *next = acct->next;
+            free(acct->name);
+            free(acct->inventories);
+            free(acct);
+            acct = next;
+        }
+    }
+    for (size_t i = 0; i < orders.bucket_count; i++) {
+        struct shadow_order *order = orders.buckets[i];
+        while (order != NULL) {
+            struct shadow_order *next = order->next;
+            free(order);
+            order = next;
+        }
+    }
+    free(accounts.buckets);
+    free(orders.buckets);
+    memset(&accounts, 0, sizeof(accounts));
+    memset(&orders, 0, sizeof(orders));
+    free(next_order_ids);
+    free(last_trade_prices);
+    next_order_ids = NULL;
+    last_trade_prices = NULL;
+}
+
+/*
+ * Apply a journal record to the shadow state.
+ */
+int snapshot_apply(JOURNAL_RECORD *rec, const char *name, int instrument) {
+    if (broken) {
+        return -1;
+    }
+
+    struct shadow_account *acct = NULL;
+    if (rec->type != JOURNAL_CANCEL && rec->type != JOURNAL_TRADE
+        && (acct = shadow_account(name)) == NULL) {
+        broken = 1;
+        return -1;
+    }
+
+    switch (rec->type) {
+        case JOURNAL_DEPOSIT:
+            acct->balance += rec->amount;
+            return 0;
+        case JOURNAL_WITHDRAW:
+            acct->balance -= rec->amount;
+            return 0;
+        case JOURNAL_ESCROW:
+            acct->inventories[instrument] += rec->quantity;
+            return 0;
+        case JOURNAL_RELEASE:
+            acct->inventories[instrument] -= rec->quantity;
+            return 0;
+        case JOURNAL_POST:
+            if (shadow_order_add(acct, instrument, rec->order, rec->sell,
+                                 rec->quantity, rec->amount) != 0) {
+                break;
+            }
+            return 0;
+        case JOURNAL_CANCEL: {
+            struct shadow_order **link = shadow_order_link(instrument, rec->order);
+            if (*link == NULL) {
+                break;
+            }
+            shadow_order_remove(link);
+            return 0;
+        }
+        case JOURNAL_TRADE: {
+            struct shadow_order **buy_link = shadow_order_link(instrument, rec->order);
+            struct shadow_order *buy = *buy_link;
+            struct shadow_order *sell = *shadow_order_link(instrument, rec->other);
+            if (buy == NULL || sell == NULL || buy->sell || !sell->sell
+                || buy->quantity < rec->quantity || sell->quantity < rec->quantity) {
+                break;
+            }
+            funds_t proceeds = rec->quantity * rec->amount;
+            buy->account->balance -= proceeds;
+            buy->account->inventories[instrument] += rec->quantity;
+            sell->account->balance += proceeds;
+            sell->account->inventories[instrument] -= rec->quantity;
+            last_trade_prices[instrument] = rec->amount;
+
+            buy->quantity -= rec->quantity;
+            sell->quantity -= rec->quantity;
+            if (buy->quantity == 0) {
+                shadow_order_remove(buy_link);
+            }
+            if (sell->quantity == 0) {
+                // Found again, as removing the buy order may have moved the link
+                shadow_order_remove(shadow_order_link(instrument, rec->other));
+            }
+            return 0;
+        }
+        default:
+            break;
+    }
+    error("Snapshot: journal record of type %d for order %u is inconsistent; "
+          "no more snapshots will be taken", rec->type, rec->order);
+    broken = 1;
+    return -1;
+}
+
+/*
+ * Sort orders by instrument, then by ID.
+ */
+static int order_compare(const void *a, const void *b) {
+    const struct shadow_order *x = *(struct shadow_order *const *)a;
+    const struct shadow_order *y = *(struct shadow_order *const *)b;
+    if (x->instrument != y->instrument) {
+        return x->instrument < y->instrument ? -1 : 1;
+    }
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/*
+ * Output to a snapshot file, computing the checksum on the way.
+ */
+struct snapshot_out {
+    FILE *file;
+    uint32_t checksum;
+    int failed;
+};
+
+static void out_write(struct snapshot_out *out, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        out->checksum = (out->checksum ^ p[i]) * 16777619u;
+    }
+    if (fwrite(data, 1, len, out->file) != len) {
+        out->failed = 1;
+    }
+}
+
+/*
+ * Write out the shadow state as a snapshot.
+ */
+int snapshot_write(const char *path, off_t offset) {
+    if (broken) {
+        return -1;
+    }
+
+    struct shadow_order **sorted = malloc((orders.count + 1) * sizeof(struct shadow_order *));
+    if (sorted == NULL) {
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < orders.bucket_count; i++) {
+        for (struct shadow_order *order = orders.buckets[i]; order != NULL; order = order->next) {
+            sorted[n++] = order;
+        }
+    }
+    qsort(sorted, n, sizeof(struct shadow_order *), order_compare);
+
+    size_t tmp_len = strlen(path) + 5;
+    char *tmp = malloc(tmp_len);
+    if (tmp == NULL) {
+        free(sorted);
+        return -1;
+    }
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+    struct snapshot_out out = { fopen(tmp, "w"), 2166136261u, 0 };
+    if (out.file == NULL) {
+        error("Cannot create snapshot %s: %s", tmp, strerror(errno));
+        free(tmp);
+        free(sorted);
+        return -1;
+    }
+
+    SNAPSHOT_HEADER header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.instruments = instrument_total;
+    header.journal_offset = offset;
+    header.accounts = accounts.count;
+    header.orders = n;
+    out_write(&out, &header, sizeof(header));
+
+    for (int i = 0; i < instrument_total; i++) {
+        SNAPSHOT_INSTRUMENT si;
+        memset(&si, 0, sizeof(si));
+        memcpy(si.symbol, exchange_get_symbol(instrument_exchange(i)), BRS_SYMBOL_SIZE);
+        si.next_order_id = next_order_ids[i];
+        si.last_trade_price = last_trade_prices[i];
+        out_write(&out, &si, sizeof(si));
+    }
+
+    static const char padding[8];
+    uint32_t index = 0;
+    for (size_t i = 0; i < accounts.bucket_count; i++) {
+        for (struct shadow_account *acct = accounts.buckets[i]; acct != NULL; acct = acct->next) {
+            SNAPSHOT_ACCOUNT sa;
+            memset(&sa, 0, sizeof(sa));
+            size_t name_length = strlen(acct->name);
+            sa.balance = acct->balance;
+            sa.name_length = name_length;
+            acct->index = index++;
+            out_write(&out, &sa, sizeof(sa));
+            out_write(&out, acct->inventories, instrument_total * sizeof(int64_t));
+            out_write(&out, acct->name, name_length);
+            out_write(&out, padding, ALIGN8(name_length) - name_length);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        SNAPSHOT_ORDER so;
+        memset(&so, 0, sizeof(so));
+        so.account = sorted[i]->account->index;
+        so.instrument = sorted[i]->instrument;
+        so.sell = sorted[i]->sell;
+        so.id = sorted[i]->id;
+        so.quantity = sorted[i]->quantity;
+        so.price = sorted[i]->price;
+        out_write(&out, &so, sizeof(so));
+    }
+    free(sorted);
+
+    uint32_t checksum = out.checksum;
+    out_write(&out, &checksum, sizeof(checksum));
+
+    if (fflush(out.file) != 0 || fdatasync(fileno(out.file)) != 0) {
+        out.failed = 1;
+    }
+    if (fclose(out.file) != 0 || out.failed || rename(tmp, path) != 0) {
+        error("Cannot write snapshot %s: %s", path, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    debug_thread("Wrote snapshot of %zu accounts and %zu orders at journal offset %ld",
+                 accounts.count, n, (long)offset);
+    return 0;
+}
+
+/*
+ * Check that a mapped snapshot is complete and undamaged, and map its
+ * instruments onto those being traded.
+ *
+ * @return 1 if it is usable, 0 if it is damaged, -1 if it refers to an
+ * instrument that is not being traded.
+ */
+static int snapshot_check(const char *data, size_t size, int *map) {
+    const SNAPSHOT_HEADER *header = (const SNAPSHOT_HEADER *)data;
+    if (size < sizeof(SNAPSHOT_HEADER) + sizeof(uint32_t)
+        || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+        || header->version != SNAPSHOT_VERSION) {
+        return 0;
+    }
+    uint32_t checksum = 2166136261u;
+    for (size_t i = 0; i < size - sizeof(uint32_t); i++) {
+        checksum = (checksum ^ (unsigned char)data[i]) * 16777619u;
+    }
+    uint32_t stored;
+    memcpy(&stored, data + size - sizeof(uint32_t), sizeof(stored));
+    if (checksum != stored || header->instruments > MAX_INSTRUMENTS) {
+        return 0;
+    }
+
+    const SNAPSHOT_INSTRUMENT *si = (const SNAPSHOT_INSTRUMENT *)(data + sizeof(SNAPSHOT_HEADER));
+    if (sizeof(SNAPSHOT_HEADER) + header->instruments * sizeof(SNAPSHOT_INSTRUMENT) > size) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < header->instruments; i++) {
+        EXCHANGE *xchg = si[i].symbol[0] == '\0' ? instrument_exchange(0)
+                                                 : instrument_lookup(si[i].symbol, BRS_SYMBOL_SIZE);
+        if (xchg == NULL) {
+            error("Snapshot refers to instrument '%.*s', which is not being traded",
+                  BRS_SYMBOL_SIZE, si[i].symbol);
+            return -1;
+        }
+        map[i] = exchange_get_instrument(xchg);
+    }
+    return 1;
+}
+
+/*
+ * Restore the accounts and exchanges, and the shadow state, from a snapshot.
+ */
+int snapshot_load(const char *path, off_t *offsetp) {
+    *offsetp = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        error("Cannot open snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        error("Cannot map snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    int map[MAX_INSTRUMENTS];
+    int usable = snapshot_check(data, size, map);
+    if (usable != 1) {
+        munmap((void *)data, size);
+        if (usable == 0) {
+            error("Snapshot %s is damaged; replaying the whole journal", path);
+            return 0;
+        }
+        return -1;
+    }
+
+    const SNAPSHOT_HEADER *header = (const SNAPSHOT_HEADER *)data;
+    const char *end = data + size - sizeof(uint32_t);
+    const char *p = data + sizeof(SNAPSHOT_HEADER);
+    const SNAPSHOT_INSTRUMENT *si = (const SNAPSHOT_INSTRUMENT *)p;
+    p += header->instruments * sizeof(SNAPSHOT_INSTRUMENT);
+
+    int ret = -1;
+    size_t inventories_size = header->instruments * sizeof(int64_t);
+    struct shadow_account **restored = calloc(header->accounts + 1, sizeof(struct shadow_account *));
+    TRADER **traders = calloc(header->accounts + 1, sizeof(TRADER *));
+    char *name = malloc(UINT16_MAX + 1);
+    if (restored == NULL || traders == NULL || name == NULL) {
+        goto out;
+    }
+
+    // Accounts, with the funds and inventory later encumbered by their orders
+    for (uint64_t i = 0; i < header->accounts; i++) {
+        if (p + sizeof(SNAPSHOT_ACCOUNT) > end) {
+            goto truncated;
+        }
+        const SNAPSHOT_ACCOUNT *sa = (const SNAPSHOT_ACCOUNT *)p;
+        p += sizeof(SNAPSHOT_ACCOUNT);
+        if (p + inventories_size + ALIGN8(sa->name_length) > end) {
+            goto truncated;
+        }
+        const int64_t *inventories = (const int64_t *)p;
+        p += inventories_size;
+        memcpy(name, p, sa->name_length);
+        name[sa->name_length] = '\0';
+        p += ALIGN8(sa->name_length);
+
+        ACCOUNT *account = account_lookup(name);
+        struct shadow_account *acct = shadow_account(name);
+        if (account == NULL || acct == NULL) {
+            goto out;
+        }
+        account_adjust(account, 0, sa->balance, 0);
+        acct->balance += sa->balance;
+        for (uint32_t j = 0; j < header->instruments; j++) {
+            account_adjust(account, map[j], 0, inventories[j]);
+            acct->inventories[map[j]] += inventories[j];
+        }
+        restored[i] = acct;
+    }
+
+    // Orders, in order of priority
+    if (p + header->orders * sizeof(SNAPSHOT_ORDER) != end) {
+        goto truncated;
+    }
+    const SNAPSHOT_ORDER *so = (const SNAPSHOT_ORDER *)p;
+    for (uint64_t i = 0; i < header->orders; i++, so++) {
+        if (so->account >= header->accounts || so->instrument >= header->instruments) {
+            goto truncated;
+        }
+        int instrument = map[so->instrument];
+        struct shadow_account *acct = restored[so->account];
+        if (traders[so->account] == NULL
+            && (traders[so->account] = trader_detached(acct->name)) == NULL) {
+            goto out;
+        }
+        if (exchange_restore_order(instrument_exchange(instrument), traders[so->account], so->id,
+                                   so->sell, so->quantity, so->price) != 0
+            || shadow_order_add(acct, instrument, so->id, so->sell, so->quantity, so->price) != 0) {
+            error("Snapshot order %u could not be restored", so->id);
+            goto out;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->instruments; i++) {
+        exchange_restore_state(instrument_exchange(map[i]), si[i].next_order_id,
+                               si[i].last_trade_price);
+        if (si[i].next_order_id > next_order_ids[map[i]]) {
+            next_order_ids[map[i]] = si[i].next_order_id;
+        }
+        last_trade_prices[map[i]] = si[i].last_trade_price;
+    }
+
+    *offsetp = header->journal_offset;
+    debug_thread("Restored %lu accounts and %lu orders from snapshot %s",
+                 (unsigned long)header->accounts, (unsigned long)header->orders, path);
+    ret = 0;
+    goto out;
+
+truncated:
+    error("Snapshot %s is inconsistent", path);
+
+out:
+    if (traders != NULL) {
+        for (uint64_t i = 0; i < header->accounts; i++) {
+            if (traders[i] != NULL) {
+                trader_unref(traders[i], "snapshot restore");
+            }
+        }
+    }
+    free(traders);
+    free(restored);
+    free(name);
+    munmap((void *)data, size);
+    return ret;
+}
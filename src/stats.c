@@ -0,0 +1,283 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "debug.h"
+
+struct stats_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+/*
+ * Counters and histograms of one thread.  Only the thread itself writes
+ * them; readers may see a value of a histogram updated before another,
+ * which does not matter for a report.
+ */
+struct stats_thread {
+    uint64_t counters[STATS_COUNTERS];
+    struct stats_histogram *histograms[STATS_HISTOGRAMS];
+    struct stats_thread *prev;
+    struct stats_thread *next;
+};
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_thread *threads = NULL;     // Threads recording, protected by stats_mutex
+static struct stats_thread retired;             // Sum of threads that have exited
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static __thread struct stats_thread *self = NULL;
+
+static const char *histogram_names[STATS_HISTOGRAMS] = {
+    [STATS_REQUEST + BRS_LOGIN_PKT] = "request.LOGIN",
+    [STATS_REQUEST + BRS_STATUS_PKT] = "request.STATUS",
+    [STATS_REQUEST + BRS_DEPOSIT_PKT] = "request.DEPOSIT",
+    [STATS_REQUEST + BRS_WITHDRAW_PKT] = "request.WITHDRAW",
+    [STATS_REQUEST + BRS_ESCROW_PKT] = "request.ESCROW",
+    [STATS_REQUEST + BRS_RELEASE_PKT] = "request.RELEASE",
+    [STATS_REQUEST + BRS_BUY_PKT] = "request.BUY",
+    [STATS_REQUEST + BRS_SELL_PKT] = "request.SELL",
+    [STATS_REQUEST + BRS_CANCEL_PKT] = "request.CANCEL",
+    [STATS_REQUEST + BRS_STATS_PKT] = "request.STATS",
+    [STATS_REQUEST + BRS_BULK_PKT] = "request.BULK",
+    [STATS_REQUEST + BRS_MASS_CANCEL_PKT] = "request.MASS_CANCEL",
+    [STATS_REQUEST + BRS_SUBSCRIBE_PKT] = "request.SUBSCRIBE",
+    [STATS_REQUEST + BRS_DEPTH_PKT] = "request.DEPTH",
+    [STATS_REQUEST + BRS_REPLAY_PKT] = "request.REPLAY",
+    [STATS_MATCH] = "match.latency",
+    [STATS_MATCH_BURST] = "match.burst",
+    [STATS_MATCH_WAKEUP] = "match.wakeup",
+    [STATS_FANOUT] = "fanout.broadcast",
+    [STATS_FANOUT_DEPTH] = "fanout.queue_depth",
+    [STATS_OUTBOUND_DEPTH] = "outbound.queue_depth",
+};
+
+static const char *counter_names[STATS_COUNTERS] = {
+    [STATS_TRADES] = "trades",
+    [STATS_MATCH_PASSES] = "match.passes",
+    [STATS_MATCH_IDLE] = "match.idle_passes",
+    [STATS_OUTBOUND_DROPS] = "outbound.drops",
+    [STATS_OUTBOUND_DISCONNECTS] = "outbound.disconnects",
+    [STATS_FANOUT_STALLS] = "fanout.stalls",
+    [STATS_MCAST_DATAGRAMS] = "multicast.datagrams",
+    [STATS_MCAST_ERRORS] = "multicast.errors",
+    [STATS_RISK_REJECTS] = "risk.rejects",
+};
+
+/*
+ * Get the bucket in which a value is counted.
+ */
+static int stats_bucket(uint64_t value) {
+    if (value < STATS_SUB_BUCKETS) {
+        return value;
+    }
+    int magnitude = 63 - __builtin_clzll(value);
+    if (magnitude > STATS_MAX_MAGNITUDE) {
+        return STATS_BUCKETS - 1;
+    }
+    int sub = (value >> (magnitude - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return STATS_SUB_BUCKETS * (magnitude - STATS_SUB_BITS + 1) + sub;
+}
+
+/*
+ * Get the largest value counted in a bucket.
+ */
+static uint64_t stats_bucket_max(int bucket) {
+    if (bucket < STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+    int magnitude = bucket / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    uint64_t sub = bucket % STATS_SUB_BUCKETS;
+    return ((STATS_SUB_BUCKETS + sub + 1) << (magnitude - STATS_SUB_BITS)) - 1;
+}
+
+/*
+ * Add one set of counters and histograms to another.  Histograms are
+ * allocated in the destination as necessary.
+ */
+static void stats_add(struct stats_thread *to, struct stats_thread *from) {
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        to->counters[i] += __atomic_load_n(&from->counters[i], __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < STATS_HISTOGRAMS; i++) {
+        struct stats_histogram *src = __atomic_load_n(&from->histograms[i], __ATOMIC_ACQUIRE);
+        if (src == NULL) {
+            continue;
+        }
+        if (to->histograms[i] == NULL
+            && (to->histograms[i] = calloc(1, sizeof(struct stats_histogram))) == NULL) {
+            continue;
+        }
+        struct stats_histogram *dst = to->histograms[i];
+        dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+        dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+        if (max > dst->max) {
+            dst->max = max;
+        }
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            dst->buckets[b] += __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void stats_free(struct stats_thread *stats) {
+    for (int i = 0; i < STATS_HISTOGRAMS; i++) {
+        free(stats->histograms[i]);
+        stats->histograms[i] = NULL;
+    }
+}
+
+/*
+ * Called when a thread that has recorded exits: keep what it recorded.
+ */
+static void stats_thread_exit(void *arg) {
+    struct stats_thread *stats = arg;
+    pthread_mutex_lock(&stats_mutex);
+    stats_add(&retired, stats);
+    if (stats->prev != NULL) {
+        stats->prev->next = stats->next;
+    } else {
+        threads = stats->next;
+    }
+    if (stats->next != NULL) {
+        stats->next->prev = stats->prev;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    stats_free(stats);
+    free(stats);
+}
+
+static void stats_key_init(void) {
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+/*
+ * Get the counters and histograms of the calling thread, creating them
+ * on first use.
+ */
+static struct stats_thread *stats_self(void) {
+    if (self != NULL) {
+        return self;
+    }
+    pthread_once(&stats_once, stats_key_init);
+    struct stats_thread *stats = calloc(1, sizeof(struct stats_thread));
+    if (stats == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&stats_mutex);
+    stats->next = threads;
+    if (threads != NULL) {
+        threads->prev = stats;
+    }
+    threads = stats;
+    pthread_mutex_unlock(&stats_mutex);
+    pthread_setspecific(stats_key, stats);
+    self = stats;
+    return stats;
+}
+
+/*
+ * Record a value in a histogram of the calling thread.
+ */
+void stats_record(stats_histogram_t histogram, uint64_t value) {
+    struct stats_thread *stats = stats_self();
+    if (stats == NULL) {
+        return;
+    }
+    struct stats_histogram *h = stats->histograms[histogram];
+    if (h == NULL) {
+        if ((h = calloc(1, sizeof(struct stats_histogram))) == NULL) {
+            return;
+        }
+        __atomic_store_n(&stats->histograms[histogram], h, __ATOMIC_RELEASE);
+    }
+    uint64_t *bucket = &h->buckets[stats_bucket(value)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+    if (value > h->max) {
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Add to a counter of the calling thread.
+ */
+void stats_count(stats_counter_t counter, uint64_t n) {
+    struct stats_thread *stats = stats_self();
+    if (stats != NULL) {
+        __atomic_store_n(&stats->counters[counter], stats->counters[counter] + n, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Get the value of a counter, summed over all threads.
+ */
+uint64_t stats_counter_total(stats_counter_t counter) {
+    pthread_mutex_lock(&stats_mutex);
+    uint64_t total = retired.counters[counter];
+    for (struct stats_thread *stats = threads; stats != NULL; stats = stats->next) {
+        total += __atomic_load_n(&stats->counters[counter], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    return total;
+}
+
+/*
+ * Get the smallest value not exceeded by a given fraction of those recorded.
+ */
+static uint64_t stats_percentile(struct stats_histogram *h, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * h->count);
+    if (rank >= h->count) {
+        rank = h->count - 1;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > rank) {
+            uint64_t value = stats_bucket_max(b);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*
+ * Write a report of all counters and histograms, summed over all threads.
+ */
+int stats_report(FILE *out) {
+    struct stats_thread total;
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&stats_mutex);
+    stats_add(&total, &retired);
+    for (struct stats_thread *stats = threads; stats != NULL; stats = stats->next) {
+        stats_add(&total, stats);
+    }
+    pthread_mutex_unlock(&stats_mutex);
+
+    fprintf(out, "# Latencies in nanoseconds\n");
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        fprintf(out, "%-24s %" PRIu64 "\n", counter_names[i], total.counters[i]);
+    }
+    fprintf(out, "%-24s %10s %10s %10s %10s %10s %10s %10s\n",
+            "histogram", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < STATS_HISTOGRAMS; i++) {
+        struct stats_histogram *h = total.histograms[i];
+        if (h == NULL || h->count == 0 || histogram_names[i] == NULL) {
+            continue;
+        }
+        fprintf(out, "%-24s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+                " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+                histogram_names[i], h->count, h->sum / h->count,
+                stats_percentile(h, 0.5), stats_percentile(h, 0.9),
+                stats_percentile(h, 0.99), stats_percentile(h, 0.999), h->max);
+    }
+    stats_free(&total);
+    return ferror(out) ? -1 : 0;
+}
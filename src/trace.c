@@ -0,0 +1,346 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "affinity.h"
+#include "debug.h"
+
+#ifdef TRACE
+
+/*
+ * Ring of trace records taken by one thread.  The thread advances head once
+ * it has filled a record; the drainer advances tail once it has written it.
+ */
+struct trace_ring {
+    size_t head;                        // Written only by the thread
+    size_t tail;                        // Written only by the drainer
+    uint32_t lost;                      // Records lost because the ring was full
+    uint32_t lost_reported;             // Used only by the drainer
+    uint32_t tid;
+    int exited;                         // Thread has exited; ring to be freed once drained
+    struct trace_ring *next;
+    TRACE_RECORD records[TRACE_RING_SIZE];
+};
+
+static int tracing = 0;
+static int running = 0;
+static FILE *trace_file = NULL;
+static pthread_t drainer_thread;
+
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings = NULL;         // Protected by rings_mutex
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static __thread struct trace_ring *self = NULL;
+
+// Format strings already written to the file (used only by the drainer)
+static uint64_t *formats = NULL;
+static size_t formats_size = 0;
+static size_t formats_count = 0;
+
+static void trace_thread_exit(void *arg) {
+    struct trace_ring *ring = arg;
+    self = NULL;
+    __atomic_store_n(&ring->exited, 1, __ATOMIC_RELEASE);
+}
+
+static void trace_key_init(void) {
+    pthread_key_create(&trace_key, trace_thread_exit);
+}
+
+/*
+ * Get the ring of the calling thread, creating it on first use.
+ */
+static struct trace_ring *trace_self(void) {
+    if (self != NULL) {
+        return self;
+    }
+    pthread_once(&trace_once, trace_key_init);
+    struct trace_ring *ring = calloc(1, sizeof(struct trace_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->tid = syscall(SYS_gettid);
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+    pthread_setspecific(trace_key, ring);
+    self = ring;
+    return ring;
+}
+
+/*
+ * Take a trace record.
+ */
+void trace_emit(int flags, const char *format, ...) {
+    if (!__atomic_load_n(&tracing, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    struct trace_ring *ring = trace_self();
+    if (ring == NULL) {
+        return;
+    }
+    size_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+        __atomic_store_n(&ring->lost, ring->lost + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    TRACE_RECORD *rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->timestamp = (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+    rec->format = (uintptr_t)format;
+    rec->tid = ring->tid;
+    rec->flags = flags;
+
+    // Take the arguments as the conversions of the format direct
+    int nargs = 0;
+    size_t strings_len = 0;
+#define STORE(v) do { uint64_t v_ = (v); if (nargs < TRACE_MAX_ARGS) rec->args[nargs++] = v_; } while (0)
+    va_list ap;
+    va_start(ap, format);
+    for (const char *p = format; *p != '\0'; p++) {
+        if (*p != '%' || *++p == '%') {
+            continue;
+        }
+        p += strspn(p, "-+ #0");
+        if (*p == '*') {
+            STORE((int64_t)va_arg(ap, int));
+            p++;
+        }
+        p += strspn(p, "0123456789");
+        int precision = -1;
+        if (*p == '.') {
+            p++;
+            if (*p == '*') {
+                precision = va_arg(ap, int);
+                STORE((int64_t)precision);
+                p++;
+            } else {
+                precision = atoi(p);
+                p += strspn(p, "0123456789");
+            }
+        }
+        int longs = 0;
+        for (; *p != '\0' && strchr("hlzjt", *p) != NULL; p++) {
+            longs += *p != 'h';
+        }
+        switch (*p) {
+            case 'd': case 'i': case 'c':
+                STORE(longs ? (int64_t)va_arg(ap, long long) : (int64_t)va_arg(ap, int));
+                break;
+            case 'u': case 'x': case 'X': case 'o':
+                STORE(longs ? va_arg(ap, unsigned long long) : va_arg(ap, unsigned int));
+                break;
+            case 'p':
+                STORE((uintptr_t)va_arg(ap, void *));
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+                double d = va_arg(ap, double);
+                uint64_t bits;
+                memcpy(&bits, &d, sizeof(bits));
+                STORE(bits);
+                break;
+            }
+            case 's': {
+                const char *s = va_arg(ap, const char *);
+                if (s == NULL) {
+                    s = "(null)";
+                }
+                if (strings_len < TRACE_STRINGS) {
+                    size_t room = TRACE_STRINGS - strings_len - 1;
+                    size_t n = strnlen(s, precision >= 0 && (size_t)precision < room ? (size_t)precision : room);
+                    memcpy(rec->strings + strings_len, s, n);
+                    rec->strings[strings_len + n] = '\0';
+                    strings_len += n + 1;
+                }
+                break;
+            }
+            default:
+                // Unsupported conversion: nothing more can be taken
+                p = p[0] != '\0' ? p + strlen(p) - 1 : p;
+                break;
+        }
+        if (*p == '\0') {
+            break;
+        }
+    }
+    va_end(ap);
+#undef STORE
+    rec->nargs = nargs;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_write_entry(trace_entry_t kind, const void *data, size_t len,
+                              const void *more, size_t more_len) {
+    TRACE_ENTRY_HEADER hdr = { kind, len + more_len };
+    fwrite(&hdr, sizeof(hdr), 1, trace_file);
+    fwrite(data, 1, len, trace_file);
+    if (more_len > 0) {
+        fwrite(more, 1, more_len, trace_file);
+    }
+}
+
+/*
+ * Write out a format string if it has not yet been written.
+ */
+static void trace_write_format(uint64_t address) {
+    if (formats_count * 2 >= formats_size) {
+        size_t size = formats_size == 0 ? 256 : formats_size * 2;
+        uint64_t *table = calloc(size, sizeof(uint64_t));
+        if (table == NULL) {
+            return;
+        }
+        for (size_t i = 0; i < formats_size; i++) {
+            if (formats[i] != 0) {
+                size_t j = (formats[i] >> 3) & (size - 1);
+                while (table[j] != 0) {
+                    j = (j + 1) & (size - 1);
+                }
+                table[j] = formats[i];
+            }
+        }
+        free(formats);
+        formats = table;
+        formats_size = size;
+    }
+    size_t i = (address >> 3) & (formats_size - 1);
+    while (formats[i] != 0) {
+        if (formats[i] == address) {
+            return;
+        }
+        i = (i + 1) & (formats_size - 1);
+    }
+    formats[i] = address;
+    formats_count++;
+    const char *text = (const char *)(uintptr_t)address;
+    trace_write_entry(TRACE_ENTRY_FORMAT, &address, sizeof(address), text, strlen(text));
+}
+
+/*
+ * Write out the records taken so far by all threads, and free the rings of
+ * threads that have exited.
+ *
+ * @return  The number of records written.
+ */
+static size_t trace_drain(void) {
+    size_t written = 0;
+    pthread_mutex_lock(&rings_mutex);
+    struct trace_ring **link = &rings;
+    while (*link != NULL) {
+        struct trace_ring *ring = *link;
+        int exited = __atomic_load_n(&ring->exited, __ATOMIC_ACQUIRE);
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        size_t tail = ring->tail;
+        for (; tail != head; tail++) {
+            TRACE_RECORD *rec = &ring->records[tail & (TRACE_RING_SIZE - 1)];
+            trace_write_format(rec->format);
+            trace_write_entry(TRACE_ENTRY_RECORD, rec, sizeof(*rec), NULL, 0);
+            written++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint32_t lost = __atomic_load_n(&ring->lost, __ATOMIC_RELAXED);
+        if (lost != ring->lost_reported) {
+            uint32_t entry[2] = { ring->tid, lost - ring->lost_reported };
+            trace_write_entry(TRACE_ENTRY_LOST, entry, sizeof(entry), NULL, 0);
+            ring->lost_reported = lost;
+        }
+
+        if (exited) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+    return written;
+}
+
+/*
+ * Thread function for the drainer.
+ */
+static void *trace_drainer_func(void *arg) {
+    (void)arg;
+    affinity_thread_name("trace");
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        if (trace_drain() == 0) {
+            fflush(trace_file);
+            struct timespec delay = { 0, 1000000 };
+            nanosleep(&delay, NULL);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start draining trace records to a file.
+ */
+int trace_init(const char *path) {
+    trace_file = fopen(path, "w");
+    if (trace_file == NULL) {
+        return -1;
+    }
+    TRACE_FILE_HEADER header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TRACE_RECORD);
+    fwrite(&header, sizeof(header), 1, trace_file);
+
+    running = 1;
+    if (pthread_create(&drainer_thread, NULL, trace_drainer_func, NULL) != 0) {
+        running = 0;
+        fclose(trace_file);
+        trace_file = NULL;
+        return -1;
+    }
+    __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Stop tracing, writing out all records taken so far, and close the file.
+ */
+void trace_fini(void) {
+    if (trace_file == NULL) {
+        return;
+    }
+    __atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join(drainer_thread, NULL);
+    trace_drain();
+    fclose(trace_file);
+    trace_file = NULL;
+    free(formats);
+    formats = NULL;
+    formats_size = formats_count = 0;
+}
+
+#else
+
+int trace_init(const char *path) {
+    (void)path;
+    return -1;
+}
+
+void trace_fini(void) {
+}
+
+void trace_emit(int flags, const char *format, ...) {
+    (void)flags;
+    (void)format;
+}
+
+#endif
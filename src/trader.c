@@ -6,26 +6,18 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
 
 #include "trader.h"
+#include "trader_ext.h"
 #include "protocol.h"
+#include "protocol_ext.h"
+#include "stats.h"
+#include "trace.h"
 #include "debug.h"
 
-/*
- * Debug macro with thread ID format (matching demo_server)
- */
-#define debug_thread(S, ...) \
-    do { \
-        fprintf(stderr, KMAG "DEBUG: %015lu: " KNRM S NL, (unsigned long)syscall(SYS_gettid), ##__VA_ARGS__); \
-    } while (0)
-
-/*
- * Format timestamp from packet header
- */
-static double format_timestamp(uint32_t sec, uint32_t nsec) {
-    return (double)sec + (double)nsec / 1000000000.0;
-}
-
 /*
  * Format packet type name
  */
@@ -51,29 +43,109 @@ static const char *packet_type_name(BRS_PACKET_TYPE type) {
     }
 }
 
+/*
+ * Size of the buffer holding packets taken from the outbound ring
+ * that have not yet been completely written.
+ */
+#define TRADER_WBUF_SIZE 1024
+
+/*
+ * A packet waiting on an outbound ring.
+ */
+struct outbound_slot {
+    BRS_PACKET_HEADER hdr;
+    uint8_t reliable;
+    uint8_t payload[OUTBOUND_MAX_PAYLOAD];
+};
+
 struct trader {
-    int fd;
+    int fd;                 // -1 once logged out
     char *name;
     ACCOUNT *account;
-    pthread_mutex_t mutex;  // Must be recursive
-    int refcount;
+    pthread_mutex_t send_lock;  // Serializes sends
+    int refcount;           // Changed atomically, without the lock
+    
+    // Outbound ring, used only by the fan-out thread
+    struct outbound_slot *out_ring;
+    int out_capacity;
+    int out_head;           // Index of oldest queued packet
+    int out_count;          // Number of queued packets
+    int out_scheduled;      // Fan-out thread has this trader in its flush set
+    int out_disconnect;     // Slow-consumer policy wants connection shut down
+    unsigned long out_drops;
+    
+    // Data taken from the ring but not yet written, protected by send_lock
+    char wbuf[TRADER_WBUF_SIZE];
+    size_t wlen;
+    size_t woff;
+    
+    // Packets held back while corked, protected by send_lock
+    int corked;
+    char cork_buf[TRADER_WBUF_SIZE];
+    size_t cork_len;
+    
+    int detached;           // Owns restored orders rather than a connection
+    TRADER_SINK *sink;      // Receives packets in place of a connection, or NULL
+    PROTO_WBUF *sender;     // Sends without blocking on the connection, or NULL
+    TRADER_FEED feed;       // Market-data subscription
+    
+    // Risk cache, changed atomically, without any lock
+    uint32_t risk_orders;   // Orders pending on all books
+    uint64_t risk_notional; // Value of those orders at their limit prices
+    uint64_t risk_due;      // Time at which the token bucket would be full (ns)
+    
+    // Links in the list of logged-in traders, protected by the shard's mutex
+    struct trader_shard *shard;
+    TRADER *shard_prev;
+    TRADER *shard_next;
 };
 
-// Global trader map
-static struct trader_map_entry {
-    char *name;
-    TRADER *trader;
-} trader_map[MAX_TRADERS];
+static int outbound_capacity = OUTBOUND_DEFAULT_CAPACITY;
+static outbound_policy_t outbound_policy = OUTBOUND_QUEUE;
+static BRS_FEED_LEVEL default_feed = BRS_FEED_FULL;
+
+/*
+ * Risk limits, each 0 if disabled.  The rate is kept as the interval between
+ * orders, and the burst as the time the bucket takes to fill.
+ */
+static uint32_t risk_max_orders = 0;
+static uint64_t risk_max_notional = 0;
+static uint64_t risk_interval = 0;      // ns per order
+static uint64_t risk_window = 0;        // ns: interval times burst
 
-static int trader_count = 0;
-static pthread_mutex_t trader_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Set of logged-in traders.
+ *
+ * Traders are spread over a number of shards, each with its own lock, so that
+ * logins and logouts can proceed in parallel and take constant time.  Within
+ * a shard, the traders at each subscription level are kept in a doubly-linked
+ * list of their own, so that a broadcast of the tape visits only the traders
+ * that subscribe to it.  Several traders can be logged in with the same user
+ * name, so the set is not indexed by name; only whole-set operations such as
+ * broadcasts need to find the traders.
+ */
+#define TRADER_SHARDS 64
+
+static struct trader_shard {
+    pthread_mutex_t mutex;
+    TRADER *head[BRS_FEED_LEVELS];  // Traders at each subscription level
+    int count;                      // Traders at all levels
+} trader_shards[TRADER_SHARDS];
+
+static unsigned next_shard = 0;
+static int feed_counts[BRS_FEED_LEVELS];
 
 /*
  * Initialize the traders module.
  */
 int traders_init(void) {
-    trader_count = 0;
-    memset(trader_map, 0, sizeof(trader_map));
+    for (int i = 0; i < TRADER_SHARDS; i++) {
+        pthread_mutex_init(&trader_shards[i].mutex, NULL);
+        for (int level = 0; level < BRS_FEED_LEVELS; level++) {
+            trader_shards[i].head[level] = NULL;
+        }
+        trader_shards[i].count = 0;
+    }
     return 0;
 }
 
@@ -81,54 +153,55 @@ int traders_init(void) {
  * Finalize the traders module, freeing all associated resources.
  */
 void traders_fini(void) {
-    pthread_mutex_lock(&trader_map_mutex);
-    
-    for (int i = 0; i < trader_count; i++) {
-        if (trader_map[i].trader != NULL) {
-            TRADER *trader = trader_map[i].trader;
-            pthread_mutex_lock(&trader->mutex);
-            trader->refcount = 1; // Set to 1 so unref will free it
-            pthread_mutex_unlock(&trader->mutex);
-            trader_unref(trader, "fini");
+    for (int i = 0; i < TRADER_SHARDS; i++) {
+        struct trader_shard *shard = &trader_shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        
+        for (int level = 0; level < BRS_FEED_LEVELS; level++) {
+            TRADER *trader = shard->head[level];
+            while (trader != NULL) {
+                TRADER *next = trader->shard_next;
+                __atomic_store_n(&trader->refcount, 1, __ATOMIC_RELAXED); // So unref will free it
+                trader_unref(trader, "fini");
+                trader = next;
+            }
+            shard->head[level] = NULL;
+            feed_counts[level] = 0;
         }
-        free(trader_map[i].name);
+        shard->count = 0;
+        pthread_mutex_unlock(&shard->mutex);
+        pthread_mutex_destroy(&shard->mutex);
     }
-    
-    trader_count = 0;
-    pthread_mutex_unlock(&trader_map_mutex);
 }
 
 /*
- * Attempt to log in a trader with a specified user name.
+ * Create a new trader, with a reference count of one, but do not add it to
+ * the set of logged-in traders.
  */
-TRADER *trader_login(int fd, char *name) {
-    if (fd < 0 || name == NULL) {
-        return NULL;
-    }
-    
-    pthread_mutex_lock(&trader_map_mutex);
-    
-    // Check if max traders reached
-    if (trader_count >= MAX_TRADERS) {
-        pthread_mutex_unlock(&trader_map_mutex);
-        return NULL;
-    }
-    
+static TRADER *trader_create(int fd, char *name) {
     // Create new trader
     TRADER *trader = malloc(sizeof(TRADER));
     if (trader == NULL) {
-        pthread_mutex_unlock(&trader_map_mutex);
         return NULL;
     }
     
+    memset(trader, 0, sizeof(TRADER));
     trader->fd = fd;
     trader->refcount = 1;
     
+    // Allocate outbound ring
+    trader->out_capacity = __atomic_load_n(&outbound_capacity, __ATOMIC_RELAXED);
+    trader->out_ring = malloc(sizeof(struct outbound_slot) * trader->out_capacity);
+    if (trader->out_ring == NULL) {
+        free(trader);
+        return NULL;
+    }
+    
     // Copy name
     trader->name = malloc(strlen(name) + 1);
     if (trader->name == NULL) {
+        free(trader->out_ring);
         free(trader);
-        pthread_mutex_unlock(&trader_map_mutex);
         return NULL;
     }
     strcpy(trader->name, name);
@@ -137,46 +210,208 @@ TRADER *trader_login(int fd, char *name) {
     trader->account = account_lookup(name);
     if (trader->account == NULL) {
         free(trader->name);
+        free(trader->out_ring);
         free(trader);
-        pthread_mutex_unlock(&trader_map_mutex);
         return NULL;
     }
     
-    // Initialize recursive mutex
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-    if (pthread_mutex_init(&trader->mutex, &attr) != 0) {
-        pthread_mutexattr_destroy(&attr);
+    if (pthread_mutex_init(&trader->send_lock, NULL) != 0) {
         free(trader->name);
+        free(trader->out_ring);
         free(trader);
-        pthread_mutex_unlock(&trader_map_mutex);
         return NULL;
     }
-    pthread_mutexattr_destroy(&attr);
-    
-    // Add to map
-    char *name_copy = malloc(strlen(name) + 1);
-    if (name_copy == NULL) {
-        pthread_mutex_destroy(&trader->mutex);
-        free(trader->name);
-        free(trader);
-        pthread_mutex_unlock(&trader_map_mutex);
+    return trader;
+}
+
+/*
+ * Link a trader into the list for its subscription level.  Must be called
+ * with the shard's mutex held.
+ */
+static void shard_link(struct trader_shard *shard, TRADER *trader) {
+    TRADER **head = &shard->head[trader->feed.level];
+    trader->shard_prev = NULL;
+    trader->shard_next = *head;
+    if (*head != NULL) {
+        (*head)->shard_prev = trader;
+    }
+    *head = trader;
+    __atomic_fetch_add(&feed_counts[trader->feed.level], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Unlink a trader from the list for its subscription level.  Must be called
+ * with the shard's mutex held.
+ */
+static void shard_unlink(struct trader_shard *shard, TRADER *trader) {
+    if (trader->shard_prev != NULL) {
+        trader->shard_prev->shard_next = trader->shard_next;
+    } else {
+        shard->head[trader->feed.level] = trader->shard_next;
+    }
+    if (trader->shard_next != NULL) {
+        trader->shard_next->shard_prev = trader->shard_prev;
+    }
+    trader->shard_prev = NULL;
+    trader->shard_next = NULL;
+    __atomic_fetch_sub(&feed_counts[trader->feed.level], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Add a trader to the set of logged-in traders, spreading traders over the shards.
+ */
+static void trader_register(TRADER *trader) {
+    struct trader_shard *shard =
+        &trader_shards[__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % TRADER_SHARDS];
+    pthread_mutex_lock(&shard->mutex);
+    trader->shard = shard;
+    trader->feed.level = __atomic_load_n(&default_feed, __ATOMIC_RELAXED);
+    shard_link(shard, trader);
+    shard->count++;
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/*
+ * Attempt to log in a trader with a specified user name.
+ */
+TRADER *trader_login(int fd, char *name) {
+    if (fd < 0 || name == NULL) {
         return NULL;
     }
-    strcpy(name_copy, name);
     
-    trader_map[trader_count].name = name_copy;
-    trader_map[trader_count].trader = trader;
-    trader_count++;
+    TRADER *trader = trader_create(fd, name);
+    if (trader == NULL) {
+        return NULL;
+    }
+    trader_register(trader);
     
     debug_thread("Create new trader %p [%s]", trader, name);
     debug_thread("Increase reference count on trader %p [%s] (0 -> 1) for new trader just logged in", trader, name);
     
-    pthread_mutex_unlock(&trader_map_mutex);
     return trader;
 }
 
+/*
+ * Log in a trader whose packets are to be handed to a sink.
+ */
+TRADER *trader_login_sink(TRADER_SINK *sink, char *name) {
+    if (sink == NULL || name == NULL) {
+        return NULL;
+    }
+    
+    TRADER *trader = trader_create(-1, name);
+    if (trader == NULL) {
+        return NULL;
+    }
+    trader->sink = sink;
+    trader_register(trader);
+    
+    debug_thread("Create new trader %p [%s] with sink %p", trader, name, sink);
+    return trader;
+}
+
+/*
+ * Log in a trader whose connection is never to be written with a blocking call.
+ */
+TRADER *trader_login_buffered(PROTO_WBUF *sender, char *name) {
+    if (sender == NULL || name == NULL) {
+        return NULL;
+    }
+    
+    TRADER *trader = trader_create(sender->fd, name);
+    if (trader == NULL) {
+        return NULL;
+    }
+    trader->sender = sender;
+    trader_register(trader);
+    
+    debug_thread("Create new trader %p [%s] with buffered sender", trader, name);
+    return trader;
+}
+
+/*
+ * Initialize a sink.
+ */
+void trader_sink_init(TRADER_SINK *sink, trader_sink_t kind, void *buf, size_t size) {
+    memset(sink, 0, sizeof(TRADER_SINK));
+    sink->kind = kind;
+    if (kind == TRADER_SINK_MEMORY) {
+        sink->buf = buf;
+        sink->size = size;
+    }
+}
+
+/*
+ * Hand a packet to a sink.
+ */
+static void sink_packet(TRADER_SINK *sink, BRS_PACKET_HEADER *pkt, void *data) {
+    if (sink->kind == TRADER_SINK_NULL) {
+        return;
+    }
+    size_t payload_size = ntohs(pkt->size);
+    size_t packet_size = sizeof(BRS_PACKET_HEADER) + payload_size;
+    __atomic_fetch_add(&sink->packets, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sink->bytes, packet_size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sink->types[pkt->type < TRADER_SINK_TYPES ? pkt->type : 0], 1,
+                       __ATOMIC_RELAXED);
+    if (sink->kind == TRADER_SINK_MEMORY) {
+        if (sink->len + packet_size > sink->size) {
+            sink->overflow += packet_size;
+            return;
+        }
+        memcpy(sink->buf + sink->len, pkt, sizeof(BRS_PACKET_HEADER));
+        if (payload_size > 0) {
+            memcpy(sink->buf + sink->len + sizeof(BRS_PACKET_HEADER), data, payload_size);
+        }
+        sink->len += packet_size;
+    }
+}
+
+/*
+ * Hand the whole packets in a buffer to a sink.
+ */
+static void sink_buffer(TRADER_SINK *sink, char *buf, size_t len) {
+    size_t off = 0;
+    while (off + sizeof(BRS_PACKET_HEADER) <= len) {
+        BRS_PACKET_HEADER hdr;
+        memcpy(&hdr, buf + off, sizeof(hdr));
+        sink_packet(sink, &hdr, buf + off + sizeof(hdr));
+        off += sizeof(hdr) + ntohs(hdr.size);
+    }
+}
+
+/*
+ * Check whether packets can be sent to a trader.  Must be called with the
+ * send lock held, or be taken only as a hint.
+ */
+static int trader_connected(TRADER *trader) {
+    return trader_get_fd(trader) >= 0 || trader->sink != NULL;
+}
+
+/*
+ * Create a trader that is not logged in, to own orders restored from the journal.
+ */
+TRADER *trader_detached(char *name) {
+    if (name == NULL) {
+        return NULL;
+    }
+    
+    TRADER *trader = trader_create(-1, name);
+    if (trader == NULL) {
+        return NULL;
+    }
+    trader->detached = 1;
+    debug_thread("Create detached trader %p [%s]", trader, name);
+    return trader;
+}
+
+/*
+ * Check whether a trader was created by trader_detached().
+ */
+int trader_is_detached(TRADER *trader) {
+    return trader->detached;
+}
+
 /*
  * Log out a trader.
  */
@@ -185,20 +420,24 @@ void trader_logout(TRADER *trader) {
         return;
     }
     
-    pthread_mutex_lock(&trader_map_mutex);
-    
-    // Remove from map
-    for (int i = 0; i < trader_count; i++) {
-        if (trader_map[i].trader == trader) {
-            free(trader_map[i].name);
-            // Move last element to this position
-            trader_map[i] = trader_map[trader_count - 1];
-            trader_count--;
-            break;
-        }
+    // Remove from the set of logged-in traders
+    struct trader_shard *shard = trader->shard;
+    if (shard != NULL) {
+        pthread_mutex_lock(&shard->mutex);
+        shard_unlink(shard, trader);
+        trader->shard = NULL;
+        shard->count--;
+        pthread_mutex_unlock(&shard->mutex);
     }
     
-    pthread_mutex_unlock(&trader_map_mutex);
+    // The connection belongs to the thread servicing the client, which
+    // closes it after logout.  The trader itself may live on (for example,
+    // referenced by pending orders), so it must stop using the descriptor.
+    pthread_mutex_lock(&trader->send_lock);
+    trader->fd = -1;
+    trader->sink = NULL;
+    trader->sender = NULL;
+    pthread_mutex_unlock(&trader->send_lock);
     
     // Unref the trader (consumes one reference)
     trader_unref(trader, "logout");
@@ -212,11 +451,9 @@ TRADER *trader_ref(TRADER *trader, char *why) {
         return NULL;
     }
     
-    pthread_mutex_lock(&trader->mutex);
-    int old_refcount = trader->refcount;
-    trader->refcount++;
-    debug_thread("Increase reference count on trader %p [%s] (%d -> %d) for %s", trader, trader->name, old_refcount, trader->refcount, why);
-    pthread_mutex_unlock(&trader->mutex);
+    // The caller already holds a reference, so nothing need be ordered
+    int old_refcount = __atomic_fetch_add(&trader->refcount, 1, __ATOMIC_RELAXED);
+    debug_thread("Increase reference count on trader %p [%s] (%d -> %d) for %s", trader, trader->name, old_refcount, old_refcount + 1, why);
     
     return trader;
 }
@@ -229,30 +466,24 @@ void trader_unref(TRADER *trader, char *why) {
         return;
     }
     
-    pthread_mutex_lock(&trader->mutex);
-    
-    int old_refcount = trader->refcount;
-    trader->refcount--;
-    debug_thread("Decrease reference count on trader %p [%s] (%d -> %d) for %s", trader, trader->name, old_refcount, trader->refcount, why);
+    // Release, so that everything done with the trader happens before
+    // it is freed by whichever thread drops the last reference
+    int old_refcount = __atomic_fetch_sub(&trader->refcount, 1, __ATOMIC_RELEASE);
+    debug_thread("Decrease reference count on trader %p [%s] (%d -> %d) for %s", trader, trader->name, old_refcount, old_refcount - 1, why);
     
-    if (trader->refcount < 0) {
+    if (old_refcount <= 0) {
         error("trader_unref: refcount went negative for %s", trader->name);
         abort();
     }
     
-    if (trader->refcount == 0) {
-        // Free resources
-        if (trader->fd >= 0) {
-            close(trader->fd);
-        }
+    if (old_refcount == 1) {
+        // Acquire what the other threads did before dropping their references
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
         free(trader->name);
-        pthread_mutex_unlock(&trader->mutex);
-        pthread_mutex_destroy(&trader->mutex);
+        free(trader->out_ring);
+        pthread_mutex_destroy(&trader->send_lock);
         free(trader);
-        return;
     }
-    
-    pthread_mutex_unlock(&trader->mutex);
 }
 
 /*
@@ -266,17 +497,11 @@ ACCOUNT *trader_get_account(TRADER *trader) {
 }
 
 /*
- * Send a packet to the client for a trader.
+ * Log an outgoing packet
  */
-int trader_send_packet(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data) {
-    if (trader == NULL || pkt == NULL) {
-        return -1;
-    }
-    
-    pthread_mutex_lock(&trader->mutex);
-    
+static void log_send(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data) {
     // Log outgoing packet
-    double timestamp = format_timestamp(ntohl(pkt->timestamp_sec), ntohl(pkt->timestamp_nsec));
+    uint32_t sec = ntohl(pkt->timestamp_sec), nsec = ntohl(pkt->timestamp_nsec);
     uint16_t payload_size = ntohs(pkt->size);
     BRS_PACKET_TYPE type = (BRS_PACKET_TYPE)pkt->type;
     
@@ -285,93 +510,130 @@ int trader_send_packet(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data) {
     
     if (type == BRS_ACK_PKT && data != NULL && payload_size == sizeof(BRS_STATUS_INFO)) {
         BRS_STATUS_INFO *info = (BRS_STATUS_INFO *)data;
-        debug_thread("=> %.9f: type=ACK, size=%d, balance: %u, inventory: %u, bid: %u, ask: %u, last: %u, order: %u", 
-              timestamp, payload_size, ntohl(info->balance), ntohl(info->inventory), 
+        debug_thread("=> %u.%09u: type=ACK, size=%d, balance: %u, inventory: %u, bid: %u, ask: %u, last: %u, order: %u", 
+              sec, nsec, payload_size, ntohl(info->balance), ntohl(info->inventory), 
               ntohl(info->bid), ntohl(info->ask), ntohl(info->last), ntohl(info->orderid));
     } else if (payload_size == 0) {
-        debug_thread("=> %.9f: type=%s, size=0 (no payload)", timestamp, packet_type_name(type));
+        debug_thread("=> %u.%09u: type=%s, size=0 (no payload)", sec, nsec, packet_type_name(type));
     } else {
-        debug_thread("=> %.9f: type=%s, size=%d", timestamp, packet_type_name(type), payload_size);
+        debug_thread("=> %u.%09u: type=%s, size=%d", sec, nsec, packet_type_name(type), payload_size);
     }
+}
+
+/*
+ * Write out, with a single system call where possible, any partially written
+ * queued data, any packets held back while corked, and then the given packet
+ * if any.  Must be called with the send lock held.
+ */
+static int trader_write(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data) {
+    struct iovec iov[4];
+    int iovcnt = 0;
     
-    int result = proto_send_packet(trader->fd, pkt, data);
-    
-    pthread_mutex_unlock(&trader->mutex);
+    // Finish any partially written queued data first, so that packets
+    // are not interleaved on the wire
+    iov[iovcnt].iov_base = trader->wbuf + trader->woff;
+    iov[iovcnt++].iov_len = trader->wlen - trader->woff;
+    iov[iovcnt].iov_base = trader->cork_buf;
+    iov[iovcnt++].iov_len = trader->cork_len;
+    if (pkt != NULL) {
+        iov[iovcnt].iov_base = pkt;
+        iov[iovcnt++].iov_len = sizeof(BRS_PACKET_HEADER);
+        iov[iovcnt].iov_base = data;
+        iov[iovcnt++].iov_len = ntohs(pkt->size);
+    }
     
+    int result = 0;
+    if (trader->sink != NULL) {
+        sink_buffer(trader->sink, iov[0].iov_base, iov[0].iov_len);
+        sink_buffer(trader->sink, trader->cork_buf, trader->cork_len);
+        if (pkt != NULL) {
+            sink_packet(trader->sink, pkt, data);
+        }
+    } else if (trader->sender != NULL) {
+        result = proto_wbuf_send_iov(trader->sender, iov, iovcnt);
+        if (result != 0 && errno == ENOBUFS) {
+            // The client has stopped reading; the thread serving it will
+            // see EOF and log the trader out
+            debug_thread("Send buffer full for trader %p [%s], disconnecting", trader, trader->name);
+            stats_count(STATS_OUTBOUND_DISCONNECTS, 1);
+            shutdown(trader->fd, SHUT_RDWR);
+        }
+    } else {
+        result = proto_send_iov(trader->fd, iov, iovcnt);
+    }
+    trader->wlen = trader->woff = 0;
+    trader->cork_len = 0;
     return result;
 }
 
 /*
- * Broadcast a packet to all currently logged-in traders.
+ * Send a packet to the client for a trader.
  */
-int trader_broadcast_packet(BRS_PACKET_HEADER *pkt, void *data) {
-    if (pkt == NULL) {
+int trader_send_packet(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data) {
+    if (trader == NULL || pkt == NULL) {
         return -1;
     }
     
-    // Create a copy of the packet for each trader
-    // We need to copy the payload if present
-    void *payload_copy = NULL;
     uint16_t payload_size = ntohs(pkt->size);
-    if (payload_size > 0 && data != NULL) {
-        payload_copy = malloc(payload_size);
-        if (payload_copy == NULL) {
-            return -1;
-        }
-        memcpy(payload_copy, data, payload_size);
+    if (payload_size > 0 && data == NULL) {
+        return -1;
     }
+    size_t packet_size = sizeof(BRS_PACKET_HEADER) + payload_size;
     
-    pthread_mutex_lock(&trader_map_mutex);
+    pthread_mutex_lock(&trader->send_lock);
     
-    // Create array of traders to broadcast to
-    TRADER **traders = malloc(sizeof(TRADER *) * trader_count);
-    if (traders == NULL) {
-        pthread_mutex_unlock(&trader_map_mutex);
-        if (payload_copy != NULL) {
-            free(payload_copy);
+    log_send(trader, pkt, data);
+    
+    int result = 0;
+    if (trader->corked && packet_size <= TRADER_WBUF_SIZE) {
+        // Hold the packet back until uncorked, writing out what has
+        // been held back so far if there is no room for it
+        if (trader->cork_len + packet_size > TRADER_WBUF_SIZE) {
+            result = trader_write(trader, NULL, NULL);
         }
-        return -1;
+        memcpy(trader->cork_buf + trader->cork_len, pkt, sizeof(BRS_PACKET_HEADER));
+        if (payload_size > 0) {
+            memcpy(trader->cork_buf + trader->cork_len + sizeof(BRS_PACKET_HEADER), data, payload_size);
+        }
+        trader->cork_len += packet_size;
+    } else {
+        result = trader_write(trader, pkt, data);
     }
     
-    int count = 0;
-    for (int i = 0; i < trader_count; i++) {
-        if (trader_map[i].trader != NULL) {
-            traders[count] = trader_ref(trader_map[i].trader, "broadcast");
-            count++;
-        }
+    pthread_mutex_unlock(&trader->send_lock);
+    
+    return result;
+}
+
+/*
+ * Broadcast a packet to all currently logged-in traders.
+ */
+int trader_broadcast_packet(BRS_PACKET_HEADER *pkt, void *data) {
+    if (pkt == NULL) {
+        return -1;
     }
     
-    pthread_mutex_unlock(&trader_map_mutex);
+    // The payload is only read while sending, so it is sent to each
+    // trader as is rather than copied.  Broadcasts are normally made by
+    // the fan-out thread, which keeps its snapshot buffer between calls;
+    // this path allocates one only for the duration of the call.
+    TRADER **traders = NULL;
+    int traders_size = 0;
+    int count = trader_snapshot_feed(&traders, &traders_size, BRS_FEED_FULL);
     
-    // Send to all traders
+    // Send to all traders subscribed to the tape
     int result = 0;
     for (int i = 0; i < count; i++) {
         // Create a copy of the header for each send
         BRS_PACKET_HEADER hdr_copy = *pkt;
-        void *data_copy = NULL;
-        
-        if (payload_size > 0 && payload_copy != NULL) {
-            data_copy = malloc(payload_size);
-            if (data_copy != NULL) {
-                memcpy(data_copy, payload_copy, payload_size);
-            }
-        }
         
-        if (trader_send_packet(traders[i], &hdr_copy, data_copy) != 0) {
+        if (trader_send_packet(traders[i], &hdr_copy, data) != 0) {
             result = -1;
         }
         
-        if (data_copy != NULL) {
-            free(data_copy);
-        }
-        
-        trader_unref(traders[i], "broadcast");
+        trader_unref(traders[i], "snapshot");
     }
-    
     free(traders);
-    if (payload_copy != NULL) {
-        free(payload_copy);
-    }
     
     return result;
 }
@@ -423,3 +685,496 @@ int trader_send_nack(TRADER *trader) {
     return trader_send_packet(trader, &hdr, NULL);
 }
 
+/*
+ * Send a NACK packet to a trader, giving the reason an order was refused.
+ */
+int trader_send_nack_reason(TRADER *trader, BRS_NACK_REASON reason) {
+    if (trader == NULL) {
+        return -1;
+    }
+    
+    BRS_PACKET_HEADER hdr;
+    hdr.type = BRS_NACK_PKT;
+    hdr.size = htons(sizeof(BRS_NACK_INFO));
+    
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.timestamp_sec = htonl(ts.tv_sec);
+    hdr.timestamp_nsec = htonl(ts.tv_nsec);
+    
+    BRS_NACK_INFO info;
+    memset(&info, 0, sizeof(info));
+    info.reason = reason;
+    return trader_send_packet(trader, &hdr, &info);
+}
+
+
+/*
+ * Set the capacity of outbound rings and the slow-consumer policy.
+ */
+void traders_set_outbound(int capacity, outbound_policy_t policy) {
+    if (capacity > 0) {
+        __atomic_store_n(&outbound_capacity, capacity, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&outbound_policy, policy, __ATOMIC_RELAXED);
+}
+
+/*
+ * Set the subscription level of traders when they log in.
+ */
+void traders_set_default_feed(BRS_FEED_LEVEL level) {
+    if (level >= 0 && level < BRS_FEED_LEVELS) {
+        __atomic_store_n(&default_feed, level, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Set the risk limits of all traders.
+ */
+void traders_set_limits(uint32_t max_orders, uint64_t max_notional, uint32_t rate, uint32_t burst) {
+    uint64_t interval = rate > 0 ? 1000000000u / rate : 0;
+    __atomic_store_n(&risk_max_orders, max_orders, __ATOMIC_RELAXED);
+    __atomic_store_n(&risk_max_notional, max_notional, __ATOMIC_RELAXED);
+    __atomic_store_n(&risk_interval, interval, __ATOMIC_RELAXED);
+    __atomic_store_n(&risk_window, interval * (burst > 0 ? burst : 1), __ATOMIC_RELAXED);
+}
+
+/*
+ * Take a token from a trader's bucket, if there is one.  The bucket is kept
+ * as the time at which it would be full again: each order pushes that time
+ * an interval later, and an order is let through unless it would be pushed
+ * more than the window beyond now.
+ *
+ * @return 0 if a token was taken, -1 if the bucket is empty.
+ */
+static int risk_take_token(TRADER *trader, uint64_t interval, uint64_t window) {
+    uint64_t now = stats_now();
+    uint64_t due = __atomic_load_n(&trader->risk_due, __ATOMIC_RELAXED);
+    uint64_t next;
+    do {
+        next = (due > now ? due : now) + interval;
+        if (next - now > window) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&trader->risk_due, &due, next, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/*
+ * Check whether a trader may enter an order.
+ */
+BRS_NACK_REASON trader_risk_check(TRADER *trader, quantity_t quantity, funds_t price,
+                                  uint32_t orders, uint64_t notional) {
+    BRS_NACK_REASON reason = BRS_NACK_NONE;
+    uint64_t value = (uint64_t)quantity * price;
+    uint32_t max_orders = __atomic_load_n(&risk_max_orders, __ATOMIC_RELAXED);
+    uint64_t max_notional = __atomic_load_n(&risk_max_notional, __ATOMIC_RELAXED);
+    uint64_t interval = __atomic_load_n(&risk_interval, __ATOMIC_RELAXED);
+    
+    // The counts can only have gone down by the time the order is placed,
+    // since only the trader's own requests, which come one at a time, add to them
+    if (value > UINT32_MAX) {
+        reason = BRS_NACK_OVERFLOW;
+    } else if (max_orders != 0
+               && __atomic_load_n(&trader->risk_orders, __ATOMIC_RELAXED) + orders >= max_orders) {
+        reason = BRS_NACK_ORDERS;
+    } else if (max_notional != 0
+               && __atomic_load_n(&trader->risk_notional, __ATOMIC_RELAXED) + notional + value
+                  > max_notional) {
+        reason = BRS_NACK_NOTIONAL;
+    } else if (interval != 0
+               && risk_take_token(trader, interval,
+                                  __atomic_load_n(&risk_window, __ATOMIC_RELAXED)) != 0) {
+        reason = BRS_NACK_RATE;
+    }
+    if (reason != BRS_NACK_NONE) {
+        stats_count(STATS_RISK_REJECTS, 1);
+        debug_thread("Trader %p order for %u at %u refused by risk check (%d)",
+                     trader, quantity, price, reason);
+    }
+    return reason;
+}
+
+/*
+ * Count an order placed on a book for a trader.
+ */
+void trader_risk_open(TRADER *trader, quantity_t quantity, funds_t price) {
+    __atomic_fetch_add(&trader->risk_orders, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&trader->risk_notional, (uint64_t)quantity * price, __ATOMIC_RELAXED);
+}
+
+/*
+ * Count a quantity of a trader's order that has left the book.
+ */
+void trader_risk_close(TRADER *trader, quantity_t quantity, funds_t price, int closed) {
+    __atomic_fetch_sub(&trader->risk_notional, (uint64_t)quantity * price, __ATOMIC_RELAXED);
+    if (closed) {
+        __atomic_fetch_sub(&trader->risk_orders, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Get the number of a trader's pending orders.
+ */
+uint32_t trader_risk_orders(TRADER *trader) {
+    return __atomic_load_n(&trader->risk_orders, __ATOMIC_RELAXED);
+}
+
+/*
+ * Get references to the logged-in traders at one subscription level, or at
+ * all levels if level is -1.
+ */
+static int snapshot_levels(TRADER ***tradersp, int *sizep, int level) {
+    int count = 0;
+    int first = level < 0 ? 0 : level;
+    int last = level < 0 ? BRS_FEED_LEVELS - 1 : level;
+    for (int i = 0; i < TRADER_SHARDS; i++) {
+        struct trader_shard *shard = &trader_shards[i];
+        if (level >= 0 && __atomic_load_n(&shard->head[level], __ATOMIC_RELAXED) == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&shard->mutex);
+        
+        if (count + shard->count > *sizep) {
+            int size = *sizep * 2;
+            if (size < count + shard->count) {
+                size = count + shard->count;
+            }
+            TRADER **traders = realloc(*tradersp, sizeof(TRADER *) * size);
+            if (traders == NULL) {
+                pthread_mutex_unlock(&shard->mutex);
+                break;
+            }
+            *tradersp = traders;
+            *sizep = size;
+        }
+        
+        for (int l = first; l <= last; l++) {
+            for (TRADER *trader = shard->head[l]; trader != NULL; trader = trader->shard_next) {
+                (*tradersp)[count++] = trader_ref(trader, "snapshot");
+            }
+        }
+        
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return count;
+}
+
+/*
+ * Get references to all currently logged-in traders.
+ */
+int trader_snapshot(TRADER ***tradersp, int *sizep) {
+    return snapshot_levels(tradersp, sizep, -1);
+}
+
+/*
+ * Get references to the logged-in traders subscribed at a specified level.
+ */
+int trader_snapshot_feed(TRADER ***tradersp, int *sizep, BRS_FEED_LEVEL level) {
+    if (level < 0 || level >= BRS_FEED_LEVELS) {
+        return 0;
+    }
+    return snapshot_levels(tradersp, sizep, level);
+}
+
+/*
+ * Change the market-data subscription of a trader.
+ */
+int trader_subscribe(TRADER *trader, BRS_FEED_LEVEL level, unsigned interval) {
+    if (trader == NULL || level < 0 || level >= BRS_FEED_LEVELS) {
+        return -1;
+    }
+    if (interval == 0) {
+        interval = BRS_QUOTE_DEFAULT_INTERVAL;
+    }
+    interval = (interval + BRS_QUOTE_MIN_INTERVAL - 1) / BRS_QUOTE_MIN_INTERVAL * BRS_QUOTE_MIN_INTERVAL;
+    
+    struct trader_shard *shard = trader->shard;
+    if (shard == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&shard->mutex);
+    shard_unlink(shard, trader);
+    trader->feed.level = level;
+    __atomic_store_n(&trader->feed.interval, interval * 1000000ull, __ATOMIC_RELAXED);
+    // The fan-out thread sends every current quote at its next tick
+    __atomic_store_n(&trader->feed.due, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&trader->feed.seen, 0, __ATOMIC_RELAXED);
+    shard_link(shard, trader);
+    pthread_mutex_unlock(&shard->mutex);
+    
+    debug_thread("Trader %p [%s] subscribed at level %d, interval %u ms", trader, trader->name,
+                 level, interval);
+    return 0;
+}
+
+/*
+ * Get the market-data subscription of a trader.
+ */
+TRADER_FEED *trader_get_feed(TRADER *trader) {
+    return &trader->feed;
+}
+
+/*
+ * Get the number of logged-in traders subscribed at a specified level.
+ */
+int traders_feed_count(BRS_FEED_LEVEL level) {
+    if (level < 0 || level >= BRS_FEED_LEVELS) {
+        return 0;
+    }
+    return __atomic_load_n(&feed_counts[level], __ATOMIC_RELAXED);
+}
+
+/*
+ * Note that a trader has data to be flushed.
+ * Returns 1 if it was not already scheduled for flushing.
+ */
+static int outbound_schedule(TRADER *trader) {
+    if (trader->out_scheduled) {
+        return 0;
+    }
+    trader->out_scheduled = 1;
+    return 1;
+}
+
+/*
+ * Double the size of a trader's full outbound ring, moving the queued
+ * packets, oldest first, to the start of the new one.
+ */
+static int outbound_grow(TRADER *trader) {
+    int capacity = trader->out_capacity * 2;
+    struct outbound_slot *ring = malloc(sizeof(struct outbound_slot) * capacity);
+    if (ring == NULL) {
+        return -1;
+    }
+    
+    int first = trader->out_capacity - trader->out_head;
+    memcpy(ring, trader->out_ring + trader->out_head, sizeof(struct outbound_slot) * first);
+    memcpy(ring + first, trader->out_ring, sizeof(struct outbound_slot) * trader->out_head);
+    free(trader->out_ring);
+    trader->out_ring = ring;
+    trader->out_capacity = capacity;
+    trader->out_head = 0;
+    return 0;
+}
+
+/*
+ * Apply the slow-consumer policy to a trader whose outbound ring is full.
+ * Returns 1 if there is now room for the new packet, 0 if the new packet
+ * is to be discarded, or -1 if the trader is to be disconnected.
+ */
+static int outbound_make_room(TRADER *trader, int reliable) {
+    switch (__atomic_load_n(&outbound_policy, __ATOMIC_RELAXED)) {
+        case OUTBOUND_QUEUE:
+            return outbound_grow(trader) == 0 ? 1 : -1;
+        case OUTBOUND_DROP_OLDEST:
+            for (int i = 0; i < trader->out_count; i++) {
+                int index = (trader->out_head + i) % trader->out_capacity;
+                if (trader->out_ring[index].reliable) {
+                    continue;
+                }
+                // Close the gap by moving the packets queued ahead of it up by one
+                for (; i > 0; i--) {
+                    int prev = (index + trader->out_capacity - 1) % trader->out_capacity;
+                    trader->out_ring[index] = trader->out_ring[prev];
+                    index = prev;
+                }
+                trader->out_head = (trader->out_head + 1) % trader->out_capacity;
+                trader->out_count--;
+                trader->out_drops++;
+                stats_count(STATS_OUTBOUND_DROPS, 1);
+                return 1;
+            }
+            break;
+        case OUTBOUND_DROP:
+            break;
+        case OUTBOUND_DISCONNECT:
+            return -1;
+    }
+    
+    if (reliable) {
+        return -1;
+    }
+    trader->out_drops++;
+    stats_count(STATS_OUTBOUND_DROPS, 1);
+    return 0;
+}
+
+/*
+ * Queue a packet on a trader's outbound ring.
+ */
+int trader_enqueue_packet(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data, int reliable) {
+    if (trader == NULL || pkt == NULL) {
+        return -1;
+    }
+    
+    uint16_t payload_size = ntohs(pkt->size);
+    if (payload_size > OUTBOUND_MAX_PAYLOAD || (payload_size > 0 && data == NULL)) {
+        return -1;
+    }
+    if (trader->out_disconnect || !trader_connected(trader)) {
+        return -1;
+    }
+    
+    // Apply the slow-consumer policy if the ring is full
+    if (trader->out_count == trader->out_capacity) {
+        int room = outbound_make_room(trader, reliable);
+        if (room < 0) {
+            debug_thread("Outbound queue full for trader %p [%s], disconnecting", trader, trader->name);
+            trader->out_disconnect = 1;
+            trader->out_count = 0;
+            stats_count(STATS_OUTBOUND_DISCONNECTS, 1);
+            return outbound_schedule(trader);
+        }
+        if (room == 0) {
+            return 0;
+        }
+    }
+    
+    log_send(trader, pkt, data);
+    
+    int tail = (trader->out_head + trader->out_count) % trader->out_capacity;
+    struct outbound_slot *slot = &trader->out_ring[tail];
+    slot->hdr = *pkt;
+    slot->reliable = reliable != 0;
+    if (payload_size > 0) {
+        memcpy(slot->payload, data, payload_size);
+    }
+    trader->out_count++;
+    stats_record(STATS_OUTBOUND_DEPTH, trader->out_count);
+    
+    return outbound_schedule(trader);
+}
+
+/*
+ * Discard everything queued for a trader.  Must be called with the send lock held.
+ */
+static void outbound_discard(TRADER *trader) {
+    trader->out_count = 0;
+    trader->wlen = trader->woff = 0;
+    trader->out_scheduled = 0;
+}
+
+/*
+ * Check whether the data queued for a trader is to be discarded.
+ */
+int trader_is_closing(TRADER *trader) {
+    return !trader_connected(trader) || __atomic_load_n(&trader->out_disconnect, __ATOMIC_RELAXED);
+}
+
+/*
+ * Send as much of a trader's queued data as can be sent without blocking.
+ */
+trader_flush_t trader_flush_packets(TRADER *trader) {
+    if (pthread_mutex_trylock(&trader->send_lock) != 0) {
+        return TRADER_FLUSH_BUSY;
+    }
+    
+    if (!trader_connected(trader) || trader->out_disconnect) {
+        if (trader->fd >= 0) {
+            // Service thread will see EOF and log the trader out
+            shutdown(trader->fd, SHUT_RDWR);
+        }
+        outbound_discard(trader);
+        pthread_mutex_unlock(&trader->send_lock);
+        return TRADER_FLUSH_CLOSED;
+    }
+    
+    // Data kept by a buffered sender goes out ahead of what is queued
+    int kept = trader->sender != NULL ? proto_wbuf_flush(trader->sender) : 0;
+    if (kept != 0) {
+        if (kept < 0) {
+            outbound_discard(trader);
+        }
+        pthread_mutex_unlock(&trader->send_lock);
+        return kept < 0 ? TRADER_FLUSH_CLOSED : TRADER_FLUSH_BLOCKED;
+    }
+    
+    while (1) {
+        // Refill the write buffer from the ring once it has been sent
+        if (trader->woff == trader->wlen) {
+            trader->wlen = trader->woff = 0;
+            while (trader->out_count > 0) {
+                struct outbound_slot *slot = &trader->out_ring[trader->out_head];
+                size_t payload_size = ntohs(slot->hdr.size);
+                if (trader->wlen + sizeof(BRS_PACKET_HEADER) + payload_size > TRADER_WBUF_SIZE) {
+                    break;
+                }
+                memcpy(trader->wbuf + trader->wlen, &slot->hdr, sizeof(BRS_PACKET_HEADER));
+                trader->wlen += sizeof(BRS_PACKET_HEADER);
+                memcpy(trader->wbuf + trader->wlen, slot->payload, payload_size);
+                trader->wlen += payload_size;
+                trader->out_head = (trader->out_head + 1) % trader->out_capacity;
+                trader->out_count--;
+            }
+            if (trader->wlen == 0) {
+                trader->out_scheduled = 0;
+                pthread_mutex_unlock(&trader->send_lock);
+                return TRADER_FLUSH_DONE;
+            }
+        }
+        
+        if (trader->sink != NULL) {
+            sink_buffer(trader->sink, trader->wbuf + trader->woff, trader->wlen - trader->woff);
+            trader->woff = trader->wlen;
+            continue;
+        }
+        
+        ssize_t n = send(trader->fd, trader->wbuf + trader->woff, trader->wlen - trader->woff,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                pthread_mutex_unlock(&trader->send_lock);
+                return TRADER_FLUSH_BLOCKED;
+            }
+            // Connection is broken; the service thread will find out on its own
+            outbound_discard(trader);
+            pthread_mutex_unlock(&trader->send_lock);
+            return TRADER_FLUSH_CLOSED;
+        }
+        trader->woff += n;
+    }
+}
+
+/*
+ * Write out what is kept by the buffered sender of a trader.
+ */
+int trader_flush_sender(TRADER *trader) {
+    pthread_mutex_lock(&trader->send_lock);
+    int result = trader->sender != NULL ? proto_wbuf_flush(trader->sender) : 0;
+    pthread_mutex_unlock(&trader->send_lock);
+    return result;
+}
+
+/*
+ * Get the file descriptor of the connection for a trader.
+ */
+int trader_get_fd(TRADER *trader) {
+    return __atomic_load_n(&trader->fd, __ATOMIC_RELAXED);
+}
+
+/*
+ * Start holding back packets sent to a trader.
+ */
+void trader_cork(TRADER *trader) {
+    pthread_mutex_lock(&trader->send_lock);
+    trader->corked++;
+    pthread_mutex_unlock(&trader->send_lock);
+}
+
+/*
+ * Stop holding back packets sent to a trader, sending those held back.
+ */
+int trader_uncork(TRADER *trader) {
+    int result = 0;
+    pthread_mutex_lock(&trader->send_lock);
+    if (trader->corked > 0 && --trader->corked == 0 && trader->cork_len > 0) {
+        result = trader_write(trader, NULL, NULL);
+    }
+    pthread_mutex_unlock(&trader->send_lock);
+    return result;
+}
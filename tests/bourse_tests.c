@@ -5,6 +5,28 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <wait.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "account.h"
+#include "account_ext.h"
+#include "exchange.h"
+#include "exchange_ext.h"
+#include "fanout.h"
+#include "instrument.h"
+#include "journal.h"
+#include "order_book.h"
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "trader.h"
+#include "trader_ext.h"
 
 static void init() {
 #ifndef NO_SERVER
@@ -71,3 +93,1353 @@ Test(student_suite, 01_connect, .init = init, .fini = fini, .timeout = 5) {
     int ret = system("util/client -p 9999 </dev/null | grep 'Connected to server'");
     cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
 }
+
+/*
+ * Tests of the modules of the server, driven in-process.
+ */
+
+/*
+ * Fill in an order to be inserted directly into an order book.
+ */
+static struct order *book_order(struct order *order, orderid_t id, order_type_t type,
+                                quantity_t quantity, funds_t price) {
+    memset(order, 0, sizeof(*order));
+    order->id = id;
+    order->type = type;
+    order->quantity = quantity;
+    order->price = price;
+    return order;
+}
+
+Test(book_suite, 00_price_time_priority, .timeout = 5) {
+    ORDER_BOOK book;
+    struct order orders[7];
+    cr_assert_eq(book_init(&book, -1), 0, "Book was not initialized");
+    book_insert(&book, book_order(&orders[0], 1, ORDER_BUY, 10, 100));
+    book_insert(&book, book_order(&orders[1], 2, ORDER_BUY, 10, 101));
+    book_insert(&book, book_order(&orders[2], 3, ORDER_BUY, 10, 101));
+    book_insert(&book, book_order(&orders[3], 4, ORDER_BUY, 10, 99));
+    book_insert(&book, book_order(&orders[4], 5, ORDER_SELL, 10, 105));
+    book_insert(&book, book_order(&orders[5], 6, ORDER_SELL, 10, 103));
+    book_insert(&book, book_order(&orders[6], 7, ORDER_SELL, 5, 103));
+    
+    struct price_level *level = book.bids.best;
+    cr_assert_eq(level->price, 101, "Best bid level at %u", level->price);
+    cr_assert_eq(level->count, 2, "Level at 101 has %d orders", level->count);
+    cr_assert_eq(level->quantity, 20, "Level at 101 has quantity %u", level->quantity);
+    cr_assert_eq(book.bids.levels, 3, "Bids have %d levels", book.bids.levels);
+    
+    // Best price first, and the oldest order at that price
+    orderid_t buys[] = { 2, 3, 1, 4 };
+    for (int i = 0; i < 4; i++) {
+        struct order *best = book_best_buy(&book);
+        cr_assert_not_null(best, "No best buy at step %d", i);
+        cr_assert_eq(best->id, buys[i], "Best buy was %u, expected %u", best->id, buys[i]);
+        book_remove(&book, best);
+    }
+    cr_assert_null(book_best_buy(&book), "Bids not empty");
+    
+    orderid_t sells[] = { 6, 7, 5 };
+    for (int i = 0; i < 3; i++) {
+        struct order *best = book_best_sell(&book);
+        cr_assert_not_null(best, "No best sell at step %d", i);
+        cr_assert_eq(best->id, sells[i], "Best sell was %u, expected %u", best->id, sells[i]);
+        book_remove(&book, best);
+    }
+    cr_assert_null(book_best_sell(&book), "Asks not empty");
+    cr_assert_eq(book.asks.levels, 0, "Asks have %d levels", book.asks.levels);
+    book_fini(&book);
+}
+
+Test(book_suite, 01_partial_fill_keeps_priority, .timeout = 5) {
+    ORDER_BOOK book;
+    struct order orders[2];
+    cr_assert_eq(book_init(&book, -1), 0, "Book was not initialized");
+    book_insert(&book, book_order(&orders[0], 1, ORDER_SELL, 10, 50));
+    book_insert(&book, book_order(&orders[1], 2, ORDER_SELL, 10, 50));
+    
+    book_reduce(&book, &orders[0], 4);
+    cr_assert_eq(book_best_sell(&book), &orders[0], "Reduced order lost its place");
+    cr_assert_eq(book.asks.best->quantity, 16, "Level quantity not reduced");
+    cr_assert_eq(book.asks.quantity, 16, "Side quantity not reduced");
+    book_remove(&book, &orders[0]);
+    book_remove(&book, &orders[1]);
+    book_fini(&book);
+}
+
+#define BOOK_TEST_ORDERS 5000
+#define BOOK_TEST_ID(i) (4 * (i) + 1)
+
+Test(book_suite, 02_cancel_after_index_resize, .timeout = 5) {
+    ORDER_BOOK book;
+    struct order *orders = calloc(BOOK_TEST_ORDERS, sizeof(struct order));
+    cr_assert_not_null(orders, "Out of memory");
+    cr_assert_eq(book_init(&book, -1), 0, "Book was not initialized");
+    
+    // IDs spaced apart, so that buckets are chained across a resize
+    book_insert(&book, book_order(&orders[0], BOOK_TEST_ID(0), ORDER_BUY, 1, 1000));
+    size_t initial = book.index_size;
+    for (int i = 1; i < BOOK_TEST_ORDERS; i++) {
+        order_type_t type = i % 2 ? ORDER_SELL : ORDER_BUY;
+        funds_t price = type == ORDER_BUY ? 1000 - i % 50 : 2000 + i % 50;
+        cr_assert_eq(book_insert(&book, book_order(&orders[i], BOOK_TEST_ID(i), type, 1, price)), 0,
+                     "Order %d was not inserted", BOOK_TEST_ID(i));
+    }
+    cr_assert_gt(book.index_size, initial, "Index was not resized from %zu", initial);
+    
+    // Cancel every third order through the index, as the exchange does
+    for (int i = 0; i < BOOK_TEST_ORDERS; i += 3) {
+        struct order *order = book_find(&book, BOOK_TEST_ID(i));
+        cr_assert_eq(order, &orders[i], "Order %d not found", BOOK_TEST_ID(i));
+        book_remove(&book, order);
+    }
+    for (int i = 0; i < BOOK_TEST_ORDERS; i++) {
+        struct order *order = book_find(&book, BOOK_TEST_ID(i));
+        if (i % 3 == 0) {
+            cr_assert_null(order, "Canceled order %d still found", BOOK_TEST_ID(i));
+        } else {
+            cr_assert_eq(order, &orders[i], "Order %d not found", BOOK_TEST_ID(i));
+        }
+        cr_assert_null(book_find(&book, BOOK_TEST_ID(i) + 1), "Unknown order found");
+    }
+    cr_assert_eq(book.bids.orders + book.asks.orders, BOOK_TEST_ORDERS - (BOOK_TEST_ORDERS + 2) / 3,
+                 "Wrong number of orders left");
+    
+    for (int i = 0; i < BOOK_TEST_ORDERS; i++) {
+        if (i % 3 != 0) {
+            book_remove(&book, &orders[i]);
+        }
+    }
+    cr_assert_null(book_best_buy(&book), "Bids not empty");
+    cr_assert_null(book_best_sell(&book), "Asks not empty");
+    book_fini(&book);
+    free(orders);
+}
+
+/*
+ * Append a packet to a buffer, in the form in which it is sent.
+ *
+ * @return  The length of the buffer with the packet appended.
+ */
+static size_t rbuf_packet(char *buf, size_t len, uint8_t type, const void *payload,
+                          uint16_t size) {
+    BRS_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.size = htons(size);
+    hdr.timestamp_sec = htonl(len);
+    memcpy(buf + len, &hdr, sizeof(hdr));
+    if (size > 0) {
+        memcpy(buf + len + sizeof(hdr), payload, size);
+    }
+    return len + sizeof(hdr) + size;
+}
+
+/*
+ * Take the next packet from a receive buffer, checking its type, payload
+ * and alignment.
+ */
+static void rbuf_expect(PROTO_RBUF *rb, uint8_t type, const void *payload, uint16_t size) {
+    BRS_PACKET_HEADER *hdr;
+    void *data;
+    cr_assert_eq(proto_rbuf_next(rb, &hdr, &data), 1, "No packet of type %d", type);
+    cr_assert_eq((uintptr_t)hdr % __alignof__(BRS_PACKET_HEADER), 0, "Header not aligned");
+    cr_assert_eq(hdr->type, type, "Packet type was %d, expected %d", hdr->type, type);
+    cr_assert_eq(ntohs(hdr->size), size, "Payload size was %d, expected %d",
+                 ntohs(hdr->size), size);
+    if (size == 0) {
+        cr_assert_null(data, "Payload given for an empty packet");
+    } else {
+        cr_assert_not_null(data, "No payload given");
+        cr_assert_arr_eq(data, payload, size, "Payload differs");
+    }
+}
+
+static void rbuf_write(int fd, const char *buf, size_t len) {
+    cr_assert_eq(write(fd, buf, len), (ssize_t)len, "Write failed");
+}
+
+Test(rbuf_suite, 00_split_packet, .timeout = 5) {
+    int fds[2];
+    uint32_t storage[PROTO_RBUF_SIZE / sizeof(uint32_t)];
+    char pkt[64];
+    BRS_FUNDS_INFO funds = { htonl(12345) };
+    size_t len = rbuf_packet(pkt, 0, BRS_DEPOSIT_PKT, &funds, sizeof(funds));
+    PROTO_RBUF rb;
+    BRS_PACKET_HEADER *hdr;
+    void *data;
+    
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, "No socket pair");
+    proto_rbuf_init(&rb, fds[0], storage, sizeof(storage));
+    
+    // Part of the header, the rest of it, and then the payload a byte at a time
+    rbuf_write(fds[1], pkt, 5);
+    cr_assert_eq(proto_rbuf_fill(&rb, 1), 5, "Wrong number of bytes read");
+    cr_assert_eq(proto_rbuf_next(&rb, &hdr, &data), 0, "Packet taken from part of a header");
+    rbuf_write(fds[1], pkt + 5, sizeof(BRS_PACKET_HEADER) - 5);
+    proto_rbuf_fill(&rb, 1);
+    cr_assert_eq(proto_rbuf_next(&rb, &hdr, &data), 0, "Packet taken without its payload");
+    for (size_t i = sizeof(BRS_PACKET_HEADER); i < len - 1; i++) {
+        rbuf_write(fds[1], pkt + i, 1);
+        proto_rbuf_fill(&rb, 1);
+        cr_assert_eq(proto_rbuf_next(&rb, &hdr, &data), 0, "Packet taken with part of its payload");
+    }
+    rbuf_write(fds[1], pkt + len - 1, 1);
+    proto_rbuf_fill(&rb, 1);
+    rbuf_expect(&rb, BRS_DEPOSIT_PKT, &funds, sizeof(funds));
+    cr_assert_eq(proto_rbuf_pending(&rb), 0, "Bytes left over");
+    cr_assert_eq(proto_rbuf_fill(&rb, 1), -1, "Read without data");
+    cr_assert_eq(errno, EAGAIN, "Nonblocking read did not fail with EAGAIN");
+    
+    proto_rbuf_fini(&rb);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+Test(rbuf_suite, 01_coalesced_packets, .timeout = 5) {
+    int fds[2];
+    uint32_t storage[PROTO_RBUF_SIZE / sizeof(uint32_t)];
+    char pkts[256];
+    BRS_FUNDS_INFO funds = { htonl(100) };
+    BRS_ORDER_INFO order = { htonl(5), htonl(42) };
+    size_t len = rbuf_packet(pkts, 0, BRS_DEPOSIT_PKT, &funds, sizeof(funds));
+    len = rbuf_packet(pkts, len, BRS_STATUS_PKT, NULL, 0);
+    len = rbuf_packet(pkts, len, BRS_BUY_PKT, &order, sizeof(order));
+    PROTO_RBUF rb;
+    BRS_PACKET_HEADER *hdr;
+    void *data;
+    
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, "No socket pair");
+    proto_rbuf_init(&rb, fds[0], storage, sizeof(storage));
+    rbuf_write(fds[1], pkts, len);
+    cr_assert_eq(proto_rbuf_fill(&rb, 1), (ssize_t)len, "Packets not read at once");
+    rbuf_expect(&rb, BRS_DEPOSIT_PKT, &funds, sizeof(funds));
+    rbuf_expect(&rb, BRS_STATUS_PKT, NULL, 0);
+    rbuf_expect(&rb, BRS_BUY_PKT, &order, sizeof(order));
+    cr_assert_eq(proto_rbuf_next(&rb, &hdr, &data), 0, "Packet taken from nothing");
+    
+    // A packet and the start of the next together
+    len = rbuf_packet(pkts, 0, BRS_STATUS_PKT, NULL, 0);
+    len = rbuf_packet(pkts, len, BRS_DEPOSIT_PKT, &funds, sizeof(funds));
+    rbuf_write(fds[1], pkts, len - 2);
+    proto_rbuf_fill(&rb, 1);
+    rbuf_expect(&rb, BRS_STATUS_PKT, NULL, 0);
+    cr_assert_eq(proto_rbuf_next(&rb, &hdr, &data), 0, "Packet taken without its payload");
+    rbuf_write(fds[1], pkts + len - 2, 2);
+    proto_rbuf_fill(&rb, 1);
+    rbuf_expect(&rb, BRS_DEPOSIT_PKT, &funds, sizeof(funds));
+    
+    proto_rbuf_fini(&rb);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+Test(rbuf_suite, 02_odd_aligned_packets, .timeout = 5) {
+    int fds[2];
+    uint32_t storage[PROTO_RBUF_SIZE / sizeof(uint32_t)];
+    char pkts[256];
+    BRS_FUNDS_INFO funds = { htonl(777) };
+    size_t len = rbuf_packet(pkts, 0, BRS_LOGIN_PKT, "abc", 3);
+    len = rbuf_packet(pkts, len, BRS_DEPOSIT_PKT, &funds, sizeof(funds));
+    len = rbuf_packet(pkts, len, BRS_LOGIN_PKT, "x", 1);
+    len = rbuf_packet(pkts, len, BRS_LOGIN_PKT, "yz", 2);
+    len = rbuf_packet(pkts, len, BRS_DEPOSIT_PKT, &funds, sizeof(funds));
+    PROTO_RBUF rb;
+    
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, "No socket pair");
+    proto_rbuf_init(&rb, fds[0], storage, sizeof(storage));
+    rbuf_write(fds[1], pkts, len);
+    proto_rbuf_fill(&rb, 1);
+    
+    // Each packet is checked before the next is taken, which may move it
+    rbuf_expect(&rb, BRS_LOGIN_PKT, "abc", 3);
+    rbuf_expect(&rb, BRS_DEPOSIT_PKT, &funds, sizeof(funds));
+    rbuf_expect(&rb, BRS_LOGIN_PKT, "x", 1);
+    rbuf_expect(&rb, BRS_LOGIN_PKT, "yz", 2);
+    rbuf_expect(&rb, BRS_DEPOSIT_PKT, &funds, sizeof(funds));
+    cr_assert_eq(proto_rbuf_pending(&rb), 0, "Bytes left over");
+    
+    proto_rbuf_fini(&rb);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+Test(rbuf_suite, 03_packet_larger_than_buffer, .timeout = 5) {
+    int fds[2];
+    uint32_t storage[16];
+    char pkts[512];
+    char name[200];
+    memset(name, 'n', sizeof(name));
+    size_t len = rbuf_packet(pkts, 0, BRS_LOGIN_PKT, name, sizeof(name));
+    len = rbuf_packet(pkts, len, BRS_STATUS_PKT, NULL, 0);
+    PROTO_RBUF rb;
+    
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, "No socket pair");
+    proto_rbuf_init(&rb, fds[0], storage, sizeof(storage));
+    rbuf_write(fds[1], pkts, len);
+    BRS_PACKET_HEADER *hdr;
+    void *data;
+    while (proto_rbuf_next(&rb, &hdr, &data) == 0) {
+        cr_assert_gt(proto_rbuf_fill(&rb, 1), 0, "Packet not received");
+    }
+    cr_assert_eq(hdr->type, BRS_LOGIN_PKT, "Wrong packet type %d", hdr->type);
+    cr_assert_arr_eq(data, name, sizeof(name), "Payload differs");
+    while (proto_rbuf_next(&rb, &hdr, &data) == 0) {
+        cr_assert_gt(proto_rbuf_fill(&rb, 1), 0, "Packet not received");
+    }
+    cr_assert_eq(hdr->type, BRS_STATUS_PKT, "Wrong packet type %d", hdr->type);
+    
+    proto_rbuf_fini(&rb);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/*
+ * Check the balance and inventory of an account.
+ */
+static void account_expect(ACCOUNT *account, funds_t balance, quantity_t inventory) {
+    BRS_STATUS_INFO info;
+    account_get_status(account, &info);
+    cr_assert_eq(ntohl(info.balance), balance, "Wrong balance");
+    cr_assert_eq(ntohl(info.inventory), inventory, "Wrong inventory");
+}
+
+Test(account_suite, 00_trade_between_accounts, .timeout = 5) {
+    cr_assert_eq(accounts_init(), 0, "Accounts were not initialized");
+    ACCOUNT *buyer = account_lookup("buyer");
+    ACCOUNT *seller = account_lookup("seller");
+    account_increase_balance(buyer, 1000);
+    account_increase_inventory(seller, 10);
+    
+    // A buy of 5 at 100 and a sell of 5 at 90, each encumbered, trade at 90
+    cr_assert_eq(account_decrease_balance(buyer, 500), 0, "Funds not encumbered");
+    cr_assert_eq(account_decrease_inventory(seller, 5), 0, "Inventory not encumbered");
+    account_apply_trade(buyer, seller, 0, 5, 450, 50);
+    account_expect(buyer, 550, 5);
+    account_expect(seller, 450, 5);
+    accounts_fini();
+}
+
+Test(account_suite, 01_trade_with_same_account, .timeout = 5) {
+    cr_assert_eq(accounts_init(), 0, "Accounts were not initialized");
+    ACCOUNT *account = account_lookup("both");
+    account_increase_balance(account, 1000);
+    account_increase_inventory(account, 10);
+    
+    // The account gets back all it encumbered on either side
+    cr_assert_eq(account_decrease_balance(account, 500), 0, "Funds not encumbered");
+    cr_assert_eq(account_decrease_inventory(account, 5), 0, "Inventory not encumbered");
+    account_apply_trade(account, account, 0, 5, 450, 50);
+    account_expect(account, 1000, 10);
+    accounts_fini();
+}
+
+#define ACCOUNT_TEST_THREADS 4
+#define ACCOUNT_TEST_TRADES 100000
+
+static void *account_self_trader(void *arg) {
+    for (int i = 0; i < ACCOUNT_TEST_TRADES; i++) {
+        account_apply_trade(arg, arg, 0, 1, 2, 1);
+    }
+    return NULL;
+}
+
+Test(account_suite, 02_concurrent_self_trades, .timeout = 10) {
+    cr_assert_eq(accounts_init(), 0, "Accounts were not initialized");
+    ACCOUNT *account = account_lookup("both");
+    
+    // No update of either half of the account is lost
+    pthread_t threads[ACCOUNT_TEST_THREADS];
+    for (int i = 0; i < ACCOUNT_TEST_THREADS; i++) {
+        pthread_create(&threads[i], NULL, account_self_trader, account);
+    }
+    for (int i = 0; i < ACCOUNT_TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    account_expect(account, 3 * ACCOUNT_TEST_THREADS * ACCOUNT_TEST_TRADES,
+                   ACCOUNT_TEST_THREADS * ACCOUNT_TEST_TRADES);
+    accounts_fini();
+}
+
+/*
+ * Log in a trader on one end of a socket pair, the other end of which is
+ * returned for reading what the trader is sent.
+ */
+static TRADER *fanout_trader(char *name, int *peerp) {
+    int fds[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, "No socket pair");
+    TRADER *trader = trader_login(fds[0], name);
+    cr_assert_not_null(trader, "Trader %s not logged in", name);
+    *peerp = fds[1];
+    return trader;
+}
+
+static void fanout_logout(TRADER *trader, int peer) {
+    int fd = trader_get_fd(trader);
+    trader_logout(trader);
+    close(fd);
+    close(peer);
+}
+
+/*
+ * Queue a packet, numbered by its quantity, on a trader's outbound ring:
+ * a POSTED from the tape, or a private BOUGHT.
+ */
+static int fanout_queue(TRADER *trader, uint32_t n, int reliable) {
+    BRS_PACKET_HEADER hdr;
+    BRS_NOTIFY_INFO info;
+    memset(&hdr, 0, sizeof(hdr));
+    memset(&info, 0, sizeof(info));
+    hdr.type = reliable ? BRS_BOUGHT_PKT : BRS_POSTED_PKT;
+    hdr.size = htons(sizeof(info));
+    info.quantity = htonl(n);
+    return trader_enqueue_packet(trader, &hdr, &info, reliable);
+}
+
+/*
+ * Read the packets a trader has been sent, checking them against the
+ * numbers expected and that nothing else was sent.
+ */
+static void fanout_expect(int peer, uint32_t *numbers, int count) {
+    for (int i = 0; i < count; i++) {
+        BRS_PACKET_HEADER hdr;
+        void *payload = NULL;
+        cr_assert_eq(proto_recv_packet(peer, &hdr, &payload), 0, "Packet %d not received", i);
+        cr_assert_not_null(payload, "No payload");
+        uint32_t n = ntohl(((BRS_NOTIFY_INFO *)payload)->quantity);
+        free(payload);
+        cr_assert_eq(n, numbers[i], "Packet %d was number %u, expected %u", i, n, numbers[i]);
+    }
+    char c;
+    cr_assert_eq(recv(peer, &c, 1, MSG_DONTWAIT), -1, "More packets than expected");
+    cr_assert_eq(errno, EAGAIN, "Connection closed");
+}
+
+/*
+ * Fill the outbound ring of a trader, which nothing drains, and one more.
+ */
+static TRADER *fanout_full(outbound_policy_t policy, int *peerp) {
+    cr_assert_eq(accounts_init(), 0, "Accounts not initialized");
+    cr_assert_eq(traders_init(), 0, "Traders not initialized");
+    traders_set_outbound(4, policy);
+    TRADER *trader = fanout_trader("slow", peerp);
+    for (uint32_t n = 1; n <= 5; n++) {
+        cr_assert_geq(fanout_queue(trader, n, 0), 0, "Packet %u not queued", n);
+    }
+    return trader;
+}
+
+Test(fanout_suite, 00_drop_policy, .timeout = 5) {
+    int peer;
+    TRADER *trader = fanout_full(OUTBOUND_DROP, &peer);
+    cr_assert_geq(fanout_queue(trader, 6, 0), 0, "Packet not dropped");
+    cr_assert_eq(trader_flush_packets(trader), TRADER_FLUSH_DONE, "Ring not drained");
+    uint32_t expected[] = { 1, 2, 3, 4 };
+    fanout_expect(peer, expected, 4);
+    fanout_logout(trader, peer);
+    traders_fini();
+    accounts_fini();
+}
+
+Test(fanout_suite, 01_drop_oldest_policy, .timeout = 5) {
+    int peer;
+    TRADER *trader = fanout_full(OUTBOUND_DROP_OLDEST, &peer);
+    cr_assert_geq(fanout_queue(trader, 6, 0), 0, "Oldest packet not discarded");
+    cr_assert_eq(trader_flush_packets(trader), TRADER_FLUSH_DONE, "Ring not drained");
+    uint32_t expected[] = { 3, 4, 5, 6 };
+    fanout_expect(peer, expected, 4);
+    fanout_logout(trader, peer);
+    traders_fini();
+    accounts_fini();
+}
+
+Test(fanout_suite, 02_disconnect_policy, .timeout = 5) {
+    int peer;
+    char c;
+    TRADER *trader = fanout_full(OUTBOUND_DISCONNECT, &peer);
+    cr_assert_eq(fanout_queue(trader, 6, 0), -1, "Packet queued for a disconnected trader");
+    cr_assert_eq(trader_flush_packets(trader), TRADER_FLUSH_CLOSED, "Trader not closed");
+    cr_assert_eq(recv(peer, &c, 1, 0), 0, "Connection not shut down");
+    fanout_logout(trader, peer);
+    traders_fini();
+    accounts_fini();
+}
+
+Test(fanout_suite, 03_private_packets_never_dropped, .timeout = 5) {
+    int peer;
+    char c;
+    TRADER *trader = fanout_full(OUTBOUND_DROP, &peer);
+    fanout_queue(trader, 6, 1);
+    cr_assert_eq(trader_flush_packets(trader), TRADER_FLUSH_CLOSED,
+                 "Trader not closed for a private packet");
+    cr_assert_eq(recv(peer, &c, 1, 0), 0, "Connection not shut down");
+    fanout_logout(trader, peer);
+    traders_fini();
+    accounts_fini();
+}
+
+Test(fanout_suite, 04_posted_before_traded, .timeout = 10) {
+    cr_assert_eq(accounts_init(), 0, "Accounts not initialized");
+    cr_assert_eq(traders_init(), 0, "Traders not initialized");
+    cr_assert_eq(fanout_init(OUTBOUND_DEFAULT_CAPACITY, OUTBOUND_DROP), 0,
+                 "Fan-out not initialized");
+    EXCHANGE *xchg = exchange_init();
+    cr_assert_not_null(xchg, "Exchange not initialized");
+    int peers[3];
+    TRADER *buyer = fanout_trader("buyer", &peers[0]);
+    TRADER *seller = fanout_trader("seller", &peers[1]);
+    TRADER *watcher = fanout_trader("watcher", &peers[2]);
+    account_increase_balance(trader_get_account(buyer), 1000);
+    account_increase_inventory(trader_get_account(seller), 10);
+    
+    orderid_t sell = exchange_post_sell(xchg, seller, 10, 50);
+    orderid_t buy = exchange_post_buy(xchg, buyer, 10, 50);
+    cr_assert(sell != 0 && buy != 0, "Orders not posted");
+    
+    // Both orders are on the tape before the trade between them
+    int posted = 0;
+    while (1) {
+        BRS_PACKET_HEADER hdr;
+        void *payload = NULL;
+        cr_assert_eq(proto_recv_packet(peers[2], &hdr, &payload), 0, "No TRADED received");
+        free(payload);
+        if (hdr.type == BRS_TRADED_PKT) {
+            break;
+        }
+        if (hdr.type == BRS_POSTED_PKT) {
+            posted++;
+        }
+    }
+    cr_assert_eq(posted, 2, "%d POSTED before TRADED, expected 2", posted);
+    
+    exchange_fini(xchg);
+    fanout_fini();
+    fanout_logout(buyer, peers[0]);
+    fanout_logout(seller, peers[1]);
+    fanout_logout(watcher, peers[2]);
+    traders_fini();
+    accounts_fini();
+}
+
+Test(fanout_suite, 05_drop_oldest_keeps_private_packets, .timeout = 5) {
+    int peer;
+    cr_assert_eq(accounts_init(), 0, "Accounts not initialized");
+    cr_assert_eq(traders_init(), 0, "Traders not initialized");
+    traders_set_outbound(4, OUTBOUND_DROP_OLDEST);
+    TRADER *trader = fanout_trader("slow", &peer);
+    cr_assert_geq(fanout_queue(trader, 1, 1), 0, "Private packet not queued");
+    for (uint32_t n = 2; n <= 5; n++) {
+        cr_assert_geq(fanout_queue(trader, n, 0), 0, "Packet %u not queued", n);
+    }
+    cr_assert_geq(fanout_queue(trader, 6, 1), 0, "Private packet not queued");
+    cr_assert_eq(trader_flush_packets(trader), TRADER_FLUSH_DONE, "Ring not drained");
+    uint32_t expected[] = { 1, 4, 5, 6 };
+    fanout_expect(peer, expected, 4);
+    fanout_logout(trader, peer);
+    traders_fini();
+    accounts_fini();
+}
+
+Test(fanout_suite, 06_queue_policy, .timeout = 5) {
+    int peer;
+    TRADER *trader = fanout_full(OUTBOUND_QUEUE, &peer);
+    for (uint32_t n = 6; n <= 10; n++) {
+        cr_assert_geq(fanout_queue(trader, n, n % 2), 0, "Packet %u not queued", n);
+    }
+    cr_assert_eq(trader_flush_packets(trader), TRADER_FLUSH_DONE, "Ring not drained");
+    uint32_t expected[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+    fanout_expect(peer, expected, 10);
+    fanout_logout(trader, peer);
+    traders_fini();
+    accounts_fini();
+}
+
+/*
+ * Start the modules that the exchange uses, and an exchange for the default
+ * instrument, restoring from a journal if one is given.
+ */
+static EXCHANGE *core_start(const char *journal) {
+    cr_assert_eq(accounts_init(), 0, "Accounts not initialized");
+    cr_assert_eq(traders_init(), 0, "Traders not initialized");
+    EXCHANGE *xchg = exchange_init();
+    cr_assert_not_null(xchg, "Exchange not initialized");
+    cr_assert_eq(instruments_init(xchg, NULL), 0, "Instruments not initialized");
+    if (journal != NULL) {
+        cr_assert_eq(journal_init(journal), 0, "Journal %s not restored", journal);
+    }
+    return xchg;
+}
+
+static void core_stop(EXCHANGE *xchg) {
+    journal_fini();
+    instruments_fini();
+    exchange_fini(xchg);
+    traders_fini();
+    accounts_fini();
+}
+
+/*
+ * Make changes to accounts as the server does for a client, recording them
+ * in the journal.
+ */
+static void core_deposit(TRADER *trader, funds_t amount) {
+    ACCOUNT *account = trader_get_account(trader);
+    account_increase_balance(account, amount);
+    journal_account(JOURNAL_DEPOSIT, account_get_name(account), NULL, amount);
+}
+
+static void core_escrow(EXCHANGE *xchg, TRADER *trader, quantity_t quantity) {
+    ACCOUNT *account = trader_get_account(trader);
+    account_increase_inventory(account, quantity);
+    journal_account(JOURNAL_ESCROW, account_get_name(account), exchange_get_symbol(xchg), quantity);
+}
+
+static void core_release(EXCHANGE *xchg, TRADER *trader, quantity_t quantity) {
+    ACCOUNT *account = trader_get_account(trader);
+    cr_assert_eq(account_decrease_inventory(account, quantity), 0, "Inventory not released");
+    journal_account(JOURNAL_RELEASE, account_get_name(account), exchange_get_symbol(xchg), quantity);
+}
+
+/*
+ * Wait for the matchmaker to make every trade that the book of an exchange
+ * allows.
+ */
+static void core_await_matched(EXCHANGE *xchg) {
+    BRS_STATUS_INFO info;
+    for (int i = 0; i < 1000; i++) {
+        exchange_get_status(xchg, NULL, &info);
+        if (info.bid == 0 || info.ask == 0 || ntohl(info.bid) < ntohl(info.ask)) {
+            return;
+        }
+        usleep(1000);
+    }
+    cr_assert_fail("Book still crossed");
+}
+
+#define JOURNAL_TEST_LEVELS 8
+
+/*
+ * State compared before a journal is written and after it is restored.
+ */
+typedef struct journal_state {
+    BRS_STATUS_INFO alice;
+    BRS_STATUS_INFO bob;
+    BRS_DEPTH_INFO depth;
+    BRS_DEPTH_LEVEL levels[2 * JOURNAL_TEST_LEVELS];
+    orderid_t last_order;          // Last order ID assigned
+} JOURNAL_STATE;
+
+static void journal_get_state(EXCHANGE *xchg, JOURNAL_STATE *state) {
+    memset(state, 0, sizeof(*state));
+    exchange_get_status(xchg, account_lookup("alice"), &state->alice);
+    exchange_get_status(xchg, account_lookup("bob"), &state->bob);
+    cr_assert_geq(exchange_get_depth(xchg, JOURNAL_TEST_LEVELS, &state->depth, state->levels), 0,
+                  "No depth");
+}
+
+static void journal_check_state(JOURNAL_STATE *got, JOURNAL_STATE *want) {
+    BRS_STATUS_INFO *g[] = { &got->alice, &got->bob };
+    BRS_STATUS_INFO *w[] = { &want->alice, &want->bob };
+    for (int i = 0; i < 2; i++) {
+        cr_assert_eq(ntohl(g[i]->balance), ntohl(w[i]->balance), "Balance %u, expected %u",
+                     ntohl(g[i]->balance), ntohl(w[i]->balance));
+        cr_assert_eq(ntohl(g[i]->inventory), ntohl(w[i]->inventory), "Inventory %u, expected %u",
+                     ntohl(g[i]->inventory), ntohl(w[i]->inventory));
+        cr_assert_eq(g[i]->bid, w[i]->bid, "Bid differs");
+        cr_assert_eq(g[i]->ask, w[i]->ask, "Ask differs");
+        cr_assert_eq(g[i]->last, w[i]->last, "Last trade price differs");
+    }
+    cr_assert_eq(got->depth.bids, want->depth.bids, "Number of bid levels differs");
+    cr_assert_eq(got->depth.asks, want->depth.asks, "Number of ask levels differs");
+    int levels = ntohs(want->depth.bids) + ntohs(want->depth.asks);
+    cr_assert_arr_eq(got->levels, want->levels, levels * sizeof(BRS_DEPTH_LEVEL),
+                     "Price levels differ");
+}
+
+/*
+ * Orders and account changes, including a trade, a partial fill and a
+ * cancellation, to be journaled.
+ */
+static void journal_first(EXCHANGE *xchg, JOURNAL_STATE *state) {
+    int alice_peer, bob_peer;
+    TRADER *alice = fanout_trader("alice", &alice_peer);
+    TRADER *bob = fanout_trader("bob", &bob_peer);
+    quantity_t quantity;
+    
+    core_deposit(alice, 10000);
+    core_escrow(xchg, bob, 100);
+    cr_assert_neq(exchange_post_sell(xchg, bob, 30, 50), 0, "Sell not posted");
+    cr_assert_neq(exchange_post_sell(xchg, bob, 20, 60), 0, "Sell not posted");
+    cr_assert_neq(exchange_post_buy(xchg, alice, 10, 55), 0, "Buy not posted");
+    core_await_matched(xchg);
+    orderid_t order = exchange_post_buy(xchg, alice, 5, 40);
+    cr_assert_neq(order, 0, "Buy not posted");
+    cr_assert_eq(exchange_cancel(xchg, alice, order, &quantity), 0, "Buy not canceled");
+    state->last_order = exchange_post_buy(xchg, alice, 5, 45);
+    cr_assert_neq(state->last_order, 0, "Buy not posted");
+    
+    fanout_logout(alice, alice_peer);
+    fanout_logout(bob, bob_peer);
+}
+
+/*
+ * Further changes, to be journaled after a snapshot.
+ */
+static void journal_second(EXCHANGE *xchg, JOURNAL_STATE *state) {
+    int alice_peer, bob_peer;
+    TRADER *alice = fanout_trader("alice", &alice_peer);
+    TRADER *bob = fanout_trader("bob", &bob_peer);
+    
+    core_deposit(alice, 500);
+    core_release(xchg, bob, 10);
+    state->last_order = exchange_post_buy(xchg, alice, 25, 60);
+    cr_assert_neq(state->last_order, 0, "Buy not posted");
+    core_await_matched(xchg);
+    
+    fanout_logout(alice, alice_peer);
+    fanout_logout(bob, bob_peer);
+}
+
+/*
+ * Run the server core in a child process with a journal, so that it can
+ * then be restored from scratch, and get the state it left.
+ */
+static void journal_run(const char *journal, void (*session)(EXCHANGE *, JOURNAL_STATE *),
+                        JOURNAL_STATE *state) {
+    JOURNAL_STATE *shared = mmap(NULL, sizeof(JOURNAL_STATE), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    cr_assert_neq(shared, MAP_FAILED, "No shared memory");
+    pid_t pid = fork();
+    if (pid == 0) {
+        EXCHANGE *xchg = core_start(journal);
+        session(xchg, shared);
+        orderid_t last_order = shared->last_order;
+        journal_get_state(xchg, shared);
+        shared->last_order = last_order;
+        core_stop(xchg);
+        _exit(0);
+    }
+    int status;
+    cr_assert_eq(waitpid(pid, &status, 0), pid, "Child not reaped");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Journaled run failed");
+    *state = *shared;
+    munmap(shared, sizeof(JOURNAL_STATE));
+}
+
+/*
+ * Restore the server core from a journal and check that it is in the
+ * state that was journaled, and that order IDs carry on from where they were.
+ */
+static void journal_check_restore(const char *journal, JOURNAL_STATE *want) {
+    JOURNAL_STATE got;
+    EXCHANGE *xchg = core_start(journal);
+    journal_get_state(xchg, &got);
+    journal_check_state(&got, want);
+    
+    int peer;
+    TRADER *alice = fanout_trader("alice", &peer);
+    orderid_t order = exchange_post_buy(xchg, alice, 1, 1);
+    cr_assert_gt(order, want->last_order, "Order ID %u reused after %u", order, want->last_order);
+    fanout_logout(alice, peer);
+    core_stop(xchg);
+}
+
+static void journal_paths(char *journal, char *snapshot, size_t size, const char *test) {
+    snprintf(journal, size, "/tmp/bourse_tests_%s_%d.jnl", test, getpid());
+    snprintf(snapshot, size, "%s.snap", journal);
+    unlink(journal);
+    unlink(snapshot);
+}
+
+static void journal_copy(const char *from, const char *to) {
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd), "cp %s %s", from, to);
+    cr_assert_eq(system(cmd), 0, "Cannot copy %s", from);
+}
+
+static off_t journal_length(const char *path) {
+    struct stat st;
+    cr_assert_eq(stat(path, &st), 0, "No journal %s", path);
+    return st.st_size;
+}
+
+Test(journal_suite, 00_restore_journal_only, .timeout = 20) {
+    char journal[128], snapshot[128];
+    JOURNAL_STATE want;
+    journal_paths(journal, snapshot, sizeof(journal), "journal");
+    
+    journal_run(journal, journal_first, &want);
+    cr_assert_eq(unlink(snapshot), 0, "No snapshot written");
+    journal_check_restore(journal, &want);
+    unlink(journal);
+    unlink(snapshot);
+}
+
+Test(journal_suite, 01_restore_snapshot_only, .timeout = 20) {
+    char journal[128], snapshot[128];
+    JOURNAL_STATE want;
+    journal_paths(journal, snapshot, sizeof(journal), "snapshot");
+    
+    // The snapshot written on the way out covers the whole journal
+    journal_run(journal, journal_first, &want);
+    cr_assert_eq(access(snapshot, R_OK), 0, "No snapshot written");
+    journal_check_restore(journal, &want);
+    unlink(journal);
+    unlink(snapshot);
+}
+
+Test(journal_suite, 02_restore_snapshot_and_tail, .timeout = 20) {
+    char journal[128], snapshot[128], saved[160];
+    JOURNAL_STATE want;
+    journal_paths(journal, snapshot, sizeof(journal), "tail");
+    snprintf(saved, sizeof(saved), "%s.saved", snapshot);
+    
+    // Put back the snapshot taken after the first run, so that the second
+    // run is replayed from the journal
+    journal_run(journal, journal_first, &want);
+    journal_copy(snapshot, saved);
+    journal_run(journal, journal_second, &want);
+    cr_assert_eq(rename(saved, snapshot), 0, "Cannot restore snapshot");
+    journal_check_restore(journal, &want);
+    unlink(journal);
+    unlink(snapshot);
+}
+
+Test(journal_suite, 03_restore_torn_last_record, .timeout = 20) {
+    char journal[128], snapshot[128], saved[160];
+    JOURNAL_STATE want;
+    journal_paths(journal, snapshot, sizeof(journal), "torn");
+    snprintf(saved, sizeof(saved), "%s.saved", snapshot);
+    
+    journal_run(journal, journal_first, &want);
+    journal_copy(snapshot, saved);
+    journal_run(journal, journal_second, &want);
+    cr_assert_eq(rename(saved, snapshot), 0, "Cannot restore snapshot");
+    
+    // A deposit only partly written, as by a crash, longer than the record
+    // that is to take its place
+    off_t length = journal_length(journal);
+    JOURNAL_RECORD rec;
+    char name[64];
+    memset(&rec, 0, sizeof(rec));
+    memset(name, 'a', sizeof(name));
+    rec.type = JOURNAL_DEPOSIT;
+    rec.name_length = 2 * sizeof(name);
+    rec.amount = 1000;
+    int fd = open(journal, O_WRONLY | O_APPEND);
+    cr_assert_neq(fd, -1, "Cannot open journal");
+    cr_assert_eq(write(fd, &rec, sizeof(rec)), (ssize_t)sizeof(rec), "Write failed");
+    cr_assert_eq(write(fd, name, sizeof(name)), (ssize_t)sizeof(name), "Write failed");
+    close(fd);
+    
+    // The torn record is cut off, and the order posted after restoring is
+    // appended in its place
+    journal_check_restore(journal, &want);
+    cr_assert_eq(journal_length(journal), length + sizeof(JOURNAL_RECORD) + strlen("alice"),
+                 "Torn record not cut off");
+    unlink(journal);
+    unlink(snapshot);
+}
+
+/*
+ * Log in a trader whose packets are discarded, with funds and inventory.
+ */
+static TRADER *core_trader(TRADER_SINK *sink, char *name, funds_t balance, quantity_t inventory) {
+    trader_sink_init(sink, TRADER_SINK_NULL, NULL, 0);
+    TRADER *trader = trader_login_sink(sink, name);
+    cr_assert_not_null(trader, "Trader %s not logged in", name);
+    account_increase_balance(trader_get_account(trader), balance);
+    account_increase_inventory(trader_get_account(trader), inventory);
+    return trader;
+}
+
+static void bulk_item(EXCHANGE_BULK_ITEM *item, BRS_PACKET_TYPE type, orderid_t order,
+                      quantity_t quantity, funds_t price) {
+    memset(item, 0, sizeof(*item));
+    item->type = type;
+    item->order = order;
+    item->quantity = quantity;
+    item->price = price;
+}
+
+Test(bulk_suite, 00_results_per_item, .timeout = 5) {
+    EXCHANGE *xchg = core_start(NULL);
+    TRADER_SINK alice_sink, bob_sink;
+    TRADER *alice = core_trader(&alice_sink, "alice", 5000, 0);
+    TRADER *bob = core_trader(&bob_sink, "bob", 0, 10);
+    orderid_t other = exchange_post_sell(xchg, bob, 10, 200);
+    cr_assert_neq(other, 0, "Sell not posted");
+    
+    // Each item sees the effects of the ones before it
+    EXCHANGE_BULK_ITEM items[8];
+    bulk_item(&items[0], BRS_BUY_PKT, 0, 10, 100);
+    bulk_item(&items[1], BRS_SELL_PKT, 0, 5, 200);
+    bulk_item(&items[2], BRS_BUY_PKT, 0, 0, 100);
+    bulk_item(&items[3], BRS_CANCEL_PKT, 0, 0, 0);
+    bulk_item(&items[4], BRS_CANCEL_PKT, other, 0, 0);
+    bulk_item(&items[5], BRS_CANCEL_PKT, other + 1000, 0, 0);
+    bulk_item(&items[6], BRS_BUY_PKT, 0, 30, 100);
+    bulk_item(&items[7], BRS_BUY_PKT, 0, 30, 100);
+    BRS_BULK_RESULT_CODE want[] = {
+        BRS_BULK_OK, BRS_BULK_INSUFFICIENT, BRS_BULK_INVALID, BRS_BULK_OK,
+        BRS_BULK_NO_ORDER, BRS_BULK_NO_ORDER, BRS_BULK_OK, BRS_BULK_INSUFFICIENT
+    };
+    cr_assert_eq(exchange_bulk(xchg, alice, items, 1), 1, "First item not posted");
+    cr_assert_neq(items[0].order, 0, "No order ID for item 0");
+    bulk_item(&items[3], BRS_CANCEL_PKT, items[0].order, 0, 0);
+    cr_assert_eq(exchange_bulk(xchg, alice, items + 1, 7), 2, "Wrong number of items succeeded");
+    for (int i = 0; i < 8; i++) {
+        cr_assert_eq(items[i].result, want[i], "Item %d has result %d, expected %d",
+                     i, items[i].result, want[i]);
+    }
+    cr_assert_eq(items[3].order, items[0].order, "Wrong order canceled");
+    cr_assert_eq(items[3].quantity, 10, "Wrong quantity canceled");
+    cr_assert_neq(items[6].order, 0, "No order ID for item 6");
+    
+    // Only the last buy that was posted still encumbers funds
+    BRS_STATUS_INFO info;
+    exchange_get_status(xchg, trader_get_account(alice), &info);
+    cr_assert_eq(ntohl(info.balance), 2000, "Balance %u, expected 2000", ntohl(info.balance));
+    cr_assert_eq(ntohl(info.bid), 100, "No bid");
+    cr_assert_eq(ntohl(info.ask), 200, "Order of another trader canceled");
+    
+    trader_logout(alice);
+    trader_logout(bob);
+    core_stop(xchg);
+}
+
+Test(bulk_suite, 01_mass_cancel, .timeout = 5) {
+    EXCHANGE *xchg = core_start(NULL);
+    TRADER_SINK alice_sink, bob_sink;
+    TRADER *alice = core_trader(&alice_sink, "alice", 5000, 10);
+    TRADER *bob = core_trader(&bob_sink, "bob", 5000, 0);
+    cr_assert_neq(exchange_post_buy(xchg, alice, 10, 100), 0, "Buy not posted");
+    cr_assert_neq(exchange_post_buy(xchg, alice, 5, 90), 0, "Buy not posted");
+    cr_assert_neq(exchange_post_sell(xchg, alice, 7, 300), 0, "Sell not posted");
+    cr_assert_neq(exchange_post_buy(xchg, bob, 1, 80), 0, "Buy not posted");
+    
+    quantity_t quantity = 0;
+    cr_assert_eq(exchange_cancel_all(xchg, alice, &quantity), 3, "Wrong number of orders canceled");
+    cr_assert_eq(quantity, 22, "Wrong quantity canceled");
+    
+    // Everything encumbered is given back, and the other trader's order stays
+    BRS_STATUS_INFO info;
+    exchange_get_status(xchg, trader_get_account(alice), &info);
+    cr_assert_eq(ntohl(info.balance), 5000, "Funds not given back");
+    cr_assert_eq(ntohl(info.inventory), 10, "Inventory not given back");
+    cr_assert_eq(ntohl(info.bid), 80, "Bid %u, expected 80", ntohl(info.bid));
+    cr_assert_eq(info.ask, 0, "Ask not canceled");
+    cr_assert_eq(exchange_cancel_all(xchg, alice, &quantity), 0, "Orders canceled twice");
+    cr_assert_eq(quantity, 0, "Quantity canceled twice");
+    
+    trader_logout(alice);
+    trader_logout(bob);
+    core_stop(xchg);
+}
+
+Test(bulk_suite, 02_mass_cancel_restored_orders, .timeout = 5) {
+    EXCHANGE *xchg = core_start(NULL);
+    TRADER_SINK alice_sink;
+    TRADER *alice = core_trader(&alice_sink, "alice", 5000, 0);
+    TRADER *restored = trader_detached("alice");
+    cr_assert_not_null(restored, "No detached trader");
+    cr_assert_eq(exchange_restore_order(xchg, restored, 1000, 1, 4, 300), 0, "Sell not restored");
+    cr_assert_eq(exchange_restore_order(xchg, restored, 1001, 0, 2, 50), 0, "Buy not restored");
+    cr_assert_neq(exchange_post_buy(xchg, alice, 10, 100), 0, "Buy not posted");
+    
+    // The orders restored for the account go with the trader's own
+    quantity_t quantity = 0;
+    cr_assert_eq(exchange_cancel_all(xchg, alice, &quantity), 3, "Wrong number of orders canceled");
+    cr_assert_eq(quantity, 16, "Wrong quantity canceled");
+    BRS_STATUS_INFO info;
+    exchange_get_status(xchg, trader_get_account(alice), &info);
+    cr_assert(info.bid == 0 && info.ask == 0, "Orders left on the book");
+    
+    trader_unref(restored, "test");
+    trader_logout(alice);
+    core_stop(xchg);
+}
+
+/*
+ * Read what a trader is sent until nothing more arrives for a while,
+ * counting the packets of each type and keeping the last QUOTE.
+ */
+static void feed_read(int peer, int *counts, BRS_QUOTE_INFO *quote) {
+    memset(counts, 0, 256 * sizeof(int));
+    struct pollfd pfd = { .fd = peer, .events = POLLIN };
+    while (poll(&pfd, 1, 300) == 1) {
+        BRS_PACKET_HEADER hdr;
+        void *payload = NULL;
+        cr_assert_eq(proto_recv_packet(peer, &hdr, &payload), 0, "Packet not received");
+        counts[hdr.type]++;
+        if (hdr.type == BRS_QUOTE_PKT) {
+            cr_assert_eq(ntohs(hdr.size), sizeof(BRS_QUOTE_INFO), "Wrong QUOTE size");
+            memcpy(quote, payload, sizeof(BRS_QUOTE_INFO));
+        }
+        free(payload);
+    }
+}
+
+static EXCHANGE *feed_start(void) {
+    cr_assert_eq(accounts_init(), 0, "Accounts not initialized");
+    cr_assert_eq(traders_init(), 0, "Traders not initialized");
+    cr_assert_eq(fanout_init(OUTBOUND_DEFAULT_CAPACITY, OUTBOUND_DROP), 0,
+                 "Fan-out not initialized");
+    EXCHANGE *xchg = exchange_init();
+    cr_assert_not_null(xchg, "Exchange not initialized");
+    cr_assert_eq(instruments_init(xchg, NULL), 0, "Instruments not initialized");
+    return xchg;
+}
+
+static void feed_stop(EXCHANGE *xchg) {
+    instruments_fini();
+    exchange_fini(xchg);
+    fanout_fini();
+}
+
+Test(feed_suite, 00_levels, .timeout = 10) {
+    EXCHANGE *xchg = feed_start();
+    int peers[4];
+    TRADER *full = fanout_trader("full", &peers[0]);
+    TRADER *top = fanout_trader("top", &peers[1]);
+    TRADER *private = fanout_trader("private", &peers[2]);
+    TRADER *poster = fanout_trader("poster", &peers[3]);
+    cr_assert_eq(fanout_subscribe(top, BRS_FEED_TOP, BRS_QUOTE_MIN_INTERVAL), 0, "Not subscribed");
+    cr_assert_eq(fanout_subscribe(private, BRS_FEED_PRIVATE, 0), 0, "Not subscribed");
+    cr_assert_neq(fanout_subscribe(private, BRS_FEED_LEVELS, 0), 0, "Unknown level accepted");
+    cr_assert_eq(traders_feed_count(BRS_FEED_FULL), 2, "Wrong number of traders on the tape");
+    
+    account_increase_balance(trader_get_account(poster), 1000);
+    cr_assert_neq(exchange_post_buy(xchg, poster, 1, 100), 0, "Buy not posted");
+    
+    int counts[256];
+    BRS_QUOTE_INFO quote;
+    feed_read(peers[0], counts, &quote);
+    cr_assert_eq(counts[BRS_POSTED_PKT], 1, "Full tape not sent");
+    cr_assert_eq(counts[BRS_QUOTE_PKT], 0, "QUOTE sent with the full tape");
+    feed_read(peers[1], counts, &quote);
+    cr_assert_eq(counts[BRS_POSTED_PKT], 0, "Tape sent for the top of the book");
+    cr_assert_geq(counts[BRS_QUOTE_PKT], 1, "No QUOTE sent");
+    cr_assert_eq(ntohl(quote.bid), 100, "QUOTE has bid %u, expected 100", ntohl(quote.bid));
+    cr_assert_eq(quote.ask, 0, "QUOTE has an ask");
+    feed_read(peers[2], counts, &quote);
+    for (int i = 0; i < 256; i++) {
+        cr_assert_eq(counts[i], 0, "Packet of type %d sent for private level", i);
+    }
+    
+    feed_stop(xchg);
+    fanout_logout(full, peers[0]);
+    fanout_logout(top, peers[1]);
+    fanout_logout(private, peers[2]);
+    fanout_logout(poster, peers[3]);
+    traders_fini();
+    accounts_fini();
+}
+
+Test(feed_suite, 01_quotes_conflated, .timeout = 10) {
+    EXCHANGE *xchg = feed_start();
+    int peers[2];
+    TRADER *top = fanout_trader("top", &peers[0]);
+    TRADER *poster = fanout_trader("poster", &peers[1]);
+    cr_assert_eq(fanout_subscribe(top, BRS_FEED_TOP, 200), 0, "Not subscribed");
+    cr_assert_eq(fanout_subscribe(poster, BRS_FEED_PRIVATE, 0), 0, "Not subscribed");
+    
+    // Changes within one interval are sent as one QUOTE with the latest values
+    account_increase_balance(trader_get_account(poster), 10000);
+    for (funds_t price = 100; price < 110; price++) {
+        cr_assert_neq(exchange_post_buy(xchg, poster, 1, price), 0, "Buy not posted");
+    }
+    int counts[256];
+    BRS_QUOTE_INFO quote;
+    feed_read(peers[0], counts, &quote);
+    cr_assert(counts[BRS_QUOTE_PKT] >= 1 && counts[BRS_QUOTE_PKT] <= 2,
+              "%d QUOTEs sent, expected 1 or 2", counts[BRS_QUOTE_PKT]);
+    cr_assert_eq(ntohl(quote.bid), 109, "QUOTE has bid %u, expected 109", ntohl(quote.bid));
+    
+    feed_stop(xchg);
+    fanout_logout(top, peers[0]);
+    fanout_logout(poster, peers[1]);
+    traders_fini();
+    accounts_fini();
+}
+
+static void depth_check(BRS_DEPTH_LEVEL *level, funds_t price, quantity_t quantity, uint32_t orders) {
+    cr_assert_eq(ntohl(level->price), price, "Level at %u, expected %u", ntohl(level->price), price);
+    cr_assert_eq(ntohl(level->quantity), quantity, "Level at %u has quantity %u, expected %u",
+                 price, ntohl(level->quantity), quantity);
+    cr_assert_eq(ntohl(level->orders), orders, "Level at %u has %u orders, expected %u",
+                 price, ntohl(level->orders), orders);
+}
+
+Test(depth_suite, 00_snapshot, .timeout = 5) {
+    EXCHANGE *xchg = core_start(NULL);
+    TRADER_SINK alice_sink, bob_sink;
+    TRADER *alice = core_trader(&alice_sink, "alice", 10000, 0);
+    TRADER *bob = core_trader(&bob_sink, "bob", 0, 10);
+    cr_assert_neq(exchange_post_buy(xchg, alice, 5, 100), 0, "Buy not posted");
+    cr_assert_neq(exchange_post_buy(xchg, alice, 3, 100), 0, "Buy not posted");
+    cr_assert_neq(exchange_post_buy(xchg, alice, 2, 99), 0, "Buy not posted");
+    cr_assert_neq(exchange_post_sell(xchg, bob, 4, 105), 0, "Sell not posted");
+    
+    // Bids from the best down, then asks from the best up
+    BRS_DEPTH_INFO info;
+    BRS_DEPTH_LEVEL levels[2 * BRS_DEPTH_DEFAULT];
+    cr_assert_eq(exchange_get_depth(xchg, BRS_DEPTH_DEFAULT, &info, levels), 3, "Wrong number of levels");
+    cr_assert_eq(ntohs(info.bids), 2, "Wrong number of bid levels");
+    cr_assert_eq(ntohs(info.asks), 1, "Wrong number of ask levels");
+    depth_check(&levels[0], 100, 8, 2);
+    depth_check(&levels[1], 99, 2, 1);
+    depth_check(&levels[2], 105, 4, 1);
+    
+    cr_assert_eq(exchange_get_depth(xchg, 1, &info, levels), 2, "Levels not limited");
+    cr_assert(ntohs(info.bids) == 1 && ntohs(info.asks) == 1, "Levels not limited on each side");
+    depth_check(&levels[0], 100, 8, 2);
+    depth_check(&levels[1], 105, 4, 1);
+    
+    trader_logout(alice);
+    trader_logout(bob);
+    core_stop(xchg);
+}
+
+/*
+ * Read the LEVEL packets a trader is sent until nothing more arrives for
+ * a while.
+ *
+ * @return  The number of LEVELs read.
+ */
+static int depth_read_levels(int peer, BRS_LEVEL_INFO *levels, int max) {
+    int count = 0;
+    struct pollfd pfd = { .fd = peer, .events = POLLIN };
+    while (poll(&pfd, 1, 300) == 1) {
+        BRS_PACKET_HEADER hdr;
+        void *payload = NULL;
+        cr_assert_eq(proto_recv_packet(peer, &hdr, &payload), 0, "Packet not received");
+        cr_assert_eq(hdr.type, BRS_LEVEL_PKT, "Packet of type %d sent for depth level", hdr.type);
+        cr_assert_eq(ntohs(hdr.size), sizeof(BRS_LEVEL_INFO), "Wrong LEVEL size");
+        cr_assert_lt(count, max, "Too many LEVELs");
+        memcpy(&levels[count++], payload, sizeof(BRS_LEVEL_INFO));
+        free(payload);
+    }
+    return count;
+}
+
+Test(depth_suite, 01_level_sequence, .timeout = 10) {
+    EXCHANGE *xchg = feed_start();
+    int peers[2];
+    TRADER *watcher = fanout_trader("watcher", &peers[0]);
+    TRADER *poster = fanout_trader("poster", &peers[1]);
+    cr_assert_eq(fanout_subscribe(watcher, BRS_FEED_DEPTH, 0), 0, "Not subscribed");
+    cr_assert_eq(fanout_subscribe(poster, BRS_FEED_PRIVATE, 0), 0, "Not subscribed");
+    account_increase_balance(trader_get_account(poster), 10000);
+    
+    BRS_DEPTH_INFO info;
+    BRS_DEPTH_LEVEL buf[2];
+    cr_assert_eq(exchange_get_depth(xchg, 1, &info, buf), 0, "Book not empty");
+    uint32_t seq = ntohl(info.seq);
+    
+    // One LEVEL per change, numbered on from the snapshot
+    quantity_t quantity;
+    orderid_t first = exchange_post_buy(xchg, poster, 5, 100);
+    cr_assert_neq(first, 0, "Buy not posted");
+    cr_assert_neq(exchange_post_buy(xchg, poster, 3, 100), 0, "Buy not posted");
+    cr_assert_eq(exchange_cancel(xchg, poster, first, &quantity), 0, "Buy not canceled");
+    BRS_LEVEL_INFO levels[8];
+    cr_assert_eq(depth_read_levels(peers[0], levels, 8), 3, "Wrong number of LEVELs");
+    quantity_t want_quantity[] = { 5, 8, 3 };
+    uint32_t want_orders[] = { 1, 2, 1 };
+    for (int i = 0; i < 3; i++) {
+        cr_assert_eq(ntohl(levels[i].seq), seq + i + 1, "LEVEL %d has seq %u, expected %u",
+                     i, ntohl(levels[i].seq), seq + i + 1);
+        cr_assert_eq(levels[i].side, BRS_SIDE_BID, "LEVEL %d not for the bids", i);
+        cr_assert_eq(ntohl(levels[i].price), 100, "LEVEL %d has wrong price", i);
+        cr_assert_eq(ntohl(levels[i].quantity), want_quantity[i], "LEVEL %d has wrong quantity", i);
+        cr_assert_eq(ntohl(levels[i].orders), want_orders[i], "LEVEL %d has wrong orders", i);
+    }
+    
+    // A snapshot taken now includes every change so far
+    cr_assert_eq(exchange_get_depth(xchg, 1, &info, buf), 1, "Wrong number of levels");
+    cr_assert_eq(ntohl(info.seq), seq + 3, "Snapshot has seq %u, expected %u", ntohl(info.seq), seq + 3);
+    depth_check(&buf[0], 100, 3, 1);
+    
+    feed_stop(xchg);
+    fanout_logout(watcher, peers[0]);
+    fanout_logout(poster, peers[1]);
+    traders_fini();
+    accounts_fini();
+}
+
+Test(replay_suite, 00_gap_filled_from_replay, .timeout = 10) {
+    EXCHANGE *xchg = feed_start();
+    int peers[2];
+    TRADER *watcher = fanout_trader("watcher", &peers[0]);
+    TRADER *poster = fanout_trader("poster", &peers[1]);
+    cr_assert_eq(fanout_subscribe(watcher, BRS_FEED_SEQUENCED, 0), 0, "Not subscribed");
+    cr_assert_eq(fanout_subscribe(poster, BRS_FEED_PRIVATE, 0), 0, "Not subscribed");
+    account_increase_balance(trader_get_account(poster), 10000);
+    
+    quantity_t quantity;
+    orderid_t order = exchange_post_buy(xchg, poster, 5, 100);
+    cr_assert_neq(order, 0, "Buy not posted");
+    cr_assert_neq(exchange_post_buy(xchg, poster, 3, 99), 0, "Buy not posted");
+    cr_assert_eq(exchange_cancel(xchg, poster, order, &quantity), 0, "Buy not canceled");
+    
+    // The tape is numbered without gaps
+    BRS_SEQ_NOTIFY_INFO tape[3];
+    uint8_t types[3];
+    for (int i = 0; i < 3; i++) {
+        BRS_PACKET_HEADER hdr;
+        void *payload = NULL;
+        cr_assert_eq(proto_recv_packet(peers[0], &hdr, &payload), 0, "Packet %d not received", i);
+        cr_assert_eq(ntohs(hdr.size), sizeof(BRS_SEQ_NOTIFY_INFO), "Packet %d not sequenced", i);
+        types[i] = hdr.type;
+        memcpy(&tape[i], payload, sizeof(BRS_SEQ_NOTIFY_INFO));
+        free(payload);
+        cr_assert_eq(ntohl(tape[i].seq), ntohl(tape[0].seq) + i, "Gap in the tape at packet %d", i);
+    }
+    cr_assert(types[0] == BRS_POSTED_PKT && types[1] == BRS_POSTED_PKT && types[2] == BRS_CANCELED_PKT,
+              "Wrong packets on the tape");
+    
+    // A client that missed the packets after the first fills the gap with
+    // what was sent, replayed from where it asks
+    BRS_REPLAY_INFO info;
+    BRS_REPLAY_EVENT events[4];
+    uint32_t from = ntohl(tape[1].seq);
+    cr_assert_eq(exchange_replay(xchg, from, 4, &info, events), 2, "Wrong number of packets replayed");
+    cr_assert_eq(ntohl(info.first), from, "Replay starts at %u, expected %u", ntohl(info.first), from);
+    cr_assert_eq(ntohl(info.last), ntohl(tape[2].seq), "Wrong last packet on the tape");
+    for (int i = 0; i < 2; i++) {
+        cr_assert_eq(ntohl(events[i].seq), from + i, "Wrong packet replayed");
+        cr_assert_eq(events[i].type, types[i + 1], "Packet replayed with wrong type");
+        cr_assert_arr_eq(&events[i].info, &tape[i + 1].info, sizeof(BRS_NOTIFY_INFO),
+                         "Packet replayed with wrong payload");
+    }
+    cr_assert_eq(exchange_replay(xchg, ntohl(tape[2].seq) + 1, 4, &info, events), 0,
+                 "Packets replayed past the end of the tape");
+    
+    feed_stop(xchg);
+    fanout_logout(watcher, peers[0]);
+    fanout_logout(poster, peers[1]);
+    traders_fini();
+    accounts_fini();
+}
+
+#define REPLAY_TEST_EXTRA 10
+
+Test(replay_suite, 01_gap_reported, .timeout = 20) {
+    EXCHANGE *xchg = core_start(NULL);
+    TRADER_SINK sink;
+    TRADER *poster = core_trader(&sink, "poster", BRS_REPLAY_KEPT + REPLAY_TEST_EXTRA, 0);
+    for (int i = 0; i < BRS_REPLAY_KEPT + REPLAY_TEST_EXTRA; i++) {
+        cr_assert_neq(exchange_post_buy(xchg, poster, 1, 1), 0, "Buy %d not posted", i);
+    }
+    
+    // Packets no longer kept are skipped, and the first one sent says so
+    BRS_REPLAY_INFO info;
+    BRS_REPLAY_EVENT *events = calloc(BRS_REPLAY_MAX, sizeof(BRS_REPLAY_EVENT));
+    cr_assert_not_null(events, "No storage");
+    cr_assert_eq(exchange_replay(xchg, 1, BRS_REPLAY_MAX, &info, events), BRS_REPLAY_MAX,
+                 "Wrong number of packets replayed");
+    uint32_t last = ntohl(info.last);
+    cr_assert_eq(last, BRS_REPLAY_KEPT + REPLAY_TEST_EXTRA, "Last packet %u", last);
+    cr_assert_eq(ntohl(info.first), last - BRS_REPLAY_KEPT + 1, "Replay starts at %u, expected %u",
+                 ntohl(info.first), last - BRS_REPLAY_KEPT + 1);
+    cr_assert_eq(ntohl(events[0].seq), ntohl(info.first), "Wrong first packet replayed");
+    cr_assert_eq(ntohl(events[BRS_REPLAY_MAX - 1].seq), ntohl(info.first) + BRS_REPLAY_MAX - 1,
+                 "Wrong last packet replayed");
+    
+    // The most recent packets are all kept
+    cr_assert_eq(exchange_replay(xchg, last - 1, BRS_REPLAY_MAX, &info, events), 2,
+                 "Wrong number of packets replayed");
+    cr_assert_eq(ntohl(info.first), last - 1, "Replay of kept packets skipped some");
+    free(events);
+    
+    trader_logout(poster);
+    core_stop(xchg);
+}
+
+/*
+ * Log in a trader with ample funds and inventory.
+ */
+static TRADER *risk_trader(EXCHANGE *xchg, TRADER_SINK *sink, char *name) {
+    trader_sink_init(sink, TRADER_SINK_NULL, NULL, 0);
+    TRADER *trader = trader_login_sink(sink, name);
+    cr_assert_not_null(trader, "Trader %s not logged in", name);
+    account_increase_balance(trader_get_account(trader), 1000000);
+    account_increase_inventory(trader_get_account(trader), 1000);
+    return trader;
+}
+
+Test(risk_suite, 00_nack_reasons, .timeout = 5) {
+    EXCHANGE *xchg = core_start(NULL);
+    TRADER_SINK sink;
+    TRADER *trader = risk_trader(xchg, &sink, "alice");
+    
+    traders_set_limits(0, 0, 0, 0);
+    cr_assert_eq(trader_risk_check(trader, 100000, 100000, 0, 0), BRS_NACK_OVERFLOW,
+                 "Overflow not refused");
+    cr_assert_eq(trader_risk_check(trader, 1000, 1000, 0, 0), BRS_NACK_NONE,
+                 "Order refused without limits");
+    
+    traders_set_limits(2, 0, 0, 0);
+    cr_assert_eq(trader_risk_check(trader, 1, 10, 0, 0), BRS_NACK_NONE, "First order refused");
+    cr_assert_eq(trader_risk_check(trader, 1, 10, 2, 20), BRS_NACK_ORDERS,
+                 "Orders of the same request not counted");
+    cr_assert_neq(exchange_post_buy(xchg, trader, 1, 10), 0, "Buy not posted");
+    cr_assert_neq(exchange_post_buy(xchg, trader, 1, 10), 0, "Buy not posted");
+    cr_assert_eq(trader_risk_check(trader, 1, 10, 0, 0), BRS_NACK_ORDERS,
+                 "Too many orders not refused");
+    
+    traders_set_limits(0, 100, 0, 0);
+    cr_assert_eq(trader_risk_check(trader, 8, 10, 0, 0), BRS_NACK_NONE, "Order within notional refused");
+    cr_assert_eq(trader_risk_check(trader, 9, 10, 0, 0), BRS_NACK_NOTIONAL,
+                 "Notional not refused");
+    cr_assert_eq(trader_risk_check(trader, 1, 10, 1, 80), BRS_NACK_NOTIONAL,
+                 "Notional of the same request not counted");
+    
+    traders_set_limits(0, 0, 1, 2);
+    cr_assert_eq(trader_risk_check(trader, 1, 10, 0, 0), BRS_NACK_NONE, "Order within burst refused");
+    cr_assert_eq(trader_risk_check(trader, 1, 10, 0, 0), BRS_NACK_NONE, "Order within burst refused");
+    cr_assert_eq(trader_risk_check(trader, 1, 10, 0, 0), BRS_NACK_RATE, "Rate not refused");
+    
+    traders_set_limits(0, 0, 0, 0);
+    trader_logout(trader);
+    core_stop(xchg);
+}
+
+Test(risk_suite, 01_release_on_cancel_and_fill, .timeout = 5) {
+    EXCHANGE *xchg = core_start(NULL);
+    exchanges_set_inline_matching(1);
+    TRADER_SINK sinks[2];
+    TRADER *alice = risk_trader(xchg, &sinks[0], "alice");
+    TRADER *bob = risk_trader(xchg, &sinks[1], "bob");
+    quantity_t quantity;
+    
+    // Cancellation gives back the order and its value
+    traders_set_limits(1, 1000, 0, 0);
+    orderid_t order = exchange_post_buy(xchg, alice, 10, 100);
+    cr_assert_neq(order, 0, "Buy not posted");
+    cr_assert_eq(trader_risk_check(alice, 1, 1, 0, 0), BRS_NACK_ORDERS, "Order not counted");
+    cr_assert_eq(exchange_cancel(xchg, alice, order, &quantity), 0, "Buy not canceled");
+    cr_assert_eq(trader_risk_check(alice, 10, 100, 0, 0), BRS_NACK_NONE,
+                 "Canceled order still counted");
+    
+    // A partial fill gives back the value traded, and a full fill the order
+    traders_set_limits(2, 1000, 0, 0);
+    cr_assert_neq(exchange_post_sell(xchg, bob, 10, 100), 0, "Sell not posted");
+    cr_assert_eq(trader_risk_check(bob, 1, 1, 0, 0), BRS_NACK_NOTIONAL, "Notional not counted");
+    cr_assert_neq(exchange_post_buy(xchg, alice, 4, 100), 0, "Buy not posted");
+    cr_assert_eq(trader_risk_check(alice, 10, 100, 0, 0), BRS_NACK_NONE, "Filled buy still counted");
+    cr_assert_eq(trader_risk_check(bob, 4, 100, 0, 0), BRS_NACK_NONE, "Value traded still counted");
+    cr_assert_eq(trader_risk_check(bob, 5, 100, 0, 0), BRS_NACK_NOTIONAL,
+                 "Value left on the book not counted");
+    cr_assert_eq(trader_risk_check(bob, 1, 1, 1, 0), BRS_NACK_ORDERS,
+                 "Partly filled order not counted");
+    cr_assert_neq(exchange_post_buy(xchg, alice, 6, 100), 0, "Buy not posted");
+    cr_assert_eq(trader_risk_check(bob, 10, 100, 1, 0), BRS_NACK_NONE,
+                 "Filled sell still counted");
+    
+    traders_set_limits(0, 0, 0, 0);
+    trader_logout(alice);
+    trader_logout(bob);
+    core_stop(xchg);
+}
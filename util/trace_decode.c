@@ -0,0 +1,252 @@
+/*
+ * Decode a trace file written by the server (see trace.h), printing each
+ * record as the server used to print it to stderr.
+ *
+ * Usage: trace_decode [-t] [<trace>]
+ *
+ *   -t  Prefix each message with the time at which it was traced.
+ *
+ * The trace is read from the standard input if no file is given.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "trace.h"
+#include "debug.h"
+
+struct format {
+    uint64_t address;
+    char *text;
+};
+
+static struct format *formats = NULL;
+static size_t formats_count = 0;
+static size_t formats_size = 0;
+
+static const char *format_lookup(uint64_t address) {
+    for (size_t i = formats_count; i > 0; i--) {
+        if (formats[i - 1].address == address) {
+            return formats[i - 1].text;
+        }
+    }
+    return NULL;
+}
+
+static int format_add(uint64_t address, char *text) {
+    if (formats_count == formats_size) {
+        size_t size = formats_size == 0 ? 256 : formats_size * 2;
+        struct format *f = realloc(formats, size * sizeof(struct format));
+        if (f == NULL) {
+            return -1;
+        }
+        formats = f;
+        formats_size = size;
+    }
+    formats[formats_count].address = address;
+    formats[formats_count].text = text;
+    formats_count++;
+    return 0;
+}
+
+/*
+ * Print a record according to its format, taking the arguments from it in
+ * the same way as trace_emit() stored them.
+ */
+static void print_record(TRACE_RECORD *rec, const char *format, FILE *out) {
+    int arg = 0;
+    const char *strings = rec->strings;
+    const char *strings_end = rec->strings + TRACE_STRINGS;
+#define NEXT() (arg < rec->nargs ? rec->args[arg++] : 0)
+    for (const char *p = format; *p != '\0'; p++) {
+        if (*p != '%') {
+            fputc(*p, out);
+            continue;
+        }
+        if (p[1] == '%') {
+            fputc('%', out);
+            p++;
+            continue;
+        }
+
+        // Rebuild the conversion specification, with '*' replaced by values
+        // and any length modifier replaced by "ll" for integers
+        char spec[64];
+        size_t len = 0;
+        const char *start = p++;
+        size_t flags = strspn(p, "-+ #0");
+        memcpy(spec, start, flags + 1);
+        len = flags + 1;
+        p += flags;
+        if (*p == '*') {
+            len += snprintf(spec + len, sizeof(spec) - len, "%d", (int)NEXT());
+            p++;
+        }
+        size_t digits = strspn(p, "0123456789");
+        if (len + digits + 1 >= sizeof(spec)) {
+            break;
+        }
+        memcpy(spec + len, p, digits);
+        len += digits;
+        p += digits;
+        if (*p == '.') {
+            spec[len++] = '.';
+            p++;
+            if (*p == '*') {
+                len += snprintf(spec + len, sizeof(spec) - len, "%d", (int)NEXT());
+                p++;
+            } else {
+                digits = strspn(p, "0123456789");
+                if (len + digits + 1 >= sizeof(spec)) {
+                    break;
+                }
+                memcpy(spec + len, p, digits);
+                len += digits;
+                p += digits;
+            }
+        }
+        int longs = 0;
+        for (; *p != '\0' && strchr("hlzjt", *p) != NULL; p++) {
+            longs += *p != 'h';
+        }
+        if (*p == '\0' || len + 4 >= sizeof(spec)) {
+            break;
+        }
+
+        switch (*p) {
+            case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': {
+                uint64_t value = NEXT();
+                if (!longs) {
+                    // Print as the int it was, sign and all
+                    value = (*p == 'd' || *p == 'i') ? (uint64_t)(int64_t)(int32_t)value
+                                                     : (uint32_t)value;
+                }
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = *p;
+                spec[len] = '\0';
+                fprintf(out, spec, value);
+                break;
+            }
+            case 'c':
+                spec[len++] = 'c';
+                spec[len] = '\0';
+                fprintf(out, spec, (int)NEXT());
+                break;
+            case 'p':
+                spec[len++] = 'p';
+                spec[len] = '\0';
+                fprintf(out, spec, (void *)(uintptr_t)NEXT());
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+                uint64_t bits = NEXT();
+                double d;
+                memcpy(&d, &bits, sizeof(d));
+                spec[len++] = *p;
+                spec[len] = '\0';
+                fprintf(out, spec, d);
+                break;
+            }
+            case 's': {
+                const char *s = "?";
+                if (strings < strings_end) {
+                    s = strings;
+                    strings += strnlen(strings, strings_end - strings) + 1;
+                }
+                spec[len++] = 's';
+                spec[len] = '\0';
+                fprintf(out, spec, s);
+                break;
+            }
+            default:
+                fputs(start, out);
+                p += strlen(p) - 1;
+                break;
+        }
+    }
+#undef NEXT
+    fputc('\n', out);
+}
+
+int main(int argc, char *argv[]) {
+    int timestamps = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t")) != -1) {
+        if (opt == 't') {
+            timestamps = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-t] [<trace>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    FILE *in = stdin;
+    if (optind < argc && (in = fopen(argv[optind], "r")) == NULL) {
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    TRACE_FILE_HEADER header;
+    if (fread(&header, sizeof(header), 1, in) != 1
+        || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "Not a trace file\n");
+        exit(EXIT_FAILURE);
+    }
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(TRACE_RECORD)) {
+        fprintf(stderr, "Trace file version %u is not supported\n", header.version);
+        exit(EXIT_FAILURE);
+    }
+
+    TRACE_ENTRY_HEADER entry;
+    while (fread(&entry, sizeof(entry), 1, in) == 1) {
+        char *data = malloc(entry.length + 1);
+        if (data == NULL || fread(data, 1, entry.length, in) != entry.length) {
+            fprintf(stderr, "Trace file is truncated\n");
+            free(data);
+            break;
+        }
+        data[entry.length] = '\0';
+
+        if (entry.kind == TRACE_ENTRY_FORMAT && entry.length >= sizeof(uint64_t)) {
+            uint64_t address;
+            memcpy(&address, data, sizeof(address));
+            memmove(data, data + sizeof(address), entry.length - sizeof(address) + 1);
+            if (format_add(address, data) == 0) {
+                continue;
+            }
+        } else if (entry.kind == TRACE_ENTRY_RECORD && entry.length == sizeof(TRACE_RECORD)) {
+            TRACE_RECORD *rec = (TRACE_RECORD *)data;
+            const char *format = format_lookup(rec->format);
+            if (timestamps) {
+                time_t sec = rec->timestamp / 1000000000u;
+                struct tm tm;
+                char buf[32];
+                strftime(buf, sizeof(buf), "%H:%M:%S", localtime_r(&sec, &tm));
+                printf("%s.%09lu ", buf, (unsigned long)(rec->timestamp % 1000000000u));
+            }
+            if (rec->flags & TRACE_RAW) {
+                // No prefix
+            } else if (rec->flags & TRACE_NO_TID) {
+                printf(KMAG "DEBUG: " KNRM);
+            } else {
+                printf(KMAG "DEBUG: %015lu: " KNRM, (unsigned long)rec->tid);
+            }
+            if (format != NULL) {
+                print_record(rec, format, stdout);
+            } else {
+                printf("(unknown format %#lx)\n", (unsigned long)rec->format);
+            }
+        } else if (entry.kind == TRACE_ENTRY_LOST && entry.length == 2 * sizeof(uint32_t)) {
+            uint32_t lost[2];
+            memcpy(lost, data, sizeof(lost));
+            printf("(%u records lost by thread %u)\n", lost[1], lost[0]);
+        }
+        free(data);
+    }
+
+    if (in != stdin) {
+        fclose(in);
+    }
+    return EXIT_SUCCESS;
+}